@@ -39,10 +39,10 @@ ShMem::~ShMem()
 //==============================================================================
 // ShMem::create
 //==============================================================================
-void *ShMem::create(const char *name, int size)
+void *ShMem::create(const char *name, int size, mode_t mode)
 {
  int oflag, prot;
- mode_t mode, processMask;
+ mode_t processMask;
  int nlen;
  
  // Copy the name
@@ -53,10 +53,9 @@ void *ShMem::create(const char *name, int size)
  strncpy(d_shmName, name, nlen);
  d_shmName[nlen] = '\0';
  
- // Allow all access modes so that opening the shared
- // memory from another process doesn't fail.( see open() ).
+ // Apply the requested modes as given, by default all, so that opening 
+ // the shared memory from another process doesn't fail.( see open() ).
  processMask = umask(0); // remove all process mode masks => can set any mode 
- mode = S_IRWXU | S_IRWXG | S_IRWXO; // and we set all modes
 
  // creation and access flags
  oflag = O_RDWR | O_CREAT | O_EXCL;  
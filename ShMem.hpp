@@ -10,6 +10,7 @@
 #define _SHMEM_HPP_INCLUDED
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string>
@@ -43,7 +44,8 @@ class ShMem
    // Default destructor deletes shared memory region if it was created
    // by the object.
   
-  void *create(const char *name, int size); 
+  void *create(const char *name, int size, 
+               mode_t mode = S_IRWXU | S_IRWXG | S_IRWXO); 
    // Creates a shared memory object with read/write access and maps it to 
    // your process address space. Note that if the shared memory 
    // object already exists this function will exit with an error (errno set).
@@ -51,6 +53,7 @@ class ShMem
    //          should begin with a leading "/" and contain no other 
    //          "/" characters.
    //  size    Size (number of bytes) of the shared memory object
+   //  mode    Permissions of the object (default: everyone may open it)
    //  return  If successful, a pointer to the starting memory location 
    //          of shared memory, else NULL, 'errno' is set and can be 
    //          retrieved by a call to getErrnoError().
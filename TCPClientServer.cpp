@@ -8,13 +8,665 @@
 
 #include "TCPClientServer.hpp"
 #include <cstring>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <algorithm>
+#include <climits>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/filter.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
 
 //==============================================================================
 // PROGRAMMER NOTE: 
 // Data transfer method: Every transaction is two packets. The first packet is
 // sizeof(int) and its value indicates the size of second packet which is the
 // data we want to transfer. 
+//
+// A negative value in the first packet is not a length but a control code. 
+// The control code is followed by a fixed size payload defined for that 
+// code. Control frames are only sent by clients that asked for a feature, 
+// so servers and clients that don't use them are unaffected.
+//
+// Shared memory transport: The client sends TCP_CTRL_SHM with its host
+// identity. A server on the same host creates a region holding one request 
+// and one reply slot and sends back its name. A request is published by 
+// bumping reqSeq, and completed when the server sets repSeq to the same 
+// value. Both counters are futex words. The protocol is strictly one 
+// request at a time, so a single slot per direction is all the ring needs.
+//
+// Load shedding: Instead of a reply, the server may send TCP_CTRL_REJECT 
+// followed by an unsigned int when a request (or a connection) is over the
+// limits set by setAdmissionLimits(). The int is the number of the request
+// on the connection, counted from 1 by both ends, so that the rejection of
+// a message sent without waiting for a reply is not taken for the reply to
+// a later request. It is 0 if the connection itself is turned away, and 
+// the server closes it.
+//
+// Publish/subscribe: A client subscribes with TCP_CTRL_SUBSCRIBE and
+// unsubscribes with TCP_CTRL_UNSUBSCRIBE, each followed by an int topic.
+// The server then pushes TCP_CTRL_PUBLISH frames followed by the int topic, 
+// the int length and the message. A frame is built once per publish() into
+// a reference counted buffer that is queued to every subscriber.
+//
+// Multiplexing: TCP_CTRL_MUX is followed by a tcp_mux_frame (stream, 
+// sequence number, length, flags) and length bytes of a message. A message 
+// may be cut into several such chunks, the last one flagged TCP_MUX_END, 
+// and chunks of different streams may be interleaved. The server replies 
+// with chunks carrying the same stream and sequence number, or with a 
+// single TCP_MUX_REJECT chunk when shedding load. The sequence number lets 
+// the client recognize replies to requests it gave up on.
+//
+// Listener handoff: The old process connects to a Unix socket of the new 
+// process and sends descriptors with SCM_RIGHTS, in messages of one tag 
+// byte: 'L' (listeners, the first one is the main listener), 'C' (client 
+// connections) and 'E' (end, no descriptors).
+//==============================================================================
+
+#define TCP_CTRL_SHM (-0x50534d31)  // control code: shared memory request
+#define TCP_CTRL_REJECT (-0x50524a31) // control code: request rejected
+#define TCP_CTRL_SUBSCRIBE (-0x50535531) // control code: subscribe to topic
+#define TCP_CTRL_UNSUBSCRIBE (-0x50555331) // control code: unsubscribe
+#define TCP_CTRL_PUBLISH (-0x50504231) // control code: published message
+#define TCP_CTRL_MUX (-0x504d5831)  // control code: chunk of a stream
+#define TCP_SHM_IDLEN 128           // size of host identity string
+#define TCP_SHM_NAMELEN 64          // size of shared memory name
+#define TCP_SHM_HDRLEN 64           // region header, one cache line
+#define TCP_SHM_SPIN 2000           // polls before sleeping on a futex
+#define TCP_HANDOFF_BATCH 64        // descriptors per handoff message
+#define TCP_HANDOFF_DRAIN 1000000   // time (us) idle clients stay after handoff
+#define TCP_WAKE_STOP (-1)          // wake up command: leave event loop
+#define TCP_WAKE_HANDOFF (-2)       // wake up command: handoff requested
+#define TCP_WAKE_FLUSH (-3)         // wake up command: subscribers to write
+#define TCP_BUSY_SELECT 50          // select faster than this (us) did not wait
+#define TCP_TUNE_INTERVAL 1000000   // time (us) between socket measurements
+#define TCP_CONNECT_STAGGER 250000  // time (us) between connection attempts
+#define TCP_TUNE_MINBUF 65536       // smallest buffer worth setting (bytes)
+#define TCP_TUNE_MAXBUF 67108864    // largest buffer chosen (bytes)
+#define TCP_CACHE_FREE 0            // cache slot unused
+#define TCP_CACHE_PENDING 1         // cache slot waiting for the handler
+#define TCP_CACHE_READY 2           // cache slot holds a reply
+#define TCP_REPLICA_SAMPLES 256     // reply times kept for the percentile
+#define TCP_REPLICA_MAXFAIL 3       // failures before a replica is left out
+#define TCP_REPLICA_BACKOFF 1000000 // time (us) a failed replica is left out
+#define TCP_MUX_CHUNK 16384         // default chunk size (bytes)
+#define TCP_MUX_END 1               // chunk flag: last chunk of the message
+#define TCP_MUX_REJECT 2            // chunk flag: request rejected
+
+// request payload for TCP_CTRL_SHM
+struct tcp_shm_request
+{
+ char identity[TCP_SHM_IDLEN]; // client host identity
+ int maxReply;                 // largest reply the client expects
+};
+
+// reply payload for TCP_CTRL_SHM
+struct tcp_shm_reply
+{
+ int accepted;                 // 1 if channel was created
+ int reqCap;                   // largest request accepted by server
+ char name[TCP_SHM_NAMELEN];   // name of shared memory object
+};
+
+// header of the shared memory region. Request data follows at offset 
+// TCP_SHM_HDRLEN, and reply data follows the request data.
+struct tcp_shm_region
+{
+ volatile int open;    // 1 while the server services the channel
+ volatile int reqSeq;  // futex word: bumped by client for each request
+ volatile int repSeq;  // futex word: set to reqSeq by server when done
+ int reqLen;           // length of request
+ int repLen;           // length of reply, -1 for none, -2 if too long,
+                       // -3 if rejected
+};
+
+// server side state of a shared memory channel
+struct tcp_shm_channel
+{
+ TCPServer *server;             // the owning server
+ ShMem shm;                     // the shared memory object
+ struct tcp_shm_region *region; // mapped region
+ int reqCap;                    // capacity of request slot
+ int repCap;                    // capacity of reply slot
+ pthread_t thread;              // service thread
+};
+
+// state of one event loop of the server
+struct tcp_event_loop
+{
+ TCPServer *server;   // the owning server
+ int index;           // position in the server's list of loops
+ int cpu;             // cpu to run on, or -1
+ int listenFd;        // listening socket serviced by this loop, or -1
+ int wakeFd[2];       // pipe carrying commands and steered connections
+ fd_set master;       // sockets serviced by this loop
+ int fdMax;           // largest socket in above set
+ int nextFd;          // socket to look at first in the next pass
+ long long nextTune;  // when to measure connections again (TCP_BDP_AUTO)
+ volatile int flushRequested; // subscribers have data waiting to be written
+ char *rcvBuf;        // receive buffer
+ pthread_t thread;    // thread running the loop (except loop 0)
+ bool running;        // true while thread runs
+};
+
+// TCP_INFO as of Linux 4.9, which adds the delivery rate to the layout 
+// known to the C library
+struct tcp_info_rate
+{
+ struct tcp_info info;
+ unsigned long long pacingRate;
+ unsigned long long maxPacingRate;
+ unsigned long long bytesAcked;
+ unsigned long long bytesReceived;
+ unsigned int segsOut;
+ unsigned int segsIn;
+ unsigned int notSentBytes;
+ unsigned int minRtt;
+ unsigned int dataSegsIn;
+ unsigned int dataSegsOut;
+ unsigned long long deliveryRate;
+};
+
+// a published message, shared by the queues of all subscribers
+struct tcp_pub_buffer
+{
+ volatile int refs;    // queues holding this buffer
+ int topic;            // topic published to
+ int frameLen;         // length of frame below
+ char frame[1];        // TCP_CTRL_PUBLISH, topic, length, message
+};
+
+// server side state of a subscriber connection
+struct tcp_subscriber
+{
+ int loop;             // event loop servicing the connection
+ int *topics;          // topics subscribed to
+ int numTopics;        // number of above topics
+ struct tcp_pub_buffer **queue; // ring of messages to write
+ int head;             // first message in above ring
+ int count;            // messages in above ring
+ int offset;           // bytes of first message already written
+ bool broken;          // write failed, wait for the connection to close
+};
+
+static void releasePubBuffer(struct tcp_pub_buffer *buf)
+{
+ if( __sync_sub_and_fetch(&buf->refs, 1) == 0 )
+  free(buf);
+}
+
+// a slot of the response cache
+struct tcp_cache_entry
+{
+ unsigned long long hash; // hash of request
+ char *request;        // copy of request
+ int requestLen;       // length of above
+ int requestCap;       // size of above buffer
+ char *reply;          // copy of reply
+ int replyLen;         // length of above, -1 if the handler gave no reply
+ int replyCap;         // size of above buffer
+ long long expires;    // when the reply gets stale (us), or 0
+ volatile int refs;    // replies being sent from this slot
+ int state;            // TCP_CACHE_FREE, _PENDING or _READY
+ bool referenced;      // used since the clock hand last passed
+ bool linked;          // in the hash chains
+ int next;             // next slot in hash chain, or -1
+};
+
+// a part of the response cache with its own lock
+struct tcp_cache_shard
+{
+ pthread_mutex_t lock; // protects everything below
+ pthread_cond_t filled; // signalled when a pending slot is filled
+ struct tcp_cache_entry *entries; // slots
+ int numEntries;       // number of slots
+ int hand;             // clock hand
+ int *buckets;         // first slot of each hash chain, or -1
+ int numBuckets;       // number of chains, a power of 2
+};
+
+// response cache of TCPServer
+struct tcp_cache
+{
+ struct tcp_cache_shard *shards;
+ int numShards;
+ long long ttl;        // lifetime of a reply (us), or 0
+ unsigned long hits;
+ unsigned long misses;
+ unsigned long evictions;
+ unsigned long coalesced;
+};
+
+// a replica of TCPReplicaClient
+struct tcp_replica
+{
+ TCPClient client;
+ long long latency;    // average reply time (us)
+ int numSamples;       // replies seen
+ int failures;         // consecutive failures
+ long long retryAt;    // when to try again after failures
+ long long sentAt;     // when the current request was sent
+ bool tried;           // used for the current request
+ bool discard;         // a late reply is yet to be read and thrown away
+};
+
+// a member of TCPClientGroup
+struct tcp_group_member
+{
+ TCPClient client;
+ bool waiting;         // yet to answer in the current round
+ int owed;             // replies of earlier rounds still to come
+};
+
+// payload of TCP_CTRL_MUX, followed by length bytes of the message
+struct tcp_mux_frame
+{
+ int stream;
+ int seq;              // request number on the stream
+ int length;           // bytes in this chunk
+ int flags;            // TCP_MUX_END, TCP_MUX_REJECT
+};
+
+// a multiplexed message partly received by the server
+struct tcp_mux_partial
+{
+ int stream;
+ int seq;
+ char *buf;
+ int len;
+ int cap;
+ struct tcp_mux_partial *next;
+};
+
+// a stream of TCPMuxClient
+struct tcp_mux_slot
+{
+ bool open;
+ bool busy;            // a reply is awaited
+ bool done;            // the reply is complete, or failed
+ int seq;              // number of the current request
+ char *buf;            // where the reply goes
+ int cap;
+ int len;
+ int error;            // errno style code if failed
+};
+
+//==============================================================================
+// shared memory helpers
+//==============================================================================
+static char *shmRequestData(struct tcp_shm_region *r)
+{
+ return (char *)r + TCP_SHM_HDRLEN;
+}
+
+static char *shmReplyData(struct tcp_shm_region *r, int reqCap)
+{
+ return (char *)r + TCP_SHM_HDRLEN + reqCap;
+}
+
+static int shmFutexWait(volatile int *addr, int val, const struct timespec *rel)
+{
+#ifdef __linux__
+ return syscall(SYS_futex, (int *)addr, FUTEX_WAIT, val, rel, NULL, 0);
+#else
+ addr = addr; val = val; rel = rel;
+ errno = ENOSYS;
+ return -1;
+#endif
+}
+
+static void shmFutexWake(volatile int *addr)
+{
+#ifdef __linux__
+ syscall(SYS_futex, (int *)addr, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+#else
+ addr = addr;
+#endif
+}
+
+static int sendFds(int sock, char tag, const int *fds, int numFds)
+{
+ // one tag byte, and the descriptors as ancillary data
+ struct msghdr msg;
+ struct iovec iov;
+ char control[CMSG_SPACE(TCP_HANDOFF_BATCH * sizeof(int))];
+ 
+ memset(&msg, 0, sizeof(msg));
+ iov.iov_base = &tag;
+ iov.iov_len = 1;
+ msg.msg_iov = &iov;
+ msg.msg_iovlen = 1;
+ if( numFds > 0 )
+ {
+  struct cmsghdr *cmsg;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+ }
+ return (sendmsg(sock, &msg, 0) == 1) ? 0 : -1;
+}
+
+static int recvFds(int sock, char *tag, int *fds, int maxFds)
+{
+ struct msghdr msg;
+ struct iovec iov;
+ char control[CMSG_SPACE(TCP_HANDOFF_BATCH * sizeof(int))];
+ struct cmsghdr *cmsg;
+ int numFds = 0;
+ 
+ memset(&msg, 0, sizeof(msg));
+ iov.iov_base = tag;
+ iov.iov_len = 1;
+ msg.msg_iov = &iov;
+ msg.msg_iovlen = 1;
+ msg.msg_control = control;
+ msg.msg_controllen = sizeof(control);
+ if( recvmsg(sock, &msg, 0) != 1 )
+  return -1;
+ for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+ {
+  if( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS) )
+  {
+   int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+   if( n > maxFds - numFds )
+    n = maxFds - numFds;
+   memcpy(&fds[numFds], CMSG_DATA(cmsg), n * sizeof(int));
+   numFds += n;
+  }
+ }
+ return numFds;
+}
+
+static long long monotonicUs()
+{
+ struct timespec now;
+ clock_gettime(CLOCK_MONOTONIC, &now);
+ return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static long long isqrt(long long n)
+{
+ long long r = 0;
+ while( (r + 1) * (r + 1) <= n )
+  r++;
+ return r;
+}
+
+//==============================================================================
+// sendVector - write all of a gathered buffer, in at most three calls.
+//==============================================================================
+static int sendVector(int fd, struct iovec *iov, int iovLen, int flags)
+{
+ struct msghdr msg;
+ memset(&msg, 0, sizeof(msg));
+ msg.msg_iov = iov;
+ msg.msg_iovlen = iovLen;
+ 
+ // write until done or try 3 times
+ int total = 0;
+ for(int i = 0; i < iovLen; i++)
+  total += iov[i].iov_len;
+ int wroteTillNow = 0;
+ int numWriteAttempts = 0;
+ while( (wroteTillNow < total) && (numWriteAttempts < 3) )
+ {
+  numWriteAttempts++;
+  int wroteNow = sendmsg(fd, &msg, flags);
+  if( wroteNow == -1 )
+   break;
+  wroteTillNow += wroteNow;
+  
+  // skip what went out
+  while( (msg.msg_iovlen > 0) && (wroteNow >= (int)msg.msg_iov[0].iov_len) )
+  {
+   wroteNow -= msg.msg_iov[0].iov_len;
+   msg.msg_iov++;
+   msg.msg_iovlen--;
+  }
+  if( msg.msg_iovlen > 0 )
+  {
+   msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + wroteNow;
+   msg.msg_iov[0].iov_len -= wroteNow;
+  }
+ }
+ return (wroteTillNow < total) ? -1 : 0;
+}
+
+//==============================================================================
+// growBuffer - enlarge a socket buffer to twice the data a connection moved 
+// per round trip over the last interval, if the kernel's own sizing 
+// (autotuning) has left it more than a quarter short. Buffers are never 
+// shrunk, as a size set once stays and turns autotuning off.
+//==============================================================================
+static void growBuffer(int fd, int option, long long bytes, long long elapsed,
+                       int rtt, int *chosen)
+{
+ long long want = 2 * (bytes * rtt / elapsed);
+ if( want > TCP_TUNE_MAXBUF )
+  want = TCP_TUNE_MAXBUF;
+ if( want < TCP_TUNE_MINBUF )
+  return;
+ 
+ // the kernel reports twice the usable size, the rest is bookkeeping
+ int have = 0;
+ socklen_t len = sizeof(int);
+ if( getsockopt(fd, SOL_SOCKET, option, &have, &len) == -1 )
+  return;
+ have /= 2;
+ if( want <= have + have / 4 )
+  return;
+ int size = (int)want;
+ if( setsockopt(fd, SOL_SOCKET, option, &size, sizeof(int)) == 0 )
+  *chosen = size;
+}
+
+//==============================================================================
+// tuneSocket - measure a connection, and grow its buffers where the 
+// throughput sustained since the last measurement needs more than the 
+// kernel has given it.
 //==============================================================================
+static int tuneSocket(int fd, TCPSocketStats *stats, bool resize)
+{
+ struct tcp_info_rate ti;
+ socklen_t len = sizeof(ti);
+ memset(&ti, 0, sizeof(ti));
+ if( getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1 )
+  return -1;
+ 
+ stats->fd = fd;
+ stats->rtt = ti.info.tcpi_rtt;
+ stats->deliveryRate = (len >= sizeof(ti)) ? (long long)ti.deliveryRate : 0;
+ 
+ // without a delivery rate, what is in flight is the best guess
+ long long bdp;
+ if( stats->deliveryRate > 0 )
+  bdp = stats->deliveryRate * stats->rtt / 1000000;
+ else
+  bdp = (long long)ti.info.tcpi_snd_cwnd * ti.info.tcpi_snd_mss;
+ stats->bdp = (bdp > TCP_TUNE_MAXBUF) ? TCP_TUNE_MAXBUF : (int)bdp;
+ if( len < sizeof(ti) )
+  return 0;
+ 
+ // traffic since the last measurement, taken at most twice an interval
+ long long now = monotonicUs();
+ long long elapsed = now - stats->measured;
+ if( (stats->measured != 0) && (elapsed < TCP_TUNE_INTERVAL / 2) )
+  return 0;
+ long long acked = (long long)ti.bytesAcked - stats->bytesAcked;
+ long long received = (long long)ti.bytesReceived - stats->bytesReceived;
+ bool first = (stats->measured == 0);
+ stats->bytesAcked = ti.bytesAcked;
+ stats->bytesReceived = ti.bytesReceived;
+ stats->measured = now;
+ if( !resize || first || (stats->rtt == 0) )
+  return 0;
+ 
+ growBuffer(fd, SO_SNDBUF, acked, elapsed, stats->rtt, &stats->sndBuf);
+ growBuffer(fd, SO_RCVBUF, received, elapsed, stats->rtt, &stats->rcvBuf);
+ return 0;
+}
+
+
+//==============================================================================
+// response cache helpers
+//==============================================================================
+static unsigned long long hashBytes(const char *buf, int len)
+{
+ // 64 bit multiply-shift hash a word at a time (MurmurHash64A)
+ const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+ unsigned long long h = 0x9747b28c ^ (len * m);
+ int k;
+ for(k = 0; k + 8 <= len; k += 8)
+ {
+  unsigned long long w;
+  memcpy(&w, buf + k, 8);
+  w *= m;
+  w ^= w >> 47;
+  w *= m;
+  h ^= w;
+  h *= m;
+ }
+ if( k < len )
+ {
+  unsigned long long w = 0;
+  memcpy(&w, buf + k, len - k);
+  h ^= w;
+  h *= m;
+ }
+ h ^= h >> 47;
+ h *= m;
+ h ^= h >> 47;
+ return h;
+}
+
+static struct tcp_cache_shard *cacheShard(struct tcp_cache *cache, 
+                                          unsigned long long hash)
+{
+ // high bits, the bucket within the shard takes the low ones
+ return &cache->shards[(hash >> 32) % cache->numShards];
+}
+
+static int cacheFind(struct tcp_cache_shard *shard, unsigned long long hash, 
+                     const char *request, int requestLen)
+{
+ int k = shard->buckets[hash & (shard->numBuckets - 1)];
+ while( k != -1 )
+ {
+  struct tcp_cache_entry *e = &shard->entries[k];
+  if( (e->hash == hash) && (e->requestLen == requestLen) 
+      && (memcmp(e->request, request, requestLen) == 0) )
+   return k;
+  k = e->next;
+ }
+ return -1;
+}
+
+static void cacheUnlink(struct tcp_cache_shard *shard, int slot)
+{
+ struct tcp_cache_entry *e = &shard->entries[slot];
+ int *link = &shard->buckets[e->hash & (shard->numBuckets - 1)];
+ while( *link != slot )
+  link = &shard->entries[*link].next;
+ *link = e->next;
+ e->linked = false;
+ e->next = -1;
+ if( e->state == TCP_CACHE_READY )
+  e->state = TCP_CACHE_FREE;
+}
+
+static int cacheAlloc(struct tcp_cache *cache, struct tcp_cache_shard *shard)
+{
+ // CLOCK: pass over slots recently used, take the first that was not. 
+ // Slots with replies being sent or computed are left alone.
+ for(int n = 0; n < 2 * shard->numEntries; n++)
+ {
+  int slot = shard->hand;
+  struct tcp_cache_entry *e = &shard->entries[slot];
+  shard->hand = (shard->hand + 1) % shard->numEntries;
+  if( (e->refs > 0) || (e->state == TCP_CACHE_PENDING) )
+   continue;
+  if( e->state == TCP_CACHE_FREE )
+   return slot;
+  if( e->referenced )
+  {
+   e->referenced = false;
+   continue;
+  }
+  cacheUnlink(shard, slot);
+  __sync_fetch_and_add(&cache->evictions, 1);
+  return slot;
+ }
+ return -1;
+}
+
+static bool cacheCopy(char **buf, int *cap, const char *data, int len)
+{
+ if( len > *cap )
+ {
+  char *p = (char *)realloc(*buf, len);
+  if( p == NULL )
+   return false;
+  *buf = p;
+  *cap = len;
+ }
+ if( len > 0 )
+  memcpy(*buf, data, len);
+ return true;
+}
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+static void bpfInsn(struct sock_filter *insn, int code, int jt, int jf, int k)
+{
+ insn->code = code;
+ insn->jt = jt;
+ insn->jf = jf;
+ insn->k = (unsigned int)k;
+}
+#endif
+
+static unsigned long long randomToken()
+{
+ // for names other processes should not guess
+ unsigned long long token = 0;
+ int fd = open("/dev/urandom", O_RDONLY);
+ if( (fd == -1) || (read(fd, &token, sizeof(token)) < (int)sizeof(token)) )
+ {
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  token ^= ((unsigned long long)t.tv_sec << 30) ^ t.tv_nsec 
+           ^ ((unsigned long long)getpid() << 48);
+ }
+ if( fd != -1 )
+  close(fd);
+ return token;
+}
+
+static void getHostIdentity(char *buf, int len)
+{
+ // host name plus the kernel boot id, so that containers sharing a 
+ // host name with another machine don't match it.
+ memset(buf, 0, len);
+ gethostname(buf, len/2 - 1);
+ int n = strlen(buf);
+ int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+ if(fd != -1)
+ {
+  buf[n++] = ':';
+  int r = read(fd, &buf[n], len - n - 1);
+  if(r > 0)
+   n += r;
+  close(fd);
+ }
+ while( (n > 0) && (buf[n-1] == '\n') )
+  buf[--n] = '\0';
+}
 
 
 //#define DEBUG
@@ -29,19 +681,13 @@ using namespace std;
 //==============================================================================
 TCPServer::TCPServer()
 {
- d_init = false;
- d_fd = -1;
- d_rcvBuf = NULL;
- d_rcvBufSize = 0;
+ setDefaults();
  setError(0, "TCPServer");
 }
 
 TCPServer::TCPServer(int port, int maxMsgSize, int bdp)
 {
- d_init = false;
- d_fd = -1;
- d_rcvBuf = NULL;
- d_rcvBufSize = 0;
+ setDefaults();
  
  // initialize a socket
  if( init(port, maxMsgSize, bdp) == -1)
@@ -50,766 +696,4892 @@ TCPServer::TCPServer(int port, int maxMsgSize, int bdp)
  setError(0, "TCPServer");
 }
 
+TCPServer::TCPServer(const char *address, int maxMsgSize, int bdp)
+{
+ setDefaults();
+ 
+ // initialize a socket
+ if( init(address, maxMsgSize, bdp) == -1)
+  return;
+ 
+ setError(0, "TCPServer");
+}
+
+
+//==============================================================================
+// TCPServer::setDefaults
+//==============================================================================
+void TCPServer::setDefaults()
+{
+ pthread_mutex_init(&d_statusLock, NULL);
+ pthread_mutex_init(&d_handlerLock, NULL);
+ for(int i = 0; i < FD_SETSIZE; i++)
+  d_shmChannels[i] = NULL;
+ for(int i = 0; i < FD_SETSIZE; i++)
+  d_subscribers[i] = NULL;
+ for(int i = 0; i < FD_SETSIZE; i++)
+  d_muxPartial[i] = NULL;
+ for(int i = 0; i < FD_SETSIZE; i++)
+  d_requestNum[i] = 0;
+ pthread_mutex_init(&d_pubLock, NULL);
+ d_subMax = -1;
+ d_subQueueLen = 64;
+ d_subPolicy = DROP_OLDEST;
+ d_pubDrops = 0;
+ d_init = false;
+ d_fd = -1;
+ d_family = AF_INET;
+ d_unixPath[0] = '\0';
+ d_rcvBuf = NULL;
+ d_rcvBufSize = 0;
+ d_handoffRequested = 0;
+ d_handoffConns = false;
+ d_handoffPath[0] = '\0';
+ d_adoptedFds = NULL;
+ d_numAdopted = 0;
+ d_loops = NULL;
+ d_numLoops = 0;
+ d_nextLoop = 0;
+ d_reusePort = false;
+ d_serializeHandler = true;
+ createLoops(1, NULL);
+ pthread_mutex_init(&d_admissionLock, NULL);
+ d_maxConnections = 0;
+ d_maxInFlight = 0;
+ d_targetDelay = 0;
+ d_interval = 0;
+ d_numConnections = 0;
+ d_inFlight = 0;
+ d_rejectedConns = 0;
+ d_rejectedReqs = 0;
+ d_firstAboveTime = 0;
+ d_dropNext = 0;
+ d_dropCount = 0;
+ d_dropping = false;
+ d_turnFrames = 1;
+ d_turnBytes = 0;
+ d_cache = NULL;
+ d_sockStats = NULL;
+}
+
 
 //==============================================================================
 // TCPServer::~TCPServer
 //==============================================================================
 TCPServer::~TCPServer()
 {
+ for(int i = 0; i < FD_SETSIZE; i++)
+ {
+  if( d_shmChannels[i] || d_subscribers[i] || d_muxPartial[i] )
+   closeConnection(i);
+ }
+ 
  if(d_fd)
  {
   close(d_fd);
   d_fd = -1;
  }
 
+ // remove the socket file of a local server
+ if( (d_family == AF_UNIX) && (d_unixPath[0] != '\0') )
+  unlink(d_unixPath);
+
  if( d_rcvBuf )
  {
   free(d_rcvBuf);
   d_rcvBuf = NULL;
  }
+ 
+ // connections handed over but never serviced
+ for(int i = 0; i < d_numAdopted; i++)
+  close(d_adoptedFds[i]);
+ if( d_adoptedFds )
+  free(d_adoptedFds);
+ 
+ freeLoops();
  d_init = false;
+ pthread_mutex_destroy(&d_handlerLock);
+ freeCache();
+ free(d_sockStats);
+ pthread_mutex_destroy(&d_admissionLock);
+ pthread_mutex_destroy(&d_pubLock);
+ pthread_mutex_destroy(&d_statusLock);
 }
 
 
 //==============================================================================
 // TCPServer::doMessageCycle
-// * TODO * combine msg length and msg into a single send() operation
 //==============================================================================
 void TCPServer::doMessageCycle()
 {
- struct sockaddr_in clntAddr;
+ if(!d_init)
+ {
+  setReport(-1, "sendAndReceive: server not initialized");
+  return;
+ }
+
+ // start additional event loops in their own threads
+ d_loops[0].listenFd = d_fd;
+ d_loops[0].rcvBuf = d_rcvBuf;
+ for(int k = 1; k < d_numLoops; k++)
+ {
+  struct tcp_event_loop *loop = &d_loops[k];
+  char *buf = (char *)realloc(loop->rcvBuf, d_rcvBufSize + sizeof(int));
+  if( buf == NULL )
+  {
+   setError(ENOMEM, "doMessageCycle(malloc)");
+   continue;
+  }
+  loop->rcvBuf = buf;
+  if( pthread_create(&loop->thread, NULL, &TCPServer::loopEntry, loop) == 0 )
+   loop->running = true;
+  else
+   setError(errno, "doMessageCycle(pthread_create)");
+ }
+ 
+ // the first loop runs in the calling thread
+ runLoop(&d_loops[0]);
+ stopLoops();
+ 
+ // close the connections left in any loop, as the next call starts 
+ // from scratch
+ for(int k = 0; k < d_numLoops; k++)
+  closeClients(&d_loops[k]);
+}
+
+
+//==============================================================================
+// TCPServer::loopEntry
+//==============================================================================
+void *TCPServer::loopEntry(void *arg)
+{
+ struct tcp_event_loop *loop = (struct tcp_event_loop *)arg;
+ loop->server->runLoop(loop);
+ return NULL;
+}
+
+
+//==============================================================================
+// TCPServer::runLoop
+//==============================================================================
+void TCPServer::runLoop(struct tcp_event_loop *loop)
+{
+ struct sockaddr_storage clntAddr;
  int clntAddrLen;
- fd_set readFds, master; // file descriptor lists
+ fd_set readFds; // file descriptor lists
+ fd_set writeFds;
  int newFd;
- int fdMax; // max file desc. number
  char *clntIp; // ip address of a new client
  char info[80]; // buf for error messages
+ bool handedOff = false; // true once listener is passed to another process
+ long long drainEnd = 0; // when to close idle connections after a handoff
  
+ // run on the requested cpu
+#ifdef __linux__
+ if( loop->cpu >= 0 )
+ {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(loop->cpu, &cpus);
+  if( pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0 )
+   setReport(-1, "doMessageCycle: could not set cpu affinity");
+ }
+#endif
  
- // add listener to master set
- FD_ZERO(&master);
- FD_SET(d_fd, &master);
- fdMax = d_fd;
- clntAddrLen = sizeof( struct sockaddr_in );
-
- if(!d_init)
+ // add listener and wake up pipe to master set
+ FD_ZERO(&loop->master);
+ loop->fdMax = -1;
+ loop->nextFd = 0;
+ loop->nextTune = 0;
+ loop->flushRequested = 0;
+ clntAddrLen = sizeof( struct sockaddr_storage );
+ if( loop->listenFd != -1 )
  {
-  d_status.setReport(-1, "sendAndReceive: server not initialized");
-  return;
+  FD_SET(loop->listenFd, &loop->master);
+  loop->fdMax = loop->listenFd;
  }
+ if( loop->wakeFd[0] != -1 )
+ {
+  FD_SET(loop->wakeFd[0], &loop->master);
+  if(loop->wakeFd[0] > loop->fdMax) loop->fdMax = loop->wakeFd[0];
+ }
+ 
+ // add connections handed over by a previous server process
+ for(int k = 0; (loop->index == 0) && (k < d_numAdopted); k++)
+ {
+  FD_SET(d_adoptedFds[k], &loop->master);
+  if(d_adoptedFds[k] > loop->fdMax) loop->fdMax = d_adoptedFds[k];
+  __sync_fetch_and_add(&d_numConnections, 1);
+ }
+ if( loop->index == 0 )
+  d_numAdopted = 0;
 
 #ifdef DEBUG
- cerr << "DEBUG [doMessageCycle]: entering loop" << endl;
+ cerr << "DEBUG [doMessageCycle]: entering loop " << loop->index << endl;
 #endif
 
  // the loop starts here
+ long long lastReady = monotonicUs();
  for(;;)
  {
-  readFds = master; // make a copy
-  if( select(fdMax+1, &readFds, NULL, NULL, NULL) == -1 )
+  readFds = loop->master; // make a copy
+  loop->flushRequested = 0;
+  int numWrites = pendingSubscribers(loop, &writeFds);
+  long long waitStart = monotonicUs();
+  struct timeval drainWait;
+  if( handedOff )
+  {
+   long long left = (drainEnd > waitStart) ? drainEnd - waitStart : 0;
+   drainWait.tv_sec = left / 1000000;
+   drainWait.tv_usec = left % 1000000;
+  }
+  if( select(loop->fdMax+1, &readFds, numWrites ? &writeFds : NULL, NULL, 
+             handedOff ? &drainWait : NULL) == -1 )
   {
    setError(errno, "doMessageCycle(select)");
    break;
   } // end if select
+  if( numWrites )
+   flushSubscribers(&writeFds, loop->fdMax);
+  
+  // When select returns at once, requests came in while the previous 
+  // ones were handled, and have been waiting since then at most.
+  long long ready = monotonicUs();
+  long long arrival = (ready - waitStart < TCP_BUSY_SELECT) ? lastReady : ready;
+  lastReady = ready;
   
-  // check for activity
-  for(int i = 0; i <= fdMax; i++)
+  // measure busy connections now and then, and resize their buffers
+  if( d_sockStats && (ready >= loop->nextTune) )
   {
+   for(int fd = 0; fd <= loop->fdMax; fd++)
+   {
+    if( FD_ISSET(fd, &loop->master) && (fd != loop->listenFd) 
+        && (fd != loop->wakeFd[0]) && (fd < FD_SETSIZE) )
+     tuneSocket(fd, &d_sockStats[fd], true);
+   }
+   loop->nextTune = ready + TCP_TUNE_INTERVAL;
+  }
+  
+  // check for activity, round-robin: the client served first in the 
+  // last pass goes last in this one.
+  int first = -1;
+  int span = loop->fdMax + 1;
+  for(int k = 0; k < span; k++)
+  {
+   int i = (loop->nextFd + k) % span;
    if( FD_ISSET(i, &readFds) ) // got activity
    {
-    if( i == d_fd) // activity on server socket. must be conn. req.
+    if( i == loop->wakeFd[0] ) // woken up by another thread
+    {
+     int cmds[64];
+     int n;
+     bool stop = false;
+     while( (n = read(loop->wakeFd[0], cmds, sizeof(cmds))) > 0 )
+     {
+      for(int k = 0; k < n / (int)sizeof(int); k++)
+      {
+       if( cmds[k] >= 0 ) // connection steered to this loop
+       {
+        FD_SET(cmds[k], &loop->master);
+        if(cmds[k] > loop->fdMax) loop->fdMax = cmds[k];
+       }
+       else if( cmds[k] == TCP_WAKE_STOP )
+        stop = true;
+       else if( (cmds[k] == TCP_WAKE_HANDOFF) && d_handoffRequested 
+                && !handedOff && (loop->index == 0) )
+       {
+        // take over the connections of all other loops, then hand off
+        d_handoffRequested = 0;
+        stopLoops();
+        for(int l = 1; l < d_numLoops; l++)
+        {
+         struct tcp_event_loop *other = &d_loops[l];
+         for(int fd = 0; fd <= other->fdMax; fd++)
+         {
+          if( !FD_ISSET(fd, &other->master) || (fd == other->wakeFd[0]) )
+           continue;
+          if( fd == other->listenFd )
+           continue;
+          FD_SET(fd, &loop->master);
+          if(fd > loop->fdMax) loop->fdMax = fd;
+         }
+         FD_ZERO(&other->master);
+        }
+        if( handoff(&loop->master, loop->fdMax) == 0 )
+        {
+         handedOff = true;
+         drainEnd = monotonicUs() + TCP_HANDOFF_DRAIN;
+         loop->listenFd = -1;
+        }
+        else
+        {
+         // carry on alone, the kernel sends new connection requests 
+         // to the remaining listener
+         for(int l = 1; l < d_numLoops; l++)
+         {
+          if( d_loops[l].listenFd != -1 )
+           close(d_loops[l].listenFd);
+          d_loops[l].listenFd = -1;
+         }
+        }
+       }
+      }
+     }
+     if( stop )
+      return;
+    } // end if i = loop->wakeFd[0]
+    else if( i == loop->listenFd) // activity on server socket. must be conn. req.
     {
      // accept connection
-     if( (newFd = accept(d_fd, (struct sockaddr *)&clntAddr, 
+     clntAddrLen = sizeof( struct sockaddr_storage );
+     if( (newFd = accept(loop->listenFd, (struct sockaddr *)&clntAddr, 
          (socklen_t *)&clntAddrLen)) == -1)
       setError(errno, "doMessageCycle(accept)");
      else
      {
-      FD_SET(newFd, &master); // add to master list
-      if(newFd > fdMax) fdMax = newFd; // keep track of maximum
-      clntIp = (char *)inet_ntoa(clntAddr.sin_addr);
-      snprintf(info, 80, "accept %s (fd %d)", clntIp, newFd);
-      d_status.setReport(0,info);
-     }
-    } // end if i = d_fd
-    else // i != d_fd => client activity. handle client data.
-    {
-      // ***** Client message processing *****
-
-     int msgSize; // client first sends size of message
-     int nbytes;
-     if( (nbytes = recv(i, &msgSize, sizeof(int), MSG_WAITALL)) 
-          < (int)sizeof(int))
+      // turn away connections over the limit
+      if( (d_maxConnections > 0) && (d_numConnections >= d_maxConnections) )
+      {
+       sendReject(newFd, 0);
+       close(newFd);
+       __sync_fetch_and_add(&d_rejectedConns, 1);
+       continue;
+      }
+      __sync_fetch_and_add(&d_numConnections, 1);
+      
+      // pass the connection to the loop on the cpu that receives its 
+      // packets, or keep it if that is us.
+      struct tcp_event_loop *target = &d_loops[steerConnection(newFd)];
+      if( (target != loop) && target->running &&
+          (write(target->wakeFd[1], &newFd, sizeof(int)) == sizeof(int)) )
+       continue;
+       
+      FD_SET(newFd, &loop->master); // add to master list
+      if(newFd > loop->fdMax) loop->fdMax = newFd; // keep track of maximum
+      if(d_family == AF_UNIX)
+       clntIp = (char *)"local";
+      else
+       clntIp = (char *)inet_ntoa(((struct sockaddr_in *)&clntAddr)->sin_addr);
+      snprintf(info, 80, "accept %s (fd %d)", clntIp, newFd);
+      setReport(0,info);
+     }
+    } // end if i = loop->listenFd
+    else // client activity. handle client data.
+    {
+     // serve a few frames from this client, as buffered and within budget
+     int frames = 0;
+     int bytes = 0;
+     bool corked = false;
+     for(;;)
+     {
+      bool mayCork = (d_family != AF_UNIX) && (frames + 1 < d_turnFrames) 
+                     && ((d_turnBytes == 0) || (bytes < d_turnBytes));
+      int n = serviceClient(loop, i, arrival, mayCork, &corked);
+      if( n == -1 )
+      {
+       corked = false;
+       break;
+      }
+      frames++;
+      bytes += n;
+      if( first == -1 )
+       first = i;
+      
+      int avail = 0;
+      if( (frames >= d_turnFrames) || ((d_turnBytes > 0) && (bytes >= d_turnBytes))
+          || (ioctl(i, FIONREAD, &avail) == -1) || (avail < (int)sizeof(int)) )
+       break;
+     }
+     
+     // push out replies still held back
+     if( corked )
      {
+      int yes = 1;
+      setsockopt(i, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+     }
+     
+     // after a handoff, close the connection once the client has been 
+     // answered, so that it reconnects to the new process
+     int pending = 0;
+     if( handedOff && FD_ISSET(i, &loop->master) && (i < FD_SETSIZE) 
+         && (d_muxPartial[i] == NULL) && (ioctl(i, FIONREAD, &pending) == 0) 
+         && (pending == 0) )
+     {
+      closeConnection(i);
+      FD_CLR(i, &loop->master);
+     }
+    } // end else i != d_fd
+   } // end if FD_ISSET
+  } // end for i = 0 to fdMax
+  if( first != -1 )
+   loop->nextFd = first + 1;
+  
+  // after a handoff, we are done once the remaining clients have gone. 
+  // Those that stay idle are closed when the drain time is up.
+  if( handedOff )
+  {
+   bool busy = false;
+   bool expired = (monotonicUs() >= drainEnd);
+   for(int k = 0; k <= loop->fdMax; k++)
+   {
+    if( !FD_ISSET(k, &loop->master) || (k == loop->wakeFd[0]) )
+     continue;
+    if( !expired )
+    {
+     busy = true;
+     break;
+    }
+    closeConnection(k);
+    FD_CLR(k, &loop->master);
+   }
+   if( !busy )
+   {
+    d_init = false;
+    break;
+   }
+  }
+ } // end for (main)
+}
+
+
+//==============================================================================
+// TCPServer::serviceClient
+//==============================================================================
+int TCPServer::serviceClient(struct tcp_event_loop *loop, int fd, long long arrival,
+                             bool mayCork, bool *corked)
+{
+  // ***** Client message processing *****
+
+ int msgSize; // client first sends size of message
+ int nbytes;
+ if( (nbytes = recv(fd, &msgSize, sizeof(int), MSG_WAITALL)) 
+      < (int)sizeof(int))
+ {
 
 #ifdef DEBUG
  cerr << "DEBUG [doMessageCycle]: disconnect or read error" << endl;
 #endif
 
-      close(i);
-      FD_CLR(i, &master);
-      snprintf(info, 80, "client disconnected (fd %d)", i);
-      continue;
-     } // end if nbytes <= 0
-     else // nbytes > 0
-     {
+  closeConnection(fd);
+  FD_CLR(fd, &loop->master);
+  return -1;
+ } // end if nbytes <= 0
+ else // nbytes > 0
+ {
 
 #ifdef DEBUG
  cerr << endl << "DEBUG [doMessageCycle]: got client header" << endl;
 #endif
 
-      // msgSize has size of incoming message.
-      // Compare with our buffer and make sure we can accomodate
-      // the incoming data
-      if( msgSize > d_rcvBufSize)
-      {
+  // chunk of a multiplexed message
+  if( msgSize == TCP_CTRL_MUX )
+  {
+   int n = serviceMuxChunk(loop, fd, arrival, mayCork, corked);
+   if( n == -1 )
+   {
+    closeConnection(fd);
+    FD_CLR(fd, &loop->master);
+    return -1;
+   }
+   return sizeof(int) + n;
+  }
+  
+  // negative size is a control frame
+  if( msgSize < 0 )
+  {
+   if( handleControl(loop, fd, msgSize) == -1 )
+   {
+    closeConnection(fd);
+    FD_CLR(fd, &loop->master);
+    return -1;
+   }
+   return sizeof(int);
+  }
+
+  // msgSize has size of incoming message.
+  // Compare with our buffer and make sure we can accomodate
+  // the incoming data
+  if( msgSize > d_rcvBufSize)
+  {
 
 #ifdef DEBUG
- cerr << "DEBUG [doMessageCycle]: buffer not large enough. (fd " << i << ")" << endl;
+ cerr << "DEBUG [doMessageCycle]: buffer not large enough. (fd " << fd << ")" << endl;
 #endif
-       // read and discard data
-       int readTillNow = 0;
-       int numReadAttempts = 0;
-       while( (readTillNow < msgSize) && (numReadAttempts < 3) )
-       {
-        int readNow;
-        numReadAttempts++;
-        readNow = recv(i, NULL, msgSize - readTillNow, MSG_WAITALL);
-        if(readNow == -1)
-         break;
-        readTillNow += readNow;
-       } // end while
-
-       close(i);
-       FD_CLR(i, &master);
-       d_status.setReport(-1,"doMessageCycle: buffer not large enough.");
-       continue; 
-      } // end if msgSize > d_rcvBufSize
-     
+   // read and discard data
+   int readTillNow = 0;
+   int numReadAttempts = 0;
+   while( (readTillNow < msgSize) && (numReadAttempts < 3) )
+   {
+    int readNow;
+    numReadAttempts++;
+    readNow = recv(fd, NULL, msgSize - readTillNow, MSG_WAITALL);
+    if(readNow == -1)
+     break;
+    readTillNow += readNow;
+   } // end while
+
+   closeConnection(fd);
+   FD_CLR(fd, &loop->master);
+   setReport(-1,"doMessageCycle: buffer not large enough.");
+   return -1;
+  } // end if msgSize > d_rcvBufSize
+ 
 #ifdef DEBUG
  cerr << "DEBUG [doMessageCycle]: buffer for incoming message ok" << endl;
 #endif
 
-      // read data until done or try 3 times
-      int readTillNow = 0;
-      int numReadAttempts = 0;
-      while( (readTillNow < msgSize) && (numReadAttempts < 3) )
-      {
-       int readNow;
-       numReadAttempts++;
-       readNow = recv(i, &(d_rcvBuf[readTillNow]), msgSize - readTillNow, 
-                      MSG_WAITALL);
-       if(readNow == -1)
-        break;
-       readTillNow += readNow;
-      } // end while
-
-      // check for read failure
-      if( readTillNow < msgSize )
-      {
-       close(i);
-       FD_CLR(i, &master);
-       setError(EIO, "doMessageCycle(recv)");
+  // read data until done or try 3 times
+  int readTillNow = 0;
+  int numReadAttempts = 0;
+  while( (readTillNow < msgSize) && (numReadAttempts < 3) )
+  {
+   int readNow;
+   numReadAttempts++;
+   readNow = recv(fd, &(loop->rcvBuf[readTillNow]), msgSize - readTillNow, 
+                  MSG_WAITALL);
+   if(readNow == -1)
+    break;
+   readTillNow += readNow;
+  } // end while
+
+  // check for read failure
+  if( readTillNow < msgSize )
+  {
+   closeConnection(fd);
+   FD_CLR(fd, &loop->master);
+   setError(EIO, "doMessageCycle(recv)");
 #ifdef DEBUG
  cerr << "DEBUG [doMessageCycle]: *ERROR* reading client data " << readTillNow << "/" << msgSize << endl;
 #endif
-       continue;
-      }
+   return -1;
+  }
 
 #ifdef DEBUG
  cerr << "DEBUG [doMessageCycle]: done reading client data" << endl;
 #endif
 
-      // send client data to user implemented function
-      const char *outMsgBuf;
-      int outMsgLen;
-      outMsgBuf = receiveAndReply(d_rcvBuf, msgSize, &outMsgLen);
-      
+  // shed load rather than queue up when over capacity
+  unsigned int requestNum = 0;
+  if( fd < FD_SETSIZE )
+   requestNum = ++d_requestNum[fd];
+  if( admitRequest(arrival) == -1 )
+  {
+   sendReject(fd, requestNum);
+   return sizeof(int) + msgSize;
+  }
+  
+  // send client data to user implemented function
+  const char *outMsgBuf;
+  int outMsgLen;
+  struct tcp_cache_entry *pinned = NULL;
+  outMsgBuf = dispatchMessage(loop->rcvBuf, msgSize, &outMsgLen, &pinned);
+  releaseRequest();
+  
 #ifdef DEBUG
  cerr << "DEBUG [doMessageCycle]: user function processed data" << endl;
 #endif
 
-      // reply to client
-      if(outMsgBuf != NULL)
-      {
+  // reply to client
+  if(outMsgBuf != NULL)
+  {
 
 #ifdef DEBUG
  cerr << "DEBUG [doMessageCycle]: will reply to client" << endl;
 #endif
 
-       // write header to client - length of outgoing data
-       if( send(i, &outMsgLen, sizeof(int), 0) < (int)sizeof(int) )
-       {
-        close(i);
-        FD_CLR(i, &master);
-        setError(EIO, "doMessageCycle(send)");
-        continue;
-       }
-      
-#ifdef DEBUG
- cerr << "DEBUG [doMessageCycle]: header sent to client" << endl;
-#endif
-
-       // write data until done or try 3 times
-       int wroteTillNow = 0;
-       int numWriteAttempts = 0;
-       while( (wroteTillNow < outMsgLen) && (numWriteAttempts < 3) )
-       {
-        int wroteNow;
-        numWriteAttempts++;
-        wroteNow = send(i, &(outMsgBuf[wroteTillNow]), 
-                         outMsgLen - wroteTillNow, 0);
-
-        if(wroteNow == -1)
-         break;
-
-        wroteTillNow += wroteNow;
-       } // end while
-       
-       // check for write failure
-       if( wroteTillNow < outMsgLen )
-       {
-        close(i);
-        FD_CLR(i, &master);
-        setError(EIO, "doMessageCycle(send)");
-        continue;
-       }
+   // Hold back the reply if another request of this client is already 
+   // here, so that replies go out together. The last one flushes.
+   int avail = 0;
+   bool more = mayCork && (ioctl(fd, FIONREAD, &avail) == 0) 
+               && (avail >= (int)sizeof(int));
+   
+   // write header and data to client in one go
+   int ret = sendReply(fd, outMsgBuf, outMsgLen, more);
+   releaseCachedReply(pinned);
+   if( ret == -1 )
+   {
+    closeConnection(fd);
+    FD_CLR(fd, &loop->master);
+    setError(EIO, "doMessageCycle(send)");
+    return -1;
+   }
+   *corked = more;
 #ifdef DEBUG
  cerr << "DEBUG [doMessageCycle]: data sent to client" << endl;
 #endif
-      // ***** \Client message processing ****
-      } // end client reply
-     } // end else nbytes > 0
-    } // end else i != d_fd
-   } // end if FD_ISSET
-  } // end for i = 0 to fdMax
- } // end for (main)
+  // ***** \Client message processing ****
+  } // end client reply
+ } // end else nbytes > 0
+ return sizeof(int) + msgSize;
 }
 
 
 //==============================================================================
-// TCPServer::receiveAndReply
+// TCPServer::sendReply
 //==============================================================================
-const char *TCPServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+int TCPServer::sendReply(int fd, const char *outMsgBuf, int outMsgLen, bool more)
 {
- inMsgBuf=inMsgBuf;
- inMsgLen=inMsgLen;
- *outMsgLen = 0;
- return NULL;
+ struct iovec iov[2];
+ iov[0].iov_base = &outMsgLen;
+ iov[0].iov_len = sizeof(int);
+ iov[1].iov_base = (void *)outMsgBuf;
+ iov[1].iov_len = outMsgLen;
+ return sendVector(fd, iov, 2, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
 }
 
 
 //==============================================================================
-// TCPServer::init
+// TCPServer::sendMuxReply
 //==============================================================================
-int TCPServer::init(int port, int bufSize, int bdp)
+int TCPServer::sendMuxReply(int fd, int stream, int seq, const char *outMsgBuf,
+                            int outMsgLen, int flags, bool more)
 {
- struct sockaddr_in name;
- int sockBufSize = bdp * 1024;
+ int code = TCP_CTRL_MUX;
+ struct tcp_mux_frame frame;
+ struct iovec iov[3];
+ frame.stream = stream;
+ frame.seq = seq;
  
- d_init = false;
- if(d_fd)
+ int sent = 0;
+ do
  {
-  close(d_fd);
-  d_fd = -1;
- }
+  int n = std::min(outMsgLen - sent, TCP_MUX_CHUNK);
+  bool last = (sent + n == outMsgLen);
+  frame.length = n;
+  frame.flags = flags | (last ? TCP_MUX_END : 0);
+  iov[0].iov_base = &code;
+  iov[0].iov_len = sizeof(int);
+  iov[1].iov_base = &frame;
+  iov[1].iov_len = sizeof(frame);
+  iov[2].iov_base = (void *)(outMsgBuf + sent);
+  iov[2].iov_len = n;
+  if( sendVector(fd, iov, 3, MSG_NOSIGNAL | ((!last || more) ? MSG_MORE : 0))
+      == -1 )
+   return -1;
+  sent += n;
+ } while( sent < outMsgLen );
+ return 0;
+}
 
- // Create an endpoint for communication
- if( (d_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+
+//==============================================================================
+// TCPServer::serviceMuxChunk
+//==============================================================================
+int TCPServer::serviceMuxChunk(struct tcp_event_loop *loop, int fd, 
+                               long long arrival, bool mayCork, bool *corked)
+{
+ struct tcp_mux_frame frame;
+ if( recv(fd, &frame, sizeof(frame), MSG_WAITALL) < (int)sizeof(frame) )
  {
-  setError(errno, "init(socket)");
+  setError(EIO, "doMessageCycle(recv)");
   return -1;
  }
- 
- // Allow reuse of port
- int yes = 1;
- if( setsockopt(d_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+ if( (fd >= FD_SETSIZE) || (frame.length < 0) )
  {
-  setError(errno, "init(setsockopt-SO_REUSEADDR)");
-  close(d_fd);
-  d_fd = -1;
+  setReport(-1, "doMessageCycle: invalid multiplexed frame");
   return -1;
  }
  
- // Do not delay sending data packets
- if( setsockopt(d_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+ // find the rest of the message if this is not its first chunk, and add up
+ // what the connection holds in unfinished messages
+ struct tcp_mux_partial **link = &d_muxPartial[fd];
+ struct tcp_mux_partial **found = NULL;
+ int numPartial = 0;
+ long long heldBytes = 0;
+ for( ; *link; link = &(*link)->next)
  {
-  setError(errno, "init(setsockopt-TCP_NODELAY)");
-  close(d_fd);
-  d_fd = -1;
+  if( (*link)->stream == frame.stream )
+   found = link;
+  heldBytes += (*link)->cap;
+  numPartial++;
+ }
+ if( found )
+  link = found;
+ struct tcp_mux_partial *part = *link;
+ if( part && (part->seq != frame.seq) )
+ {
+  part->seq = frame.seq; // the client gave up on the earlier message
+  part->len = 0;
+ }
+ 
+ int partLen = part ? part->len : 0;
+ if( frame.length > d_rcvBufSize - partLen )
+ {
+  setReport(-1,"doMessageCycle: buffer not large enough.");
   return -1;
  }
-
- // set suggested optimal socket buffer sizes.
- if( sockBufSize != 0 ) {
-  if( setsockopt(d_fd, SOL_SOCKET, SO_SNDBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+ int msgSize = partLen + frame.length;
+ 
+ // a message in one chunk is read in place, others are collected
+ char *data = loop->rcvBuf;
+ if( part || !(frame.flags & TCP_MUX_END) )
+ {
+  if( part == NULL )
   {
-   setError(errno, "init(setsockopt-SO_SNDBUF)");
-   close(d_fd);
-   d_fd = -1;
-   return -1;
+   if( numPartial >= TCP_MUX_MAX_STREAMS )
+   {
+    setReport(-1, "doMessageCycle: too many streams");
+    return -1;
+   }
+   part = new struct tcp_mux_partial;
+   part->stream = frame.stream;
+   part->seq = frame.seq;
+   part->buf = NULL;
+   part->len = 0;
+   part->cap = 0;
+   part->next = NULL;
+   *link = part;
   }
-
-  if( setsockopt(d_fd, SOL_SOCKET, SO_RCVBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+  if( msgSize > part->cap )
   {
-   setError(errno, "init(setsockopt-SO_RCVBUF)");
-   close(d_fd);
-   d_fd = -1;
-   return -1;
+   int cap = std::min(std::max(msgSize, 2 * part->cap), d_rcvBufSize);
+   if( heldBytes - part->cap + cap > 
+       std::max((long long)TCP_MUX_MAX_PARTIAL, (long long)d_rcvBufSize) )
+   {
+    setReport(-1, "doMessageCycle: unfinished messages too large");
+    return -1;
+   }
+   char *buf = (char *)realloc(part->buf, cap);
+   if( buf == NULL )
+   {
+    setReport(ENOMEM, "doMessageCycle(realloc)");
+    return -1;
+   }
+   part->buf = buf;
+   part->cap = cap;
   }
+  data = part->buf + part->len;
  }
- 
- // bind a name to the socket
- name.sin_family = AF_INET;
- name.sin_port = htons(port);
- name.sin_addr.s_addr = htonl(INADDR_ANY);
- memset(&(name.sin_zero), '\0', 8);
- if( bind(d_fd, (struct sockaddr *)&name, sizeof(struct sockaddr)) == -1)
+ if( (frame.length > 0) && 
+     (recv(fd, data, frame.length, MSG_WAITALL) < frame.length) )
  {
-  setError(errno, "init(bind)");
-  close(d_fd);
-  d_fd = -1;
+  setError(EIO, "doMessageCycle(recv)");
   return -1;
  }
-
- // listen for connections
- if( listen(d_fd, 20) == -1) // 20 = length of queue of waiting clients
+ int consumed = sizeof(frame) + frame.length;
+ if( !(frame.flags & TCP_MUX_END) )
  {
-  setError(errno, "init(listen)");
-  close(d_fd);
-  d_fd = -1;
-  return -1;
+  part->len = msgSize;
+  return consumed;
  }
-
- // Create the buffer to store client messages
- // The message from client is formatted as (int)msgLen + (char *)msg 
- d_rcvBuf = (char *)realloc(d_rcvBuf, bufSize * sizeof(char) + sizeof(int));
- if(d_rcvBuf == NULL)
+ 
+ // the message is complete
+ const char *inMsgBuf = part ? part->buf : loop->rcvBuf;
+ int ret = 0;
+ if( admitRequest(arrival) == -1 )
+  ret = sendMuxReply(fd, frame.stream, frame.seq, NULL, 0, TCP_MUX_REJECT, 
+                     false);
+ else
  {
-  setError(ENOMEM, "TCPServer(malloc)");
-  close(d_fd);
-  d_fd = -1;
+  const char *outMsgBuf;
+  int outMsgLen;
+  struct tcp_cache_entry *pinned = NULL;
+  outMsgBuf = dispatchMessage(inMsgBuf, msgSize, &outMsgLen, &pinned);
+  releaseRequest();
+  if( outMsgBuf != NULL )
+  {
+   int avail = 0;
+   bool more = mayCork && (ioctl(fd, FIONREAD, &avail) == 0) 
+               && (avail >= (int)sizeof(int));
+   ret = sendMuxReply(fd, frame.stream, frame.seq, outMsgBuf, outMsgLen, 0, 
+                      more);
+   *corked = more;
+  }
+  releaseCachedReply(pinned);
+ }
+ if( part )
+ {
+  *link = part->next;
+  free(part->buf);
+  delete part;
+ }
+ if( ret == -1 )
+ {
+  setError(EIO, "doMessageCycle(send)");
   return -1;
  }
- d_rcvBufSize = bufSize;
-
- d_init = true;
- return 0;
+ return consumed;
 }
 
 
 //==============================================================================
-// TCPServer::getStatusCode
+// TCPServer::freeMuxPartial
 //==============================================================================
-int TCPServer::getStatusCode() const
+void TCPServer::freeMuxPartial(int fd)
 {
- return d_status.getReportCode();
+ while( d_muxPartial[fd] )
+ {
+  struct tcp_mux_partial *part = d_muxPartial[fd];
+  d_muxPartial[fd] = part->next;
+  free(part->buf);
+  delete part;
+ }
 }
 
 
 //==============================================================================
-// TCPServer::getStatusMessage
+// TCPServer::stopLoops
 //==============================================================================
-const char *TCPServer::getStatusMessage() const
+void TCPServer::stopLoops()
 {
- return d_status.getReportMessage();
+ int cmd = TCP_WAKE_STOP;
+ for(int k = 1; k < d_numLoops; k++)
+ {
+  if( !d_loops[k].running )
+   continue;
+  if( write(d_loops[k].wakeFd[1], &cmd, sizeof(int)) == sizeof(int) )
+   pthread_join(d_loops[k].thread, NULL);
+  else
+  {
+   pthread_cancel(d_loops[k].thread);
+   pthread_join(d_loops[k].thread, NULL);
+  }
+  d_loops[k].running = false;
+ }
 }
 
 
 //==============================================================================
-// TCPServer::setError
+// TCPServer::closeClients
 //==============================================================================
-void TCPServer::setError(int code, const char *functionName)
+void TCPServer::closeClients(struct tcp_event_loop *loop)
 {
- char buf[80];
- snprintf(buf, 80, "%s: %s", functionName, strerror(code));
- d_status.setReport(code, buf);
+ for(int fd = 0; fd <= loop->fdMax; fd++)
+ {
+  if( !FD_ISSET(fd, &loop->master) || (fd == loop->listenFd) 
+      || (fd == loop->wakeFd[0]) )
+   continue;
+  closeConnection(fd);
+  FD_CLR(fd, &loop->master);
+ }
+ 
+ // connections steered to the loop but not picked up
+ int cmds[64];
+ int n;
+ while( (loop->wakeFd[0] != -1) 
+        && ((n = read(loop->wakeFd[0], cmds, sizeof(cmds))) > 0) )
+ {
+  for(int k = 0; k < n / (int)sizeof(int); k++)
+  {
+   if( cmds[k] >= 0 )
+   {
+    close(cmds[k]);
+    __sync_fetch_and_sub(&d_numConnections, 1);
+   }
+  }
+ }
 }
 
 
 //==============================================================================
-// TCPServer::enableIgnoreSigPipe
+// TCPServer::steerConnection
 //==============================================================================
-int TCPServer::enableIgnoreSigPipe()
+int TCPServer::steerConnection(int fd)
 {
- if(signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+ int cpu = -1;
+ 
+ if( d_numLoops == 1 )
+  return 0;
+ 
+#ifdef SO_INCOMING_CPU
+ socklen_t len = sizeof(int);
+ if( getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1 )
+  cpu = -1;
+#endif
+ 
+ // no cpu information, spread connections evenly
+ if( cpu < 0 )
+  return (__sync_fetch_and_add(&d_nextLoop, 1) & 0x7fffffff) % d_numLoops;
+ 
+ for(int k = 0; k < d_numLoops; k++)
  {
-  d_status.setReport(-1, "enableIgnoreSigPipe: failed");
-  return -1;
+  if( d_loops[k].cpu == cpu )
+   return k;
  }
- return 0;
+ return cpu % d_numLoops;
 }
 
 
 //==============================================================================
-// TCPServer::disableIgnoreSigPipe
+// TCPServer::receiveAndReply
 //==============================================================================
-int TCPServer::disableIgnoreSigPipe()
+const char *TCPServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
 {
- if(signal(SIGPIPE, SIG_DFL) == SIG_ERR)
- {
-  d_status.setReport(-1,"disableIgnoreSigPipe: failed");
-  return -1;
- }
- return 0;
+ inMsgBuf=inMsgBuf;
+ inMsgLen=inMsgLen;
+ *outMsgLen = 0;
+ return NULL;
 }
 
 
 //==============================================================================
-// TCPClient::TCPClient
+// TCPServer::dispatchMessage
 //==============================================================================
-TCPClient::TCPClient()
+const char *TCPServer::dispatchMessage(const char *inMsgBuf, int inMsgLen, 
+                                       int *outMsgLen, 
+                                       struct tcp_cache_entry **pinned)
 {
- d_fd = -1;
- d_init = false;
- d_serverName = NULL;
- d_serverPort = 0;
- d_recvTimeout.tv_sec = 1;
- d_recvTimeout.tv_usec = 0;
- d_bdp = 0;
- setError(0, "TCPClient");
+ const char *outMsgBuf;
+ *pinned = NULL;
+ if( d_cache )
+  return cachedMessage(inMsgBuf, inMsgLen, outMsgLen, pinned);
+ if( !d_serializeHandler )
+  return receiveAndReply(inMsgBuf, inMsgLen, outMsgLen);
+ pthread_mutex_lock(&d_handlerLock);
+ outMsgBuf = receiveAndReply(inMsgBuf, inMsgLen, outMsgLen);
+ pthread_mutex_unlock(&d_handlerLock);
+ return outMsgBuf;
 }
 
 
-TCPClient::TCPClient(const char *serverIp, int port, struct timeval &t, int bdp)
+//==============================================================================
+// TCPServer::cachedMessage
+//==============================================================================
+const char *TCPServer::cachedMessage(const char *inMsgBuf, int inMsgLen, 
+                                     int *outMsgLen, 
+                                     struct tcp_cache_entry **pinned)
 {
- d_init = false;
- d_serverName = NULL;
- d_serverPort = 0;
- d_recvTimeout.tv_sec = 1;
- d_recvTimeout.tv_usec = 0;
- d_fd = -1;
- d_bdp = 0;
+ unsigned long long hash = hashBytes(inMsgBuf, inMsgLen);
+ struct tcp_cache_shard *shard = cacheShard(d_cache, hash);
+ struct tcp_cache_entry *e;
  
- // init connection to server
- if( init(serverIp, port, t, bdp) == -1 )
-  return;
+ pthread_mutex_lock(&shard->lock);
+ int slot = cacheFind(shard, hash, inMsgBuf, inMsgLen);
  
- setError(0, "TCPClient");
-}
-
+ // the same request is being handled for someone else. Wait for it.
+ while( (slot != -1) && (shard->entries[slot].state == TCP_CACHE_PENDING) )
+ {
+  __sync_fetch_and_add(&d_cache->coalesced, 1);
+  pthread_cond_wait(&shard->filled, &shard->lock);
+  slot = cacheFind(shard, hash, inMsgBuf, inMsgLen);
+ }
+ if( slot != -1 )
+ {
+  e = &shard->entries[slot];
+  if( (e->expires == 0) || (monotonicUs() < e->expires) )
+  {
+   __sync_fetch_and_add(&d_cache->hits, 1);
+   e->referenced = true;
+   *outMsgLen = e->replyLen;
+   if( e->replyLen < 0 )
+   {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+   }
+   __sync_fetch_and_add(&e->refs, 1); // released without the lock
+   *pinned = e;
+   pthread_mutex_unlock(&shard->lock);
+   return e->reply;
+  }
+  cacheUnlink(shard, slot); // stale
+ }
+ 
+ // miss. Claim a slot so that others asking the same wait for us.
+ __sync_fetch_and_add(&d_cache->misses, 1);
+ slot = cacheAlloc(d_cache, shard);
+ e = (slot == -1) ? NULL : &shard->entries[slot];
+ if( e && !cacheCopy(&e->request, &e->requestCap, inMsgBuf, inMsgLen) )
+  e = NULL;
+ if( e )
+ {
+  int *bucket = &shard->buckets[hash & (shard->numBuckets - 1)];
+  e->hash = hash;
+  e->requestLen = inMsgLen;
+  e->state = TCP_CACHE_PENDING;
+  e->referenced = false;
+  e->linked = true;
+  e->next = *bucket;
+  *bucket = slot;
+ }
+ pthread_mutex_unlock(&shard->lock);
+ 
+ // call the handler, and copy its reply before anyone calls it again
+ const char *outMsgBuf;
+ char *reply = NULL;
+ int replyLen = -1;
+ if( d_serializeHandler )
+  pthread_mutex_lock(&d_handlerLock);
+ outMsgBuf = receiveAndReply(inMsgBuf, inMsgLen, outMsgLen);
+ if( (outMsgBuf != NULL) && (*outMsgLen >= 0) )
+ {
+  replyLen = *outMsgLen;
+  reply = (char *)malloc(replyLen ? replyLen : 1);
+  if( reply )
+   memcpy(reply, outMsgBuf, replyLen);
+ }
+ if( d_serializeHandler )
+  pthread_mutex_unlock(&d_handlerLock);
+ if( e == NULL )
+ {
+  // nowhere to keep it
+  free(reply);
+  return outMsgBuf;
+ }
+ 
+ pthread_mutex_lock(&shard->lock);
+ if( (outMsgBuf != NULL) && (reply == NULL) )
+ {
+  // out of memory, drop the slot and send the handler's buffer
+  if( e->linked )
+   cacheUnlink(shard, slot);
+  e->state = TCP_CACHE_FREE;
+  pthread_cond_broadcast(&shard->filled);
+  pthread_mutex_unlock(&shard->lock);
+  return outMsgBuf;
+ }
+ free(e->reply);
+ e->reply = reply;
+ e->replyCap = (replyLen > 0) ? replyLen : 0;
+ e->replyLen = replyLen;
+ e->expires = d_cache->ttl ? monotonicUs() + d_cache->ttl : 0;
+ e->state = e->linked ? TCP_CACHE_READY : TCP_CACHE_FREE; // invalidated?
+ if( replyLen >= 0 )
+ {
+  __sync_fetch_and_add(&e->refs, 1);
+  *pinned = e;
+ }
+ pthread_cond_broadcast(&shard->filled);
+ pthread_mutex_unlock(&shard->lock);
+ return (replyLen >= 0) ? e->reply : NULL;
+}
+
+
+//==============================================================================
+// TCPServer::releaseCachedReply
+//==============================================================================
+void TCPServer::releaseCachedReply(struct tcp_cache_entry *pinned)
+{
+ if( pinned )
+  __sync_fetch_and_sub(&pinned->refs, 1);
+}
+
+
+//==============================================================================
+// TCPServer::enableResponseCache
+//==============================================================================
+int TCPServer::enableResponseCache(int maxEntries, int ttl, int numShards)
+{
+ if( (maxEntries < 0) || (ttl < 0) || (numShards < 1) 
+     || ((maxEntries > 0) && (maxEntries < numShards)) )
+ {
+  setReport(EINVAL, "enableResponseCache: invalid argument");
+  return -1;
+ }
+ freeCache();
+ if( maxEntries == 0 )
+  return 0;
+ 
+ struct tcp_cache *cache = new struct tcp_cache;
+ cache->numShards = numShards;
+ cache->ttl = ttl;
+ cache->hits = 0;
+ cache->misses = 0;
+ cache->evictions = 0;
+ cache->coalesced = 0;
+ cache->shards = new struct tcp_cache_shard[numShards];
+ for(int k = 0; k < numShards; k++)
+ {
+  struct tcp_cache_shard *shard = &cache->shards[k];
+  pthread_mutex_init(&shard->lock, NULL);
+  pthread_cond_init(&shard->filled, NULL);
+  shard->numEntries = (maxEntries + numShards - 1) / numShards;
+  shard->entries = (struct tcp_cache_entry *)calloc(shard->numEntries, 
+                                               sizeof(struct tcp_cache_entry));
+  shard->hand = 0;
+  shard->numBuckets = 1;
+  while( shard->numBuckets < 2 * shard->numEntries )
+   shard->numBuckets *= 2;
+  shard->buckets = (int *)malloc(shard->numBuckets * sizeof(int));
+  if( shard->buckets )
+   memset(shard->buckets, 0xff, shard->numBuckets * sizeof(int)); // all -1
+  for(int n = 0; shard->entries && (n < shard->numEntries); n++)
+   shard->entries[n].next = -1;
+ }
+ d_cache = cache;
+ for(int k = 0; k < numShards; k++)
+ {
+  if( (cache->shards[k].entries == NULL) || (cache->shards[k].buckets == NULL) )
+  {
+   freeCache();
+   setReport(ENOMEM, "enableResponseCache(malloc)");
+   return -1;
+  }
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::freeCache
+//==============================================================================
+void TCPServer::freeCache()
+{
+ if( d_cache == NULL )
+  return;
+ for(int k = 0; k < d_cache->numShards; k++)
+ {
+  struct tcp_cache_shard *shard = &d_cache->shards[k];
+  for(int n = 0; shard->entries && (n < shard->numEntries); n++)
+  {
+   free(shard->entries[n].request);
+   free(shard->entries[n].reply);
+  }
+  free(shard->entries);
+  free(shard->buckets);
+  pthread_mutex_destroy(&shard->lock);
+  pthread_cond_destroy(&shard->filled);
+ }
+ delete [] d_cache->shards;
+ delete d_cache;
+ d_cache = NULL;
+}
+
+
+//==============================================================================
+// TCPServer::invalidateCachedReply
+//==============================================================================
+int TCPServer::invalidateCachedReply(const char *request, int requestLen)
+{
+ if( (d_cache == NULL) || (request == NULL) || (requestLen < 0) )
+  return 0;
+ unsigned long long hash = hashBytes(request, requestLen);
+ struct tcp_cache_shard *shard = cacheShard(d_cache, hash);
+ pthread_mutex_lock(&shard->lock);
+ int slot = cacheFind(shard, hash, request, requestLen);
+ if( slot != -1 )
+  cacheUnlink(shard, slot);
+ pthread_mutex_unlock(&shard->lock);
+ return (slot != -1) ? 1 : 0;
+}
+
+
+//==============================================================================
+// TCPServer::clearCache
+//==============================================================================
+void TCPServer::clearCache()
+{
+ for(int k = 0; d_cache && (k < d_cache->numShards); k++)
+ {
+  struct tcp_cache_shard *shard = &d_cache->shards[k];
+  pthread_mutex_lock(&shard->lock);
+  for(int n = 0; n < shard->numEntries; n++)
+  {
+   if( shard->entries[n].linked )
+    cacheUnlink(shard, n);
+  }
+  pthread_mutex_unlock(&shard->lock);
+ }
+}
+
+
+//==============================================================================
+// TCPServer::getCacheCounters
+//==============================================================================
+void TCPServer::getCacheCounters(unsigned long *hits, unsigned long *misses, 
+                                 unsigned long *evictions, 
+                                 unsigned long *coalesced) const
+{
+ unsigned long h = 0, m = 0, e = 0, c = 0;
+ if( d_cache )
+ {
+  h = d_cache->hits;
+  m = d_cache->misses;
+  e = d_cache->evictions;
+  c = d_cache->coalesced;
+ }
+ if( hits )
+  *hits = h;
+ if( misses )
+  *misses = m;
+ if( evictions )
+  *evictions = e;
+ if( coalesced )
+  *coalesced = c;
+}
+
+
+//==============================================================================
+// TCPServer::setAdmissionLimits
+//==============================================================================
+int TCPServer::setAdmissionLimits(int maxConnections, int maxInFlight, 
+                                  int targetDelay, int interval)
+{
+ if( (maxConnections < 0) || (maxInFlight < 0) || (targetDelay < 0) 
+     || (interval <= 0) )
+ {
+  setReport(EINVAL, "setAdmissionLimits: invalid limit");
+  return -1;
+ }
+ pthread_mutex_lock(&d_admissionLock);
+ d_maxConnections = maxConnections;
+ d_maxInFlight = maxInFlight;
+ d_targetDelay = targetDelay;
+ d_interval = interval;
+ d_firstAboveTime = 0;
+ d_dropping = false;
+ d_dropCount = 0;
+ pthread_mutex_unlock(&d_admissionLock);
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::setTurnBudget
+//==============================================================================
+int TCPServer::setTurnBudget(int maxFrames, int maxBytes)
+{
+ if( (maxFrames < 1) || (maxBytes < 0) )
+ {
+  setReport(EINVAL, "setTurnBudget: invalid budget");
+  return -1;
+ }
+ d_turnFrames = maxFrames;
+ d_turnBytes = maxBytes;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::getSocketStats
+//==============================================================================
+int TCPServer::getSocketStats(TCPSocketStats *stats, int maxStats) const
+{
+ int n = 0;
+ for(int fd = 0; d_sockStats && stats && (fd < FD_SETSIZE) && (n < maxStats); fd++)
+ {
+  if( d_sockStats[fd].fd != -1 )
+   stats[n++] = d_sockStats[fd];
+ }
+ return n;
+}
+
+
+//==============================================================================
+// TCPServer::getAdmissionCounters
+//==============================================================================
+void TCPServer::getAdmissionCounters(unsigned long *rejectedConnections, 
+                                     unsigned long *rejectedRequests) const
+{
+ if( rejectedConnections )
+  *rejectedConnections = d_rejectedConns;
+ if( rejectedRequests )
+  *rejectedRequests = d_rejectedReqs;
+}
+
+
+//==============================================================================
+// TCPServer::admitRequest
+//==============================================================================
+int TCPServer::admitRequest(long long arrival)
+{
+ // limit on requests being handled at the same time
+ int inFlight = __sync_add_and_fetch(&d_inFlight, 1);
+ if( (d_maxInFlight > 0) && (inFlight > d_maxInFlight) )
+ {
+  __sync_fetch_and_sub(&d_inFlight, 1);
+  __sync_fetch_and_add(&d_rejectedReqs, 1);
+  return -1;
+ }
+ if( d_targetDelay <= 0 )
+  return 0;
+ 
+ // CoDel: once the queueing delay has stayed above target for an
+ // interval, reject requests at a rate that grows with the square root
+ // of the number of rejections, until the delay falls below target.
+ long long now = monotonicUs();
+ long long sojourn = now - arrival;
+ bool reject = false;
+ pthread_mutex_lock(&d_admissionLock);
+ if( sojourn < d_targetDelay )
+ {
+  d_firstAboveTime = 0;
+  d_dropping = false;
+ }
+ else if( d_firstAboveTime == 0 )
+  d_firstAboveTime = now + d_interval;
+ else if( !d_dropping && (now >= d_firstAboveTime) )
+ {
+  // re-enter dropping state at the previous rate if it was recent
+  d_dropping = true;
+  reject = true;
+  if( (d_dropCount > 2) && (now - d_dropNext < 16 * d_interval) )
+   d_dropCount -= 2;
+  else
+   d_dropCount = 1;
+  d_dropNext = now + d_interval / isqrt(d_dropCount);
+ }
+ else if( d_dropping && (now >= d_dropNext) )
+ {
+  reject = true;
+  d_dropCount++;
+  d_dropNext += d_interval / isqrt(d_dropCount);
+ }
+ pthread_mutex_unlock(&d_admissionLock);
+ 
+ if( reject )
+ {
+  __sync_fetch_and_sub(&d_inFlight, 1);
+  __sync_fetch_and_add(&d_rejectedReqs, 1);
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::releaseRequest
+//==============================================================================
+void TCPServer::releaseRequest()
+{
+ __sync_fetch_and_sub(&d_inFlight, 1);
+}
+
+
+//==============================================================================
+// TCPServer::sendReject
+//==============================================================================
+void TCPServer::sendReject(int fd, unsigned int requestNum)
+{
+ int frame[2];
+ frame[0] = TCP_CTRL_REJECT;
+ frame[1] = (int)requestNum;
+ if( send(fd, frame, sizeof(frame), MSG_DONTWAIT | MSG_NOSIGNAL) 
+     < (int)sizeof(frame) )
+  setError(EIO, "doMessageCycle(send)");
+}
+
+
+//==============================================================================
+// TCPServer::handleControl
+//==============================================================================
+int TCPServer::handleControl(struct tcp_event_loop *loop, int fd, int code)
+{
+ struct tcp_shm_request request;
+ struct tcp_shm_reply reply;
+ char identity[TCP_SHM_IDLEN];
+ static int channelNum = 0;
+ 
+ if( (code == TCP_CTRL_SUBSCRIBE) || (code == TCP_CTRL_UNSUBSCRIBE) )
+  return handleSubscription(loop, fd, code);
+ if( code != TCP_CTRL_SHM )
+ {
+  setReport(-1, "doMessageCycle: unknown control frame");
+  return -1;
+ }
+ 
+ if( recv(fd, &request, sizeof(request), MSG_WAITALL) < (int)sizeof(request) )
+ {
+  setError(EIO, "doMessageCycle(recv)");
+  return -1;
+ }
+ request.identity[TCP_SHM_IDLEN - 1] = '\0';
+
+ // accept only clients on this host
+ memset(&reply, 0, sizeof(reply));
+ getHostIdentity(identity, TCP_SHM_IDLEN);
+ if( (fd < FD_SETSIZE) && (d_shmChannels[fd] == NULL) && (request.maxReply > 0) 
+     && (request.maxReply <= INT_MAX - TCP_SHM_HDRLEN - d_rcvBufSize)
+     && (strncmp(identity, request.identity, TCP_SHM_IDLEN) == 0) )
+ {
+#ifdef __linux__
+  struct tcp_shm_channel *channel = new struct tcp_shm_channel;
+  int size = TCP_SHM_HDRLEN + d_rcvBufSize + request.maxReply;
+  snprintf(reply.name, TCP_SHM_NAMELEN, "/putils-tcp-%d-%d-%016llx", 
+           __sync_fetch_and_add(&channelNum, 1), fd, randomToken());
+  channel->server = this;
+  channel->reqCap = d_rcvBufSize;
+  channel->repCap = request.maxReply;
+  channel->region = (struct tcp_shm_region *)channel->shm.create(reply.name, 
+                                               size, S_IRUSR | S_IWUSR);
+  if( channel->region != NULL )
+  {
+   memset(channel->region, 0, TCP_SHM_HDRLEN);
+   channel->region->open = 1;
+   if( pthread_create(&channel->thread, NULL, &TCPServer::shmServiceEntry, 
+       channel) == 0 )
+   {
+    d_shmChannels[fd] = channel;
+    reply.accepted = 1;
+    reply.reqCap = d_rcvBufSize;
+   }
+  }
+  if( !reply.accepted )
+  {
+   setError(channel->shm.getErrnoError(), "doMessageCycle(shm)");
+   delete channel;
+   reply.name[0] = '\0';
+  }
+#endif
+ }
+ 
+ // send result to client
+ if( (send(fd, &code, sizeof(int), 0) < (int)sizeof(int)) ||
+     (send(fd, &reply, sizeof(reply), 0) < (int)sizeof(reply)) )
+ {
+  setError(EIO, "doMessageCycle(send)");
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::setSubscriberPolicy
+//==============================================================================
+int TCPServer::setSubscriberPolicy(int maxQueued, SubscriberPolicy policy)
+{
+ if( maxQueued < 1 )
+ {
+  setReport(EINVAL, "setSubscriberPolicy: invalid queue length");
+  return -1;
+ }
+ pthread_mutex_lock(&d_pubLock);
+ if( d_subMax >= 0 )
+ {
+  pthread_mutex_unlock(&d_pubLock);
+  setReport(EBUSY, "setSubscriberPolicy: subscribers connected");
+  return -1;
+ }
+ d_subQueueLen = maxQueued;
+ d_subPolicy = policy;
+ pthread_mutex_unlock(&d_pubLock);
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::publish
+//==============================================================================
+int TCPServer::publish(int topic, const char *msg, int msgLen)
+{
+ if( (msg == NULL) && (msgLen > 0) )
+ {
+  setReport(EINVAL, "publish: invalid buffer");
+  return -1;
+ }
+ 
+ // build the frame once for all subscribers
+ int frameLen = 3 * sizeof(int) + msgLen;
+ struct tcp_pub_buffer *buf;
+ buf = (struct tcp_pub_buffer *)malloc(sizeof(struct tcp_pub_buffer) + frameLen);
+ if( buf == NULL )
+ {
+  setReport(ENOMEM, "publish(malloc)");
+  return -1;
+ }
+ int hdr[3] = { TCP_CTRL_PUBLISH, topic, msgLen };
+ memcpy(buf->frame, hdr, sizeof(hdr));
+ if( msgLen > 0 )
+  memcpy(buf->frame + sizeof(hdr), msg, msgLen);
+ buf->topic = topic;
+ buf->frameLen = frameLen;
+ buf->refs = 1; // ours, until queued everywhere
+ 
+ int numQueued = 0;
+ pthread_mutex_lock(&d_pubLock);
+ for(int fd = 0; fd <= d_subMax; fd++)
+ {
+  struct tcp_subscriber *sub = d_subscribers[fd];
+  if( (sub == NULL) || sub->broken )
+   continue;
+  bool subscribed = false;
+  for(int k = 0; (k < sub->numTopics) && !subscribed; k++)
+   subscribed = (sub->topics[k] == topic);
+  if( !subscribed )
+   continue;
+  
+  // a subscriber that is behind gets the latest value in place of an 
+  // older one of the same topic that it has yet to start on.
+  bool queued = false;
+  if( d_subPolicy == CONFLATE )
+  {
+   for(int k = (sub->offset > 0) ? 1 : 0; (k < sub->count) && !queued; k++)
+   {
+    int slot = (sub->head + k) % d_subQueueLen;
+    if( sub->queue[slot]->topic != topic )
+     continue;
+    __sync_fetch_and_add(&buf->refs, 1);
+    releasePubBuffer(sub->queue[slot]);
+    sub->queue[slot] = buf;
+    queued = true;
+    __sync_fetch_and_add(&d_pubDrops, 1);
+   }
+  }
+  if( !queued && (sub->count == d_subQueueLen) )
+  {
+   // no room. Drop the new message, or the oldest one not yet started.
+   __sync_fetch_and_add(&d_pubDrops, 1);
+   if( (d_subPolicy == DROP_NEWEST) || ((sub->offset > 0) && (sub->count == 1)) )
+    continue;
+   int victim = (sub->offset > 0) ? 1 : 0;
+   releasePubBuffer(sub->queue[(sub->head + victim) % d_subQueueLen]);
+   for(int k = victim; k < sub->count - 1; k++)
+    sub->queue[(sub->head + k) % d_subQueueLen] = 
+     sub->queue[(sub->head + k + 1) % d_subQueueLen];
+   sub->count--;
+  }
+  if( !queued )
+  {
+   __sync_fetch_and_add(&buf->refs, 1);
+   sub->queue[(sub->head + sub->count) % d_subQueueLen] = buf;
+   sub->count++;
+  }
+  numQueued++;
+  
+  // write what the socket takes now, and leave the rest to the event loop
+  if( flushSubscriber(fd) > 0 )
+  {
+   struct tcp_event_loop *loop = &d_loops[sub->loop];
+   int cmd = TCP_WAKE_FLUSH;
+   if( (__sync_lock_test_and_set(&loop->flushRequested, 1) == 0)
+       && (loop->wakeFd[1] != -1) )
+    if( write(loop->wakeFd[1], &cmd, sizeof(int)) != sizeof(int) )
+     loop->flushRequested = 0;
+  }
+ }
+ pthread_mutex_unlock(&d_pubLock);
+ releasePubBuffer(buf);
+ return numQueued;
+}
+
+
+//==============================================================================
+// TCPServer::getPublishDrops
+//==============================================================================
+unsigned long TCPServer::getPublishDrops() const
+{
+ return d_pubDrops;
+}
+
+
+//==============================================================================
+// TCPServer::handleSubscription
+//==============================================================================
+int TCPServer::handleSubscription(struct tcp_event_loop *loop, int fd, int code)
+{
+ int topic;
+ if( recv(fd, &topic, sizeof(int), MSG_WAITALL) < (int)sizeof(int) )
+ {
+  setError(EIO, "doMessageCycle(recv)");
+  return -1;
+ }
+ if( fd >= FD_SETSIZE )
+  return -1;
+ 
+ pthread_mutex_lock(&d_pubLock);
+ struct tcp_subscriber *sub = d_subscribers[fd];
+ if( code == TCP_CTRL_UNSUBSCRIBE )
+ {
+  for(int k = 0; sub && (k < sub->numTopics); k++)
+  {
+   if( sub->topics[k] == topic )
+    sub->topics[k] = sub->topics[--sub->numTopics];
+  }
+  pthread_mutex_unlock(&d_pubLock);
+  return 0;
+ }
+ 
+ if( sub == NULL )
+ {
+  sub = new struct tcp_subscriber;
+  sub->loop = loop->index;
+  sub->topics = NULL;
+  sub->numTopics = 0;
+  sub->queue = (struct tcp_pub_buffer **)malloc(d_subQueueLen * 
+                                                sizeof(struct tcp_pub_buffer *));
+  sub->head = 0;
+  sub->count = 0;
+  sub->offset = 0;
+  sub->broken = false;
+  if( sub->queue == NULL )
+  {
+   delete sub;
+   pthread_mutex_unlock(&d_pubLock);
+   setReport(ENOMEM, "doMessageCycle(malloc)");
+   return -1;
+  }
+  d_subscribers[fd] = sub;
+  if( fd > d_subMax ) 
+   d_subMax = fd;
+ }
+ for(int k = 0; k < sub->numTopics; k++)
+ {
+  if( sub->topics[k] == topic )
+  {
+   pthread_mutex_unlock(&d_pubLock);
+   return 0;
+  }
+ }
+ int *topics = (int *)realloc(sub->topics, (sub->numTopics + 1) * sizeof(int));
+ if( topics != NULL )
+ {
+  sub->topics = topics;
+  sub->topics[sub->numTopics++] = topic;
+ }
+ pthread_mutex_unlock(&d_pubLock);
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::flushSubscriber
+//==============================================================================
+int TCPServer::flushSubscriber(int fd)
+{
+ struct tcp_subscriber *sub = d_subscribers[fd];
+ while( (sub->count > 0) && !sub->broken )
+ {
+  struct tcp_pub_buffer *buf = sub->queue[sub->head];
+  int n = send(fd, buf->frame + sub->offset, buf->frameLen - sub->offset, 
+               MSG_DONTWAIT | MSG_NOSIGNAL);
+  if( n == -1 )
+  {
+   if( (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) )
+    sub->broken = true; // the event loop closes it on the next read
+   break;
+  }
+  sub->offset += n;
+  if( sub->offset < buf->frameLen )
+   break;
+  releasePubBuffer(buf);
+  sub->head = (sub->head + 1) % d_subQueueLen;
+  sub->count--;
+  sub->offset = 0;
+ }
+ return sub->broken ? 0 : sub->count;
+}
+
+
+//==============================================================================
+// TCPServer::pendingSubscribers
+//==============================================================================
+int TCPServer::pendingSubscribers(struct tcp_event_loop *loop, fd_set *writeFds)
+{
+ int n = 0;
+ FD_ZERO(writeFds);
+ if( d_subMax < 0 )
+  return 0;
+ pthread_mutex_lock(&d_pubLock);
+ for(int fd = 0; fd <= d_subMax; fd++)
+ {
+  struct tcp_subscriber *sub = d_subscribers[fd];
+  if( sub && (sub->loop == loop->index) && (sub->count > 0) && !sub->broken )
+  {
+   FD_SET(fd, writeFds);
+   n++;
+  }
+ }
+ pthread_mutex_unlock(&d_pubLock);
+ return n;
+}
+
+
+//==============================================================================
+// TCPServer::flushSubscribers
+//==============================================================================
+void TCPServer::flushSubscribers(fd_set *writable, int fdMax)
+{
+ pthread_mutex_lock(&d_pubLock);
+ for(int fd = 0; fd <= fdMax; fd++)
+ {
+  if( FD_ISSET(fd, writable) && d_subscribers[fd] )
+   flushSubscriber(fd);
+ }
+ pthread_mutex_unlock(&d_pubLock);
+}
+
+
+//==============================================================================
+// TCPServer::closeConnection
+//==============================================================================
+void TCPServer::closeConnection(int fd)
+{
+ if( (fd < FD_SETSIZE) && d_shmChannels[fd] )
+ {
+  struct tcp_shm_channel *channel = d_shmChannels[fd];
+  
+  // stop the service thread and release any waiting client
+  channel->region->open = 0;
+  __sync_fetch_and_add(&channel->region->reqSeq, 1);
+  __sync_fetch_and_add(&channel->region->repSeq, 1);
+  shmFutexWake(&channel->region->reqSeq);
+  shmFutexWake(&channel->region->repSeq);
+  pthread_join(channel->thread, NULL);
+  
+  channel->shm.unlink();
+  delete channel;
+  d_shmChannels[fd] = NULL;
+ }
+ if( (fd < FD_SETSIZE) && d_subscribers[fd] )
+ {
+  pthread_mutex_lock(&d_pubLock);
+  struct tcp_subscriber *sub = d_subscribers[fd];
+  d_subscribers[fd] = NULL;
+  while( (d_subMax >= 0) && (d_subscribers[d_subMax] == NULL) )
+   d_subMax--;
+  pthread_mutex_unlock(&d_pubLock);
+  for(int k = 0; k < sub->count; k++)
+   releasePubBuffer(sub->queue[(sub->head + k) % d_subQueueLen]);
+  free(sub->queue);
+  free(sub->topics);
+  delete sub;
+ }
+ if( fd < FD_SETSIZE )
+ {
+  freeMuxPartial(fd);
+  d_requestNum[fd] = 0;
+ }
+ if( d_sockStats && (fd < FD_SETSIZE) )
+ {
+  memset(&d_sockStats[fd], 0, sizeof(TCPSocketStats));
+  d_sockStats[fd].fd = -1;
+ }
+ close(fd);
+ __sync_fetch_and_sub(&d_numConnections, 1);
+}
+
+
+//==============================================================================
+// TCPServer::shmServiceEntry
+//==============================================================================
+void *TCPServer::shmServiceEntry(void *arg)
+{
+ struct tcp_shm_channel *channel = (struct tcp_shm_channel *)arg;
+ struct tcp_shm_region *r = channel->region;
+ int lastSeq = 0;
+ 
+ while( r->open )
+ {
+  // wait for the next request. Poll briefly before sleeping, as the 
+  // client usually sends its next request right after a reply.
+  int seq = r->reqSeq;
+  for(int spin = 0; (seq == lastSeq) && (spin < TCP_SHM_SPIN); spin++)
+   seq = r->reqSeq;
+  if( seq == lastSeq )
+  {
+   shmFutexWait(&r->reqSeq, lastSeq, NULL);
+   continue;
+  }
+  if( !r->open )
+   break;
+  lastSeq = seq;
+  __sync_synchronize();
+  
+  // handle the request in place
+  const char *outMsgBuf = NULL;
+  int outMsgLen = 0;
+  struct tcp_cache_entry *pinned = NULL;
+  int inMsgLen = r->reqLen;
+  bool admitted = (channel->server->admitRequest(monotonicUs()) == 0);
+  if( admitted && (inMsgLen >= 0) && (inMsgLen <= channel->reqCap) )
+   outMsgBuf = channel->server->dispatchMessage(shmRequestData(r), inMsgLen, 
+                                                &outMsgLen, &pinned);
+  if( admitted )
+   channel->server->releaseRequest();
+  if( !admitted )
+   r->repLen = -3;
+  else if( outMsgBuf == NULL )
+   r->repLen = -1;
+  else if( (outMsgLen < 0) || (outMsgLen > channel->repCap) )
+   r->repLen = -2;
+  else
+  {
+   memcpy(shmReplyData(r, channel->reqCap), outMsgBuf, outMsgLen);
+   r->repLen = outMsgLen;
+  }
+  channel->server->releaseCachedReply(pinned);
+  
+  // publish the reply
+  __sync_synchronize();
+  r->repSeq = lastSeq;
+  shmFutexWake(&r->repSeq);
+ }
+ return NULL;
+}
+
+
+//==============================================================================
+// TCPServer::init
+//==============================================================================
+int TCPServer::init(int port, int bufSize, int bdp)
+{
+ struct sockaddr_in name;
+ 
+ // bind to any interface on the given port
+ name.sin_family = AF_INET;
+ name.sin_port = htons(port);
+ name.sin_addr.s_addr = htonl(INADDR_ANY);
+ memset(&(name.sin_zero), '\0', 8);
+ 
+ return bindAndListen((struct sockaddr *)&name, sizeof(struct sockaddr_in), 
+                      bufSize, bdp);
+}
+
+
+int TCPServer::init(const char *address, int bufSize, int bdp)
+{
+ struct sockaddr_un name;
+ 
+ // only local addresses are accepted here
+ if( (address == NULL) || strncmp(address, "unix:", 5) 
+     || (strlen(address + 5) == 0)
+     || (strlen(address + 5) >= sizeof(name.sun_path)) )
+ {
+  d_init = false;
+  setReport(EINVAL, "init: invalid local address");
+  return -1;
+ }
+ 
+ memset(&name, 0, sizeof(struct sockaddr_un));
+ name.sun_family = AF_UNIX;
+ strncpy(name.sun_path, address + 5, sizeof(name.sun_path) - 1);
+ 
+ // remove a stale socket file left by an earlier server
+ unlink(name.sun_path);
+ 
+ return bindAndListen((struct sockaddr *)&name, sizeof(struct sockaddr_un), 
+                      bufSize, bdp);
+}
+
+
+//==============================================================================
+// TCPServer::bindAndListen
+//==============================================================================
+int TCPServer::bindAndListen(struct sockaddr *name, socklen_t nameLen, 
+                             int bufSize, int bdp)
+{
+ d_init = false;
+ if(d_fd)
+ {
+  close(d_fd);
+  d_fd = -1;
+ }
+ if( (d_family == AF_UNIX) && (d_unixPath[0] != '\0') )
+  unlink(d_unixPath);
+ d_unixPath[0] = '\0';
+ d_family = name->sa_family;
+
+ if( (d_fd = openListener(name, nameLen, bdp)) == -1 )
+  return -1;
+ 
+ // room for measurements of every connection
+ free(d_sockStats);
+ d_sockStats = NULL;
+ if( (bdp == TCP_BDP_AUTO) && (d_family != AF_UNIX) )
+ {
+  d_sockStats = (TCPSocketStats *)calloc(FD_SETSIZE, sizeof(TCPSocketStats));
+  for(int k = 0; d_sockStats && (k < FD_SETSIZE); k++)
+   d_sockStats[k].fd = -1;
+ }
+ if( d_family == AF_UNIX )
+ {
+  strncpy(d_unixPath, ((struct sockaddr_un *)name)->sun_path, 
+          sizeof(d_unixPath) - 1);
+  d_unixPath[sizeof(d_unixPath) - 1] = '\0';
+ }
+ 
+ // one listener per event loop, and a program that picks the loop 
+ // running on the cpu that received the connection request
+ for(int k = 1; k < d_numLoops; k++)
+ {
+  if( d_loops[k].listenFd != -1 )
+   close(d_loops[k].listenFd);
+  d_loops[k].listenFd = -1;
+  if( d_reusePort && (d_family == AF_INET) )
+  {
+   if( (d_loops[k].listenFd = openListener(name, nameLen, bdp)) == -1 )
+   {
+    close(d_fd);
+    d_fd = -1;
+    return -1;
+   }
+  }
+ }
+ if( d_reusePort && (d_family == AF_INET) && (d_numLoops > 1) )
+ {
+  if( attachSteeringProgram() == -1 )
+  {
+   close(d_fd);
+   d_fd = -1;
+   return -1;
+  }
+ }
+
+ // Create the buffer to store client messages
+ // The message from client is formatted as (int)msgLen + (char *)msg 
+ d_rcvBuf = (char *)realloc(d_rcvBuf, bufSize * sizeof(char) + sizeof(int));
+ if(d_rcvBuf == NULL)
+ {
+  setError(ENOMEM, "TCPServer(malloc)");
+  close(d_fd);
+  d_fd = -1;
+  return -1;
+ }
+ d_rcvBufSize = bufSize;
+
+ d_init = true;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::openListener
+//==============================================================================
+int TCPServer::openListener(struct sockaddr *name, socklen_t nameLen, int bdp)
+{
+ int sockBufSize = bdp * 1024;
+ int fd;
+
+ // Create an endpoint for communication
+ if( (fd = socket(name->sa_family, SOCK_STREAM, 0)) == -1)
+ {
+  setError(errno, "init(socket)");
+  return -1;
+ }
+ 
+ int yes = 1;
+ if( name->sa_family == AF_INET )
+ {
+  // Allow reuse of port
+  if( setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_REUSEADDR)");
+   close(fd);
+   return -1;
+  }
+ 
+  // Do not delay sending data packets
+  if( setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-TCP_NODELAY)");
+   close(fd);
+   return -1;
+  }
+  
+  // Share the port between the listeners of all event loops
+  if( d_reusePort && 
+      (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) )
+  {
+   setError(errno, "init(setsockopt-SO_REUSEPORT)");
+   close(fd);
+   return -1;
+  }
+ }
+
+ // set suggested optimal socket buffer sizes.
+ if( sockBufSize > 0 ) {
+  if( setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_SNDBUF)");
+   close(fd);
+   return -1;
+  }
+
+  if( setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_RCVBUF)");
+   close(fd);
+   return -1;
+  }
+ }
+ 
+ // bind a name to the socket
+ if( bind(fd, name, nameLen) == -1)
+ {
+  setError(errno, "init(bind)");
+  close(fd);
+  return -1;
+ }
+
+ // listen for connections
+ if( listen(fd, 20) == -1) // 20 = length of queue of waiting clients
+ {
+  setError(errno, "init(listen)");
+  close(fd);
+  return -1;
+ }
+ return fd;
+}
+
+
+//==============================================================================
+// TCPServer::attachSteeringProgram
+//==============================================================================
+int TCPServer::attachSteeringProgram()
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+ // The program returns the index of the listener (= event loop) to 
+ // use for a new connection: the loop pinned to the receiving cpu, or
+ // cpu modulo the number of loops.
+ struct sock_filter *code;
+ struct sock_fprog prog;
+ int n = 0;
+ 
+ code = (struct sock_filter *)malloc((2 * d_numLoops + 3) * sizeof(struct sock_filter));
+ if( code == NULL )
+ {
+  setError(ENOMEM, "init(malloc)");
+  return -1;
+ }
+ bpfInsn(&code[n++], BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU);
+ for(int k = 0; k < d_numLoops; k++)
+ {
+  if( d_loops[k].cpu < 0 )
+   continue;
+  bpfInsn(&code[n++], BPF_JMP | BPF_JEQ | BPF_K, 0, 1, d_loops[k].cpu);
+  bpfInsn(&code[n++], BPF_RET | BPF_K, 0, 0, k);
+ }
+ bpfInsn(&code[n++], BPF_ALU | BPF_MOD | BPF_K, 0, 0, d_numLoops);
+ bpfInsn(&code[n++], BPF_RET | BPF_A, 0, 0, 0);
+ 
+ prog.len = n;
+ prog.filter = code;
+ if( setsockopt(d_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1 )
+ {
+  setError(errno, "init(setsockopt-SO_ATTACH_REUSEPORT_CBPF)");
+  free(code);
+  return -1;
+ }
+ free(code);
+ return 0;
+#else
+ setReport(ENOSYS, "init: reuseport steering not supported");
+ return -1;
+#endif
+}
+
+
+//==============================================================================
+// TCPServer::setEventLoops
+//==============================================================================
+int TCPServer::setEventLoops(int numLoops, const int *cpus, bool reusePortSteering,
+                             bool concurrentHandler)
+{
+ if( d_init )
+ {
+  setReport(EBUSY, "setEventLoops: server already initialized");
+  return -1;
+ }
+ if( (numLoops < 1) || (numLoops > FD_SETSIZE) )
+ {
+  setReport(EINVAL, "setEventLoops: invalid number of loops");
+  return -1;
+ }
+ if( createLoops(numLoops, cpus) == -1 )
+  return -1;
+ d_reusePort = reusePortSteering;
+ d_serializeHandler = (numLoops == 1) || !concurrentHandler;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::createLoops
+//==============================================================================
+int TCPServer::createLoops(int numLoops, const int *cpus)
+{
+ freeLoops();
+ d_loops = (struct tcp_event_loop *)malloc(numLoops * sizeof(struct tcp_event_loop));
+ if( d_loops == NULL )
+ {
+  setError(ENOMEM, "setEventLoops(malloc)");
+  d_numLoops = 0;
+  return -1;
+ }
+ d_numLoops = numLoops;
+ for(int k = 0; k < numLoops; k++)
+ {
+  struct tcp_event_loop *loop = &d_loops[k];
+  loop->server = this;
+  loop->index = k;
+  loop->cpu = cpus ? cpus[k] : -1;
+  loop->listenFd = -1;
+  loop->rcvBuf = NULL;
+  loop->running = false;
+  FD_ZERO(&loop->master);
+  loop->fdMax = -1;
+  
+  // pipe used to wake up the loop from other threads
+  if( pipe(loop->wakeFd) == 0 )
+  {
+   fcntl(loop->wakeFd[0], F_SETFL, O_NONBLOCK);
+   fcntl(loop->wakeFd[1], F_SETFL, O_NONBLOCK);
+  }
+  else
+  {
+   loop->wakeFd[0] = -1;
+   loop->wakeFd[1] = -1;
+  }
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::freeLoops
+//==============================================================================
+void TCPServer::freeLoops()
+{
+ for(int k = 0; k < d_numLoops; k++)
+ {
+  struct tcp_event_loop *loop = &d_loops[k];
+  if( loop->wakeFd[0] != -1 )
+  {
+   close(loop->wakeFd[0]);
+   close(loop->wakeFd[1]);
+  }
+  
+  // loop 0 shares the server listener and buffer
+  if( k > 0 )
+  {
+   if( loop->listenFd != -1 )
+    close(loop->listenFd);
+   if( loop->rcvBuf )
+    free(loop->rcvBuf);
+  }
+ }
+ if( d_loops )
+  free(d_loops);
+ d_loops = NULL;
+ d_numLoops = 0;
+}
+
+
+//==============================================================================
+// TCPServer::requestHandoff
+//==============================================================================
+int TCPServer::requestHandoff(const char *path, bool passConnections)
+{
+ if( (path == NULL) || (strlen(path) == 0) 
+     || (strlen(path) >= sizeof(d_handoffPath)) || (d_loops[0].wakeFd[1] == -1) )
+ {
+  errno = EINVAL;
+  return -1;
+ }
+ 
+ // doMessageCycle() does the work between two client messages
+ strncpy(d_handoffPath, path, sizeof(d_handoffPath) - 1);
+ d_handoffPath[sizeof(d_handoffPath) - 1] = '\0';
+ d_handoffConns = passConnections;
+ d_handoffRequested = 1;
+ int cmd = TCP_WAKE_HANDOFF;
+ if( write(d_loops[0].wakeFd[1], &cmd, sizeof(int)) == -1 )
+  return -1;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::handoff
+//==============================================================================
+int TCPServer::handoff(fd_set *master, int fdMax)
+{
+ struct sockaddr_un name;
+ int sock, numFds = 0;
+ int *fds;
+ char info[80];
+ 
+ // connect to the new server process
+ memset(&name, 0, sizeof(struct sockaddr_un));
+ name.sun_family = AF_UNIX;
+ strncpy(name.sun_path, d_handoffPath, sizeof(name.sun_path) - 1);
+ if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 )
+ {
+  setError(errno, "handoff(socket)");
+  return -1;
+ }
+ if( connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_un)) == -1 )
+ {
+  setError(errno, "handoff(connect)");
+  close(sock);
+  return -1;
+ }
+ 
+ // listeners first (one per event loop with SO_REUSEPORT, so that no 
+ // accept queue is dropped), then client connections if asked for. 
+ // Clients on shared memory channels and subscribers are not passed, 
+ // they reconnect instead.
+ fds = (int *)malloc((fdMax + d_numLoops + 1) * sizeof(int));
+ if( fds == NULL )
+ {
+  setError(ENOMEM, "handoff(malloc)");
+  close(sock);
+  return -1;
+ }
+ fds[numFds++] = d_fd;
+ for(int l = 1; l < d_numLoops; l++)
+ {
+  if( d_loops[l].listenFd != -1 )
+   fds[numFds++] = d_loops[l].listenFd;
+ }
+ int numListeners = numFds;
+ for(int k = 0; (k <= fdMax) && d_handoffConns; k++)
+ {
+  if( FD_ISSET(k, master) && (k != d_fd) && (k != d_loops[0].wakeFd[0]) 
+      && (d_shmChannels[k] == NULL) && (d_subscribers[k] == NULL) )
+   fds[numFds++] = k;
+ }
+ 
+ // send descriptors in batches
+ int sent = 0;
+ while( sent < numFds )
+ {
+  int end = (sent < numListeners) ? numListeners : numFds;
+  int n = end - sent;
+  if( n > TCP_HANDOFF_BATCH )
+   n = TCP_HANDOFF_BATCH;
+  if( sendFds(sock, (sent < numListeners) ? 'L' : 'C', &fds[sent], n) == -1 )
+   break;
+  sent += n;
+ }
+ if( (sent < numFds) || (sendFds(sock, 'E', NULL, 0) == -1) )
+ {
+  setError(errno, "handoff(sendmsg)");
+  free(fds);
+  close(sock);
+  return -1;
+ }
+ close(sock);
+ 
+ // the new process owns these now. The socket file of a local 
+ // listener stays, as the new process is listening on it.
+ for(int k = 0; k < numFds; k++)
+ {
+  FD_CLR(fds[k], master);
+  close(fds[k]);
+  if( k >= numListeners )
+   __sync_fetch_and_sub(&d_numConnections, 1);
+ }
+ d_fd = -1;
+ for(int l = 1; l < d_numLoops; l++)
+  d_loops[l].listenFd = -1;
+ d_unixPath[0] = '\0';
+ if( d_handoffConns )
+ {
+  for(int k = 0; k <= fdMax; k++)
+  {
+   if( FD_ISSET(k, master) && (k != d_loops[0].wakeFd[0]) )
+   {
+    closeConnection(k);
+    FD_CLR(k, master);
+   }
+  }
+ }
+ 
+ snprintf(info, 80, "handoff: passed %d sockets to %s", numFds, d_handoffPath);
+ setReport(0, info);
+ free(fds);
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::initFromHandoff
+//==============================================================================
+int TCPServer::initFromHandoff(const char *path, int bufSize)
+{
+ struct sockaddr_un name;
+ struct sockaddr_storage local;
+ socklen_t localLen = sizeof(struct sockaddr_storage);
+ int sock, conn;
+ int fds[TCP_HANDOFF_BATCH];
+ int numListeners = 0;
+ char tag;
+ 
+ d_init = false;
+ if(d_fd)
+ {
+  close(d_fd);
+  d_fd = -1;
+ }
+ if( (d_family == AF_UNIX) && (d_unixPath[0] != '\0') )
+  unlink(d_unixPath);
+ d_unixPath[0] = '\0';
+ 
+ if( (path == NULL) || (strlen(path) == 0) 
+     || (strlen(path) >= sizeof(name.sun_path)) )
+ {
+  setReport(EINVAL, "initFromHandoff: invalid path");
+  return -1;
+ }
+ 
+ // wait for the old server process to connect
+ memset(&name, 0, sizeof(struct sockaddr_un));
+ name.sun_family = AF_UNIX;
+ strncpy(name.sun_path, path, sizeof(name.sun_path) - 1);
+ unlink(path);
+ if( (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 )
+ {
+  setError(errno, "initFromHandoff(socket)");
+  return -1;
+ }
+ if( (bind(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_un)) == -1) 
+     || (listen(sock, 1) == -1) )
+ {
+  setError(errno, "initFromHandoff(bind)");
+  close(sock);
+  return -1;
+ }
+ conn = accept(sock, NULL, NULL);
+ close(sock);
+ unlink(path);
+ if( conn == -1 )
+ {
+  setError(errno, "initFromHandoff(accept)");
+  return -1;
+ }
+ 
+ // receive the listeners followed by client connections. Listeners of 
+ // several event loops go to our loops, in order. Any we have no loop 
+ // for are emptied into adopted connections and closed, and the kernel 
+ // sends new connection requests to the others.
+ for(;;)
+ {
+  int n = recvFds(conn, &tag, fds, TCP_HANDOFF_BATCH);
+  if( (n == -1) || (tag == 'E') )
+   break;
+  int first = 0;
+  while( (tag == 'L') && (first < n) && (numListeners < d_numLoops) )
+  {
+   if( numListeners == 0 )
+    d_fd = fds[first++];
+   else
+   {
+    if( d_loops[numListeners].listenFd != -1 )
+     close(d_loops[numListeners].listenFd);
+    d_loops[numListeners].listenFd = fds[first++];
+   }
+   numListeners++;
+  }
+  if( tag == 'L' )
+  {
+   for(int k = first; k < n; k++)
+    drainListener(fds[k]);
+   continue;
+  }
+  int *adopted = (int *)realloc(d_adoptedFds, 
+                       (d_numAdopted + n) * sizeof(int));
+  if( adopted == NULL )
+  {
+   for(int k = 0; k < n; k++)
+    close(fds[k]);
+   continue;
+  }
+  d_adoptedFds = adopted;
+  for(int k = 0; k < n; k++)
+   d_adoptedFds[d_numAdopted++] = fds[k];
+ }
+ close(conn);
+ if( (tag != 'E') || (d_fd == -1) )
+ {
+  setReport(EPROTO, "initFromHandoff: listener not received");
+  return -1;
+ }
+ 
+ // find out what we are listening on
+ if( getsockname(d_fd, (struct sockaddr *)&local, &localLen) == -1 )
+ {
+  setError(errno, "initFromHandoff(getsockname)");
+  return -1;
+ }
+ d_family = local.ss_family;
+ if( d_family == AF_UNIX )
+ {
+  strncpy(d_unixPath, ((struct sockaddr_un *)&local)->sun_path, 
+          sizeof(d_unixPath) - 1);
+  d_unixPath[sizeof(d_unixPath) - 1] = '\0';
+ }
+
+ // Create the buffer to store client messages
+ d_rcvBuf = (char *)realloc(d_rcvBuf, bufSize * sizeof(char) + sizeof(int));
+ if(d_rcvBuf == NULL)
+ {
+  setError(ENOMEM, "TCPServer(malloc)");
+  return -1;
+ }
+ d_rcvBufSize = bufSize;
+ 
+ d_init = true;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::drainListener
+//==============================================================================
+void TCPServer::drainListener(int fd)
+{
+ int conn;
+ 
+ fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+ while( (conn = accept(fd, NULL, NULL)) != -1 )
+ {
+  int *adopted = (int *)realloc(d_adoptedFds, 
+                       (d_numAdopted + 1) * sizeof(int));
+  if( adopted == NULL )
+  {
+   close(conn);
+   continue;
+  }
+  d_adoptedFds = adopted;
+  d_adoptedFds[d_numAdopted++] = conn;
+ }
+ close(fd);
+}
+
+
+//==============================================================================
+// TCPServer::getStatusCode
+//==============================================================================
+int TCPServer::getStatusCode() const
+{
+ pthread_mutex_lock(&d_statusLock);
+ int code = d_status.getReportCode();
+ pthread_mutex_unlock(&d_statusLock);
+ return code;
+}
+
+
+//==============================================================================
+// TCPServer::getStatusMessage
+//==============================================================================
+const char *TCPServer::getStatusMessage() const
+{
+ pthread_mutex_lock(&d_statusLock);
+ const char *message = d_status.getReportMessage();
+ pthread_mutex_unlock(&d_statusLock);
+ return message;
+}
+
+
+//==============================================================================
+// TCPServer::setError
+//==============================================================================
+void TCPServer::setError(int code, const char *functionName)
+{
+ char buf[80];
+ snprintf(buf, 80, "%s: %s", functionName, strerror(code));
+ setReport(code, buf);
+}
+
+
+//==============================================================================
+// TCPServer::setReport
+//==============================================================================
+void TCPServer::setReport(int code, const char *message)
+{
+ // event loops and shared memory service threads report concurrently
+ pthread_mutex_lock(&d_statusLock);
+ d_status.setReport(code, message);
+ pthread_mutex_unlock(&d_statusLock);
+}
+
+
+//==============================================================================
+// TCPServer::enableIgnoreSigPipe
+//==============================================================================
+int TCPServer::enableIgnoreSigPipe()
+{
+ if(signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+ {
+  setReport(-1, "enableIgnoreSigPipe: failed");
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPServer::disableIgnoreSigPipe
+//==============================================================================
+int TCPServer::disableIgnoreSigPipe()
+{
+ if(signal(SIGPIPE, SIG_DFL) == SIG_ERR)
+ {
+  setReport(-1,"disableIgnoreSigPipe: failed");
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::TCPClient
+//==============================================================================
+TCPClient::TCPClient()
+{
+ d_shmWanted = false;
+ d_shmMaxReply = 0;
+ d_shmReqCap = 0;
+ d_shm = NULL;
+ d_shmRegion = NULL;
+ d_shmPending = false;
+ d_fd = -1;
+ d_numAddrs = 0;
+ d_connectTimeout = 0;
+ d_init = false;
+ d_serverName = NULL;
+ d_serverPort = 0;
+ d_recvTimeout.tv_sec = 1;
+ d_recvTimeout.tv_usec = 0;
+ d_bdp = 0;
+ memset(&d_sockStats, 0, sizeof(d_sockStats));
+ d_sockStats.fd = -1;
+ d_nextTune = 0;
+ d_requestNum = 0;
+ d_lastAnswered = 0;
+ setError(0, "TCPClient");
+}
+
+
+TCPClient::TCPClient(const char *serverIp, int port, struct timeval &t, int bdp)
+{
+ d_shmWanted = false;
+ d_shmMaxReply = 0;
+ d_shmReqCap = 0;
+ d_shm = NULL;
+ d_shmRegion = NULL;
+ d_shmPending = false;
+ d_init = false;
+ d_numAddrs = 0;
+ d_connectTimeout = 0;
+ d_serverName = NULL;
+ d_serverPort = 0;
+ d_recvTimeout.tv_sec = 1;
+ d_recvTimeout.tv_usec = 0;
+ d_fd = -1;
+ d_bdp = 0;
+ memset(&d_sockStats, 0, sizeof(d_sockStats));
+ d_sockStats.fd = -1;
+ d_nextTune = 0;
+ d_requestNum = 0;
+ d_lastAnswered = 0;
+ 
+ // init connection to server
+ if( init(serverIp, port, t, bdp) == -1 )
+  return;
+ 
+ setError(0, "TCPClient");
+}
+
+
+//==============================================================================
+// TCPClient::~TCPClient
+//==============================================================================
+TCPClient::~TCPClient()
+{
+ closeShMem();
+ if(d_shm)
+  delete d_shm;
+ if(d_fd)
+ {
+  close(d_fd);
+  d_fd = -1;
+ }
+ if(d_serverName)
+  free(d_serverName);
+}
+
+
+//==============================================================================
+// TCPClient::sendAndReceive
+//==============================================================================
+int TCPClient::sendAndReceive(char *outMsgBuf, int outMsgLen,
+                     char *inMsgBuf, int inBufLen, int *inMsgLen)
+{
+ return exchange(outMsgBuf, outMsgLen, inMsgBuf, inBufLen, inMsgLen, 0);
+}
+
+
+//==============================================================================
+// TCPClient::sendAndReceive
+//==============================================================================
+int TCPClient::sendAndReceive(char *outMsgBuf, int outMsgLen,
+                     char *inMsgBuf, int inBufLen, int *inMsgLen,
+                     const struct timespec &deadline)
+{
+ long long us = (long long)deadline.tv_sec * 1000000 + deadline.tv_nsec / 1000;
+ 
+ // 0 means no deadline, and an expired one must still fail
+ if( us <= 0 )
+  us = 1;
+ return exchange(outMsgBuf, outMsgLen, inMsgBuf, inBufLen, inMsgLen, us);
+}
+
+
+//==============================================================================
+// TCPClient::exchange
+//==============================================================================
+int TCPClient::exchange(char *outMsgBuf, int outMsgLen,
+                     char *inMsgBuf, int inBufLen, int *inMsgLen,
+                     long long deadline)
+{
+ // don't start what cannot finish in time
+ if( deadline && (monotonicUs() >= deadline) )
+ {
+  setError(ETIMEDOUT, "sendAndReceive");
+  return -1;
+ }
+ 
+ if( ensureConnected(deadline) == -1 )
+  return -1;
+ 
+ // check buffer pointers
+ if( outMsgBuf == NULL )
+ {
+  d_status.setReport(EINVAL, "sendAndReceive: invalid buffer");
+  return -1;
+ }
+ 
+ // use the shared memory channel if we have one
+ if( d_shmRegion )
+  return shmSendAndReceive(outMsgBuf, outMsgLen, inMsgBuf, inBufLen, inMsgLen,
+                           deadline);
+ 
+ if( sendRequest(outMsgBuf, outMsgLen, deadline) == -1 )
+  return -1;
+
+ // check if interested in reply
+ if(inMsgBuf == NULL)
+  return 0;
+
+#ifdef DEBUG
+ cout << "DEBUG [sendAndReceive]: want reply from server" << endl;
+#endif
+
+ if( receiveReply(inMsgBuf, inBufLen, inMsgLen, deadline) == -1 )
+  return -1;
+ 
+ // follow the link as it changes
+ if( d_bdp == TCP_BDP_AUTO )
+ {
+  long long now = monotonicUs();
+  if( now >= d_nextTune )
+  {
+   tuneSocket(d_fd, &d_sockStats, true);
+   d_nextTune = now + TCP_TUNE_INTERVAL;
+  }
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::ensureConnected
+//==============================================================================
+int TCPClient::ensureConnected(long long deadline)
+{
+ if(!d_init)
+ {
+  d_status.setReport(-1, "sendAndReceive: client not initialized");
+  return -1;
+ }
+ 
+ // initialize connection again if we lost it due to error, or if the 
+ // server closed it (as after handing its listener to a new process).
+ if( d_fd != -1 )
+ {
+  char c;
+  int n = recv(d_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if( (n == -1) && ((errno == EBADF) || (errno == ENOTSOCK)) )
+   d_fd = -1;
+  else if( (n == 0) || ((n == -1) && (errno != EAGAIN) 
+           && (errno != EWOULDBLOCK) && (errno != EINTR)) )
+   dropConnection();
+ }
+ if( d_fd == -1 )
+ {
+  // with a deadline, skip the name lookup (it cannot be bounded) and 
+  // connect to the address resolved last time.
+  if( deadline )
+  {
+   closeShMem();
+   d_fd = -1;
+   return openConnection(deadline);
+  }
+  if( init(d_serverName, d_serverPort, d_recvTimeout, d_bdp) == -1 )
+   return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::dropConnection
+//==============================================================================
+void TCPClient::dropConnection()
+{
+ // forget the descriptor too, as another client may be given the same
+ // number before we reconnect.
+ close(d_fd);
+ d_fd = -1;
+}
+
+
+//==============================================================================
+// TCPClient::waitSocket
+//==============================================================================
+int TCPClient::waitSocket(short events, long long deadline, 
+                          const char *functionName)
+{
+ struct pollfd pfd;
+ pfd.fd = d_fd;
+ pfd.events = events;
+ 
+ for(;;)
+ {
+  long long remaining = deadline - monotonicUs();
+  if( remaining <= 0 )
+  {
+   setError(ETIMEDOUT, functionName);
+   return -1;
+  }
+  
+  struct timespec ts;
+  ts.tv_sec = remaining / 1000000;
+  ts.tv_nsec = (remaining % 1000000) * 1000;
+  pfd.revents = 0;
+  int n = ppoll(&pfd, 1, &ts, NULL);
+  
+  // errors and hangups count as ready. The next call reports them.
+  if( n > 0 )
+   return 0;
+  if( (n == -1) && (errno != EINTR) )
+  {
+   setError(errno, functionName);
+   return -1;
+  }
+ }
+}
+
+
+//==============================================================================
+// TCPClient::transfer
+//==============================================================================
+int TCPClient::transfer(bool out, char *buf, int len, long long deadline)
+{
+ const char *fn = out ? "sendAndReceive(send)" : "sendAndReceive(recv)";
+ int done = 0;
+ 
+ while( done < len )
+ {
+  int n;
+  if( out )
+   n = send(d_fd, &buf[done], len - done, MSG_DONTWAIT);
+  else
+   n = recv(d_fd, &buf[done], len - done, MSG_DONTWAIT);
+  
+  if( n > 0 )
+  {
+   done += n;
+   continue;
+  }
+  if( n == 0 )
+  {
+   setError(ECONNRESET, fn); // server closed the connection
+   return -1;
+  }
+  if( (errno == EAGAIN) || (errno == EWOULDBLOCK) )
+  {
+   if( waitSocket(out ? POLLOUT : POLLIN, deadline, fn) == -1 )
+    return -1;
+  }
+  else if( errno != EINTR )
+  {
+   setError(errno, fn);
+   return -1;
+  }
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::sendRequest
+//==============================================================================
+int TCPClient::sendRequest(const char *outMsgBuf, int outMsgLen, 
+                           long long deadline)
+{
+ // the whole frame, or nothing useful, by the deadline
+ if( deadline )
+ {
+  if( (transfer(true, (char *)&outMsgLen, sizeof(int), deadline) == -1)
+      || (transfer(true, (char *)outMsgBuf, outMsgLen, deadline) == -1) )
+  {
+   dropConnection();
+   return -1;
+  }
+  d_requestNum++;
+  return 0;
+ }
+ 
+ // write header (size) info to server
+ if( send(d_fd, &outMsgLen, sizeof(int), 0) < (int)sizeof(int) )
+ {
+  setError(errno, "sendAndReceive(send)");
+  dropConnection();
+  return -1;
+ }
+
+#ifdef DEBUG
+ cerr << "DEBUG [sendAndReceive]: header sent to server" << endl;
+#endif
+
+ // write until done or try 3 times
+ int wroteTillNow = 0;
+ int numWriteAttempts = 0;
+ while( (wroteTillNow < outMsgLen) && (numWriteAttempts < 3) )
+ {
+  int wroteNow;
+  numWriteAttempts++;
+  wroteNow = send(d_fd, &(outMsgBuf[wroteTillNow]), 
+                         outMsgLen - wroteTillNow, 0);
+  if(wroteNow == -1)
+   break;
+   
+  wroteTillNow += wroteNow;
+ } // end while
+       
+ // check for write failure
+ if( wroteTillNow < outMsgLen )
+ {
+  setError(EIO, "sendAndReceive(send)"); // physical write failure
+  dropConnection();
+  return -1;
+ }
+ d_requestNum++;
+ 
+#ifdef DEBUG
+ cerr << "DEBUG [sendAndReceive]: data sent to server" << endl;
+#endif
+
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::receiveReply
+//==============================================================================
+int TCPClient::receiveReply(char *inMsgBuf, int inBufLen, int *inMsgLen,
+                            long long deadline)
+{
+ // read header packet for size of incoming data
+ while(1)
+ {
+  if( receiveInt(inMsgLen, deadline) == -1 )
+   return -1;
+  if( *inMsgLen != TCP_CTRL_REJECT )
+   break;
+  
+  // server is overloaded. Rejections of messages sent without waiting 
+  // for a reply are skipped.
+  int num;
+  if( receiveInt(&num, deadline) == -1 )
+   return -1;
+  if( num == 0 )
+  {
+   d_status.setReport(EBUSY, "sendAndReceive: connection rejected, server overloaded");
+   dropConnection();
+   return -1;
+  }
+  if( (unsigned int)num - d_lastAnswered - 1 < d_requestNum - d_lastAnswered - 1 )
+   continue;
+  
+  // the connection is still good
+  d_lastAnswered = d_requestNum;
+  d_status.setReport(EBUSY, "sendAndReceive: rejected, server overloaded");
+  return -1;
+ }
+ d_lastAnswered = d_requestNum;
+
+#ifdef DEBUG
+ cerr << "DEBUG [sendAndReceive]: received header from server" << endl;
+#endif
+ 
+ // inMsgLen has size of incoming message.
+ // Compare with our buffer to make sure we can accomodate it.
+ if( *inMsgLen > inBufLen)
+ {
+
+#ifdef DEBUG
+ cerr << "DEBUG [sendAndReceive]: buffer size not enough" << endl;
+#endif
+
+  d_status.setReport(-1, "sendAndReceive: buffer not large enough.");
+  dropConnection();
+  return -1;
+ }
+       
+#ifdef DEBUG
+ cerr << "DEBUG [sendAndReceive]: buffer size ok" << endl;
+#endif
+
+ if( deadline )
+ {
+  if( transfer(false, inMsgBuf, *inMsgLen, deadline) == -1 )
+  {
+   dropConnection();
+   return -1;
+  }
+  return 0;
+ }
+ 
+ // read until done or try 3 times
+ int readTillNow = 0;
+ int numReadAttempts = 0;
+ while( (readTillNow < *inMsgLen) && (numReadAttempts < 3) )
+ {
+  int readNow;
+  numReadAttempts++;
+  readNow = recv(d_fd, &(inMsgBuf[readTillNow]), *inMsgLen - readTillNow, 
+                 MSG_WAITALL);
+  
+  if(readNow == -1)
+   break;
+   
+  readTillNow += readNow;
+ } // end while
+
+ // check for read failure
+ if( readTillNow < *inMsgLen )
+ {
+  setError(EIO, "sendAndReceive(recv)"); // physical read failure
+  dropConnection();
+  return -1;
+ }
+
+#ifdef DEBUG
+ cerr << "DEBUG [sendAndReceive]: done reading reply from server" << endl;
+#endif
+
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::receiveInt
+//==============================================================================
+int TCPClient::receiveInt(int *value, long long deadline)
+{
+ if( deadline )
+ {
+  if( transfer(false, (char *)value, sizeof(int), deadline) == -1 )
+  {
+   dropConnection();
+   return -1;
+  }
+ }
+ else if( recv(d_fd, value, sizeof(int), MSG_WAITALL) < (int)sizeof(int) )
+ {
+  setError(errno, "sendAndReceive(recv)");
+  dropConnection();
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::discardReply
+//==============================================================================
+int TCPClient::discardReply()
+{
+ struct pollfd pfd;
+ pfd.fd = d_fd;
+ pfd.events = POLLIN;
+ pfd.revents = 0;
+ if( d_fd == -1 )
+  return -1;
+ if( poll(&pfd, 1, 0) == 0 )
+  return 1;
+ 
+ int len;
+ if( recv(d_fd, &len, sizeof(int), MSG_WAITALL) < (int)sizeof(int) )
+ {
+  dropConnection();
+  return -1;
+ }
+ if( len == TCP_CTRL_REJECT )
+ {
+  int num;
+  if( (recv(d_fd, &num, sizeof(int), MSG_WAITALL) < (int)sizeof(int)) 
+      || (num == 0) )
+  {
+   dropConnection();
+   return -1;
+  }
+  d_lastAnswered = d_requestNum;
+  return 0;
+ }
+ if( len < 0 )
+ {
+  dropConnection();
+  return -1;
+ }
+ 
+ char scratch[1024];
+ while( len > 0 )
+ {
+  int n = recv(d_fd, scratch, (len < (int)sizeof(scratch)) ? len : 
+               (int)sizeof(scratch), MSG_WAITALL);
+  if( n <= 0 )
+  {
+   dropConnection();
+   return -1;
+  }
+  len -= n;
+ }
+ d_lastAnswered = d_requestNum;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::init
+//==============================================================================
+int TCPClient::init(const char *serverIp, int port, struct timeval &timeout, int bdp)
+{
+ char info[80];
+ 
+ d_recvTimeout.tv_sec = timeout.tv_sec;
+ d_recvTimeout.tv_usec = timeout.tv_usec;
+ d_bdp = bdp;
+ memset(&d_sockStats, 0, sizeof(d_sockStats));
+ d_sockStats.fd = -1;
+ d_nextTune = 0;
+
+ closeShMem();
+ if(d_fd)
+ {
+  close(d_fd);
+  d_fd = -1;
+ }
+ d_init = false;
+
+ // copy the server name
+ int nlen;
+ nlen = strlen(serverIp);
+ if( !d_serverName ) {
+  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
+  if( d_serverName == NULL ) {
+   setError(-1, "init(realloc)");
+   return -1;
+  }
+  strncpy(d_serverName, serverIp, nlen);
+  d_serverName[nlen] = '\0';
+ }
+ else if(strncmp(d_serverName, serverIp, nlen)) {
+  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
+  if( d_serverName == NULL ) {
+   setError(-1, "init(realloc)");
+   return -1;
+  }
+  strncpy(d_serverName, serverIp, nlen);
+  d_serverName[nlen] = '\0';
+ }
+ d_serverPort = port;
+ 
+ d_numAddrs = 0;
+ if( strncmp(serverIp, "unix:", 5) == 0 )
+ {
+  // local server on a Unix domain socket
+  struct sockaddr_un *local = (struct sockaddr_un *)&d_addrs[0];
+  if( (strlen(serverIp + 5) == 0) 
+      || (strlen(serverIp + 5) >= sizeof(local->sun_path)) )
+  {
+   d_status.setReport(EINVAL, "init: invalid local address");
+   return -1;
+  }
+  memset(local, 0, sizeof(struct sockaddr_un));
+  local->sun_family = AF_UNIX;
+  strncpy(local->sun_path, serverIp + 5, sizeof(local->sun_path) - 1);
+  d_addrLens[0] = sizeof(struct sockaddr_un);
+  d_numAddrs = 1;
+ }
+ else
+ {
+  // get all network addresses of the server
+  struct addrinfo hints, *res, *ai;
+  char service[16];
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, 16, "%d", port);
+  int rc = getaddrinfo(serverIp, service, &hints, &res);
+  if( rc != 0 )
+  {
+   snprintf(info, 80, "getaddrinfo %s", gai_strerror(rc));
+   d_status.setReport(rc, info);
+   return -1;
+  }
+  
+  // alternate between the family listed first and the other one, keeping 
+  // the resolver's order within each (RFC 8305).
+  struct addrinfo *family[2][TCP_CLIENT_MAX_ADDRS];
+  int count[2] = {0, 0};
+  for(ai = res; ai != NULL; ai = ai->ai_next)
+  {
+   int f = (ai->ai_family == res->ai_family) ? 0 : 1;
+   if( (count[f] < TCP_CLIENT_MAX_ADDRS) 
+       && (ai->ai_addrlen <= sizeof(struct sockaddr_storage)) )
+    family[f][count[f]++] = ai;
+  }
+  for(int i = 0; (i < count[0]) || (i < count[1]); i++)
+  {
+   for(int f = 0; f < 2; f++)
+   {
+    if( (i >= count[f]) || (d_numAddrs == TCP_CLIENT_MAX_ADDRS) )
+     continue;
+    memcpy(&d_addrs[d_numAddrs], family[f][i]->ai_addr, 
+           family[f][i]->ai_addrlen);
+    d_addrLens[d_numAddrs++] = family[f][i]->ai_addrlen;
+   }
+  }
+  freeaddrinfo(res);
+ }
+ 
+ // the server is known now. If it can not be reached, the calls that 
+ // need it try again (see ensureConnected()).
+ d_init = true;
+ 
+ // bound the connection attempts, or let each run until the kernel 
+ // gives up on it
+ return openConnection(d_connectTimeout ? monotonicUs() + d_connectTimeout : 0);
+}
+
+
+//==============================================================================
+// TCPClient::setConnectTimeout
+//==============================================================================
+void TCPClient::setConnectTimeout(struct timeval &timeout)
+{
+ d_connectTimeout = (long long)timeout.tv_sec * 1000000 + timeout.tv_usec;
+}
+
+
+//==============================================================================
+// TCPClient::openSocket
+//==============================================================================
+int TCPClient::openSocket(int family)
+{
+ int fd;
+ 
+ // Create an endpoint for communication
+ if( (fd = socket(family, SOCK_STREAM, 0)) == -1)
+ {
+  setError(errno, "init(socket)");
+  return -1;
+ }
+ 
+ // Do not delay sending data packets
+ int yes = 1;
+ if( (family != AF_UNIX) && 
+     (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1) )
+ {
+  setError(errno, "init(setsockopt-TCP_NODELAY)");
+  close(fd);
+  return -1;
+ }
+
+ // set suggested optimal socket buffer sizes.
+ yes = d_bdp * 1024;
+ if( yes > 0 ) {
+  if( setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *)&yes, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_SNDBUF)");
+   close(fd);
+   return -1;
+  }
+
+  // set suggested optimal socket buffer sizes.
+  if( setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *)&yes, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_RCVBUF)");
+   close(fd);
+   return -1;
+  }
+ }
+
+ // set receive timeout 
+ if( setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &d_recvTimeout, 
+     sizeof(struct timeval)) == -1)
+ {
+  setError(errno, "init(setsockopt) SO_RCVTIMEO");
+  close(fd);
+  return -1;
+ }
+ 
+ // connect without blocking, so that attempts can overlap
+ if( fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 )
+ {
+  setError(errno, "init(fcntl)");
+  close(fd);
+  return -1;
+ }
+ return fd;
+}
+
+
+//==============================================================================
+// TCPClient::openConnection
+//==============================================================================
+int TCPClient::openConnection(long long deadline)
+{
+ struct pollfd pfds[TCP_CLIENT_MAX_ADDRS];
+ int addrOf[TCP_CLIENT_MAX_ADDRS];
+ int numPending = 0;
+ int next = 0;
+ int winner = -1;
+ int lastErr = ETIMEDOUT;
+ long long nextStart = 0;
+ 
+ d_fd = -1;
+ d_requestNum = 0;
+ d_lastAnswered = 0;
+ while( winner == -1 )
+ {
+  long long now = monotonicUs();
+  
+  // start the next attempt when the previous ones have had their head 
+  // start, or have all failed
+  if( (next < d_numAddrs) && ((numPending == 0) || (now >= nextStart)) )
+  {
+   int fd = openSocket(d_addrs[next].ss_family);
+   if( fd == -1 )
+    break; // status already set
+   if( connect(fd, (struct sockaddr *)&d_addrs[next], d_addrLens[next]) == 0 )
+   {
+    d_fd = fd;
+    winner = next;
+    break;
+   }
+   if( errno == EINPROGRESS )
+   {
+    pfds[numPending].fd = fd;
+    pfds[numPending].events = POLLOUT;
+    addrOf[numPending++] = next;
+   }
+   else
+   {
+    lastErr = errno;
+    close(fd);
+   }
+   next++;
+   nextStart = now + TCP_CONNECT_STAGGER;
+   continue;
+  }
+  
+  if( numPending == 0 )
+  {
+   setError(lastErr, "init(connect)");
+   break;
+  }
+  
+  // wait for an attempt to complete, the deadline, or the next start
+  long long wait = -1;
+  if( deadline )
+  {
+   wait = deadline - now;
+   if( wait <= 0 )
+   {
+    setError(ETIMEDOUT, "init(connect)");
+    break;
+   }
+  }
+  if( (next < d_numAddrs) && ((wait == -1) || (nextStart - now < wait)) )
+   wait = nextStart - now;
+  
+  struct timespec ts;
+  ts.tv_sec = wait / 1000000;
+  ts.tv_nsec = (wait % 1000000) * 1000;
+  for(int i = 0; i < numPending; i++)
+   pfds[i].revents = 0;
+  if( ppoll(pfds, numPending, (wait == -1) ? NULL : &ts, NULL) == -1 )
+  {
+   if( errno == EINTR )
+    continue;
+   setError(errno, "init(poll)");
+   break;
+  }
+  
+  for(int i = 0; (i < numPending) && (winner == -1); i++)
+  {
+   if( pfds[i].revents == 0 )
+    continue;
+   int err = 0;
+   socklen_t errLen = sizeof(int);
+   if( getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &errLen) == -1 )
+    err = errno;
+   if( err == 0 )
+   {
+    d_fd = pfds[i].fd;
+    winner = addrOf[i];
+    pfds[i] = pfds[--numPending];
+    addrOf[i] = addrOf[numPending];
+    break;
+   }
+   
+   // failed, so give the next address its turn right away
+   lastErr = err;
+   close(pfds[i].fd);
+   pfds[i] = pfds[numPending - 1];
+   addrOf[i] = addrOf[numPending - 1];
+   numPending--;
+   i--;
+   nextStart = now;
+  }
+ }
+ 
+ // abandon the attempts that lost the race
+ for(int i = 0; i < numPending; i++)
+  close(pfds[i].fd);
+ if( winner == -1 )
+  return -1;
+ 
+ fcntl(d_fd, F_SETFL, fcntl(d_fd, F_GETFL) & ~O_NONBLOCK);
+ 
+ // try the address that worked first next time
+ if( winner > 0 )
+ {
+  struct sockaddr_storage addr = d_addrs[winner];
+  socklen_t len = d_addrLens[winner];
+  memmove(&d_addrs[1], &d_addrs[0], winner * sizeof(d_addrs[0]));
+  memmove(&d_addrLens[1], &d_addrLens[0], winner * sizeof(d_addrLens[0]));
+  d_addrs[0] = addr;
+  d_addrLens[0] = len;
+ }
+ 
+ // negotiate shared memory transport. On failure we simply stay on TCP.
+ if( d_shmWanted )
+  negotiateShMem();
+ 
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::enableShMemTransport
+//==============================================================================
+int TCPClient::enableShMemTransport(int maxReplySize)
+{
+ d_shmWanted = true;
+ d_shmMaxReply = maxReplySize;
+ 
+ if(!d_init)
+ {
+  d_status.setReport(-1, "enableShMemTransport: client not initialized");
+  return -1;
+ }
+ if( d_shmRegion )
+  return 0;
+ if( d_fd == -1 )
+ {
+  d_status.setReport(-1, "enableShMemTransport: not connected");
+  return -1;
+ }
+ return negotiateShMem();
+}
+
+
+//==============================================================================
+// TCPClient::isShMemTransportActive
+//==============================================================================
+bool TCPClient::isShMemTransportActive() const
+{
+ return (d_shmRegion != NULL);
+}
+
+
+//==============================================================================
+// TCPClient::negotiateShMem
+//==============================================================================
+int TCPClient::negotiateShMem()
+{
+#ifndef __linux__
+ setError(ENOSYS, "enableShMemTransport");
+ return -1;
+#else
+ struct tcp_shm_request request;
+ struct tcp_shm_reply reply;
+ int code = TCP_CTRL_SHM;
+ 
+ if( d_shmMaxReply <= 0 )
+ {
+  d_status.setReport(EINVAL, "enableShMemTransport: invalid reply size");
+  return -1;
+ }
+ 
+ // send request
+ memset(&request, 0, sizeof(request));
+ getHostIdentity(request.identity, TCP_SHM_IDLEN);
+ request.maxReply = d_shmMaxReply;
+ if( (send(d_fd, &code, sizeof(int), 0) < (int)sizeof(int)) ||
+     (send(d_fd, &request, sizeof(request), 0) < (int)sizeof(request)) )
+ {
+  setError(errno, "enableShMemTransport(send)");
+  dropConnection();
+  return -1;
+ }
+ 
+ // read server response
+ if( (recv(d_fd, &code, sizeof(int), MSG_WAITALL) < (int)sizeof(int)) ||
+     (code != TCP_CTRL_SHM) ||
+     (recv(d_fd, &reply, sizeof(reply), MSG_WAITALL) < (int)sizeof(reply)) )
+ {
+  setError(EIO, "enableShMemTransport(recv)");
+  dropConnection();
+  return -1;
+ }
+ if( !reply.accepted )
+ {
+  d_status.setReport(-1, "enableShMemTransport: declined by server");
+  return -1;
+ }
+ 
+ // map the channel
+ reply.name[TCP_SHM_NAMELEN - 1] = '\0';
+ if( d_shm == NULL )
+  d_shm = new ShMem;
+ if( reply.reqCap < 0 )
+ {
+  d_status.setReport(-1, "enableShMemTransport: invalid reply from server");
+  return -1;
+ }
+ d_shmRegion = (struct tcp_shm_region *)d_shm->open(reply.name, 
+                    TCP_SHM_HDRLEN + reply.reqCap + d_shmMaxReply);
+ if( d_shmRegion == NULL )
+ {
+  setError(d_shm->getErrnoError(), "enableShMemTransport(shm)");
+  return -1;
+ }
+ d_shmReqCap = reply.reqCap;
+ d_shmPending = false;
+ return 0;
+#endif
+}
+
+
+//==============================================================================
+// TCPClient::shmSendAndReceive
+//==============================================================================
+int TCPClient::shmSendAndReceive(char *outMsgBuf, int outMsgLen,
+                     char *inMsgBuf, int inBufLen, int *inMsgLen,
+                     long long deadline)
+{
+ struct tcp_shm_region *r = d_shmRegion;
+ 
+ // the server must be done with the previous request
+ if( d_shmPending )
+ {
+  if( waitShMemReply(deadline) == -1 )
+   return -1;
+  d_shmPending = false;
+ }
+ 
+ if( (outMsgLen < 0) || (outMsgLen > d_shmReqCap) )
+ {
+  d_status.setReport(-1, "sendAndReceive: message too long");
+  return -1;
+ }
+ 
+ // publish the request
+ memcpy(shmRequestData(r), outMsgBuf, outMsgLen);
+ r->reqLen = outMsgLen;
+ __sync_synchronize();
+ __sync_fetch_and_add(&r->reqSeq, 1);
+ shmFutexWake(&r->reqSeq);
+ 
+ // check if interested in reply
+ if( inMsgBuf == NULL )
+ {
+  d_shmPending = true;
+  return 0;
+ }
+ 
+ if( waitShMemReply(deadline) == -1 )
+  return -1;
+ 
+ // copy out the reply
+ int repLen = r->repLen;
+ if( repLen == -3 )
+ {
+  d_status.setReport(EBUSY, "sendAndReceive: rejected, server overloaded");
+  return -1;
+ }
+ if( repLen == -1 )
+ {
+  d_status.setReport(-1, "sendAndReceive: no reply from server");
+  return -1;
+ }
+ if( (repLen < 0) || (repLen > inBufLen) || (repLen > d_shmMaxReply) )
+ {
+  d_status.setReport(-1, "sendAndReceive: buffer not large enough.");
+  return -1;
+ }
+ memcpy(inMsgBuf, shmReplyData(r, d_shmReqCap), repLen);
+ *inMsgLen = repLen;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::waitShMemReply
+//==============================================================================
+int TCPClient::waitShMemReply(long long until)
+{
+ struct tcp_shm_region *r = d_shmRegion;
+ struct timespec now, deadline, remaining;
+ int seq = r->reqSeq;
+ 
+ if( until )
+ {
+  deadline.tv_sec = until / 1000000;
+  deadline.tv_nsec = (until % 1000000) * 1000;
+ }
+ else
+ {
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += d_recvTimeout.tv_sec;
+  deadline.tv_nsec += d_recvTimeout.tv_usec * 1000;
+  if( deadline.tv_nsec >= 1000000000 )
+  {
+   deadline.tv_sec++;
+   deadline.tv_nsec -= 1000000000;
+  }
+ }
+ 
+ for(;;)
+ {
+  // poll briefly, replies to short requests come back quickly
+  int rep = r->repSeq;
+  for(int spin = 0; (rep != seq) && (spin < TCP_SHM_SPIN); spin++)
+   rep = r->repSeq;
+  
+  if( !r->open )
+  {
+   d_status.setReport(EPIPE, "sendAndReceive: shared memory channel closed");
+   break;
+  }
+  if( rep == seq )
+  {
+   __sync_synchronize();
+   return 0;
+  }
+  
+  // sleep until the server wakes us or we time out
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+  remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+  if( remaining.tv_nsec < 0 )
+  {
+   remaining.tv_sec--;
+   remaining.tv_nsec += 1000000000;
+  }
+  if( remaining.tv_sec < 0 )
+  {
+   setError(ETIMEDOUT, "sendAndReceive(shm)");
+   break;
+  }
+  shmFutexWait(&r->repSeq, rep, &remaining);
+ }
+ 
+ // give up the channel and the connection. They will be re-established 
+ // on the next call.
+ closeShMem();
+ dropConnection();
+ return -1;
+}
+
+
+//==============================================================================
+// TCPClient::closeShMem
+//==============================================================================
+void TCPClient::closeShMem()
+{
+ if( d_shmRegion )
+  d_shm->close();
+ d_shmRegion = NULL;
+ d_shmPending = false;
+}
+
+
+//==============================================================================
+// TCPClient::getSocketStats
+//==============================================================================
+int TCPClient::getSocketStats(TCPSocketStats *stats)
+{
+ if( (stats == NULL) || (d_fd == -1) )
+ {
+  d_status.setReport(EINVAL, "getSocketStats: not connected");
+  return -1;
+ }
+ if( tuneSocket(d_fd, &d_sockStats, d_bdp == TCP_BDP_AUTO) == -1 )
+ {
+  setError(errno, "getSocketStats(getsockopt)");
+  return -1;
+ }
+ *stats = d_sockStats;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::subscribe
+//==============================================================================
+int TCPClient::subscribe(int topic)
+{
+ return sendSubscription(TCP_CTRL_SUBSCRIBE, topic);
+}
+
+
+//==============================================================================
+// TCPClient::unsubscribe
+//==============================================================================
+int TCPClient::unsubscribe(int topic)
+{
+ return sendSubscription(TCP_CTRL_UNSUBSCRIBE, topic);
+}
+
+
+//==============================================================================
+// TCPClient::sendSubscription
+//==============================================================================
+int TCPClient::sendSubscription(int code, int topic)
+{
+ if( ensureConnected() == -1 )
+  return -1;
+ 
+ int frame[2] = { code, topic };
+ if( send(d_fd, frame, sizeof(frame), 0) < (int)sizeof(frame) )
+ {
+  setError(errno, "subscribe(send)");
+  dropConnection();
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::receivePublished
+//==============================================================================
+int TCPClient::receivePublished(char *inMsgBuf, int inBufLen, int *inMsgLen, 
+                                int *topic)
+{
+ int hdr[3]; // code, topic, length
+ 
+ if( !d_init || (d_fd == -1) )
+ {
+  d_status.setReport(-1, "receivePublished: not subscribed");
+  return -1;
+ }
+ if( (inMsgBuf == NULL) || (inMsgLen == NULL) )
+ {
+  d_status.setReport(EINVAL, "receivePublished: invalid buffer");
+  return -1;
+ }
+ 
+ int n = recv(d_fd, hdr, sizeof(hdr), MSG_WAITALL);
+ if( (n == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) )
+ {
+  d_status.setReport(ETIMEDOUT, "receivePublished: timed out");
+  return -1;
+ }
+ if( n < (int)sizeof(hdr) )
+ {
+  // a partial header leaves the stream out of step
+  setError((n == -1) ? errno : EIO, "receivePublished(recv)");
+  dropConnection();
+  return -1;
+ }
+ if( (hdr[0] != TCP_CTRL_PUBLISH) || (hdr[2] < 0) )
+ {
+  d_status.setReport(EPROTO, "receivePublished: unexpected frame");
+  dropConnection();
+  return -1;
+ }
+ 
+ // skip a message that does not fit
+ if( hdr[2] > inBufLen )
+ {
+  int left = hdr[2];
+  while( left > 0 )
+  {
+   int chunk = (left < inBufLen) ? left : inBufLen;
+   if( (chunk <= 0) || ((n = recv(d_fd, inMsgBuf, chunk, MSG_WAITALL)) <= 0) )
+   {
+    dropConnection();
+    break;
+   }
+   left -= n;
+  }
+  d_status.setReport(-1, "receivePublished: buffer not large enough.");
+  return -1;
+ }
+ 
+ if( (hdr[2] > 0) && (recv(d_fd, inMsgBuf, hdr[2], MSG_WAITALL) < hdr[2]) )
+ {
+  setError(EIO, "receivePublished(recv)");
+  dropConnection();
+  return -1;
+ }
+ *inMsgLen = hdr[2];
+ if( topic )
+  *topic = hdr[1];
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::getStatusCode
+//==============================================================================
+int TCPClient::getStatusCode() const
+{
+ return d_status.getReportCode();
+}
+
+
+//==============================================================================
+// TCPClient::getStatusMessage
+//==============================================================================
+const char *TCPClient::getStatusMessage() const
+{
+ return d_status.getReportMessage();
+}
+
+
+//==============================================================================
+// TCPClient::setError
+//==============================================================================
+void TCPClient::setError(int code, const char *functionName)
+{
+ char buf[80];
+ snprintf(buf, 80, "%s: %s", functionName, strerror(code));
+ d_status.setReport(code, buf);
+}
+
+
+//==============================================================================
+// TCPClient::enableIgnoreSigPipe
+//==============================================================================
+int TCPClient::enableIgnoreSigPipe()
+{
+ if(signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+ {
+  d_status.setReport(-1, "enableIgnoreSigPipe: failed");
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClient::disableIgnoreSigPipe
+//==============================================================================
+int TCPClient::disableIgnoreSigPipe()
+{
+ if(signal(SIGPIPE, SIG_DFL) == SIG_ERR)
+ {
+  d_status.setReport(-1, "disableIgnoreSigPipe: failed");
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// TCPReplicaClient::TCPReplicaClient
+//==============================================================================
+TCPReplicaClient::TCPReplicaClient()
+{
+ d_replicas = NULL;
+ d_numReplicas = 0;
+ d_timeout.tv_sec = 0;
+ d_timeout.tv_usec = 0;
+ d_hedging = false;
+ d_hedgeMinDelay = 1000;
+ d_hedgeCount = 0;
+ d_samples = NULL;
+ d_numSamples = 0;
+ d_p95 = 0;
+ d_status.setReport(0, "TCPReplicaClient: Success");
+}
+
+
+//==============================================================================
+// TCPReplicaClient::~TCPReplicaClient
+//==============================================================================
+TCPReplicaClient::~TCPReplicaClient()
+{
+ freeReplicas();
+}
+
+
+//==============================================================================
+// TCPReplicaClient::freeReplicas
+//==============================================================================
+void TCPReplicaClient::freeReplicas()
+{
+ delete [] d_replicas;
+ d_replicas = NULL;
+ d_numReplicas = 0;
+ free(d_samples);
+ d_samples = NULL;
+ d_numSamples = 0;
+ d_p95 = 0;
+}
+
+
+//==============================================================================
+// TCPReplicaClient::init
+//==============================================================================
+int TCPReplicaClient::init(const char * const *serverIps, const int *ports, 
+                           int numServers, struct timeval &timeout, int bdp)
+{
+ freeReplicas();
+ if( (serverIps == NULL) || (ports == NULL) || (numServers < 1) )
+ {
+  d_status.setReport(EINVAL, "init: no servers");
+  return -1;
+ }
+ 
+ d_samples = (int *)malloc(TCP_REPLICA_SAMPLES * sizeof(int));
+ if( d_samples == NULL )
+ {
+  d_status.setReport(ENOMEM, "init(malloc)");
+  return -1;
+ }
+ d_replicas = new tcp_replica[numServers];
+ d_numReplicas = numServers;
+ d_timeout = timeout;
+ 
+ // a replica that is down now may come up later, so only remember 
+ // the failure here.
+ for(int k = 0; k < numServers; k++)
+ {
+  struct tcp_replica *r = &d_replicas[k];
+  r->latency = 0;
+  r->numSamples = 0;
+  r->failures = 0;
+  r->retryAt = 0;
+  r->sentAt = 0;
+  r->tried = false;
+  r->discard = false;
+  if( r->client.init(serverIps[k], ports[k], timeout, bdp) == -1 )
+  {
+   r->failures = TCP_REPLICA_MAXFAIL;
+   r->retryAt = monotonicUs() + TCP_REPLICA_BACKOFF;
+  }
+ }
+ d_status.setReport(0, "TCPReplicaClient: Success");
+ return 0;
+}
+
+
+//==============================================================================
+// TCPReplicaClient::setHedging
+//==============================================================================
+int TCPReplicaClient::setHedging(bool enable, int minDelay)
+{
+ if( minDelay < 0 )
+ {
+  d_status.setReport(EINVAL, "setHedging: invalid delay");
+  return -1;
+ }
+ d_hedging = enable;
+ d_hedgeMinDelay = minDelay;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPReplicaClient::sendAndReceive
+//==============================================================================
+int TCPReplicaClient::sendAndReceive(char *outMsgBuf, int outMsgLen, 
+                                     char *inMsgBuf, int inBufLen, int *inMsgLen)
+{
+ if( d_numReplicas == 0 )
+ {
+  d_status.setReport(-1, "sendAndReceive: client not initialized");
+  return -1;
+ }
+ if( outMsgBuf == NULL )
+ {
+  d_status.setReport(EINVAL, "sendAndReceive: invalid buffer");
+  return -1;
+ }
+ 
+ long long start = monotonicUs();
+ long long deadline = start + (long long)d_timeout.tv_sec * 1000000 
+                      + d_timeout.tv_usec;
+ long long hedgeAt = start + ((d_p95 > d_hedgeMinDelay) ? d_p95 : d_hedgeMinDelay);
+ bool canHedge = d_hedging && (d_numReplicas > 1);
+ 
+ for(int k = 0; k < d_numReplicas; k++)
+  d_replicas[k].tried = false;
+ 
+ int pending[2];
+ int numPending = 0;
+ int first = startRequest(start, outMsgBuf, outMsgLen);
+ if( first == -1 )
+  return -1;
+ if( inMsgBuf == NULL )
+  return 0;
+ pending[numPending++] = first;
+ 
+ // wait for the first reply, hedging once if it is late
+ for(;;)
+ {
+  long long now = monotonicUs();
+  long long until = (canHedge && (hedgeAt < deadline)) ? hedgeAt : deadline;
+  if( now >= until )
+  {
+   if( until == deadline )
+   {
+    for(int i = 0; i < numPending; i++)
+    {
+     d_replicas[pending[i]].discard = true;
+     recordLatency(pending[i], now, false);
+    }
+    d_status.setReport(ETIMEDOUT, "sendAndReceive: no reply from any replica");
+    return -1;
+   }
+   canHedge = false;
+   int k = startRequest(now, outMsgBuf, outMsgLen);
+   if( k != -1 )
+   {
+    pending[numPending++] = k;
+    d_hedgeCount++;
+   }
+   continue;
+  }
+  
+  struct pollfd pfd[2];
+  for(int i = 0; i < numPending; i++)
+  {
+   pfd[i].fd = d_replicas[pending[i]].client.d_fd;
+   pfd[i].events = POLLIN;
+   pfd[i].revents = 0;
+  }
+  struct timespec wait;
+  wait.tv_sec = (until - now) / 1000000;
+  wait.tv_nsec = ((until - now) % 1000000) * 1000;
+  int ready = ppoll(pfd, numPending, &wait, NULL);
+  if( ready == -1 )
+  {
+   if( errno == EINTR )
+    continue;
+   d_status.setReport(errno, "sendAndReceive(ppoll)");
+   for(int i = 0; i < numPending; i++)
+    d_replicas[pending[i]].discard = true;
+   return -1;
+  }
+  
+  for(int i = 0; (i < numPending) && (ready > 0); i++)
+  {
+   if( pfd[i].revents == 0 )
+    continue;
+   int k = pending[i];
+   struct tcp_replica *r = &d_replicas[k];
+   int ret = r->client.receiveReply(inMsgBuf, inBufLen, inMsgLen, deadline);
+   now = monotonicUs();
+   if( ret == 0 )
+   {
+    // the other copy loses. It has taken at least this long.
+    recordLatency(k, now, true);
+    for(int j = 0; j < numPending; j++)
+    {
+     struct tcp_replica *o = &d_replicas[pending[j]];
+     if( j == i )
+      continue;
+     o->discard = true;
+     if( now - o->sentAt > o->latency )
+      o->latency += (now - o->sentAt - o->latency) / 8;
+    }
+    return 0;
+   }
+   
+   // try another replica if no copy is left in flight
+   d_status.setReport(r->client.getStatusCode(), r->client.getStatusMessage());
+   recordLatency(k, now, false);
+   pending[i] = pending[--numPending];
+   if( numPending == 0 )
+   {
+    k = startRequest(now, outMsgBuf, outMsgLen);
+    if( k == -1 )
+     return -1;
+    pending[numPending++] = k;
+   }
+   break;
+  }
+ } // for(;;)
+}
+
 
 //==============================================================================
-// TCPClient::~TCPClient
+// TCPReplicaClient::startRequest
 //==============================================================================
-TCPClient::~TCPClient()
+int TCPReplicaClient::startRequest(long long now, const char *outMsgBuf, 
+                                   int outMsgLen)
+{
+ bool failed = false;
+ for(;;)
+ {
+  int k = pickReplica(now);
+  if( k == -1 )
+  {
+   if( !failed )
+    d_status.setReport(EAGAIN, "sendAndReceive: no replica available");
+   return -1;
+  }
+  
+  struct tcp_replica *r = &d_replicas[k];
+  r->tried = true;
+  if( (r->client.ensureConnected() == 0) 
+      && (r->client.sendRequest(outMsgBuf, outMsgLen) == 0) )
+  {
+   r->sentAt = monotonicUs();
+   return k;
+  }
+  d_status.setReport(r->client.getStatusCode(), r->client.getStatusMessage());
+  recordLatency(k, now, false);
+  failed = true;
+ }
+}
+
+
+//==============================================================================
+// TCPReplicaClient::pickReplica
+//==============================================================================
+int TCPReplicaClient::pickReplica(long long now)
+{
+ int best = -1;
+ int owing = -1;
+ for(int k = 0; k < d_numReplicas; k++)
+ {
+  struct tcp_replica *r = &d_replicas[k];
+  if( r->tried )
+   continue;
+  if( (r->failures >= TCP_REPLICA_MAXFAIL) && (now < r->retryAt) )
+   continue;
+  
+  // a replica that lost a hedge race owes us a reply
+  if( r->discard )
+  {
+   if( r->client.discardReply() == 1 )
+   {
+    owing = k;
+    continue;
+   }
+   r->discard = false;
+  }
+  if( (best == -1) || (r->latency < d_replicas[best].latency) )
+   best = k;
+ }
+ 
+ // rather than wait for a late reply, start over on a new connection
+ if( (best == -1) && (owing != -1) )
+ {
+  d_replicas[owing].client.dropConnection();
+  d_replicas[owing].discard = false;
+  best = owing;
+ }
+ return best;
+}
+
+
+//==============================================================================
+// TCPReplicaClient::recordLatency
+//==============================================================================
+void TCPReplicaClient::recordLatency(int replica, long long now, bool success)
+{
+ struct tcp_replica *r = &d_replicas[replica];
+ if( !success )
+ {
+  if( ++r->failures >= TCP_REPLICA_MAXFAIL )
+   r->retryAt = now + TCP_REPLICA_BACKOFF;
+  return;
+ }
+ 
+ long long latency = now - r->sentAt;
+ r->failures = 0;
+ if( r->numSamples++ == 0 )
+  r->latency = latency;
+ else
+  r->latency += (latency - r->latency) / 8;
+ 
+ // percentile over recent replies from all replicas, refreshed every 
+ // few samples
+ d_samples[d_numSamples % TCP_REPLICA_SAMPLES] = (int)latency;
+ d_numSamples++;
+ if( (d_numSamples % 16) == 0 )
+ {
+  int sorted[TCP_REPLICA_SAMPLES];
+  int n = (d_numSamples < TCP_REPLICA_SAMPLES) ? d_numSamples : TCP_REPLICA_SAMPLES;
+  memcpy(sorted, d_samples, n * sizeof(int));
+  std::nth_element(sorted, sorted + (n * 95) / 100, sorted + n);
+  d_p95 = sorted[(n * 95) / 100];
+ }
+}
+
+
+//==============================================================================
+// TCPReplicaClient::getLatency
+//==============================================================================
+int TCPReplicaClient::getLatency(int replica) const
+{
+ if( (replica < 0) || (replica >= d_numReplicas) 
+     || (d_replicas[replica].numSamples == 0) )
+  return -1;
+ return (int)d_replicas[replica].latency;
+}
+
+
+//==============================================================================
+// TCPReplicaClient::getHedgeCount
+//==============================================================================
+unsigned long TCPReplicaClient::getHedgeCount() const
+{
+ return d_hedgeCount;
+}
+
+
+//==============================================================================
+// TCPReplicaClient::getStatusCode
+//==============================================================================
+int TCPReplicaClient::getStatusCode() const
+{
+ return d_status.getReportCode();
+}
+
+
+//==============================================================================
+// TCPReplicaClient::getStatusMessage
+//==============================================================================
+const char *TCPReplicaClient::getStatusMessage() const
+{
+ return d_status.getReportMessage();
+}
+
+
+//==============================================================================
+// TCPClientGroup::TCPClientGroup
+//==============================================================================
+TCPClientGroup::TCPClientGroup()
+{
+ d_members = NULL;
+ d_numMembers = 0;
+ d_timeout.tv_sec = 0;
+ d_timeout.tv_usec = 0;
+ d_pollFds = NULL;
+ d_pollMembers = NULL;
+ d_numWaiting = 0;
+ d_numReplies = 0;
+ d_numFailures = 0;
+ d_quorum = 0;
+ d_deadline = 0;
+ d_status.setReport(0, "TCPClientGroup: Success");
+}
+
+
+//==============================================================================
+// TCPClientGroup::~TCPClientGroup
+//==============================================================================
+TCPClientGroup::~TCPClientGroup()
+{
+ freeMembers();
+}
+
+
+//==============================================================================
+// TCPClientGroup::freeMembers
+//==============================================================================
+void TCPClientGroup::freeMembers()
+{
+ delete [] d_members;
+ d_members = NULL;
+ d_numMembers = 0;
+ free(d_pollFds);
+ d_pollFds = NULL;
+ free(d_pollMembers);
+ d_pollMembers = NULL;
+ d_numWaiting = 0;
+}
+
+
+//==============================================================================
+// TCPClientGroup::init
+//==============================================================================
+int TCPClientGroup::init(const char * const *serverIps, const int *ports, 
+                         int numServers, struct timeval &timeout, int bdp)
+{
+ freeMembers();
+ if( (serverIps == NULL) || (ports == NULL) || (numServers < 1) )
+ {
+  d_status.setReport(EINVAL, "init: no servers");
+  return -1;
+ }
+ 
+ d_pollFds = (struct pollfd *)malloc(numServers * sizeof(struct pollfd));
+ d_pollMembers = (int *)malloc(numServers * sizeof(int));
+ if( (d_pollFds == NULL) || (d_pollMembers == NULL) )
+ {
+  freeMembers();
+  d_status.setReport(ENOMEM, "init(malloc)");
+  return -1;
+ }
+ d_members = new tcp_group_member[numServers];
+ d_numMembers = numServers;
+ d_timeout = timeout;
+ 
+ // members that are down now are retried by every scatter(), as their
+ // clients keep the server address (see TCPClient::init())
+ for(int k = 0; k < numServers; k++)
+ {
+  d_members[k].waiting = false;
+  d_members[k].owed = 0;
+  d_members[k].client.init(serverIps[k], ports[k], timeout, bdp);
+ }
+ d_status.setReport(0, "TCPClientGroup: Success");
+ return 0;
+}
+
+
+//==============================================================================
+// TCPClientGroup::getSize
+//==============================================================================
+int TCPClientGroup::getSize() const
+{
+ return d_numMembers;
+}
+
+
+//==============================================================================
+// TCPClientGroup::scatter
+//==============================================================================
+int TCPClientGroup::scatter(const char *outMsgBuf, int outMsgLen, int quorum, 
+                            int deadline, const int *members, int numMembers)
+{
+ if( d_numMembers == 0 )
+ {
+  d_status.setReport(-1, "scatter: group not initialized");
+  return -1;
+ }
+ if( (outMsgBuf == NULL) || (quorum < 0) || (deadline < 0) )
+ {
+  d_status.setReport(EINVAL, "scatter: invalid argument");
+  return -1;
+ }
+ endRound();
+ 
+ if( members == NULL )
+  numMembers = d_numMembers;
+ long long now = monotonicUs();
+ d_deadline = now + (deadline ? deadline : (long long)d_timeout.tv_sec * 1000000 
+                                            + d_timeout.tv_usec);
+ d_quorum = quorum;
+ d_numReplies = 0;
+ d_numFailures = 0;
+ 
+ // send to all members before waiting on any
+ for(int k = 0; k < numMembers; k++)
+ {
+  int m = members ? members[k] : k;
+  if( (m < 0) || (m >= d_numMembers) || d_members[m].waiting )
+   continue;
+  TCPClient *client = &d_members[m].client;
+  if( client->d_fd == -1 )
+   d_members[m].owed = 0; // nothing owed on a new connection
+  if( (client->ensureConnected() == -1) 
+      || (client->sendRequest(outMsgBuf, outMsgLen) == -1) )
+  {
+   d_status.setReport(client->getStatusCode(), client->getStatusMessage());
+   d_members[m].owed = 0;
+   d_numFailures++;
+   continue;
+  }
+  d_members[m].waiting = true;
+  d_numWaiting++;
+ }
+ return d_numWaiting;
+}
+
+
+//==============================================================================
+// TCPClientGroup::gather
+//==============================================================================
+int TCPClientGroup::gather(char *inMsgBuf, int inBufLen, int *inMsgLen, 
+                           int *member)
+{
+ if( (inMsgBuf == NULL) || (inMsgLen == NULL) )
+ {
+  d_status.setReport(EINVAL, "gather: invalid buffer");
+  return -1;
+ }
+ 
+ for(;;)
+ {
+  if( (d_numWaiting == 0) || ((d_quorum > 0) && (d_numReplies >= d_quorum)) )
+  {
+   endRound();
+   return 0;
+  }
+  long long now = monotonicUs();
+  if( now >= d_deadline )
+  {
+   d_numFailures += d_numWaiting;
+   endRound();
+   d_status.setReport(ETIMEDOUT, "gather: deadline reached");
+   return 0;
+  }
+  
+  // wait on every member that has yet to answer
+  int n = 0;
+  for(int m = 0; m < d_numMembers; m++)
+  {
+   if( !d_members[m].waiting )
+    continue;
+   d_pollFds[n].fd = d_members[m].client.d_fd;
+   d_pollFds[n].events = POLLIN;
+   d_pollFds[n].revents = 0;
+   d_pollMembers[n++] = m;
+  }
+  struct timespec wait;
+  wait.tv_sec = (d_deadline - now) / 1000000;
+  wait.tv_nsec = ((d_deadline - now) % 1000000) * 1000;
+  int ready = ppoll(d_pollFds, n, &wait, NULL);
+  if( ready == -1 )
+  {
+   if( errno == EINTR )
+    continue;
+   d_status.setReport(errno, "gather(ppoll)");
+   return -1;
+  }
+  
+  // return the first reply found
+  for(int k = 0; (k < n) && (ready > 0); k++)
+  {
+   if( d_pollFds[k].revents == 0 )
+    continue;
+   ready--;
+   int m = d_pollMembers[k];
+   struct tcp_group_member *g = &d_members[m];
+   
+   // skip what is left over from earlier rounds
+   if( g->owed > 0 )
+   {
+    if( g->client.discardReply() == -1 )
+    {
+     g->owed = 0;
+     g->waiting = false;
+     d_numWaiting--;
+     d_numFailures++;
+    }
+    else
+     g->owed--;
+    continue;
+   }
+   
+   g->waiting = false;
+   d_numWaiting--;
+   if( g->client.receiveReply(inMsgBuf, inBufLen, inMsgLen, d_deadline) == -1 )
+   {
+    d_status.setReport(g->client.getStatusCode(), g->client.getStatusMessage());
+    if( g->client.d_fd == -1 )
+     g->owed = 0;
+    d_numFailures++;
+    continue;
+   }
+   d_numReplies++;
+   if( member )
+    *member = m;
+   return 1;
+  }
+ } // for(;;)
+}
+
+
+//==============================================================================
+// TCPClientGroup::endRound
+//==============================================================================
+void TCPClientGroup::endRound()
+{
+ for(int m = 0; (m < d_numMembers) && (d_numWaiting > 0); m++)
+ {
+  if( !d_members[m].waiting )
+   continue;
+  d_members[m].waiting = false;
+  d_members[m].owed++;
+  d_numWaiting--;
+ }
+}
+
+
+//==============================================================================
+// TCPClientGroup::getNumReplies
+//==============================================================================
+int TCPClientGroup::getNumReplies() const
+{
+ return d_numReplies;
+}
+
+
+//==============================================================================
+// TCPClientGroup::getNumFailures
+//==============================================================================
+int TCPClientGroup::getNumFailures() const
+{
+ return d_numFailures;
+}
+
+
+//==============================================================================
+// TCPClientGroup::getStatusCode
+//==============================================================================
+int TCPClientGroup::getStatusCode() const
+{
+ return d_status.getReportCode();
+}
+
+
+//==============================================================================
+// TCPClientGroup::getStatusMessage
+//==============================================================================
+const char *TCPClientGroup::getStatusMessage() const
+{
+ return d_status.getReportMessage();
+}
+
+
+//==============================================================================
+// TCPMuxClient::TCPMuxClient
+//==============================================================================
+TCPMuxClient::TCPMuxClient()
+{
+ d_slots = NULL;
+ d_timeout.tv_sec = 1;
+ d_timeout.tv_usec = 0;
+ d_chunkSize = TCP_MUX_CHUNK;
+ d_scratch = NULL;
+ d_scratchSize = 0;
+ d_reading = false;
+ d_broken = true;
+ d_generation = 0;
+ pthread_mutex_init(&d_lock, NULL);
+ pthread_mutex_init(&d_writeLock, NULL);
+ 
+ // reply waits are measured on the monotonic clock
+ pthread_condattr_t attr;
+ pthread_condattr_init(&attr);
+ pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+ pthread_cond_init(&d_cond, &attr);
+ pthread_condattr_destroy(&attr);
+ d_status.setReport(0, "TCPMuxClient");
+}
+
+
+//==============================================================================
+// TCPMuxClient::~TCPMuxClient
+//==============================================================================
+TCPMuxClient::~TCPMuxClient()
+{
+ free(d_slots);
+ free(d_scratch);
+ pthread_cond_destroy(&d_cond);
+ pthread_mutex_destroy(&d_writeLock);
+ pthread_mutex_destroy(&d_lock);
+}
+
+
+//==============================================================================
+// TCPMuxClient::init
+//==============================================================================
+int TCPMuxClient::init(const char *serverIp, int port, struct timeval &timeout, 
+                       int bdp)
+{
+ if( d_slots == NULL )
+ {
+  d_slots = (struct tcp_mux_slot *)calloc(TCP_MUX_MAX_STREAMS, 
+                                          sizeof(struct tcp_mux_slot));
+  if( d_slots == NULL )
+  {
+   d_status.setReport(ENOMEM, "init(calloc)");
+   return -1;
+  }
+ }
+ d_timeout = timeout;
+ d_generation++;
+ d_broken = true;
+ if( d_client.init(serverIp, port, timeout, bdp) == -1 )
+ {
+  d_status.setReport(d_client.getStatusCode(), d_client.getStatusMessage());
+  return -1;
+ }
+ d_broken = false;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPMuxClient::setChunkSize
+//==============================================================================
+int TCPMuxClient::setChunkSize(int chunkSize)
+{
+ if( chunkSize < 1 )
+ {
+  d_status.setReport(EINVAL, "setChunkSize: invalid size");
+  return -1;
+ }
+ d_chunkSize = chunkSize;
+ return 0;
+}
+
+
+//==============================================================================
+// TCPMuxClient::openStream
+//==============================================================================
+int TCPMuxClient::openStream()
+{
+ if( d_slots == NULL )
+ {
+  d_status.setReport(-1, "openStream: client not initialized");
+  return -1;
+ }
+ 
+ pthread_mutex_lock(&d_lock);
+ for(int k = 0; k < TCP_MUX_MAX_STREAMS; k++)
+ {
+  if( !d_slots[k].open )
+  {
+   d_slots[k].open = true;
+   d_slots[k].busy = false;
+   pthread_mutex_unlock(&d_lock);
+   return k + 1;
+  }
+ }
+ d_status.setReport(EMFILE, "openStream: too many streams");
+ pthread_mutex_unlock(&d_lock);
+ return -1;
+}
+
+
+//==============================================================================
+// TCPMuxClient::closeStream
+//==============================================================================
+int TCPMuxClient::closeStream(int stream)
 {
- if(d_fd)
+ int ret = 0;
+ pthread_mutex_lock(&d_lock);
+ if( (d_slots == NULL) || (stream < 1) || (stream > TCP_MUX_MAX_STREAMS) 
+     || !d_slots[stream - 1].open )
  {
-  close(d_fd);
-  d_fd = -1;
+  d_status.setReport(EINVAL, "closeStream: invalid stream");
+  ret = -1;
  }
- if(d_serverName)
-  free(d_serverName);
+ else if( d_slots[stream - 1].busy )
+ {
+  d_status.setReport(EBUSY, "closeStream: stream in use");
+  ret = -1;
+ }
+ else
+  d_slots[stream - 1].open = false;
+ pthread_mutex_unlock(&d_lock);
+ return ret;
 }
 
 
 //==============================================================================
-// TCPClient::sendAndReceive
+// TCPMuxClient::sendAndReceive
 //==============================================================================
-int TCPClient::sendAndReceive(char *outMsgBuf, int outMsgLen,
+int TCPMuxClient::sendAndReceive(int stream, char *outMsgBuf, int outMsgLen, 
                      char *inMsgBuf, int inBufLen, int *inMsgLen)
 {
- if(!d_init)
+ if( (outMsgBuf == NULL) || (outMsgLen < 0) )
  {
-  d_status.setReport(-1, "sendAndReceive: client not initialized");
+  d_status.setReport(EINVAL, "sendAndReceive: invalid buffer");
   return -1;
  }
+ long long deadline = monotonicUs() + (long long)d_timeout.tv_sec * 1000000 
+                      + d_timeout.tv_usec;
  
- // initialize connection again if we lost it due to error.
- if( fcntl(d_fd, F_GETFL) == -1 )
- {
-  if( init(d_serverName, d_serverPort, d_recvTimeout, d_bdp) == -1 )
-   return -1;
- }
- 
- // check buffer pointers
- if( outMsgBuf == NULL )
+ pthread_mutex_lock(&d_writeLock);
+ pthread_mutex_lock(&d_lock);
+ if( (d_slots == NULL) || (stream < 1) || (stream > TCP_MUX_MAX_STREAMS) 
+     || !d_slots[stream - 1].open || d_slots[stream - 1].busy )
  {
-  d_status.setReport(EINVAL, "sendAndReceive: invalid buffer");
+  d_status.setReport(EINVAL, "sendAndReceive: stream not open, or in use");
+  pthread_mutex_unlock(&d_lock);
+  pthread_mutex_unlock(&d_writeLock);
   return -1;
  }
-  
- // write header (size) info to server
- if( send(d_fd, &outMsgLen, sizeof(int), 0) < (int)sizeof(int) )
+ if( d_broken && (reconnect() == -1) )
  {
-  setError(errno, "sendAndReceive(send)");
-  close(d_fd);
+  pthread_mutex_unlock(&d_lock);
+  pthread_mutex_unlock(&d_writeLock);
   return -1;
  }
-
-#ifdef DEBUG
- cerr << "DEBUG [sendAndReceive]: header sent to server" << endl;
-#endif
-
- // write until done or try 3 times
- int wroteTillNow = 0;
- int numWriteAttempts = 0;
- while( (wroteTillNow < outMsgLen) && (numWriteAttempts < 3) )
+ 
+ struct tcp_mux_slot *slot = &d_slots[stream - 1];
+ slot->busy = (inMsgBuf != NULL);
+ slot->done = false;
+ slot->seq++;
+ slot->buf = inMsgBuf;
+ slot->cap = inBufLen;
+ slot->len = 0;
+ slot->error = 0;
+ int generation = d_generation;
+ pthread_mutex_unlock(&d_lock);
+ 
+ // send the message in chunks, letting other streams in between them
+ int code = TCP_CTRL_MUX;
+ struct tcp_mux_frame frame;
+ struct iovec iov[3];
+ frame.stream = stream;
+ frame.seq = slot->seq;
+ int sent = 0;
+ int ret = 0;
+ for(;;)
  {
-  int wroteNow;
-  numWriteAttempts++;
-  wroteNow = send(d_fd, &(outMsgBuf[wroteTillNow]), 
-                         outMsgLen - wroteTillNow, 0);
-  if(wroteNow == -1)
+  int n = std::min(outMsgLen - sent, d_chunkSize);
+  frame.length = n;
+  frame.flags = (sent + n == outMsgLen) ? TCP_MUX_END : 0;
+  iov[0].iov_base = &code;
+  iov[0].iov_len = sizeof(int);
+  iov[1].iov_base = &frame;
+  iov[1].iov_len = sizeof(frame);
+  iov[2].iov_base = outMsgBuf + sent;
+  iov[2].iov_len = n;
+  
+  // a new connection would get the rest of a message without its start
+  if( d_generation != generation )
+   ret = -1;
+  else
+   ret = sendVector(d_client.d_fd, iov, 3, MSG_NOSIGNAL);
+  pthread_mutex_unlock(&d_writeLock);
+  sent += n;
+  if( (ret == -1) || (sent == outMsgLen) )
    break;
-   
-  wroteTillNow += wroteNow;
- } // end while
-       
- // check for write failure
- if( wroteTillNow < outMsgLen )
+  pthread_mutex_lock(&d_writeLock);
+ }
+ if( ret == -1 )
  {
-  setError(EIO, "sendAndReceive(send)"); // physical write failure
-  close(d_fd);
+  failConnection(generation, EPIPE, "sendAndReceive(send)");
+  pthread_mutex_lock(&d_lock);
+  slot->busy = false;
+  pthread_mutex_unlock(&d_lock);
   return -1;
  }
  
-#ifdef DEBUG
- cerr << "DEBUG [sendAndReceive]: data sent to server" << endl;
-#endif
-
  // check if interested in reply
- if(inMsgBuf == NULL)
+ if( inMsgBuf == NULL )
   return 0;
-
-#ifdef DEBUG
- cout << "DEBUG [sendAndReceive]: want reply from server" << endl;
-#endif
-
- // read header packet for size of incoming data
- if( recv(d_fd, inMsgLen, sizeof(int), MSG_WAITALL) < (int)sizeof(int) )
+ 
+ // wait for the reply. A thread that finds nobody reading the connection 
+ // reads it, for all the streams, until its own reply is complete.
+ pthread_mutex_lock(&d_lock);
+ while( !slot->done )
  {
-  setError(errno, "sendAndReceive(recv)");
-  close(d_fd);
-  return -1;
+  if( monotonicUs() >= deadline )
+  {
+   slot->error = ETIMEDOUT;
+   break;
+  }
+  if( !d_reading )
+  {
+   d_reading = true;
+   pthread_mutex_unlock(&d_lock);
+   readFrame(deadline);
+   pthread_mutex_lock(&d_lock);
+   d_reading = false;
+   pthread_cond_broadcast(&d_cond);
+  }
+  else
+  {
+   struct timespec until;
+   until.tv_sec = deadline / 1000000;
+   until.tv_nsec = (deadline % 1000000) * 1000;
+   pthread_cond_timedwait(&d_cond, &d_lock, &until);
+  }
  }
-
-#ifdef DEBUG
- cerr << "DEBUG [sendAndReceive]: received header from server" << endl;
-#endif
  
- // inMsgLen has size of incoming message.
- // Compare with our buffer to make sure we can accomodate it.
- if( *inMsgLen > inBufLen)
+ // a late reply is recognized by its sequence number and dropped
+ slot->busy = false;
+ ret = 0;
+ switch( slot->error )
  {
-
-#ifdef DEBUG
- cerr << "DEBUG [sendAndReceive]: buffer size not enough" << endl;
-#endif
-
-  d_status.setReport(-1, "sendAndReceive: buffer not large enough.");
-  close(d_fd);
-  return -1;
+  case 0:
+   *inMsgLen = slot->len;
+   break;
+  case EBUSY:
+   d_status.setReport(EBUSY, "sendAndReceive: rejected, server overloaded");
+   ret = -1;
+   break;
+  case EMSGSIZE:
+   d_status.setReport(-1, "sendAndReceive: buffer not large enough.");
+   ret = -1;
+   break;
+  case ETIMEDOUT:
+   d_status.setReport(ETIMEDOUT, "sendAndReceive(recv): Connection timed out");
+   ret = -1;
+   break;
+  default:
+   ret = -1; // connection failed, reported by failConnection()
+   break;
  }
-       
-#ifdef DEBUG
- cerr << "DEBUG [sendAndReceive]: buffer size ok" << endl;
-#endif
+ pthread_mutex_unlock(&d_lock);
+ return ret;
+}
 
- // read until done or try 3 times
- int readTillNow = 0;
- int numReadAttempts = 0;
- while( (readTillNow < *inMsgLen) && (numReadAttempts < 3) )
- {
-  int readNow;
-  numReadAttempts++;
-  readNow = recv(d_fd, &(inMsgBuf[readTillNow]), *inMsgLen - readTillNow, 
-                 MSG_WAITALL);
-  
-  if(readNow == -1)
-   break;
-   
-  readTillNow += readNow;
- } // end while
 
- // check for read failure
- if( readTillNow < *inMsgLen )
+//==============================================================================
+// TCPMuxClient::reconnect
+//==============================================================================
+int TCPMuxClient::reconnect()
+{
+ // the reading thread must be off the old connection
+ while( d_reading )
+  pthread_cond_wait(&d_cond, &d_lock);
+ 
+ d_client.dropConnection();
+ if( d_client.ensureConnected() == -1 )
  {
-  setError(EIO, "sendAndReceive(recv)"); // physical read failure
-  close(d_fd);
+  d_status.setReport(d_client.getStatusCode(), d_client.getStatusMessage());
   return -1;
  }
-
-#ifdef DEBUG
- cerr << "DEBUG [sendAndReceive]: done reading reply from server" << endl;
-#endif
-
+ d_generation++;
+ d_broken = false;
  return 0;
-} 
-                   
+}
+
 
 //==============================================================================
-// TCPClient::init
+// TCPMuxClient::readFrame
 //==============================================================================
-int TCPClient::init(const char *serverIp, int port, struct timeval &timeout, int bdp)
+int TCPMuxClient::readFrame(long long deadline)
 {
- struct hostent *server;
- char info[80];
+ int fd = d_client.d_fd;
+ int generation = d_generation;
  
- d_recvTimeout.tv_sec = timeout.tv_sec;
- d_recvTimeout.tv_usec = timeout.tv_usec;
- d_bdp = bdp;
-
- if(d_fd)
- {
-  close(d_fd);
-  d_fd = -1;
- }
- d_init = false;
-
- // copy the server name
- int nlen;
- nlen = strlen(serverIp);
- if( !d_serverName ) {
-  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
-  if( d_serverName == NULL ) {
-   setError(-1, "init(realloc)");
-   return -1;
-  }
-  strncpy(d_serverName, serverIp, nlen);
-  d_serverName[nlen] = '\0';
- }
- else if(strncmp(d_serverName, serverIp, nlen)) {
-  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
-  if( d_serverName == NULL ) {
-   setError(-1, "init(realloc)");
-   return -1;
-  }
-  strncpy(d_serverName, serverIp, nlen);
-  d_serverName[nlen] = '\0';
- }
- d_serverPort = port;
+ // wait for the next chunk of any stream
+ long long remaining = deadline - monotonicUs();
+ if( remaining <= 0 )
+  return 0;
+ struct pollfd pfd;
+ struct timespec ts;
+ pfd.fd = fd;
+ pfd.events = POLLIN;
+ pfd.revents = 0;
+ ts.tv_sec = remaining / 1000000;
+ ts.tv_nsec = (remaining % 1000000) * 1000;
+ if( ppoll(&pfd, 1, &ts, NULL) <= 0 )
+  return 0;
  
-
- // get network server entry
- server = gethostbyname(serverIp);
- if( server == NULL )
+ int code = 0;
+ struct tcp_mux_frame frame;
+ if( (recv(fd, &code, sizeof(int), MSG_WAITALL) == (int)sizeof(int)) 
+     && (code == TCP_CTRL_REJECT) )
  {
-  snprintf(info, 80, "gethostbyname %s", hstrerror(h_errno));
-  d_status.setReport(h_errno, info);
+  // the server turned the connection away
+  failConnection(generation, EBUSY, "sendAndReceive(recv)");
   return -1;
  }
- 
- // Create an endpoint for communication
- if( (d_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+ if( (code != TCP_CTRL_MUX) 
+     || (recv(fd, &frame, sizeof(frame), MSG_WAITALL) < (int)sizeof(frame))
+     || (frame.length < 0) )
  {
-  setError(errno, "init(socket)");
+  failConnection(generation, EIO, "sendAndReceive(recv)");
   return -1;
  }
- 
- d_server.sin_family = AF_INET;
- d_server.sin_port = htons(port);
- d_server.sin_addr.s_addr = *((in_addr_t *)server->h_addr);
- memset(&(d_server.sin_zero), '\0', 8);
-
- // Do not delay sending data packets
- int yes = 1;
- if( setsockopt(d_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+ if( frame.length > d_scratchSize )
  {
-  setError(errno, "init(setsockopt-TCP_NODELAY)");
-  close(d_fd);
-  d_fd = -1;
-  return -1;
- }
-
- // set suggested optimal socket buffer sizes.
- yes = d_bdp * 1024;
- if( yes != 0 ) {
-  if( setsockopt(d_fd, SOL_SOCKET, SO_SNDBUF, (char *)&yes, sizeof(int)) == -1)
-  {
-   setError(errno, "init(setsockopt-SO_SNDBUF)");
-   close(d_fd);
-   d_fd = -1;
-   return -1;
-  }
-
-  // set suggested optimal socket buffer sizes.
-  if( setsockopt(d_fd, SOL_SOCKET, SO_RCVBUF, (char *)&yes, sizeof(int)) == -1)
+  char *buf = (char *)realloc(d_scratch, frame.length);
+  if( buf == NULL )
   {
-   setError(errno, "init(setsockopt-SO_RCVBUF)");
-   close(d_fd);
-   d_fd = -1;
+   failConnection(generation, ENOMEM, "sendAndReceive(realloc)");
    return -1;
   }
+  d_scratch = buf;
+  d_scratchSize = frame.length;
  }
-
- // set receive timeout 
- if( setsockopt(d_fd, SOL_SOCKET, SO_RCVTIMEO, &d_recvTimeout, 
-     sizeof(struct timeval)) == -1)
+ if( (frame.length > 0) && 
+     (recv(fd, d_scratch, frame.length, MSG_WAITALL) < frame.length) )
  {
-  setError(errno, "init(setsockopt) SO_RCVTIMEO");
-  close(d_fd);
-  d_fd = -1;
+  failConnection(generation, EIO, "sendAndReceive(recv)");
   return -1;
  }
-
- // connect to the server
- if( connect(d_fd, (struct sockaddr *)&d_server, 
-    sizeof(struct sockaddr)) == -1)
+ 
+ // hand it to its stream, unless nobody is waiting for it any more
+ pthread_mutex_lock(&d_lock);
+ if( (frame.stream >= 1) && (frame.stream <= TCP_MUX_MAX_STREAMS) )
  {
-  setError(errno, "init(connect)");
-  close(d_fd);
-  d_fd = -1;
-  return -1;
+  struct tcp_mux_slot *slot = &d_slots[frame.stream - 1];
+  if( slot->busy && !slot->done && (slot->seq == frame.seq) )
+  {
+   if( frame.flags & TCP_MUX_REJECT )
+    slot->error = EBUSY;
+   else if( slot->len + frame.length > slot->cap )
+    slot->error = EMSGSIZE; // keep reading to the end of the reply
+   else if( slot->error == 0 )
+   {
+    memcpy(slot->buf + slot->len, d_scratch, frame.length);
+    slot->len += frame.length;
+   }
+   if( frame.flags & (TCP_MUX_END | TCP_MUX_REJECT) )
+   {
+    slot->done = true;
+    pthread_cond_broadcast(&d_cond);
+   }
+  }
  }
- d_init = true; 
+ pthread_mutex_unlock(&d_lock);
  return 0;
 }
 
 
 //==============================================================================
-// TCPClient::getStatusCode
-//==============================================================================
-int TCPClient::getStatusCode() const
-{
- return d_status.getReportCode();
-}
-
-
-//==============================================================================
-// TCPClient::getStatusMessage
-//==============================================================================
-const char *TCPClient::getStatusMessage() const
-{
- return d_status.getReportMessage();
-}
-
-
-//==============================================================================
-// TCPClient::setError
+// TCPMuxClient::failConnection
 //==============================================================================
-void TCPClient::setError(int code, const char *functionName)
+void TCPMuxClient::failConnection(int generation, int code, 
+                                  const char *functionName)
 {
- char buf[80];
- snprintf(buf, 80, "%s: %s", functionName, strerror(code));
- d_status.setReport(code, buf);
+ pthread_mutex_lock(&d_lock);
+ if( (generation == d_generation) && !d_broken )
+ {
+  char buf[80];
+  snprintf(buf, 80, "%s: %s", functionName, strerror(code));
+  d_status.setReport(code, buf);
+  d_broken = true;
+  
+  // wake up the reader and the streams. The socket is closed on reconnect,
+  // when nobody uses it any more.
+  shutdown(d_client.d_fd, SHUT_RDWR);
+  for(int k = 0; k < TCP_MUX_MAX_STREAMS; k++)
+  {
+   if( d_slots[k].busy && !d_slots[k].done )
+   {
+    d_slots[k].error = code;
+    d_slots[k].done = true;
+   }
+  }
+  pthread_cond_broadcast(&d_cond);
+ }
+ pthread_mutex_unlock(&d_lock);
 }
 
 
 //==============================================================================
-// TCPClient::enableIgnoreSigPipe
+// TCPMuxClient::getStatusCode
 //==============================================================================
-int TCPClient::enableIgnoreSigPipe()
+int TCPMuxClient::getStatusCode() const
 {
- if(signal(SIGPIPE, SIG_IGN) == SIG_ERR)
- {
-  d_status.setReport(-1, "enableIgnoreSigPipe: failed");
-  return -1;
- }
- return 0;
+ return d_status.getReportCode();
 }
 
 
 //==============================================================================
-// TCPClient::disableIgnoreSigPipe
+// TCPMuxClient::getStatusMessage
 //==============================================================================
-int TCPClient::disableIgnoreSigPipe()
+const char *TCPMuxClient::getStatusMessage() const
 {
- if(signal(SIGPIPE, SIG_DFL) == SIG_ERR)
- {
-  d_status.setReport(-1, "disableIgnoreSigPipe: failed");
-  return -1;
- }
- return 0;
+ return d_status.getReportMessage();
 }
@@ -12,6 +12,8 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -23,8 +25,41 @@
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "StatusReport.hpp"
+#include "ShMem.hpp"
+
+struct tcp_shm_region;
+struct tcp_shm_channel;
+struct tcp_event_loop;
+struct tcp_subscriber;
+struct tcp_cache_entry;
+struct tcp_cache;
+struct tcp_mux_partial;
+struct tcp_mux_slot;
+
+#define TCP_BDP_AUTO (-1) // bdp argument: size socket buffers from measurements
+#define TCP_CLIENT_MAX_ADDRS 8 // server addresses a TCPClient tries
+#define TCP_MUX_MAX_STREAMS 1024 // streams of a TCPMuxClient
+#define TCP_MUX_MAX_PARTIAL (16 << 20) // bytes of unfinished multiplexed
+                                      // messages a server holds per client
+
+//==============================================================================
+// Measurements and socket buffer sizes of a connection (see TCP_BDP_AUTO).
+//==============================================================================
+struct TCPSocketStats
+{
+ int fd;                 // socket of the connection
+ int rtt;                // smoothed round-trip time (microseconds)
+ long long deliveryRate; // recent delivery rate (bytes/sec), 0 if not known
+ int bdp;                // bandwidth-delay product (bytes)
+ int sndBuf;             // send buffer size chosen (bytes), 0 if not set
+ int rcvBuf;             // receive buffer size chosen (bytes), 0 if not set
+ long long bytesAcked;   // bytes sent and acknowledged, at last measurement
+ long long bytesReceived;// bytes received, at last measurement
+ long long measured;     // time (monotonic, microseconds) of the above
+};
 
 //==============================================================================
 // class TCPServer
@@ -48,8 +83,32 @@
 // Use TCPClient/TCPServer when you want to reliably transfer data at slow
 // speeds. Use UDPClient/UDPServer when your primary requirement is speed.
 //
+// When client and server run on the same host, the server can listen on a
+// Unix domain socket instead of a TCP port by passing an address of the
+// form "unix:/path/to/socket". Framing and the receiveAndReply() interface 
+// are identical, but data does not go through the TCP/IP stack.
+//
+// A client on the same host may also request a shared memory transport 
+// (see TCPClient::enableShMemTransport()). The server then services that
+// client from a separate thread which waits on the shared memory region.
+// Calls to receiveAndReply() are serialized by the server, so the user 
+// implementation need not be reentrant (unless asked for otherwise, see 
+// setEventLoops()).
+//
+// A server process can be restarted without refusing connections: the new 
+// process calls initFromHandoff() and the old process calls requestHandoff(),
+// which passes the listening socket (and optionally the established client 
+// connections) to the new process.
+//
+// On multi-core machines the server can run several event loops, each 
+// pinned to a cpu (see setEventLoops()). Each accepted connection is 
+// serviced by the loop on the cpu that received its packets, so that 
+// packet processing and receiveAndReply() share the cpu caches.
+//
 // <b>Example Program:</b>
 // \include TCPClientServer.t.cpp
+// The shared memory transport: 
+// \include TCPShMem.t.cpp
 //==============================================================================
 
 class TCPServer
@@ -72,6 +131,20 @@ class TCPServer
    //              per sec. Then your BDP is 100e6 * 50e-3 / 8 = 625 kilo bytes.
    //              You can use the 'ping' utility to get an approx. measure for
    //              the round-trip time. Set this to 0 to use system defaults.
+   //              Set this to TCP_BDP_AUTO to have the server measure the 
+   //              round-trip time and throughput of every connection 
+   //              (TCP_INFO) once a second (Linux). The kernel sizes the 
+   //              buffers itself. A buffer is only set, to twice the 
+   //              product, when the throughput over the last second needs
+   //              more than the kernel gave. See getSocketStats().
+
+  TCPServer(const char *address, int maxMsgSize=1024, int bdp=0);
+   // Initializes the server on a local address. 
+   //  address     Address of the form "unix:/path/to/socket" on which the 
+   //              server will wait for clients on the same host. Any 
+   //              existing file at that path is removed.
+   //  maxMsgSize  Maximum size (bytes) of the receive buffer. 
+   //  bdp         Estimated BDP. See above.
    
   virtual ~TCPServer();
    // The destructor frees resources.
@@ -85,9 +158,178 @@ class TCPServer
    //  bdp     Estimated BDP. See constructor for details.
    //  return  0 on success, -1 on failure.
 
+  int init(const char *address, int maxMsgSize, int bdp=0);
+   // Initialize the server on a local (Unix domain) address.
+   //  address     Address of the form "unix:/path/to/socket".
+   //  maxMsgSize  Maximum size (bytes) of the receive buffer.
+   //  bdp         Estimated BDP. See constructor for details.
+   //  return      0 on success, -1 on failure.
+
+  int initFromHandoff(const char *path, int maxMsgSize);
+   // Initialize the server with the listening socket of another server 
+   // process that is being replaced (see requestHandoff()). This function
+   // blocks until the old process connects and passes its listener, and 
+   // optionally its client connections, to this process. Clients never 
+   // see the listener close, so a restart drops no connection requests.
+   // Listeners of several event loops (SO_REUSEPORT) go to the loops set
+   // up with setEventLoops(), in order. Connections waiting on those left
+   // over are accepted, and the listeners closed.
+   //  path        Path of a Unix domain socket created by this function,
+   //              on which the old process connects.
+   //  maxMsgSize  Maximum size (bytes) of the receive buffer.
+   //  return      0 on success, -1 on failure.
+
+  int requestHandoff(const char *path, bool passConnections=false);
+   // Ask doMessageCycle() to pass the listening socket to a new server 
+   // process waiting in initFromHandoff(). The handoff happens between 
+   // two client messages, so no request is lost. With several event 
+   // loops on SO_REUSEPORT, the listeners of all loops are passed. 
+   // Afterwards this server accepts no more clients. It closes each 
+   // remaining connection once the reply to the client's current request
+   // is sent, and those idle for a second after the handoff, and then
+   // doMessageCycle() returns. A TCPClient notices the closed connection
+   // before its next request and reconnects to the new process. This 
+   // function may be called from another thread or from a signal handler.
+   //  path             Path given to initFromHandoff() by the new process.
+   //  passConnections  If true, established client connections are passed 
+   //                   as well and doMessageCycle() returns right away. 
+   //                   Clients on shared memory channels are disconnected
+   //                   instead, and reconnect to the new process.
+   //  return           0 if the request was queued, else -1.
+
+  int setEventLoops(int numLoops, const int *cpus=NULL, 
+                    bool reusePortSteering=false, bool concurrentHandler=false);
+   // Service clients from several event loops. Call this before init().
+   // doMessageCycle() runs the first loop in the calling thread and the
+   // others in threads of their own. An accepted connection is passed to 
+   // the loop on the cpu that received it (SO_INCOMING_CPU), or spread 
+   // over the loops if the system does not report the cpu.
+   //  numLoops           Number of event loops (default is 1).
+   //  cpus               NULL, or array of numLoops cpu numbers to pin 
+   //                     the loops to. The first loop pins the thread 
+   //                     calling doMessageCycle(). Use -1 to not pin a loop.
+   //  reusePortSteering  If true, each loop gets its own listening socket
+   //                     (SO_REUSEPORT) and the kernel runs a small BPF 
+   //                     program that chooses the listener of the loop
+   //                     pinned to the receiving cpu (Linux 4.5 and later, 
+   //                     TCP only). Otherwise one listener is shared.
+   //  concurrentHandler  If true, receiveAndReply() is called from the 
+   //                     loops concurrently, and must be reentrant. The
+   //                     reply buffer it returns must not be shared between
+   //                     calls. By default calls are serialized.
+   //  return             0 on success, -1 on error.
+
+  int setAdmissionLimits(int maxConnections, int maxInFlight, int targetDelay,
+                         int interval=100000);
+   // Shed load when over capacity instead of queueing requests. Connections
+   // and requests over the limits get a short rejection frame, and 
+   // TCPClient::sendAndReceive() fails with status EBUSY, so that clients 
+   // back off quickly and served requests keep a bounded latency. A 
+   // rejected connection is closed; the client connects again on its next
+   // call. Use 0 for no limit. 
+   //  maxConnections  Largest number of client connections.
+   //  maxInFlight     Largest number of requests handled at the same time
+   //                  (over all event loops and shared memory channels).
+   //  targetDelay     Acceptable queueing delay (microseconds) between the 
+   //                  arrival of a request and the call to receiveAndReply().
+   //                  When the delay stays above this target for an interval, 
+   //                  requests are rejected at an increasing rate until it 
+   //                  drops below target again (CoDel). Typically 5000.
+   //  interval        Interval (microseconds) for the above (default 100ms).
+   //  return          0 on success, -1 on invalid arguments.
+  
+  void getAdmissionCounters(unsigned long *rejectedConnections, 
+                            unsigned long *rejectedRequests) const;
+   // Get the number of connections and requests rejected so far.
+   //  rejectedConnections  Connections over the limit (or NULL)
+   //  rejectedRequests     Requests over the limits (or NULL)
+
+  int setTurnBudget(int maxFrames, int maxBytes=0);
+   // Set how much one client is served per pass of the event loop. Clients
+   // with data are served round-robin, one turn each per pass, and a turn 
+   // ends when the client has no complete header buffered or the budget 
+   // is used up, so a client that floods the server cannot hold up the 
+   // others for long. Messages are never split, so a turn is at least one 
+   // message. The default is one message per turn.
+   //  maxFrames  Largest number of messages served in a turn (>= 1).
+   //  maxBytes   Turn ends once this many bytes were read, or 0 for no limit.
+   //  return     0 on success, -1 on invalid arguments.
+
+  enum SubscriberPolicy
+  {
+   DROP_NEWEST,  // a full queue takes no more messages
+   DROP_OLDEST,  // a full queue drops its oldest message to take a new one
+   CONFLATE      // a new message replaces a queued one of the same topic,
+                 // otherwise as DROP_OLDEST
+  };
+   // What happens to messages published to a subscriber that is behind.
+  
+  int setSubscriberPolicy(int maxQueued, SubscriberPolicy policy);
+   // Set how messages are queued to subscribers (see publish()). Call this
+   // before clients subscribe. The default is 64 messages and DROP_OLDEST.
+   //  maxQueued  Largest number of messages queued to a subscriber.
+   //  policy     What to do with a subscriber that is behind.
+   //  return     0 on success, -1 on error.
+  
+  int publish(int topic, const char *msg, int msgLen);
+   // Send a message to all clients subscribed to a topic (see 
+   // TCPClient::subscribe()). The message is copied once into a buffer 
+   // shared by all subscribers, queued to each and written as far as 
+   // the sockets take it without blocking. The event loop writes the 
+   // rest as the sockets drain. A subscriber that cannot keep up loses
+   // messages as set by setSubscriberPolicy(). May be called from any 
+   // thread, including receiveAndReply().
+   //  topic   Topic to publish to.
+   //  msg     Message.
+   //  msgLen  Length of the message.
+   //  return  Number of subscribers the message was queued to, -1 on 
+   //          error.
+  
+  unsigned long getPublishDrops() const;
+   //  return  Number of messages dropped or replaced for slow subscribers.
+
+  int enableResponseCache(int maxEntries, int ttl, int numShards=16);
+   // Keep replies to requests, and answer a request that is byte for byte
+   // the same as an earlier one from the cache instead of calling 
+   // receiveAndReply(). Only use this if replies depend on nothing but 
+   // the request (or call invalidateCachedReply() when they change). If 
+   // the same request comes in again while the first is being handled, 
+   // it waits for that reply rather than calling receiveAndReply() again.
+   // The cache is split into shards with their own locks, and replaces 
+   // entries not used recently (CLOCK). Call before doMessageCycle().
+   //  maxEntries  Largest number of replies kept, or 0 to disable the cache.
+   //  ttl         Time (microseconds) a reply is used for, or 0 for ever.
+   //  numShards   Number of independently locked parts.
+   //  return      0 on success, -1 on error.
+  
+  int invalidateCachedReply(const char *request, int requestLen);
+   // Forget the cached reply to a request.
+   //  request     The request.
+   //  requestLen  Length of the request.
+   //  return      1 if a reply was forgotten, else 0.
+  
+  void clearCache();
+   // Forget all cached replies.
+  
+  void getCacheCounters(unsigned long *hits, unsigned long *misses, 
+                        unsigned long *evictions, unsigned long *coalesced) const;
+   // Get response cache statistics. Any pointer may be NULL.
+   //  hits       Requests answered from the cache.
+   //  misses     Requests passed to receiveAndReply().
+   //  evictions  Replies replaced to make room.
+   //  coalesced  Requests that waited for the same request to finish.
+
+  int getSocketStats(TCPSocketStats *stats, int maxStats) const;
+   // Get the latest measurements and buffer sizes of the connections 
+   // when the server was set up with TCP_BDP_AUTO.
+   //  stats     Array to fill in.
+   //  maxStats  Size of the above array.
+   //  return    Number of entries filled in.
+
   void doMessageCycle();
-   // This function never returns, unless server initialization failed. It 
-   // constantly checks for any waiting clients. When connected to a client 
+   // This function never returns, unless server initialization failed or 
+   // the server was handed over to another process (see requestHandoff()). 
+   // It constantly checks for any waiting clients. When connected to a client 
    // it copies the message from the client into the message buffer and calls 
    // receiveAndReply(). Upon return from user implemented receiveAndReply() 
    // this function will reply back to the client if required ( see receiveAndReply() ). 
@@ -131,10 +373,170 @@ class TCPServer
    // Set an error report
    //  code          errno error code
    //  functionName  The unsuccessful function call
+
+  void setReport(int code, const char *message);
+   // Set a status report, under d_statusLock.
+
+  void setDefaults();
+   // Initialize members. Common to all constructors.
+
+  int bindAndListen(struct sockaddr *name, socklen_t nameLen, int bufSize, 
+                    int bdp);
+   // Create the listening socket, bind it to a name and allocate the
+   // receive buffer. Common to both init() functions.
+   //  name     Address to bind to (AF_INET or AF_UNIX)
+   //  nameLen  Length of the above address
+   //  bufSize  Maximum size of client messages
+   //  bdp      Estimated BDP.
+   //  return   0 on success, -1 on failure.
+
+  const char *dispatchMessage(const char *inMsgBuf, int inMsgLen, int *outMsgLen,
+                              struct tcp_cache_entry **pinned);
+   // Call receiveAndReply() with the handler lock held. All client 
+   // messages are delivered through here.
+   //  pinned  Set to the cache slot the reply is in, if any. Pass it to
+   //          releaseCachedReply() once the reply is sent.
+  
+  const char *cachedMessage(const char *inMsgBuf, int inMsgLen, int *outMsgLen,
+                            struct tcp_cache_entry **pinned);
+   // dispatchMessage() through the response cache.
+  
+  void releaseCachedReply(struct tcp_cache_entry *pinned);
+   // Allow a cache slot to be reused (see dispatchMessage()).
+  
+  void freeCache();
+   // Release the response cache.
+
+  int admitRequest(long long arrival);
+   // Decide whether to handle a request.
+   //  arrival  Time (monotonic, microseconds) the request was seen
+   //  return   0 to handle it (call releaseRequest() when done), -1 to 
+   //           reject it.
+  
+  void releaseRequest();
+   // Done handling an admitted request.
+  
+  int serviceClient(struct tcp_event_loop *loop, int fd, long long arrival,
+                    bool mayCork, bool *corked);
+   // Read one message from a client, call the handler and reply.
+   //  loop     Event loop the client belongs to
+   //  fd       Client socket
+   //  arrival  Time (monotonic, microseconds) the message was seen
+   //  mayCork  true if the reply may be held back (MSG_MORE) when the 
+   //           next request of the client is already buffered
+   //  corked   Set true if the reply was held back, false if it was sent
+   //  return   Bytes read, or -1 if the connection was closed.
+  
+  int sendReply(int fd, const char *outMsgBuf, int outMsgLen, bool more);
+   // Send header and reply in one call.
+   //  more    true to hold back the data for more replies (MSG_MORE)
+   //  return  0 on success, -1 on error.
+  
+  int serviceMuxChunk(struct tcp_event_loop *loop, int fd, long long arrival,
+                      bool mayCork, bool *corked);
+   // Read a chunk of a multiplexed message (TCP_CTRL_MUX frame), and 
+   // process the message when it is complete.
+   //  return  Bytes read after the control code, -1 if the connection 
+   //          must be closed.
+  
+  int sendMuxReply(int fd, int stream, int seq, const char *outMsgBuf, 
+                   int outMsgLen, int flags, bool more);
+   // Send a reply on a stream, in chunks.
+   //  flags   Frame flags besides the end of message flag.
+   //  more    true to hold back the last chunk for more replies.
+   //  return  0 on success, -1 on error.
+  
+  void freeMuxPartial(int fd);
+   // Discard the incomplete multiplexed messages of a connection.
+  
+  int handleSubscription(struct tcp_event_loop *loop, int fd, int code);
+   // Add or remove a topic of a subscriber.
+   //  return  0 on success, -1 to close the connection.
+  
+  int flushSubscriber(int fd);
+   // Write queued messages to a subscriber until the socket is full. 
+   // Call with d_pubLock held.
+   //  return  Number of messages left in the queue.
+  
+  int pendingSubscribers(struct tcp_event_loop *loop, fd_set *writeFds);
+   // Collect subscribers of a loop with messages to write.
+   //  return  Number of subscribers in writeFds.
+  
+  void flushSubscribers(fd_set *writable, int fdMax);
+   // Write to subscribers whose sockets have room.
+  
+  void sendReject(int fd, unsigned int requestNum);
+   // Send a rejection frame to a client.
+   //  requestNum  Number of the request on the connection (from 1), or 0
+   //              if the connection itself is turned away.
+
+  int handleControl(struct tcp_event_loop *loop, int fd, int code);
+   // Process a control frame (negative length header) from a client.
+   //  fd      Client socket
+   //  code    The control code
+   //  return  0 on success, -1 if the connection must be closed.
+
+  void closeConnection(int fd);
+   // Close a client connection and release any shared memory channel 
+   // associated with it.
+   
+  static void *shmServiceEntry(void *channel);
+   // Thread function that services a shared memory channel.
+
+  static void *loopEntry(void *loop);
+   // Thread function for additional event loops.
+  
+  void runLoop(struct tcp_event_loop *loop);
+   // Service clients of an event loop. Returns on error, on handoff or 
+   // when asked to stop by stopLoops().
+  
+  void stopLoops();
+   // Stop and join all event loops except the first.
+  
+  void closeClients(struct tcp_event_loop *loop);
+   // Close the connections of a stopped event loop, including those 
+   // steered to it and not yet picked up.
+  
+  int steerConnection(int fd);
+   // Choose the event loop to service a new connection.
+   //  fd      The accepted socket
+   //  return  Index of the loop.
+  
+  int openListener(struct sockaddr *name, socklen_t nameLen, int bdp);
+   // Create a socket and listen on the given name.
+   //  return  The socket, or -1 on error.
+  
+  int attachSteeringProgram();
+   // Attach the reuseport BPF program to the listeners.
+   //  return  0 on success, -1 on error.
+  
+  int createLoops(int numLoops, const int *cpus);
+   // Allocate event loop state.
+   //  return  0 on success, -1 on error.
+  
+  void freeLoops();
+   // Release event loop state.
+
+  int handoff(fd_set *master, int fdMax);
+   // Pass the listeners (and connections) to the process waiting on 
+   // d_handoffPath. Called from doMessageCycle().
+   //  master  Set of sockets serviced by doMessageCycle()
+   //  fdMax   Largest socket in the above set
+   //  return  0 on success, -1 on failure (nothing was handed over).
+   
+  void drainListener(int fd);
+   // Accept the connections waiting on a handed over listener that no 
+   // event loop services, adopt them and close the listener.
    
   int d_fd;
    // Socket file descriptor
   
+  int d_family;
+   // Address family of the listening socket (AF_INET or AF_UNIX)
+  
+  char d_unixPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+   // Path of the listening socket if d_family is AF_UNIX
+  
   char *d_rcvBuf;
    // The receive buffer
   
@@ -144,8 +546,122 @@ class TCPServer
   bool d_init;
    // true if server initialized
 
+  pthread_mutex_t d_handlerLock;
+   // Serializes calls to receiveAndReply()
+  
+  struct tcp_shm_channel *d_shmChannels[FD_SETSIZE];
+   // Shared memory channels, indexed by client socket
+
+  struct tcp_event_loop *d_loops;
+   // Event loops
+  
+  int d_numLoops;
+   // Number of event loops
+  
+  int d_nextLoop;
+   // Next loop for connections without cpu information
+  
+  bool d_reusePort;
+   // true if each loop has a listener of its own
+  
+  bool d_serializeHandler;
+   // true if calls to receiveAndReply() are serialized
+  
+  volatile sig_atomic_t d_handoffRequested;
+   // Set by requestHandoff()
+  
+  bool d_handoffConns;
+   // true if connections are passed on handoff
+  
+  char d_handoffPath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+   // Where to pass the listener on handoff
+  
+  pthread_mutex_t d_admissionLock;
+   // Protects the CoDel state below
+  
+  int d_maxConnections;
+   // Connection limit, or 0
+  
+  int d_maxInFlight;
+   // Limit on requests being handled, or 0
+  
+  long long d_targetDelay;
+   // Target queueing delay (us), or 0
+  
+  long long d_interval;
+   // CoDel interval (us)
+  
+  volatile int d_numConnections;
+   // Current number of client connections
+  
+  volatile int d_inFlight;
+   // Requests being handled
+  
+  unsigned long d_rejectedConns;
+   // Connections rejected
+  
+  unsigned long d_rejectedReqs;
+   // Requests rejected
+  
+  long long d_firstAboveTime;
+   // CoDel: when delay above target becomes a reason to drop, or 0
+  
+  long long d_dropNext;
+   // CoDel: time of next rejection
+  
+  int d_dropCount;
+   // CoDel: rejections since entering dropping state
+  
+  bool d_dropping;
+   // CoDel: true while rejecting
+
+  struct tcp_subscriber *d_subscribers[FD_SETSIZE];
+   // Subscriber state by socket (if subscribed)
+  
+  pthread_mutex_t d_pubLock;
+   // Protects subscribers and their queues
+  
+  int d_subMax;
+   // Largest socket with a subscriber, or -1
+  
+  int d_subQueueLen;
+   // Messages queued per subscriber at most
+  
+  SubscriberPolicy d_subPolicy;
+   // Policy for slow subscribers
+  
+  unsigned long d_pubDrops;
+   // Messages dropped or replaced
+  
+  struct tcp_cache *d_cache;
+   // Response cache, or NULL
+  
+  struct tcp_mux_partial *d_muxPartial[FD_SETSIZE];
+   // Multiplexed messages still arriving, by socket (see TCPMuxClient)
+  
+  unsigned int d_requestNum[FD_SETSIZE];
+   // Requests received on each connection, to number rejections
+  
+  TCPSocketStats *d_sockStats;
+   // Measurements by socket with TCP_BDP_AUTO, or NULL
+  
+  int d_turnFrames;
+   // Messages served per client per pass
+  
+  int d_turnBytes;
+   // Bytes served per client per pass, or 0
+  
+  int *d_adoptedFds;
+   // Connections received by initFromHandoff()
+  
+  int d_numAdopted;
+   // Number of connections in above list
+
   StatusReport d_status;
    // Status reports 
+  
+  mutable pthread_mutex_t d_statusLock;
+   // Serializes status reports of event loops and service threads
 };
 
 
@@ -182,7 +698,7 @@ class TCPClient
    // This constructor initializes parameters for a connection 
    // to remote server BUT doesn't connect until sendAndReceive() is
    // called.
-   //  serverIp  IP name of the remote server.
+   //  serverIp  IP name of the remote server, or "unix:" address (see init()).
    //  port      Port address on which the remote server is listening
    //            for client connections.
    //  timeout   The sendAndReceive() function sends messages and 
@@ -205,9 +721,11 @@ class TCPClient
    
   int init(const char *serverIp, int port, struct timeval &timeout, int bdp=0);
    // Establish connection with a remote server.
-   //  serverIp  IP name of the remote server.
+   //  serverIp  IP name of the remote server, or an address of the form
+   //            "unix:/path/to/socket" to connect to a server on the same 
+   //            host over a Unix domain socket.
    //  port      Port address on which the remote server is listening
-   //            for client connections.
+   //            for client connections. Ignored for "unix:" addresses.
    //  timeout   The sendAndReceive() function sends messages and 
    //            waits for replies from the server. This parameter 
    //            sets the timeout period in waiting for a reply. If a 
@@ -221,8 +739,27 @@ class TCPClient
    //            50ms, and the link bandwidth is 100 Mbits per sec. Then your 
    //            BDP is 100e6 * 50e-3 / 8 = 625 kilo bytes. You can use the 
    //            'ping' utility to get an approx. measure for the round-trip 
-   //            time. Set this to 0 to use system defaults.
+   //            time. Set this to 0 to use system defaults, or to 
+   //            TCP_BDP_AUTO to grow the buffers beyond the kernel's own 
+   //            sizing when the round-trip time and sustained throughput
+   //            measured on the connection call for it (Linux). See 
+   //            getSocketStats().
    //  return    0 on success, -1 on error.
+   // All IPv6 and IPv4 addresses of the server are resolved (up to 
+   // TCP_CLIENT_MAX_ADDRS), and connected to in the "Happy Eyeballs" 
+   // manner: address families alternate, a new attempt starts every 
+   // 250 ms or as soon as the previous one fails, and the first to 
+   // connect is kept. The attempts give up after the connect timeout, if
+   // one is set (see setConnectTimeout()). If the addresses were resolved
+   // but no connection was made, the client keeps them, and the next call
+   // that needs the server connects again.
+
+  void setConnectTimeout(struct timeval &timeout);
+   // Set the time allowed for connecting, by init() and when reconnecting
+   // after a lost connection. Call before init().
+   //  timeout   Time to connect in. Zero (default) sets no limit: each 
+   //            attempt runs until the kernel gives up on it, as a 
+   //            blocking connect() would (about two minutes on Linux).
 
   int sendAndReceive(char *outMsgBuf, int outMsgLen, char *inMsgBuf,
                      int inBufLen, int *inMsgLen);
@@ -245,6 +782,18 @@ class TCPClient
    //  return     0 on success, -1 on error. Call getStatus....() for the
    //             error.
 
+  int sendAndReceive(char *outMsgBuf, int outMsgLen, char *inMsgBuf,
+                     int inBufLen, int *inMsgLen, 
+                     const struct timespec &deadline);
+   // As above, but the whole exchange - reconnecting if needed, sending 
+   // and receiving - must complete by an absolute \a deadline on the 
+   // CLOCK_MONOTONIC clock (see clock_gettime()), instead of each receive 
+   // getting the timeout given to init(). Sends are bounded too. On expiry 
+   // the status code is ETIMEDOUT and the connection is closed, as a late 
+   // reply would otherwise be taken for the reply to the next request. 
+   //  deadline   Time by which the call must return.
+   //  return     0 on success, -1 on error or when the deadline passed.
+
   int getStatusCode() const;
    //  return  Latest status code.
    
@@ -261,14 +810,148 @@ class TCPClient
    // if server terminates
    //  return  0 if no error, else -1
 
+  int enableShMemTransport(int maxReplySize);
+   // Request a shared memory transport from the server. If the server
+   // runs on the same host, messages are thereafter exchanged through a 
+   // shared memory region with futex based wakeups, and the TCP connection 
+   // is only used to detect that either end has gone away. The transport
+   // is negotiated again whenever the connection is re-established. 
+   // The region can only be opened by processes of the server's user.
+   // Requires Linux and a server of this version or later.
+   //  maxReplySize  Largest reply (bytes) expected from the server. Longer 
+   //                replies are reported as errors by sendAndReceive().
+   //  return        0 if the shared memory transport is in use, else -1 
+   //                (the connection remains usable over TCP).
+  
+  bool isShMemTransportActive() const;
+   //  return  true if messages currently go through shared memory.
+
+  int getSocketStats(TCPSocketStats *stats);
+   // Measure the connection and, with TCP_BDP_AUTO, resize its socket 
+   // buffers. This is also done once a second by sendAndReceive().
+   //  stats   Filled in with the measurements and buffer sizes.
+   //  return  0 on success, -1 if not connected or not measurable.
+
+  int subscribe(int topic);
+   // Ask the server to send messages published to a topic (see 
+   // TCPServer::publish()). Receive them with receivePublished(). Use a 
+   // client for subscriptions only, as published messages would get in 
+   // the way of replies to sendAndReceive(). Subscriptions are lost with
+   // the connection, so subscribe again after receivePublished() fails.
+   //  topic   Topic to subscribe to.
+   //  return  0 on success, -1 on error.
+  
+  int unsubscribe(int topic);
+   // Stop receiving messages published to a topic.
+   //  topic   Topic subscribed to earlier.
+   //  return  0 on success, -1 on error.
+  
+  int receivePublished(char *inMsgBuf, int inBufLen, int *inMsgLen, 
+                       int *topic);
+   // Wait for the next published message, at most for the timeout given 
+   // to init().
+   //  inMsgBuf  Buffer for the message.
+   //  inBufLen  Size of the above buffer.
+   //  inMsgLen  Length of the message.
+   //  topic     Topic the message was published to.
+   //  return    0 on success, -1 on error or timeout. A message that does 
+   //            not fit the buffer is skipped and reported as an error.
+
  private:
+  friend class TCPReplicaClient;
+  friend class TCPClientGroup;
+  friend class TCPMuxClient;
+  
   void setError(int code, const char *functionName);
    // Set a error report
    //  code          errno error code
    //  functionName  The unsuccessful function call
+
+  int exchange(char *outMsgBuf, int outMsgLen, char *inMsgBuf,
+               int inBufLen, int *inMsgLen, long long deadline);
+   // Common part of the sendAndReceive() overloads.
+   //  deadline  Absolute monotonic time (usec), or 0 for none.
+   //  return    0 on success, -1 on error.
+
+  int openConnection(long long deadline);
+   // Connect to one of the addresses resolved by init(), racing attempts
+   // to the addresses in turn.
+   //  deadline  Absolute monotonic time (usec) to connect by, or 0 for 
+   //            no limit.
+   //  return    0 on success, -1 on error.
+
+  int openSocket(int family);
+   // Create a non-blocking socket with the options of this client.
+   //  return  The socket, or -1 on error.
+
+  int ensureConnected(long long deadline = 0);
+   // Connect again if the connection was lost.
+   //  return  0 on success, -1 on error.
+  
+  void dropConnection();
+   // Close the connection. The next call reconnects.
+  
+  int waitSocket(short events, long long deadline, const char *functionName);
+   // Wait until the socket is ready for \a events or the deadline passes.
+   //  return  0 when ready, -1 on timeout (ETIMEDOUT) or error.
+  
+  int transfer(bool out, char *buf, int len, long long deadline);
+   // Send or receive exactly \a len bytes before the deadline.
+   //  return  0 on success, -1 on error or timeout.
+  
+  int sendRequest(const char *outMsgBuf, int outMsgLen, long long deadline = 0);
+   // Send a message over TCP (first half of sendAndReceive()).
+   //  deadline  Absolute monotonic time (usec), or 0 for none.
+   //  return    0 on success, -1 on error.
+  
+  int receiveReply(char *inMsgBuf, int inBufLen, int *inMsgLen, 
+                   long long deadline = 0);
+   // Receive a reply over TCP (second half of sendAndReceive()).
+   //  deadline  Absolute monotonic time (usec), or 0 for the init() 
+   //            timeout on each receive.
+   //  return    0 on success, -1 on error.
+  
+  int sendSubscription(int code, int topic);
+   // Send a subscribe or unsubscribe control frame.
+   //  return  0 on success, -1 on error.
+  
+  int receiveInt(int *value, long long deadline);
+   // Receive an int, by the deadline if not 0.
+   //  return  0 on success, -1 on error (the connection is dropped).
+  
+  int discardReply();
+   // Read and throw away a reply if one is available, without blocking.
+   //  return  0 if a reply was discarded, 1 if none is available yet, 
+   //          -1 if the connection was lost.
+
+  int negotiateShMem();
+   // Ask the server for a shared memory channel on the current connection.
+   //  return  0 on success, -1 on failure.
+
+  int shmSendAndReceive(char *outMsgBuf, int outMsgLen, char *inMsgBuf,
+                        int inBufLen, int *inMsgLen, long long deadline = 0);
+   // sendAndReceive() over the shared memory channel.
+
+  int waitShMemReply(long long deadline = 0);
+   // Wait until the server has finished with the last request.
+   //  deadline  Absolute monotonic time (usec), or 0 for the init() timeout.
+   //  return    0 on success, -1 on timeout or if the channel was closed.
+
+  void closeShMem();
+   // Release the shared memory channel.
  
-  struct sockaddr_in d_server;
-   // server to connect to.
+  struct sockaddr_storage d_addrs[TCP_CLIENT_MAX_ADDRS];
+   // server addresses to connect to (AF_INET, AF_INET6 or AF_UNIX), in 
+   // the order of trying. Once connected, that address is moved first.
+  
+  socklen_t d_addrLens[TCP_CLIENT_MAX_ADDRS];
+   // lengths of the above addresses
+  
+  int d_numAddrs;
+   // number of addresses above
+  
+  long long d_connectTimeout;
+   // time allowed for connecting (usec), 0 for the kernel's own limit
   
   char *d_serverName;
    // server name
@@ -284,10 +967,299 @@ class TCPClient
   
   struct timeval d_recvTimeout;
    // receive timeout 
+  
+  TCPSocketStats d_sockStats;
+   // latest measurements of the connection
+  
+  long long d_nextTune;
+   // when to measure the connection again (TCP_BDP_AUTO)
+  
+  unsigned int d_requestNum;
+   // Requests sent on the connection, to match rejections
+  
+  unsigned int d_lastAnswered;
+   // Latest request whose reply or rejection was read
     
   bool d_init;
    // true if client initialized
  
+  bool d_shmWanted;
+   // true if the shared memory transport was requested
+  
+  int d_shmMaxReply;
+   // largest expected reply over shared memory
+  
+  int d_shmReqCap;
+   // largest request the server accepts over shared memory
+  
+  ShMem *d_shm;
+   // shared memory object for the channel
+  
+  struct tcp_shm_region *d_shmRegion;
+   // the mapped channel, or NULL if not in use
+  
+  bool d_shmPending;
+   // true if a request was sent without waiting for its reply
+ 
+  StatusReport d_status;
+   // Error reports 
+ 
+ //======== END OF INTERFACE ========
+};
+
+
+
+//==============================================================================
+// class TCPReplicaClient
+//------------------------------------------------------------------------------
+// \brief
+// A client for a set of replicated servers.
+// 
+// Holds a connection to each of several servers that give the same answers 
+// (see TCPClient). Each request goes to the replica with the lowest average
+// latency (an exponentially weighted moving average of its reply times). 
+// Replicas that fail repeatedly are left out for a while. If hedging is 
+// enabled and no reply arrives within the 95th percentile of recent reply 
+// times, the request is also sent to the next best replica and the first 
+// reply wins. This trades a few percent of extra requests for a much 
+// shorter tail when one replica stalls. Only use hedging for requests 
+// that are safe to execute twice.
+//
+// <b>Example Program:</b>
+// \code
+// const char *hosts[] = {"10.0.0.1", "10.0.0.2", "10.0.0.3"};
+// int ports[] = {5000, 5000, 5000};
+// struct timeval timeout = {1, 0};
+// TCPReplicaClient client;
+// client.init(hosts, ports, 3, timeout);
+// client.setHedging(true);
+// client.sendAndReceive(msg, msgLen, reply, sizeof(reply), &replyLen);
+// \endcode
+//==============================================================================
+
+class TCPReplicaClient
+{
+ public:
+  TCPReplicaClient();
+   // The default constructor. Does nothing.
+  
+  ~TCPReplicaClient();
+   // The destructor. Cleans up.
+  
+  int init(const char * const *serverIps, const int *ports, int numServers, 
+           struct timeval &timeout, int bdp=0);
+   // Set the replicas and connect to them. A replica that is down is 
+   // connected to again once its back-off has passed.
+   //  serverIps   IP names (or "unix:" addresses) of the servers.
+   //  ports       Ports of the servers.
+   //  numServers  Number of servers in the above arrays.
+   //  timeout     Longest time sendAndReceive() waits for a reply.
+   //  bdp         See TCPClient.
+   //  return      0 on success, -1 on error.
+  
+  int setHedging(bool enable, int minDelay=1000);
+   // Send a second copy of a request to another replica when the first
+   // is late.
+   //  enable    true to enable hedged requests.
+   //  minDelay  Shortest wait (microseconds) before hedging. The wait is 
+   //            the 95th percentile of recent reply times, but not less 
+   //            than this.
+   //  return    0 on success, -1 on error.
+  
+  int sendAndReceive(char *outMsgBuf, int outMsgLen, char *inMsgBuf,
+                     int inBufLen, int *inMsgLen);
+   // Send a message to the best replica and receive a reply. If the
+   // replica fails, the message is sent to the next one. Parameters are
+   // as in TCPClient::sendAndReceive().
+   //  return  0 on success, -1 on error. Call getStatus....() for the
+   //          error.
+  
+  int getLatency(int replica) const;
+   //  replica  Index of a replica (order as given to init()).
+   //  return   Average reply time (microseconds) of the replica, or -1 
+   //           if not known.
+  
+  unsigned long getHedgeCount() const;
+   //  return  Number of hedged requests sent so far.
+
+  int getStatusCode() const;
+   //  return  Latest status code.
+   
+  const char *getStatusMessage() const;
+   //  return  Latest error status report.
+   
+ private:
+  int pickReplica(long long now);
+   // Select the healthy replica with the lowest average latency that 
+   // has not been tried for the current request.
+   //  now     Current time (monotonic, microseconds)
+   //  return  Index of replica, or -1 if none is available.
+  
+  int startRequest(long long now, const char *outMsgBuf, int outMsgLen);
+   // Send a message to the best replica, or the next one if that fails.
+   //  return  Index of replica, or -1 if no replica took the message.
+  
+  void recordLatency(int replica, long long now, bool success);
+   // Update latency statistics of a replica after a reply or failure.
+  
+  void freeReplicas();
+   // Release all replicas.
+  
+  struct tcp_replica *d_replicas;
+   // the replicas
+  
+  int d_numReplicas;
+   // number of replicas
+  
+  struct timeval d_timeout;
+   // reply timeout
+  
+  bool d_hedging;
+   // true if hedged requests are enabled
+  
+  int d_hedgeMinDelay;
+   // shortest hedging delay (us)
+  
+  unsigned long d_hedgeCount;
+   // hedged requests sent
+  
+  int *d_samples;
+   // recent reply times (us), a ring buffer
+  
+  int d_numSamples;
+   // samples recorded so far
+  
+  int d_p95;
+   // 95th percentile of the samples (us)
+  
+  StatusReport d_status;
+   // Error reports 
+ 
+ //======== END OF INTERFACE ========
+};
+
+
+//==============================================================================
+// class TCPClientGroup
+//------------------------------------------------------------------------------
+// \brief
+// Scatter/gather requests over a group of servers from a single thread.
+// 
+// Holds a connection to each server of the group (see TCPClient). scatter()
+// sends a request to all or some of the members without waiting, and 
+// gather() returns the replies one by one in the order they arrive, so a 
+// fan-out to many servers takes about one round trip instead of one per 
+// server. A round ends when every member has answered, when a quorum of 
+// replies has been received, or at the deadline, whichever comes first. 
+// Replies that arrive after their round ended are thrown away.
+//
+// <b>Example Program:</b>
+// \code
+// TCPClientGroup group;
+// group.init(hosts, ports, 40, timeout);
+// group.scatter(query, queryLen, 30, 20000); // 30 replies or 20 ms
+// int member;
+// while( group.gather(reply, sizeof(reply), &replyLen, &member) == 1 )
+//  merge(member, reply, replyLen);
+// \endcode
+//==============================================================================
+
+class TCPClientGroup
+{
+ public:
+  TCPClientGroup();
+   // The default constructor. Does nothing.
+  
+  ~TCPClientGroup();
+   // The destructor. Cleans up.
+  
+  int init(const char * const *serverIps, const int *ports, int numServers, 
+           struct timeval &timeout, int bdp=0);
+   // Set the members of the group and connect to them. A member that is
+   // down is connected to again by every scatter() that includes it.
+   //  serverIps   IP names (or "unix:" addresses) of the servers.
+   //  ports       Ports of the servers.
+   //  numServers  Number of servers in the above arrays.
+   //  timeout     Deadline for a round if scatter() is not given one.
+   //  bdp         See TCPClient.
+   //  return      0 on success, -1 on error.
+  
+  int getSize() const;
+   //  return  Number of members.
+  
+  int scatter(const char *outMsgBuf, int outMsgLen, int quorum=0, 
+              int deadline=0, const int *members=NULL, int numMembers=0);
+   // Start a round by sending a message to members of the group. Any 
+   // replies left over from the previous round are thrown away.
+   //  outMsgBuf   Message to send.
+   //  outMsgLen   Length of message.
+   //  quorum      Round ends after this many replies, or 0 to wait for all.
+   //  deadline    Round ends after this time (microseconds) from now, or 0
+   //              for the timeout given to init().
+   //  members     Indices of members to send to, or NULL for all.
+   //  numMembers  Number of indices in the above array.
+   //  return      Number of members the message was sent to, -1 on error.
+  
+  int gather(char *inMsgBuf, int inBufLen, int *inMsgLen, int *member);
+   // Wait for the next reply of the current round.
+   //  inMsgBuf  Buffer for the reply.
+   //  inBufLen  Size of the above buffer.
+   //  inMsgLen  Length of the reply.
+   //  member    Index of the member that replied.
+   //  return    1 when a reply was received, 0 when the round has ended 
+   //            (see getNumReplies() and getNumFailures()), -1 on error.
+  
+  int getNumReplies() const;
+   //  return  Replies received in the current round.
+  
+  int getNumFailures() const;
+   // Members whose connection failed in the current round, or that did 
+   // not answer in time.
+   //  return  Number of failed members.
+
+  int getStatusCode() const;
+   //  return  Latest status code.
+   
+  const char *getStatusMessage() const;
+   //  return  Latest error status report.
+   
+ private:
+  void endRound();
+   // Give up on members that have not answered yet.
+  
+  void freeMembers();
+   // Release all members.
+  
+  struct tcp_group_member *d_members;
+   // the members
+  
+  int d_numMembers;
+   // number of members
+  
+  struct timeval d_timeout;
+   // default round deadline
+  
+  struct pollfd *d_pollFds;
+   // poll list, one entry per member
+  
+  int *d_pollMembers;
+   // member for each entry of the above list
+  
+  int d_numWaiting;
+   // members yet to answer in the current round
+  
+  int d_numReplies;
+   // replies in the current round
+  
+  int d_numFailures;
+   // failures in the current round
+  
+  int d_quorum;
+   // replies that end the round, or 0
+  
+  long long d_deadline;
+   // end of current round (monotonic, microseconds)
+  
   StatusReport d_status;
    // Error reports 
  
@@ -295,5 +1267,134 @@ class TCPClient
 };
 
 
+//==============================================================================
+// class TCPMuxClient
+//------------------------------------------------------------------------------
+// \brief
+// Many independent conversations with one server over a single connection.
+// 
+// Each conversation is a stream opened with openStream(). Threads may call
+// sendAndReceive() at the same time, each on a stream of its own. Messages
+// are sent as chunks tagged with the stream, and chunks of different 
+// streams are interleaved, so a small request does not wait behind a large
+// one being sent. The server reassembles each message, and replies on the 
+// same stream. While threads wait for replies, one of them at a time reads 
+// from the connection and hands each chunk to the stream it belongs to.
+// The server drops a connection whose unfinished messages take more than
+// TCP_MUX_MAX_PARTIAL bytes (or one receive buffer, if larger).
+// Requires a TCPServer of this version or later.
+//
+// <b>Example Program:</b>
+// \code
+// struct timeval timeout = {1, 0};
+// TCPMuxClient client;
+// client.init("10.0.0.1", 5000, timeout);
+// int stream = client.openStream(); // one per thread
+// client.sendAndReceive(stream, msg, msgLen, reply, sizeof(reply), &replyLen);
+// client.closeStream(stream);
+// \endcode
+// A complete program, small messages alongside large ones: 
+// \include TCPMux.t.cpp
+//==============================================================================
+
+class TCPMuxClient
+{
+ public:
+  TCPMuxClient();
+   // The default constructor. Does nothing.
+  
+  ~TCPMuxClient();
+   // The destructor. Cleans up.
+  
+  int init(const char *serverIp, int port, struct timeval &timeout, int bdp=0);
+   // Connect to the server. Parameters are as in TCPClient::init(). If the
+   // server can not be reached yet, sendAndReceive() connects again.
+   //  timeout   Longest time sendAndReceive() waits for a reply.
+   //  return    0 on success, -1 on error.
+  
+  int setChunkSize(int chunkSize);
+   // Set the size messages are cut into. Smaller chunks let other 
+   // streams in sooner, larger ones cost fewer system calls.
+   //  chunkSize  Bytes per chunk (default 16384).
+   //  return     0 on success, -1 on error.
+  
+  int openStream();
+   //  return  A new stream, or -1 if all TCP_MUX_MAX_STREAMS are open.
+  
+  int closeStream(int stream);
+   // Release a stream that is not in use.
+   //  return  0 on success, -1 on error.
+  
+  int sendAndReceive(int stream, char *outMsgBuf, int outMsgLen, 
+                     char *inMsgBuf, int inBufLen, int *inMsgLen);
+   // Send a message on a stream and receive the reply. Only one call at 
+   // a time per stream. Parameters are as in TCPClient::sendAndReceive().
+   // The connection is re-established if it was lost.
+   //  stream  Stream from openStream().
+   //  return  0 on success, -1 on error. Call getStatus....() for the
+   //          error, which is the latest of any stream.
+  
+  int getStatusCode() const;
+   //  return  Latest status code.
+   
+  const char *getStatusMessage() const;
+   //  return  Latest error status report.
+   
+ private:
+  int reconnect();
+   // Replace a failed connection. Called with both locks held.
+   //  return  0 on success, -1 on error.
+  
+  int readFrame(long long deadline);
+   // Read one chunk from the connection, waiting until the deadline at 
+   // most, and pass it to its stream. Called by the reading thread.
+   //  return  0 on success or timeout, -1 if the connection failed.
+  
+  void failConnection(int generation, int code, const char *functionName);
+   // Mark the connection broken and fail the streams waiting on it.
+   //  generation  Connection the error occurred on.
+  
+  TCPClient d_client;
+   // The connection
+  
+  struct tcp_mux_slot *d_slots;
+   // Streams (stream n in slot n - 1)
+  
+  struct timeval d_timeout;
+   // reply timeout
+  
+  int d_chunkSize;
+   // bytes per chunk sent
+  
+  char *d_scratch;
+   // chunk being read
+  
+  int d_scratchSize;
+   // size of the above buffer
+  
+  bool d_reading;
+   // true while a thread reads from the connection
+  
+  bool d_broken;
+   // true if the connection failed
+  
+  int d_generation;
+   // incremented on each new connection
+  
+  pthread_mutex_t d_lock;
+   // Protects the streams and the state above
+  
+  pthread_mutex_t d_writeLock;
+   // Serializes chunks written to the connection
+  
+  pthread_cond_t d_cond;
+   // Signalled when a reply completes or the reading thread is done
+  
+  StatusReport d_status;
+   // Error reports 
+ 
+ //======== END OF INTERFACE ========
+};
+
 
 #endif // _TCPCLIENTSERVER_HPP_INCLUDED
@@ -8,6 +8,633 @@
 
 #include "UDPClientServer.hpp"
 #include <cstring>
+#include <climits>
+#include <time.h>
+#include <poll.h>
+#include <netinet/udp.h>
+#include <net/if.h>
+
+//==============================================================================
+// Wire format
+//------------------------------------------------------------------------------
+// A datagram carries one message. Optionally it starts with a udp_seq_header
+// (UDP_CTRL_SEQ and a sequence number, host byte order), which the server
+// strips before calling receiveAndReply() and puts in front of the reply.
+// The client uses it to match replies to requests (see 
+// UDPClient::sendRequest()).
+//
+// Reliable delivery: Packets of a UDPReliableClient start with a 
+// udp_rel_header (UDP_CTRL_REL). The client sends messages flagged 
+// UDP_REL_DATA, numbered from 0 per connection number (a new number resets
+// the server state of the client), with the oldest number it still needs in 
+// ack. Unreliable messages are flagged UDP_REL_UNRELIABLE and numbered 
+// separately. The server answers each packet with an acknowledgement 
+// (UDP_REL_ACK) or, once the message was handled, with its reply 
+// (UDP_REL_REPLY, or UDP_REL_NOREPLY without payload). Both carry the 
+// lowest number not received in ack, a bitmap of the received numbers 
+// above it in sack, and the messages in flight the server accepts in 
+// window (UDP_REL_WINDOW less the messages it holds back for order).
+//
+// Fragmentation: A message too long for one datagram (sequence header 
+// included) is sent as datagrams that each start with a udp_frag_header
+// (UDP_CTRL_FRAG, the message number chosen by the sender, the message 
+// length, the offset of the fragment in the message and the fragment 
+// length). All fragments but the last are of the fragment length. A reply 
+// to a fragmented message that is too long for one datagram goes back in 
+// fragments of the same length and with the same message number.
+//==============================================================================
+
+#ifdef __linux__
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103             // kernel headers older than 4.18
+#define UDP_GRO 104
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#endif
+#define UDP_GRO_BUFSIZE 65536       // largest datagram coalesced by GRO
+#define UDP_GSO_MAXSEGS 64          // segments per send with UDP_SEGMENT
+#define UDP_MAX_PAYLOAD 65507       // largest UDP/IPv4 payload
+#define UDP_CONTROL_LEN (CMSG_SPACE(sizeof(int)) + \
+        CMSG_SPACE(sizeof(struct timespec)) + \
+        CMSG_SPACE(sizeof(unsigned int))) // ancillary data per packet
+#define UDP_CTRL_SEQ (-0x55535131)  // control code: sequence header
+#define UDP_SEQ_HDRLEN ((int)sizeof(struct udp_seq_header))
+#define UDP_MAX_PENDING 1024        // requests outstanding per client
+#define UDP_CTRL_REL (-0x55524c31)  // control code: reliable delivery header
+#define UDP_HDR_ROOM ((int)sizeof(struct udp_rel_header)) // largest header
+#define UDP_REL_DATA 1              // flag: message from the client
+#define UDP_REL_ORDERED 2           // flag: deliver in order
+#define UDP_REL_UNRELIABLE 4        // flag: not retransmitted
+#define UDP_REL_ACK 8               // flag: acknowledgement only
+#define UDP_REL_REPLY 16            // flag: reply to the message
+#define UDP_REL_NOREPLY 32          // flag: message handled, no reply
+#define UDP_REL_HELD 64             // flag: message was held back
+#define UDP_REL_HISTORY (2 * UDP_REL_WINDOW) // messages a server remembers
+#define UDP_REL_MAX_PEERS 64        // clients a server remembers
+#define UDP_REL_MAX_REPLIES 16      // unreliable replies a client keeps
+#define UDP_REL_MAX_RETRIES 10      // unanswered resends before giving up
+#define UDP_REL_DUP_THRESH 3        // later acks before a fast retransmit
+#define UDP_REL_INITIAL_RTO 250000  // timeout before an RTT sample (us)
+#define UDP_REL_MIN_RTO 2000        // timeout bounds (us)
+#define UDP_REL_MAX_RTO 1000000
+#define UDP_CTRL_FRAG (-0x55465231) // control code: fragment header
+#define UDP_FRAG_HDRLEN ((int)sizeof(struct udp_frag_header))
+#define UDP_FRAG_MIN 64             // smallest fragment (header included)
+#define UDP_FRAG_MAX 8972           // largest fragment, for 9000 byte MTUs
+#define UDP_FRAG_DEFAULT 1472       // fragment if the path MTU is unknown
+#define UDP_FRAG_BATCH 64           // fragments per sendmmsg()
+#define UDP_FRAG_CLIENT_MSGS 8      // replies a client reassembles at once
+#define UDP_FRAG_CLIENT_MAX (64 << 20) // longest reply a client reassembles
+#define UDP_RATE_GROUP 8            // rate table entries probed per address
+
+// header of a sequenced request or reply
+struct udp_seq_header
+{
+ int code;                    // UDP_CTRL_SEQ
+ unsigned int seq;            // request number
+};
+
+// header of a packet of a reliable connection
+struct udp_rel_header
+{
+ int code;                    // UDP_CTRL_REL
+ unsigned int conn;           // connection number
+ unsigned int seq;            // message number
+ unsigned int ack;            // client: oldest needed, server: first missing
+ unsigned long long sack;     // server: bit i set if ack + 1 + i received
+ unsigned short flags;        // UDP_REL_...
+ unsigned short window;       // server: messages in flight accepted
+};
+
+// header of a fragment of a message
+struct udp_frag_header
+{
+ int code;                    // UDP_CTRL_FRAG
+ unsigned int msgId;          // message number
+ unsigned int total;          // message length
+ unsigned int offset;         // position of the fragment in the message
+ unsigned int fragSize;       // data per fragment, the last may be shorter
+};
+
+// a message being reassembled
+struct udp_frag_partial
+{
+ bool inUse;
+ struct sockaddr_in from;
+ unsigned int msgId;
+ unsigned int total;
+ unsigned int fragSize;
+ int missing;                 // fragments not received yet
+ long long lastSeen;          // us, monotonic clock
+ char *buf;                   // the message, kept bytes of it
+ int bufCap;
+ unsigned char *received;     // bit per fragment
+ int receivedCap;
+};
+
+// messages being reassembled (see UDPServer::setReassembly)
+struct udp_frag_table
+{
+ struct udp_frag_partial *parts;
+ int size;                    // messages at once
+ unsigned int maxMsgSize;     // longer ones are dropped
+ int keep;                    // bytes kept of each message, 0 for all
+ long long timeout;           // us after the last fragment to drop one, 0 never
+};
+
+// rate limit state of a client address. The token bucket is kept as the
+// time it is full again (GCRA), so one compare-and-swap updates it.
+struct udp_rate_entry
+{
+ unsigned int addr;           // client address, 0 if free
+ unsigned int unused;
+ long long full;              // ns, monotonic clock
+};
+
+// client addresses of a rate limited server (see UDPServer::setRateLimit)
+struct udp_rate_table
+{
+ struct udp_rate_entry *entries;
+ unsigned int mask;           // entries - 1, entries a power of two
+ long long interval;          // ns per packet at the allowed rate
+ long long tolerance;         // ns the bucket may be ahead, for the burst
+};
+
+// a message remembered by the server
+struct udp_rel_entry
+{
+ unsigned int seq;
+ int state;                   // 0 empty, 1 held back, 2 handled
+ bool ordered;
+ char *msg;                   // held message
+ int msgLen;
+ int msgCap;
+ char *reply;                 // reply, or NULL if none
+ int replyLen;
+ int replyCap;
+};
+
+// server state of a UDPReliableClient
+struct udp_rel_peer
+{
+ struct sockaddr_in addr;
+ unsigned int conn;
+ unsigned int next;           // lowest number not received
+ long long lastSeen;          // us, monotonic clock
+ int users;                   // threads servicing the peer (d_relLock)
+ pthread_mutex_t lock;        // held while servicing the peer
+ struct udp_rel_entry entries[UDP_REL_HISTORY]; // by number modulo
+};
+
+// a reliable message of a UDPReliableClient
+struct udp_rel_slot
+{
+ bool inUse;
+ unsigned int seq;
+ unsigned int id;
+ bool ordered;
+ char *msg;
+ int msgLen;
+ int msgCap;
+ long long sent;              // last sent (us, monotonic clock)
+ long long due;               // next resend
+ int sends;                   // times sent
+ int silent;                  // resends in a row the server did not answer
+ bool sampled;                // true once an RTT sample was taken
+ bool received;               // acknowledged by the server
+ bool fastResent;             // resent after later acks
+ bool complete;               // handled by the server
+ bool hasReply;               // reply waiting for receive()
+ char *reply;
+ int replyLen;
+ int replyCap;
+};
+
+// a reply to an unreliable message
+struct udp_rel_reply
+{
+ unsigned int id;
+ char *data;
+ int len;
+};
+
+// a request waiting for its reply (see UDPClient::sendRequest)
+struct udp_pending
+{
+ unsigned int seq;
+ long long sent;              // time sent (us, monotonic clock)
+ bool busy;                   // true while the reply is awaited
+};
+
+// buffers for one batch of packets (see UDPServer::setBatchSize)
+struct udp_batch
+{
+ int size;                    // packets per batch
+ int rcvSize;                 // bytes per packet received
+ int sndSize;                 // bytes per reply
+ char *rcvBufs;               // received packets, rcvSize apart
+ char *sndBufs;               // copies of the replies, sndSize apart
+ char *control;               // ancillary data with GRO, or NULL
+ struct iovec *rcvIov;
+ struct iovec *sndIov;
+ struct sockaddr_in *peers;   // senders of the received packets
+#ifdef __linux__
+ struct mmsghdr *rcvMsgs;
+ struct mmsghdr *sndMsgs;
+#endif
+};
+
+// one receive thread and its socket (see UDPServer::setReceiveThreads)
+struct udp_receiver
+{
+ UDPServer *server;
+ int index;                   // 0 runs in the thread calling doMessageCycle()
+ int cpu;                     // cpu to run on, or -1
+ int fd;                      // socket bound to the server port
+ char *rcvBuf;                // receive buffer
+ char *fragBuf;               // the last message reassembled, or NULL
+ int fragCap;                 // size of the above
+ unsigned long dropped;       // packets over the rate limit
+ unsigned long evicted;       // rate limited addresses forgotten early
+ unsigned int socketDrops;    // packets the kernel dropped (SO_RXQ_OVFL)
+ struct udp_batch *batch;     // batch buffers, or NULL
+ pthread_t thread;
+ bool running;                // true if thread was started
+};
+
+static long long monotonicUs()
+{
+ struct timespec now;
+ clock_gettime(CLOCK_MONOTONIC, &now);
+ return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static long long deadlineAfter(long long timeout)
+{
+ // a timeout of 0 never passes
+ return timeout ? monotonicUs() + timeout : LLONG_MAX;
+}
+
+static long long clockNs(clockid_t clock)
+{
+ struct timespec now;
+ clock_gettime(clock, &now);
+ return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// add a sample to a histogram shared by the receive threads
+static void recordLatency(UDPLatencyHistogram *h, long long ns)
+{
+ if( ns < 0 )
+  ns = 0;
+ int i = 63 - __builtin_clzll((unsigned long long)ns | 1);
+ if( i >= UDP_HIST_BUCKETS )
+  i = UDP_HIST_BUCKETS - 1;
+ __sync_fetch_and_add(&h->count[i], 1);
+ __sync_fetch_and_add(&h->samples, 1);
+ __sync_fetch_and_add(&h->totalNs, (unsigned long long)ns);
+ unsigned long long max = h->maxNs;
+ while( ((unsigned long long)ns > max) && 
+        !__sync_bool_compare_and_swap(&h->maxNs, max, (unsigned long long)ns) )
+  max = h->maxNs;
+}
+
+// length of the sequence header at the start of a message (0 if none)
+static int readSeqHeader(const char *msg, int msgLen, struct udp_seq_header *hdr)
+{
+ if( msgLen < UDP_SEQ_HDRLEN )
+  return 0;
+ memcpy(hdr, msg, UDP_SEQ_HDRLEN);
+ return (hdr->code == UDP_CTRL_SEQ) ? UDP_SEQ_HDRLEN : 0;
+}
+
+// the fragment header at the start of a packet, if it is a valid one
+static int readFragHeader(const char *pkt, int pktLen, struct udp_frag_header *hdr)
+{
+ if( pktLen < UDP_FRAG_HDRLEN )
+  return 0;
+ memcpy(hdr, pkt, UDP_FRAG_HDRLEN);
+ unsigned int len = pktLen - UDP_FRAG_HDRLEN;
+ if( (hdr->code != UDP_CTRL_FRAG) || (hdr->fragSize == 0) || (hdr->total == 0)
+     || (hdr->offset % hdr->fragSize != 0) || (hdr->offset >= hdr->total)
+     || (len > hdr->total - hdr->offset) )
+  return 0;
+ 
+ // all but the last fragment are full
+ return (len == hdr->fragSize) || (hdr->offset + len == hdr->total);
+}
+
+static struct udp_frag_table *newFragTable(int size, unsigned int maxMsgSize, 
+                                           long long timeout)
+{
+ struct udp_frag_table *t = (struct udp_frag_table *)calloc(1, sizeof(*t));
+ if( t == NULL )
+  return NULL;
+ t->parts = (struct udp_frag_partial *)calloc(size, sizeof(struct udp_frag_partial));
+ if( t->parts == NULL )
+ {
+  free(t);
+  return NULL;
+ }
+ t->size = size;
+ t->maxMsgSize = maxMsgSize;
+ t->timeout = timeout;
+ return t;
+}
+
+static void freeFragTable(struct udp_frag_table *t)
+{
+ if( t == NULL )
+  return;
+ for(int k = 0; k < t->size; k++)
+ {
+  free(t->parts[k].buf);
+  free(t->parts[k].received);
+ }
+ free(t->parts);
+ free(t);
+}
+
+// Add a fragment to its message. Messages are found by sender and number.
+// A new one takes a free place, or that of the message that has waited 
+// longest for a fragment; the buffers stay allocated for the next one.
+// Returns the message once it is complete, else NULL. The caller frees
+// its place (inUse).
+static struct udp_frag_partial *addFragment(struct udp_frag_table *t, 
+                                            const struct sockaddr_in *from,
+                                            const struct udp_frag_header *hdr,
+                                            const char *data, int len, 
+                                            long long now)
+{
+ if( hdr->total > t->maxMsgSize )
+  return NULL;
+ struct udp_frag_partial *p = NULL, *oldest = NULL;
+ for(int k = 0; k < t->size; k++)
+ {
+  struct udp_frag_partial *q = &t->parts[k];
+  if( !q->inUse )
+  {
+   if( (oldest == NULL) || oldest->inUse )
+    oldest = q;
+   continue;
+  }
+  if( (q->msgId == hdr->msgId) && (q->from.sin_port == from->sin_port)
+      && (q->from.sin_addr.s_addr == from->sin_addr.s_addr) )
+  {
+   p = q;
+   break;
+  }
+  if( (oldest == NULL) || (oldest->inUse && (q->lastSeen < oldest->lastSeen)) )
+   oldest = q;
+ }
+ 
+ // a stale or different message of the same number starts over
+ if( (p != NULL) && ((p->total != hdr->total) || (p->fragSize != hdr->fragSize)
+     || ((t->timeout > 0) && (now - p->lastSeen > t->timeout))) )
+  p->inUse = false;
+ if( (p == NULL) || !p->inUse )
+ {
+  if( p == NULL )
+   p = oldest;
+  int keep = ((t->keep > 0) && (hdr->total > (unsigned int)t->keep)) 
+             ? t->keep : (int)hdr->total;
+  int numFrags = (hdr->total - 1) / hdr->fragSize + 1;
+  int mapLen = (numFrags + 7) / 8;
+  if( p->bufCap < keep )
+  {
+   char *buf = (char *)realloc(p->buf, keep);
+   if( buf == NULL )
+    return NULL;
+   p->buf = buf;
+   p->bufCap = keep;
+  }
+  if( p->receivedCap < mapLen )
+  {
+   unsigned char *map = (unsigned char *)realloc(p->received, mapLen);
+   if( map == NULL )
+    return NULL;
+   p->received = map;
+   p->receivedCap = mapLen;
+  }
+  memset(p->received, 0, mapLen);
+  p->inUse = true;
+  p->from = *from;
+  p->msgId = hdr->msgId;
+  p->total = hdr->total;
+  p->fragSize = hdr->fragSize;
+  p->missing = numFrags;
+ }
+ p->lastSeen = now;
+ 
+ // duplicates are ignored, bytes past the kept ones are not stored
+ unsigned int index = hdr->offset / hdr->fragSize;
+ if( p->received[index / 8] & (1 << (index % 8)) )
+  return NULL;
+ p->received[index / 8] |= (1 << (index % 8));
+ int keep = (p->bufCap < (int)p->total) ? p->bufCap : (int)p->total;
+ if( (int)hdr->offset < keep )
+  memcpy(p->buf + hdr->offset, data, 
+         ((int)hdr->offset + len > keep) ? keep - (int)hdr->offset : len);
+ return (--p->missing == 0) ? p : NULL;
+}
+
+// Send a message in fragments of fragLen bytes (header included). The 
+// message is hdrLen bytes of header followed by msg.
+static int sendFragments(int fd, const void *hdr, int hdrLen, const char *msg, 
+                         int msgLen, unsigned int msgId, int fragLen,
+                         struct sockaddr_in *to, socklen_t toLen)
+{
+ struct udp_frag_header fh[UDP_FRAG_BATCH];
+ struct iovec iov[UDP_FRAG_BATCH][3];
+ struct msghdr m[UDP_FRAG_BATCH];
+ int total = hdrLen + msgLen;
+ int dataLen = fragLen - UDP_FRAG_HDRLEN;
+ int offset = 0;
+ while( offset < total )
+ {
+  // a fragment may take the rest of the header and the start of msg
+  int n = 0;
+  for(; (n < UDP_FRAG_BATCH) && (offset < total); n++)
+  {
+   int len = (total - offset < dataLen) ? total - offset : dataLen;
+   int k = 0;
+   fh[n].code = UDP_CTRL_FRAG;
+   fh[n].msgId = msgId;
+   fh[n].total = total;
+   fh[n].offset = offset;
+   fh[n].fragSize = dataLen;
+   iov[n][k].iov_base = &fh[n];
+   iov[n][k++].iov_len = UDP_FRAG_HDRLEN;
+   if( offset < hdrLen )
+   {
+    iov[n][k].iov_base = (char *)hdr + offset;
+    iov[n][k++].iov_len = (hdrLen - offset < len) ? hdrLen - offset : len;
+   }
+   if( offset + len > hdrLen )
+   {
+    int start = (offset > hdrLen) ? offset - hdrLen : 0;
+    iov[n][k].iov_base = (void *)(msg + start);
+    iov[n][k++].iov_len = offset + len - hdrLen - start;
+   }
+   memset(&m[n], 0, sizeof(struct msghdr));
+   m[n].msg_name = to;
+   m[n].msg_namelen = toLen;
+   m[n].msg_iov = iov[n];
+   m[n].msg_iovlen = k;
+   offset += len;
+  }
+  
+#ifdef __linux__
+  struct mmsghdr mm[UDP_FRAG_BATCH];
+  for(int i = 0; i < n; i++)
+  {
+   mm[i].msg_hdr = m[i];
+   mm[i].msg_len = 0;
+  }
+  int sent = 0;
+  while( sent < n )
+  {
+   int k = sendmmsg(fd, &mm[sent], n - sent, 0);
+   if( k == -1 )
+   {
+    if( errno == EINTR )
+     continue;
+    return -1;
+   }
+   sent += k;
+  }
+#else
+  for(int i = 0; i < n; i++)
+  {
+   if( sendmsg(fd, &m[i], 0) == -1 )
+    return -1;
+  }
+#endif
+ }
+ return 0;
+}
+
+// Charge a packet to the bucket of its client address. Addresses are 
+// looked up in a group of UDP_RATE_GROUP entries; a new one takes the entry
+// that is full again soonest (free ones are). Races between receive 
+// threads may charge a packet to the wrong address, never block.
+// Returns 1 if the packet is within the limit, 0 to drop it.
+static int rateAllowed(struct udp_rate_table *t, unsigned int addr, long long now,
+                       unsigned long *evicted)
+{
+ if( addr == 0 )
+  return 1;
+ unsigned int h = (unsigned int)(((unsigned long long)addr * 0x9E3779B97F4A7C15ULL) >> 32);
+ struct udp_rate_entry *group = &t->entries[h & t->mask & ~(UDP_RATE_GROUP - 1)];
+ struct udp_rate_entry *e = NULL;
+ struct udp_rate_entry *victim = group;
+ for(int k = 0; k < UDP_RATE_GROUP; k++)
+ {
+  if( group[k].addr == addr )
+  {
+   e = &group[k];
+   break;
+  }
+  if( group[k].full < victim->full )
+   victim = &group[k];
+ }
+ if( e == NULL )
+ {
+  unsigned int old = victim->addr;
+  if( !__sync_bool_compare_and_swap(&victim->addr, old, addr) )
+   return 1;
+  if( (old != 0) && (victim->full > now) )
+   (*evicted)++;
+  victim->full = now;
+  e = victim;
+ }
+ 
+ // one interval per packet, up to the tolerance ahead of now
+ while(1)
+ {
+  long long full = e->full;
+  long long start = (full > now) ? full : now;
+  if( start - now > t->tolerance )
+   return 0;
+  if( __sync_bool_compare_and_swap(&e->full, full, start + t->interval) )
+   return 1;
+ }
+}
+
+// copy a reply to a remembered message, or note that there is none
+static void keepReply(struct udp_rel_entry *e, const char *reply, int replyLen)
+{
+ e->replyLen = -1;
+ if( (reply == NULL) || (replyLen < 0) )
+  return;
+ if( e->replyCap < replyLen )
+ {
+  char *buf = (char *)realloc(e->reply, replyLen);
+  if( buf == NULL )
+   return;
+  e->reply = buf;
+  e->replyCap = replyLen;
+ }
+ memcpy(e->reply, reply, replyLen);
+ e->replyLen = replyLen;
+}
+
+// bits of the 64 messages after ack that the server has received. If held
+// is not NULL, it is set to the number of those held back.
+static unsigned long long selectiveAck(struct udp_rel_peer *peer,
+                                       unsigned int ack, int *held)
+{
+ unsigned long long sack = 0;
+ if( held )
+  *held = 0;
+ for(int k = 0; k < 64; k++)
+ {
+  struct udp_rel_entry *s = &peer->entries[(ack + 1 + k) % UDP_REL_HISTORY];
+  if( (s->seq == ack + 1 + k) && (s->state != 0) )
+  {
+   sack |= 1ULL << k;
+   if( held && (s->state == 1) )
+    (*held)++;
+  }
+ }
+ return sack;
+}
+
+// send a reply, preceded by hdrLen bytes of header
+static int sendReply(int fd, const void *hdr, int hdrLen,
+                     const char *msg, int msgLen, struct sockaddr_in *to, 
+                     socklen_t toLen)
+{
+ struct msghdr m;
+ struct iovec iov[2];
+ memset(&m, 0, sizeof(m));
+ iov[0].iov_base = (void *)hdr;
+ iov[0].iov_len = hdrLen;
+ iov[1].iov_base = (void *)msg;
+ iov[1].iov_len = msgLen;
+ m.msg_name = to;
+ m.msg_namelen = toLen;
+ m.msg_iov = (hdrLen > 0) ? iov : &iov[1];
+ m.msg_iovlen = (hdrLen > 0) ? 2 : 1;
+ return (sendmsg(fd, &m, 0) == hdrLen + msgLen) ? 0 : -1;
+}
+
+// the local interface of a multicast option, given by address or (Linux) by
+// name. NULL is any interface.
+static int readInterface(const char *interface, struct in_addr *addr, int *index)
+{
+ addr->s_addr = htonl(INADDR_ANY);
+ *index = 0;
+ if( (interface == NULL) || (inet_aton(interface, addr) != 0) )
+  return 0;
+#ifdef __linux__
+ if( (*index = if_nametoindex(interface)) > 0 )
+  return 0;
+#endif
+ return -1;
+}
 
 //==============================================================================
 // UDPServer::UDPServer
@@ -15,9 +642,25 @@
 UDPServer::UDPServer()
 {
  d_init = false;
+ d_running = false;
  d_fd = -1;
  d_rcvBuf = NULL;
  d_rcvBufSize = 0;
+ d_batchSize = 1;
+ d_gro = false;
+ d_timestamps = false;
+ memset(&d_queueHist, 0, sizeof(UDPLatencyHistogram));
+ memset(&d_handlerHist, 0, sizeof(UDPLatencyHistogram));
+ d_receivers = NULL;
+ d_numReceivers = 0;
+ d_serializeHandler = false;
+ pthread_mutex_init(&d_handlerLock, NULL);
+ d_relPeers = NULL;
+ pthread_mutex_init(&d_relLock, NULL);
+ d_frags = NULL;
+ pthread_mutex_init(&d_fragLock, NULL);
+ d_rateLimit = NULL;
+ createReceivers(1, NULL);
  setError(0, "UDPServer");
 }
 
@@ -25,9 +668,25 @@ UDPServer::UDPServer()
 UDPServer::UDPServer(int port, int maxMsgSize, int bdp)
 {
  d_init = false;
+ d_running = false;
  d_fd = -1;
  d_rcvBuf = NULL;
  d_rcvBufSize = 0;
+ d_batchSize = 1;
+ d_gro = false;
+ d_timestamps = false;
+ memset(&d_queueHist, 0, sizeof(UDPLatencyHistogram));
+ memset(&d_handlerHist, 0, sizeof(UDPLatencyHistogram));
+ d_receivers = NULL;
+ d_numReceivers = 0;
+ d_serializeHandler = false;
+ pthread_mutex_init(&d_handlerLock, NULL);
+ d_relPeers = NULL;
+ pthread_mutex_init(&d_relLock, NULL);
+ d_frags = NULL;
+ pthread_mutex_init(&d_fragLock, NULL);
+ d_rateLimit = NULL;
+ createReceivers(1, NULL);
  
  // initialize
  if( init(port, maxMsgSize, bdp) == -1)
@@ -53,6 +712,26 @@ UDPServer::~UDPServer()
   free(d_rcvBuf);
   d_rcvBuf = NULL;
  }
+ freeReceivers();
+ pthread_mutex_destroy(&d_handlerLock);
+ for(int k = 0; d_relPeers && (k < UDP_REL_MAX_PEERS); k++)
+ {
+  struct udp_rel_peer *p = d_relPeers[k];
+  if( p == NULL )
+   continue;
+  for(int i = 0; i < UDP_REL_HISTORY; i++)
+  {
+   free(p->entries[i].msg);
+   free(p->entries[i].reply);
+  }
+  pthread_mutex_destroy(&p->lock);
+  free(p);
+ }
+ free(d_relPeers);
+ pthread_mutex_destroy(&d_relLock);
+ freeFragTable(d_frags);
+ pthread_mutex_destroy(&d_fragLock);
+ setRateLimit(0, 0);
  d_init = false;
 }
 
@@ -68,114 +747,2061 @@ void UDPServer::doMessageCycle()
   return;
  }
  
+ // start additional receivers in their own threads
+ d_running = true;
+ d_receivers[0].fd = d_fd;
+ d_receivers[0].rcvBuf = d_rcvBuf;
+ for(int k = 1; k < d_numReceivers; k++)
+ {
+  struct udp_receiver *r = &d_receivers[k];
+  if( r->running || (r->fd == -1) )
+   continue;
+  if( pthread_create(&r->thread, NULL, &UDPServer::receiverEntry, r) == 0 )
+   r->running = true;
+  else
+   setError(errno, "doMessageCycle(pthread_create)");
+ }
+ 
+ // the first receiver runs in the calling thread. Others are stopped when 
+ // this thread is cancelled.
+ pthread_cleanup_push(&UDPServer::stopReceivers, this);
+ runReceiver(&d_receivers[0]);
+ pthread_cleanup_pop(1);
+}
+
+
+//==============================================================================
+// UDPServer::receiverEntry
+//==============================================================================
+void *UDPServer::receiverEntry(void *arg)
+{
+ struct udp_receiver *r = (struct udp_receiver *)arg;
+ r->server->runReceiver(r);
+ return NULL;
+}
+
+
+//==============================================================================
+// UDPServer::stopReceivers
+//==============================================================================
+void UDPServer::stopReceivers(void *arg)
+{
+ UDPServer *server = (UDPServer *)arg;
+ for(int k = 1; k < server->d_numReceivers; k++)
+ {
+  struct udp_receiver *r = &server->d_receivers[k];
+  if( !r->running )
+   continue;
+  pthread_cancel(r->thread);
+  pthread_join(r->thread, NULL);
+  r->running = false;
+ }
+ server->d_running = false;
+}
+
+
+//==============================================================================
+// UDPServer::runReceiver
+//==============================================================================
+void UDPServer::runReceiver(struct udp_receiver *r)
+{
+ // run on the requested cpu
+#ifdef __linux__
+ if( r->cpu >= 0 )
+ {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(r->cpu, &cpus);
+  if( pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0 )
+   d_status.setReport(-1, "doMessageCycle: could not set cpu affinity");
+ }
+#endif
+ 
+ // receive and reply in batches. GRO and timestamps need the ancillary 
+ // data.
+ if( (d_batchSize > 1) || d_gro || d_timestamps )
+ {
+  if( (r->batch == NULL) && (allocBatch(r) == -1) )
+   return;
+  doBatchCycle(r);
+  return;
+ }
+ 
  struct sockaddr_in clntAddr;
  int clntAddrLen, msgSize;
 
- clntAddrLen = sizeof(clntAddr);
  while(1)
  {
   // exit if we must
   pthread_testcancel();
 
   // wait for messages
-  if( (msgSize = recvfrom(d_fd, d_rcvBuf, d_rcvBufSize, 0, 
+  clntAddrLen = sizeof(clntAddr);
+  if( (msgSize = recvfrom(r->fd, r->rcvBuf, packetSize(), 0, 
       (struct sockaddr *) &clntAddr, (socklen_t *)&clntAddrLen)) == -1 )
   {
    setError(EIO, "doMessageCycle(recvfrom)");
    continue;
   }
+  
+  // drop packets of clients over their rate
+  if( d_rateLimit && !rateAllowed(d_rateLimit, clntAddr.sin_addr.s_addr, 
+      clockNs(CLOCK_MONOTONIC), &r->evicted) )
+  {
+   r->dropped++;
+   continue;
+  }
+  
+  // Call user implemented function. Not cancelled while holding the lock.
+  int cancelState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
+  if( d_serializeHandler )
+   pthread_mutex_lock(&d_handlerLock);
+  if( !serviceReliable(r, r->rcvBuf, msgSize, &clntAddr, clntAddrLen) )
+  {
+   struct udp_frag_header frag;
+   switch( reassemble(r, r->rcvBuf, msgSize, &clntAddr, &frag) )
+   {
+    case 0:
+     handleMessage(r, r->rcvBuf, msgSize, &clntAddr, clntAddrLen, NULL);
+     break;
+    case 2:
+     handleMessage(r, r->fragBuf, frag.total, &clntAddr, clntAddrLen, &frag);
+     break;
+   }
+  }
+  if( d_serializeHandler )
+   pthread_mutex_unlock(&d_handlerLock);
+  pthread_setcancelstate(cancelState, NULL);
+ } // end while
+}
 
-  // Call user implemented function
-  const char *outMsgBuf;
-  int outMsgLen;
-  outMsgBuf = receiveAndReply(d_rcvBuf, msgSize, &outMsgLen);
 
-  if(outMsgBuf == NULL)
-   continue;
-   
-  // reply to client
-  if( sendto(d_fd, outMsgBuf, outMsgLen, 0, 
-      (struct sockaddr *) &clntAddr, clntAddrLen) != outMsgLen )
+//==============================================================================
+// UDPServer::doBatchCycle
+//==============================================================================
+void UDPServer::doBatchCycle(struct udp_receiver *r)
+{
+#ifdef __linux__
+ struct udp_batch *b = r->batch;
+ 
+ while(1)
+ {
+  // exit if we must
+  pthread_testcancel();
+  
+  // wait for the first message, then take what else is there
+  for(int i = 0; i < b->size; i++)
   {
-   setError(EIO, "doMessageCycle(sendto)");
+   b->rcvMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+   if( b->control )
+    b->rcvMsgs[i].msg_hdr.msg_controllen = UDP_CONTROL_LEN;
+  }
+  int numMsgs = recvmmsg(r->fd, b->rcvMsgs, b->size, MSG_WAITFORONE, NULL);
+  if( numMsgs == -1 )
+  {
+   setError(EIO, "doMessageCycle(recvmmsg)");
    continue;
   }
+  long long now = d_rateLimit ? clockNs(CLOCK_MONOTONIC) : 0;
+  
+  // Call user implemented function for each. Not cancelled while holding
+  // the lock.
+  int cancelState;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
+  if( d_serializeHandler )
+   pthread_mutex_lock(&d_handlerLock);
+  int numReplies = 0;
+  for(int i = 0; i < numMsgs; i++)
+  {
+   char *msg = &b->rcvBufs[i * b->rcvSize];
+   int msgLen = b->rcvMsgs[i].msg_len;
+   
+   // packets coalesced by GRO arrive as one buffer of equal size segments
+   // (the last may be shorter), each a message of its own. They share the
+   // receive timestamp.
+   int segmentSize = msgLen;
+   struct timespec stamp;
+   bool stamped = false;
+   struct cmsghdr *cmsg;
+   for(cmsg = CMSG_FIRSTHDR(&b->rcvMsgs[i].msg_hdr); cmsg != NULL; 
+       cmsg = CMSG_NXTHDR(&b->rcvMsgs[i].msg_hdr, cmsg))
+   {
+    if( (cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO) )
+     memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(int));
+#ifdef SCM_TIMESTAMPNS
+    if( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS) )
+    {
+     memcpy(&stamp, CMSG_DATA(cmsg), sizeof(struct timespec));
+     stamped = d_timestamps;
+    }
+#endif
+#ifdef SO_RXQ_OVFL
+    if( (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_RXQ_OVFL) )
+     memcpy(&r->socketDrops, CMSG_DATA(cmsg), sizeof(unsigned int));
+#endif
+   }
+   if( segmentSize <= 0 )
+    segmentSize = msgLen;
+   
+   int offset = 0;
+   do
+   {
+    int segLen = (msgLen - offset < segmentSize) ? msgLen - offset : segmentSize;
+    
+    // drop packets of clients over their rate
+    if( d_rateLimit && !rateAllowed(d_rateLimit, b->peers[i].sin_addr.s_addr, 
+        now, &r->evicted) )
+    {
+     r->dropped++;
+     offset += segLen;
+     continue;
+    }
+    long long started = 0;
+    if( stamped )
+    {
+     recordLatency(&d_queueHist, clockNs(CLOCK_REALTIME) - 
+                   ((long long)stamp.tv_sec * 1000000000 + stamp.tv_nsec));
+     started = clockNs(CLOCK_MONOTONIC);
+    }
+    numReplies = handlePacket(r, i, msg + offset, segLen, numReplies);
+    if( stamped )
+     recordLatency(&d_handlerHist, clockNs(CLOCK_MONOTONIC) - started);
+    offset += segLen;
+   } while( offset < msgLen );
+  }
+  if( d_serializeHandler )
+   pthread_mutex_unlock(&d_handlerLock);
+  sendReplies(r, numReplies);
+  pthread_setcancelstate(cancelState, NULL);
  } // end while
+#else
+ r = r;
+#endif
 }
 
 
 //==============================================================================
-// UDPServer::receiveAndReply
+// UDPServer::handlePacket
 //==============================================================================
-const char *UDPServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+int UDPServer::handlePacket(struct udp_receiver *r, int i, const char *pkt, 
+                            int pktLen, int numReplies)
 {
- inMsgBuf = inMsgBuf;
- inMsgLen = inMsgLen;
- *outMsgLen = 0;
- return NULL;
+#ifdef __linux__
+ struct udp_batch *b = r->batch;
+ if( serviceReliable(r, pkt, pktLen, &b->peers[i], 
+     b->rcvMsgs[i].msg_hdr.msg_namelen) )
+  return numReplies;
+ 
+ // a complete reassembled message is replied to right away
+ struct udp_frag_header frag;
+ int state = reassemble(r, pkt, pktLen, &b->peers[i], &frag);
+ if( state != 0 )
+ {
+  if( state == 2 )
+   handleMessage(r, r->fragBuf, frag.total, &b->peers[i], 
+                 b->rcvMsgs[i].msg_hdr.msg_namelen, &frag);
+  return numReplies;
+ }
+ struct udp_seq_header hdr;
+ int hdrLen = readSeqHeader(pkt, pktLen, &hdr);
+ int inLen = pktLen - hdrLen;
+ if( inLen > packetSize() - UDP_HDR_ROOM )
+  inLen = packetSize() - UDP_HDR_ROOM;
+ const char *outMsgBuf;
+ int outMsgLen;
+ outMsgBuf = receiveAndReply(pkt + hdrLen, inLen, &outMsgLen);
+ if(outMsgBuf == NULL)
+  return numReplies;
+ 
+ // too long to keep, reply right away
+ if( hdrLen + outMsgLen > b->sndSize )
+ {
+  if( sendReply(r->fd, &hdr, hdrLen, outMsgBuf, outMsgLen, &b->peers[i],
+      b->rcvMsgs[i].msg_hdr.msg_namelen) == -1 )
+   setError(EIO, "doMessageCycle(sendmsg)");
+  return numReplies;
+ }
+ 
+ // with GRO there can be more replies than slots
+ if( numReplies == b->size )
+ {
+  sendReplies(r, numReplies);
+  numReplies = 0;
+ }
+ struct msghdr *reply = &b->sndMsgs[numReplies].msg_hdr;
+ char *slot = (char *)b->sndIov[numReplies].iov_base;
+ memcpy(slot, &hdr, hdrLen);
+ memcpy(slot + hdrLen, outMsgBuf, outMsgLen);
+ b->sndIov[numReplies].iov_len = hdrLen + outMsgLen;
+ reply->msg_name = &b->peers[i];
+ reply->msg_namelen = b->rcvMsgs[i].msg_hdr.msg_namelen;
+ return numReplies + 1;
+#else
+ r = r;
+ i = i;
+ pkt = pkt;
+ pktLen = pktLen;
+ return numReplies;
+#endif
 }
 
 
 //==============================================================================
-// UDPServer::init
+// UDPServer::sendReplies
 //==============================================================================
-int UDPServer::init(int port, int maxMsgSize, int bdp)
+void UDPServer::sendReplies(struct udp_receiver *r, int numReplies)
 {
- struct sockaddr_in name;
- int sockBufSize = bdp * 1024;
- 
- if(d_init)
+#ifdef __linux__
+ // reply to clients. A failed message is skipped.
+ struct udp_batch *b = r->batch;
+ int sent = 0;
+ while( sent < numReplies )
  {
-  if(d_fd)
+  int n = sendmmsg(r->fd, &b->sndMsgs[sent], numReplies - sent, 0);
+  if( n == -1 )
   {
-   close(d_fd);
-   d_fd = -1;
+   if( errno == EINTR )
+    continue;
+   setError(EIO, "doMessageCycle(sendmmsg)");
+   n = 1;
   }
+  sent += n;
  }
- d_init = false;
+#else
+ r = r;
+ numReplies = numReplies;
+#endif
+}
 
- // Create an endpoint for communication
- if( (d_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+
+//==============================================================================
+// UDPServer::serviceReliable
+//==============================================================================
+int UDPServer::serviceReliable(struct udp_receiver *r, const char *msg, int msgLen,
+                               struct sockaddr_in *from, socklen_t fromLen)
+{
+ struct udp_rel_header hdr;
+ if( msgLen < UDP_HDR_ROOM )
+  return 0;
+ memcpy(&hdr, msg, UDP_HDR_ROOM);
+ if( (hdr.code != UDP_CTRL_REL) || !(hdr.flags & UDP_REL_DATA) )
+  return 0;
+ const char *inMsgBuf = msg + UDP_HDR_ROOM;
+ int inMsgLen = msgLen - UDP_HDR_ROOM;
+ if( inMsgLen > d_rcvBufSize )
+  inMsgLen = d_rcvBufSize;
+ 
+ struct udp_rel_header out;
+ memset(&out, 0, sizeof(out));
+ out.code = UDP_CTRL_REL;
+ out.conn = hdr.conn;
+ out.window = UDP_REL_WINDOW;
+ 
+ // unreliable messages are handled and replied to once
+ const char *outMsgBuf;
+ int outMsgLen;
+ if( hdr.flags & UDP_REL_UNRELIABLE )
  {
-  setError(errno, "init(socket)");
-  d_fd = -1;
-  return -1;
+  outMsgBuf = receiveAndReply(inMsgBuf, inMsgLen, &outMsgLen);
+  out.seq = hdr.seq;
+  out.flags = UDP_REL_REPLY | UDP_REL_UNRELIABLE;
+  if( (outMsgBuf != NULL) && (sendReply(r->fd, &out, UDP_HDR_ROOM, outMsgBuf, 
+      outMsgLen, from, fromLen) == -1) )
+   setError(EIO, "doMessageCycle(sendmsg)");
+  return 1;
  }
  
- // Allow reuse of port 
- int yes = 1;
- if( setsockopt(d_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+ // the table of peers is locked while looking up, the peer while its 
+ // messages are handled and replied to, so that receive threads service 
+ // different clients at once.
+ pthread_mutex_lock(&d_relLock);
+ struct udp_rel_peer *peer = findPeer(from);
+ if( peer != NULL )
+  peer->users++;
+ pthread_mutex_unlock(&d_relLock);
+ if( peer == NULL )
+  return 1;
+ pthread_mutex_lock(&peer->lock);
+ 
+ // a new connection starts afresh
+ if( peer->conn != hdr.conn )
  {
-  setError(errno, "init(setsockopt) SO_REUSEADDR");
-  close(d_fd);
-  d_fd = -1;
-  return -1;
+  for(int k = 0; k < UDP_REL_HISTORY; k++)
+   peer->entries[k].state = 0;
+  peer->conn = hdr.conn;
+  peer->next = 0;
  }
  
- // set suggested optimal socket buffer sizes.
- if( sockBufSize != 0 ) {
-  if( setsockopt(d_fd, SOL_SOCKET, SO_SNDBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+ // the client has the replies of all messages before the oldest it needs
+ if( (int)(hdr.ack - peer->next) > UDP_REL_HISTORY )
+ {
+  for(int k = 0; k < UDP_REL_HISTORY; k++)
+   peer->entries[k].state = 0;
+  peer->next = hdr.ack;
+ }
+ while( (int)(hdr.ack - peer->next) > 0 )
+  peer->entries[peer->next++ % UDP_REL_HISTORY].state = 0;
+ 
+ unsigned int handled[UDP_REL_WINDOW + 1];
+ unsigned int acks[UDP_REL_WINDOW + 1]; // acknowledgement sent with each
+ int numHandled = 0, numAcked = 0;
+ int numDirect = 0; // handled on arrival, the rest were held back
+ int ahead = (int)(hdr.seq - peer->next);
+ struct udp_rel_entry *e = &peer->entries[hdr.seq % UDP_REL_HISTORY];
+ bool known = (ahead < 0) || ((e->seq == hdr.seq) && (e->state != 0));
+ if( !known && (ahead < UDP_REL_WINDOW) )
+ {
+  e->seq = hdr.seq;
+  e->ordered = (hdr.flags & UDP_REL_ORDERED);
+  if( e->ordered && (ahead > 0) )
   {
-   setError(errno, "init(setsockopt-SO_SNDBUF)");
-   close(d_fd);
-   d_fd = -1;
-   return -1;
+   // hold back until the messages before it arrived
+   if( e->msgCap < inMsgLen )
+   {
+    char *buf = (char *)realloc(e->msg, inMsgLen);
+    if( buf == NULL )
+    {
+     releasePeer(peer);
+     setError(ENOMEM, "doMessageCycle(malloc)");
+     return 1;
+    }
+    e->msg = buf;
+    e->msgCap = inMsgLen;
+   }
+   memcpy(e->msg, inMsgBuf, inMsgLen);
+   e->msgLen = inMsgLen;
+   e->state = 1;
   }
-  if( setsockopt(d_fd, SOL_SOCKET, SO_RCVBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+  else
   {
-   setError(errno, "init(setsockopt-SO_RCVBUF)");
-   close(d_fd);
-   d_fd = -1;
-   return -1;
+   e->state = 2;
+   outMsgBuf = receiveAndReply(inMsgBuf, inMsgLen, &outMsgLen);
+   keepReply(e, outMsgBuf, outMsgLen);
+   handled[numHandled++] = hdr.seq;
+  }
+  
+  // move past received messages, handling those held back. Each reply
+  // carries the acknowledgement as it stood when its message was handled,
+  // so that the client does not take the messages released after it for
+  // ones whose reply was lost.
+  numDirect = numHandled;
+  struct udp_rel_entry *n = &peer->entries[peer->next % UDP_REL_HISTORY];
+  while( (n->seq == peer->next) && (n->state != 0) )
+  {
+   if( n->state == 1 )
+   {
+    while( numAcked < numHandled )
+     acks[numAcked++] = peer->next;
+    n->state = 2;
+    outMsgBuf = receiveAndReply(n->msg, n->msgLen, &outMsgLen);
+    keepReply(n, outMsgBuf, outMsgLen);
+    if( numHandled <= UDP_REL_WINDOW )
+     handled[numHandled++] = n->seq;
+   }
+   peer->next++;
+   n = &peer->entries[peer->next % UDP_REL_HISTORY];
   }
  }
+ else if( known && (e->seq == hdr.seq) && (e->state == 2) )
+ {
+  // retransmitted message, its reply was lost
+  handled[numHandled++] = hdr.seq;
+  numDirect = numHandled;
+ }
+ while( numAcked < numHandled )
+  acks[numAcked++] = peer->next;
+ 
+ // acknowledge what was received, and offer the room not taken by 
+ // messages held back
+ int held = 0;
+ out.ack = peer->next;
+ out.sack = selectiveAck(peer, peer->next, &held);
+ out.window = (held < UDP_REL_WINDOW) ? UDP_REL_WINDOW - held : 1;
+ if( numHandled == 0 )
+ {
+  out.seq = hdr.seq;
+  out.flags = UDP_REL_ACK;
+  if( sendReply(r->fd, &out, UDP_HDR_ROOM, NULL, 0, from, fromLen) == -1 )
+   setError(EIO, "doMessageCycle(sendmsg)");
+ }
+ for(int k = 0; k < numHandled; k++)
+ {
+  struct udp_rel_entry *h = &peer->entries[handled[k] % UDP_REL_HISTORY];
+  out.ack = acks[k];
+  out.sack = selectiveAck(peer, acks[k], NULL);
+  out.seq = handled[k];
+  out.flags = (h->replyLen >= 0) ? UDP_REL_REPLY : UDP_REL_NOREPLY;
+  if( k >= numDirect )
+   out.flags |= UDP_REL_HELD;
+  if( sendReply(r->fd, &out, UDP_HDR_ROOM, h->reply, 
+      (h->replyLen >= 0) ? h->replyLen : 0, from, fromLen) == -1 )
+   setError(EIO, "doMessageCycle(sendmsg)");
+ }
+ releasePeer(peer);
+ return 1;
+}
+
+
+//==============================================================================
+// UDPServer::releasePeer
+//==============================================================================
+void UDPServer::releasePeer(struct udp_rel_peer *peer)
+{
+ pthread_mutex_unlock(&peer->lock);
+ pthread_mutex_lock(&d_relLock);
+ peer->users--;
+ pthread_mutex_unlock(&d_relLock);
+}
+
+
+//==============================================================================
+// UDPServer::findPeer
+//==============================================================================
+struct udp_rel_peer *UDPServer::findPeer(struct sockaddr_in *from)
+{
+ if( (d_relPeers == NULL) && ((d_relPeers = (struct udp_rel_peer **)calloc(
+     UDP_REL_MAX_PEERS, sizeof(struct udp_rel_peer *))) == NULL) )
+ {
+  setError(ENOMEM, "doMessageCycle(malloc)");
+  return NULL;
+ }
+ 
+ // the client, else a free place, else the one heard from least 
+ // recently that no other thread is servicing
+ struct udp_rel_peer *peer = NULL;
+ int k, oldest = -1;
+ for(k = 0; k < UDP_REL_MAX_PEERS; k++)
+ {
+  struct udp_rel_peer *p = d_relPeers[k];
+  if( p == NULL )
+   break;
+  if( (p->addr.sin_addr.s_addr == from->sin_addr.s_addr) && 
+      (p->addr.sin_port == from->sin_port) )
+  {
+   peer = p;
+   break;
+  }
+  if( (p->users == 0) && 
+      ((oldest == -1) || (p->lastSeen < d_relPeers[oldest]->lastSeen)) )
+   oldest = k;
+ }
+ if( peer == NULL )
+ {
+  if( k == UDP_REL_MAX_PEERS )
+  {
+   if( oldest == -1 )
+    return NULL;
+   peer = d_relPeers[oldest];
+  }
+  else
+  {
+   if( (peer = (struct udp_rel_peer *)calloc(1, sizeof(struct udp_rel_peer))) 
+       == NULL )
+   {
+    setError(ENOMEM, "doMessageCycle(malloc)");
+    return NULL;
+   }
+   pthread_mutex_init(&peer->lock, NULL);
+   d_relPeers[k] = peer;
+  }
+  
+  // start afresh for the new client
+  peer->addr = *from;
+  peer->conn = 0;
+  peer->next = 0;
+  for(k = 0; k < UDP_REL_HISTORY; k++)
+   peer->entries[k].state = 0;
+ }
+ peer->lastSeen = monotonicUs();
+ return peer;
+}
+
+
+//==============================================================================
+// UDPServer::reassemble
+//==============================================================================
+int UDPServer::reassemble(struct udp_receiver *r, const char *pkt, int pktLen,
+                          struct sockaddr_in *from, struct udp_frag_header *frag)
+{
+ if( (d_frags == NULL) || !readFragHeader(pkt, pktLen, frag) )
+  return 0;
+ pthread_mutex_lock(&d_fragLock);
+ struct udp_frag_partial *p = addFragment(d_frags, from, frag, 
+                                          pkt + UDP_FRAG_HDRLEN, 
+                                          pktLen - UDP_FRAG_HDRLEN, monotonicUs());
+ if( p != NULL )
+ {
+  // trade buffers with the receiver, so that the table is not locked 
+  // while the message is handled
+  char *buf = r->fragBuf;
+  int cap = r->fragCap;
+  r->fragBuf = p->buf;
+  r->fragCap = p->bufCap;
+  p->buf = buf;
+  p->bufCap = cap;
+  p->inUse = false;
+ }
+ pthread_mutex_unlock(&d_fragLock);
+ return (p != NULL) ? 2 : 1;
+}
+
+
+//==============================================================================
+// UDPServer::handleMessage
+//==============================================================================
+void UDPServer::handleMessage(struct udp_receiver *r, const char *msg, int msgLen,
+                              struct sockaddr_in *from, socklen_t fromLen,
+                              const struct udp_frag_header *frag)
+{
+ // the header is not passed to the handler
+ struct udp_seq_header hdr;
+ int hdrLen = readSeqHeader(msg, msgLen, &hdr);
+ msgLen -= hdrLen;
+ if( (frag == NULL) && (msgLen > packetSize() - UDP_HDR_ROOM) )
+  msgLen = packetSize() - UDP_HDR_ROOM;
+ const char *outMsgBuf;
+ int outMsgLen;
+ outMsgBuf = receiveAndReply(msg + hdrLen, msgLen, &outMsgLen);
+ if( outMsgBuf == NULL )
+  return;
+ 
+ // reply to client, in fragments like the message if it does not fit
+ int ret;
+ int fragLen = (frag != NULL) ? (int)frag->fragSize + UDP_FRAG_HDRLEN : 0;
+ if( (frag != NULL) && (hdrLen + outMsgLen > fragLen) )
+  ret = sendFragments(r->fd, &hdr, hdrLen, outMsgBuf, outMsgLen, frag->msgId,
+                      fragLen, from, fromLen);
+ else
+  ret = sendReply(r->fd, &hdr, hdrLen, outMsgBuf, outMsgLen, from, fromLen);
+ if( ret == -1 )
+  setError(EIO, "doMessageCycle(sendmsg)");
+}
+
+
+//==============================================================================
+// UDPServer::packetSize
+//==============================================================================
+int UDPServer::packetSize() const
+{
+ // fragments may be longer than the messages received whole
+ int size = d_rcvBufSize;
+ if( (d_frags != NULL) && (size < UDP_FRAG_MAX) )
+  size = UDP_FRAG_MAX;
+ return size + UDP_HDR_ROOM;
+}
+
+
+//==============================================================================
+// UDPServer::setReceiveOffload
+//==============================================================================
+int UDPServer::setReceiveOffload(bool enable)
+{
+ if( d_running )
+ {
+  d_status.setReport(EBUSY, "setReceiveOffload: message cycle running");
+  return -1;
+ }
+#ifdef __linux__
+ int on = enable ? 1 : 0;
+ for(int k = 0; d_init && (k < d_numReceivers); k++)
+ {
+  int fd = (k == 0) ? d_fd : d_receivers[k].fd;
+  if( setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(int)) == -1 )
+  {
+   setError(errno, "setReceiveOffload(setsockopt-UDP_GRO)");
+   return -1;
+  }
+ }
+ freeBatch();
+ d_gro = enable;
+ return 0;
+#else
+ if( !enable )
+  return 0;
+ d_status.setReport(ENOSYS, "setReceiveOffload: not supported");
+ return -1;
+#endif
+}
+
+
+//==============================================================================
+// UDPServer::setTimestamps
+//==============================================================================
+int UDPServer::setTimestamps(bool enable)
+{
+ if( d_running )
+ {
+  d_status.setReport(EBUSY, "setTimestamps: message cycle running");
+  return -1;
+ }
+#ifdef SO_TIMESTAMPNS
+ int on = enable ? 1 : 0;
+ for(int k = 0; d_init && (k < d_numReceivers); k++)
+ {
+  int fd = (k == 0) ? d_fd : d_receivers[k].fd;
+  if( setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(int)) == -1 )
+  {
+   setError(errno, "setTimestamps(setsockopt-SO_TIMESTAMPNS)");
+   return -1;
+  }
+#ifdef SO_RXQ_OVFL
+  if( setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(int)) == -1 )
+  {
+   setError(errno, "setTimestamps(setsockopt-SO_RXQ_OVFL)");
+   return -1;
+  }
+#endif
+ }
+ freeBatch();
+ if( enable && !d_timestamps )
+  clearLatencyHistograms();
+ d_timestamps = enable;
+ return 0;
+#else
+ if( !enable )
+  return 0;
+ d_status.setReport(ENOSYS, "setTimestamps: not supported");
+ return -1;
+#endif
+}
+
+
+//==============================================================================
+// UDPServer::getLatencyHistograms
+//==============================================================================
+void UDPServer::getLatencyHistograms(UDPLatencyHistogram *queueDelay, 
+                                     UDPLatencyHistogram *handlerTime) const
+{
+ if( queueDelay )
+  *queueDelay = d_queueHist;
+ if( handlerTime )
+  *handlerTime = d_handlerHist;
+}
+
+
+//==============================================================================
+// UDPServer::getSocketDrops
+//==============================================================================
+unsigned long UDPServer::getSocketDrops() const
+{
+ unsigned long drops = 0;
+ for(int k = 0; k < d_numReceivers; k++)
+  drops += d_receivers[k].socketDrops;
+ return drops;
+}
+
+
+//==============================================================================
+// UDPServer::clearLatencyHistograms
+//==============================================================================
+void UDPServer::clearLatencyHistograms()
+{
+ memset(&d_queueHist, 0, sizeof(UDPLatencyHistogram));
+ memset(&d_handlerHist, 0, sizeof(UDPLatencyHistogram));
+}
+
+
+//==============================================================================
+// UDPServer::setBatchSize
+//==============================================================================
+int UDPServer::setBatchSize(int batchSize)
+{
+ if( d_running )
+ {
+  d_status.setReport(EBUSY, "setBatchSize: message cycle running");
+  return -1;
+ }
+ if( batchSize < 1 )
+ {
+  d_status.setReport(EINVAL, "setBatchSize: invalid size");
+  return -1;
+ }
+#ifndef __linux__
+ if( batchSize > 1 )
+ {
+  d_status.setReport(ENOSYS, "setBatchSize: not supported");
+  return -1;
+ }
+#endif
+ freeBatch();
+ d_batchSize = batchSize;
+ return 0;
+}
+
+
+//==============================================================================
+// UDPServer::setRateLimit
+//==============================================================================
+int UDPServer::setRateLimit(double packetsPerSec, int burst, int maxSources)
+{
+ if( d_running )
+ {
+  d_status.setReport(EBUSY, "setRateLimit: message cycle running");
+  return -1;
+ }
+ if( packetsPerSec <= 0 )
+ {
+  if( d_rateLimit )
+   free(d_rateLimit->entries);
+  free(d_rateLimit);
+  d_rateLimit = NULL;
+  return 0;
+ }
+ if( (burst < 1) || (maxSources < 1) || (packetsPerSec > 1e9) )
+ {
+  d_status.setReport(EINVAL, "setRateLimit: invalid argument");
+  return -1;
+ }
+ 
+ // groups of entries are aligned to cache lines
+ unsigned int size = UDP_RATE_GROUP;
+ while( (size < (unsigned int)maxSources) && (size < 0x40000000) )
+  size <<= 1;
+ struct udp_rate_table *t = (struct udp_rate_table *)malloc(sizeof(*t));
+ void *entries = NULL;
+ if( (t == NULL) || (posix_memalign(&entries, 64, 
+     size * sizeof(struct udp_rate_entry)) != 0) )
+ {
+  free(t);
+  setError(ENOMEM, "setRateLimit(malloc)");
+  return -1;
+ }
+ memset(entries, 0, size * sizeof(struct udp_rate_entry));
+ t->entries = (struct udp_rate_entry *)entries;
+ t->mask = size - 1;
+ t->interval = (long long)(1e9 / packetsPerSec);
+ if( t->interval < 1 )
+  t->interval = 1;
+ t->tolerance = (long long)(burst - 1) * t->interval;
+ setRateLimit(0, 0);
+ d_rateLimit = t;
+ return 0;
+}
+
+
+//==============================================================================
+// UDPServer::getRateLimitCounters
+//==============================================================================
+void UDPServer::getRateLimitCounters(unsigned long *dropped, 
+                                     unsigned long *evicted) const
+{
+ unsigned long d = 0, e = 0;
+ for(int k = 0; k < d_numReceivers; k++)
+ {
+  d += d_receivers[k].dropped;
+  e += d_receivers[k].evicted;
+ }
+ if( dropped )
+  *dropped = d;
+ if( evicted )
+  *evicted = e;
+}
+
+
+//==============================================================================
+// UDPServer::setReceiveThreads
+//==============================================================================
+int UDPServer::setReceiveThreads(int numThreads, const int *cpus, bool concurrentHandler)
+{
+ if( d_init )
+ {
+  d_status.setReport(EBUSY, "setReceiveThreads: server already initialized");
+  return -1;
+ }
+ if( numThreads < 1 )
+ {
+  d_status.setReport(EINVAL, "setReceiveThreads: invalid number of threads");
+  return -1;
+ }
+#ifndef SO_REUSEPORT
+ if( numThreads > 1 )
+ {
+  d_status.setReport(ENOSYS, "setReceiveThreads: not supported");
+  return -1;
+ }
+#endif
+ if( createReceivers(numThreads, cpus) == -1 )
+  return -1;
+ d_serializeHandler = (numThreads > 1) && !concurrentHandler;
+ return 0;
+}
+
+
+//==============================================================================
+// UDPServer::setReassembly
+//==============================================================================
+int UDPServer::setReassembly(int maxMsgSize, int maxPartial, int timeoutMs)
+{
+ if( d_init )
+ {
+  d_status.setReport(EBUSY, "setReassembly: server already initialized");
+  return -1;
+ }
+ if( (maxMsgSize < 1) || (maxPartial < 1) || (timeoutMs < 1) )
+ {
+  d_status.setReport(EINVAL, "setReassembly: invalid argument");
+  return -1;
+ }
+ struct udp_frag_table *t = newFragTable(maxPartial, maxMsgSize, 
+                                         (long long)timeoutMs * 1000);
+ if( t == NULL )
+ {
+  setError(ENOMEM, "setReassembly(malloc)");
+  return -1;
+ }
+ freeFragTable(d_frags);
+ d_frags = t;
+ return 0;
+}
+
+
+//==============================================================================
+// UDPServer::joinGroup
+//==============================================================================
+int UDPServer::joinGroup(const char *group, const char *interface)
+{
+ return setMembership(true, group, interface);
+}
+
+
+//==============================================================================
+// UDPServer::leaveGroup
+//==============================================================================
+int UDPServer::leaveGroup(const char *group, const char *interface)
+{
+ return setMembership(false, group, interface);
+}
+
+
+//==============================================================================
+// UDPServer::setMembership
+//==============================================================================
+int UDPServer::setMembership(bool join, const char *group, const char *interface)
+{
+ const char *fn = join ? "joinGroup" : "leaveGroup";
+ char info[80];
+ if( !d_init )
+ {
+  snprintf(info, 80, "%s: server not initialized", fn);
+  d_status.setReport(-1, info);
+  return -1;
+ }
+ struct in_addr groupAddr, ifAddr;
+ int ifIndex;
+ if( (group == NULL) || (inet_aton(group, &groupAddr) == 0) || 
+     !IN_MULTICAST(ntohl(groupAddr.s_addr)) || 
+     (readInterface(interface, &ifAddr, &ifIndex) == -1) )
+ {
+  snprintf(info, 80, "%s: invalid group or interface", fn);
+  d_status.setReport(EINVAL, info);
+  return -1;
+ }
+ 
+#ifdef IP_MULTICAST_ALL
+ // only groups joined here, and only on the first receiver, so that a 
+ // packet is handled once
+ int no = 0;
+ for(int k = 0; join && (k < d_numReceivers); k++)
+ {
+  int fd = (k == 0) ? d_fd : d_receivers[k].fd;
+  if( (fd != -1) && 
+      (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &no, sizeof(int)) == -1) )
+  {
+   snprintf(info, 80, "%s(setsockopt-IP_MULTICAST_ALL)", fn);
+   setError(errno, info);
+   return -1;
+  }
+ }
+#endif
+ 
+#ifdef __linux__
+ struct ip_mreqn req;
+ memset(&req, 0, sizeof(req));
+ req.imr_multiaddr = groupAddr;
+ req.imr_address = ifAddr;
+ req.imr_ifindex = ifIndex;
+#else
+ struct ip_mreq req;
+ req.imr_multiaddr = groupAddr;
+ req.imr_interface = ifAddr;
+#endif
+ if( setsockopt(d_fd, IPPROTO_IP, join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+     &req, sizeof(req)) == -1 )
+ {
+  snprintf(info, 80, "%s(setsockopt-%s)", fn, 
+           join ? "IP_ADD_MEMBERSHIP" : "IP_DROP_MEMBERSHIP");
+  setError(errno, info);
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// UDPServer::createReceivers
+//==============================================================================
+int UDPServer::createReceivers(int numThreads, const int *cpus)
+{
+ freeReceivers();
+ d_receivers = (struct udp_receiver *)malloc(numThreads * sizeof(struct udp_receiver));
+ if( d_receivers == NULL )
+ {
+  setError(ENOMEM, "setReceiveThreads(malloc)");
+  d_numReceivers = 0;
+  return -1;
+ }
+ d_numReceivers = numThreads;
+ for(int k = 0; k < numThreads; k++)
+ {
+  struct udp_receiver *r = &d_receivers[k];
+  r->server = this;
+  r->index = k;
+  r->cpu = cpus ? cpus[k] : -1;
+  r->fd = -1;
+  r->rcvBuf = NULL;
+  r->fragBuf = NULL;
+  r->fragCap = 0;
+  r->dropped = 0;
+  r->evicted = 0;
+  r->socketDrops = 0;
+  r->batch = NULL;
+  r->running = false;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// UDPServer::freeReceivers
+//==============================================================================
+void UDPServer::freeReceivers()
+{
+ if( d_receivers == NULL )
+  return;
+ freeBatch();
+ closeReceivers();
+ for(int k = 0; k < d_numReceivers; k++)
+  free(d_receivers[k].fragBuf);
+ free(d_receivers);
+ d_receivers = NULL;
+ d_numReceivers = 0;
+}
+
+
+//==============================================================================
+// UDPServer::closeReceivers
+//==============================================================================
+void UDPServer::closeReceivers()
+{
+ // the first receiver uses d_fd and d_rcvBuf
+ for(int k = 1; k < d_numReceivers; k++)
+ {
+  struct udp_receiver *r = &d_receivers[k];
+  if( r->fd != -1 )
+   close(r->fd);
+  free(r->rcvBuf);
+  r->fd = -1;
+  r->rcvBuf = NULL;
+ }
+}
+
+
+//==============================================================================
+// UDPServer::allocBatch
+//==============================================================================
+int UDPServer::allocBatch(struct udp_receiver *r)
+{
+#ifdef __linux__
+ int n = d_batchSize;
+ struct udp_batch *b = (struct udp_batch *)calloc(1, sizeof(struct udp_batch));
+ if( b == NULL )
+ {
+  setError(ENOMEM, "doMessageCycle(malloc)");
+  return -1;
+ }
+ r->batch = b;
+ b->size = n;
+ b->rcvSize = packetSize();
+ b->sndSize = d_rcvBufSize + UDP_SEQ_HDRLEN;
+ 
+ // GRO delivers up to a full datagram of segments
+ if( d_gro && (b->rcvSize < UDP_GRO_BUFSIZE) )
+  b->rcvSize = UDP_GRO_BUFSIZE;
+ b->rcvBufs = (char *)malloc((size_t)n * b->rcvSize);
+ b->sndBufs = (char *)malloc((size_t)n * b->sndSize);
+ b->control = (d_gro || d_timestamps) ? (char *)calloc(n, UDP_CONTROL_LEN) : NULL;
+ b->rcvIov = (struct iovec *)calloc(n, sizeof(struct iovec));
+ b->sndIov = (struct iovec *)calloc(n, sizeof(struct iovec));
+ b->peers = (struct sockaddr_in *)calloc(n, sizeof(struct sockaddr_in));
+ b->rcvMsgs = (struct mmsghdr *)calloc(n, sizeof(struct mmsghdr));
+ b->sndMsgs = (struct mmsghdr *)calloc(n, sizeof(struct mmsghdr));
+ if( !b->rcvBufs || !b->sndBufs || !b->rcvIov || !b->sndIov || !b->peers 
+     || !b->rcvMsgs || !b->sndMsgs || ((d_gro || d_timestamps) && !b->control) )
+ {
+  freeBatch(r);
+  setError(ENOMEM, "doMessageCycle(malloc)");
+  return -1;
+ }
+ 
+ // the headers point at fixed buffers, only lengths change
+ for(int i = 0; i < n; i++)
+ {
+  b->rcvIov[i].iov_base = &b->rcvBufs[i * b->rcvSize];
+  b->rcvIov[i].iov_len = b->rcvSize;
+  b->rcvMsgs[i].msg_hdr.msg_iov = &b->rcvIov[i];
+  b->rcvMsgs[i].msg_hdr.msg_iovlen = 1;
+  b->rcvMsgs[i].msg_hdr.msg_name = &b->peers[i];
+  if( b->control )
+   b->rcvMsgs[i].msg_hdr.msg_control = &b->control[i * UDP_CONTROL_LEN];
+  b->sndIov[i].iov_base = &b->sndBufs[i * b->sndSize];
+  b->sndMsgs[i].msg_hdr.msg_iov = &b->sndIov[i];
+  b->sndMsgs[i].msg_hdr.msg_iovlen = 1;
+ }
+ return 0;
+#else
+ r = r;
+ setError(ENOSYS, "doMessageCycle(recvmmsg)");
+ return -1;
+#endif
+}
+
+
+//==============================================================================
+// UDPServer::freeBatch
+//==============================================================================
+void UDPServer::freeBatch()
+{
+ for(int k = 0; k < d_numReceivers; k++)
+  freeBatch(&d_receivers[k]);
+}
+
+
+void UDPServer::freeBatch(struct udp_receiver *r)
+{
+ struct udp_batch *b = r->batch;
+ if( b == NULL )
+  return;
+ free(b->rcvBufs);
+ free(b->sndBufs);
+ free(b->control);
+ free(b->rcvIov);
+ free(b->sndIov);
+ free(b->peers);
+#ifdef __linux__
+ free(b->rcvMsgs);
+ free(b->sndMsgs);
+#endif
+ free(b);
+ r->batch = NULL;
+}
+
+
+//==============================================================================
+// UDPServer::receiveAndReply
+//==============================================================================
+const char *UDPServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ inMsgBuf = inMsgBuf;
+ inMsgLen = inMsgLen;
+ *outMsgLen = 0;
+ return NULL;
+}
+
+
+//==============================================================================
+// UDPServer::init
+//==============================================================================
+int UDPServer::init(int port, int maxMsgSize, int bdp)
+{
+ int sockBufSize = bdp * 1024;
+ 
+ if(d_init)
+ {
+  if(d_fd)
+  {
+   close(d_fd);
+   d_fd = -1;
+  }
+  closeReceivers();
+ }
+ d_init = false;
+
+ // Create the endpoint for communication
+ if( (d_fd = openSocket(port, sockBufSize)) == -1 )
+  return -1;
+ 
+ // the other receivers join the port chosen by the system
+ struct sockaddr_in name;
+ socklen_t nameLen = sizeof(name);
+ if( (port == 0) && (getsockname(d_fd, (struct sockaddr *)&name, &nameLen) == 0) )
+  port = ntohs(name.sin_port);
+
+ // Create the buffer to store client messages
+ d_rcvBufSize = maxMsgSize;
+ d_rcvBuf = (char *)realloc(d_rcvBuf, packetSize());
+ if(d_rcvBuf == NULL)
+ {
+  setError(ENOMEM, "UDPServer(malloc)");
+  close(d_fd);
+  d_fd = -1;
+  return -1;
+ }
+ freeBatch();
+ 
+ // drop counts are per socket
+ for(int k = 0; k < d_numReceivers; k++)
+  d_receivers[k].socketDrops = 0;
+ 
+ // each additional receiver has a socket of its own on the same port
+ for(int k = 1; k < d_numReceivers; k++)
+ {
+  struct udp_receiver *r = &d_receivers[k];
+  r->rcvBuf = (char *)malloc(packetSize());
+  if( r->rcvBuf == NULL )
+  {
+   setError(ENOMEM, "UDPServer(malloc)");
+   r->fd = -1;
+  }
+  else
+   r->fd = openSocket(port, sockBufSize);
+  if( r->fd == -1 )
+  {
+   closeReceivers();
+   close(d_fd);
+   d_fd = -1;
+   return -1;
+  }
+ }
+ d_init = true;
+ 
+ return 0;
+}
+
+
+//==============================================================================
+// UDPServer::openSocket
+//==============================================================================
+int UDPServer::openSocket(int port, int sockBufSize)
+{
+ struct sockaddr_in name;
+ int fd;
+ 
+ // Create an endpoint for communication
+ if( (fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+ {
+  setError(errno, "init(socket)");
+  return -1;
+ }
+ 
+ // Allow reuse of port 
+ int yes = 1;
+ if( setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+ {
+  setError(errno, "init(setsockopt) SO_REUSEADDR");
+  close(fd);
+  return -1;
+ }
+ 
+ // let the kernel spread packets over the sockets of the receivers
+#ifdef SO_REUSEPORT
+ if( (d_numReceivers > 1) && 
+     (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) )
+ {
+  setError(errno, "init(setsockopt-SO_REUSEPORT)");
+  close(fd);
+  return -1;
+ }
+#endif
+ 
+ // set suggested optimal socket buffer sizes.
+ if( sockBufSize != 0 ) {
+  if( setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_SNDBUF)");
+   close(fd);
+   return -1;
+  }
+  if( setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *)&sockBufSize, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_RCVBUF)");
+   close(fd);
+   return -1;
+  }
+ }
+ 
+ // receive coalesced packets
+#ifdef __linux__
+ if( d_gro && (setsockopt(fd, SOL_UDP, UDP_GRO, &yes, sizeof(int)) == -1) )
+ {
+  setError(errno, "init(setsockopt-UDP_GRO)");
+  close(fd);
+  return -1;
+ }
+#endif
+#ifdef SO_TIMESTAMPNS
+ if( d_timestamps && 
+     (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(int)) == -1) )
+ {
+  setError(errno, "init(setsockopt-SO_TIMESTAMPNS)");
+  close(fd);
+  return -1;
+ }
+#endif
+#ifdef SO_RXQ_OVFL
+ if( d_timestamps && 
+     (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof(int)) == -1) )
+ {
+  setError(errno, "init(setsockopt-SO_RXQ_OVFL)");
+  close(fd);
+  return -1;
+ }
+#endif
+ 
+ // bind a name to the socket
+ name.sin_family = AF_INET;
+ name.sin_port = htons(port);
+ name.sin_addr.s_addr = htonl(INADDR_ANY);
+ memset(&(name.sin_zero), '\0', 8);
+ if( bind(fd, (struct sockaddr *)&name, sizeof(struct sockaddr)) == -1)
+ {
+  setError(errno, "init(bind)");
+  close(fd);
+  return -1;
+ }
+ return fd;
+}
+
+//==============================================================================
+// UDPServer::getStatusCode
+//==============================================================================
+int UDPServer::getStatusCode() const
+{
+ return d_status.getReportCode();
+}
+
+
+//==============================================================================
+// UDPServer::getStatusMessage
+//==============================================================================
+const char *UDPServer::getStatusMessage() const
+{
+ return d_status.getReportMessage();
+}
+
+
+//==============================================================================
+// UDPServer::setError
+//==============================================================================
+void UDPServer::setError(int code, const char *functionName)
+{
+ char buf[80];
+ snprintf(buf, 80, "%s: %s", functionName, strerror(code));
+ d_status.setReport(code, buf);
+}
+
+
+//==============================================================================
+// UDPClient::UDPClient
+//==============================================================================
+UDPClient::UDPClient()
+{
+ d_fd = -1;
+ d_init = false;
+ d_serverName = NULL;
+ d_serverPort = 0;
+ d_recvTimeout.tv_sec = 1;
+ d_recvTimeout.tv_usec = 0;
+ d_bdp = 0;
+ d_gso = true;
+ d_sequencing = false;
+ d_nextSeq = 1;
+ d_pending = NULL;
+ d_fragSize = 0;
+ d_fragLen = 0;
+ d_nextFragId = (unsigned int)monotonicUs();
+ d_pkt = NULL;
+ d_frags = NULL;
+ d_mcastTtl = -1;
+ d_mcastLoop = true;
+ d_mcastAddr.s_addr = htonl(INADDR_ANY);
+ d_mcastIndex = 0;
+ setError(0, "UDPClient");
+}
+
+
+UDPClient::UDPClient(const char *serverIp, int port, struct timeval &t, int bdp)
+{
+ d_init = false;
+ d_serverName = NULL;
+ d_serverPort = 0;
+ d_fd = -1;
+ d_recvTimeout.tv_sec = 1;
+ d_recvTimeout.tv_usec = 0;
+ d_bdp = 0;
+ d_gso = true;
+ d_sequencing = false;
+ d_nextSeq = 1;
+ d_pending = NULL;
+ d_fragSize = 0;
+ d_fragLen = 0;
+ d_nextFragId = (unsigned int)monotonicUs();
+ d_pkt = NULL;
+ d_frags = NULL;
+ d_mcastTtl = -1;
+ d_mcastLoop = true;
+ d_mcastAddr.s_addr = htonl(INADDR_ANY);
+ d_mcastIndex = 0;
+ 
+ // init connection to server
+ if( init(serverIp, port, t, bdp) == -1 )
+  return;
+ 
+ setError(0, "UDPClient");
+}
+
+
+//==============================================================================
+// UDPClient::~UDPClient
+//==============================================================================
+UDPClient::~UDPClient()
+{
+ if(d_fd)
+ {
+  close(d_fd);
+  d_fd = -1;
+ }
+ if(d_serverName)
+  free(d_serverName);
+ free(d_pending);
+ free(d_pkt);
+ freeFragTable(d_frags);
+}
+
+
+//==============================================================================
+// UDPClient::sendAndReceive
+//==============================================================================
+int UDPClient::sendAndReceive(char *outMsgBuf, int outMsgLen,
+                     char *inMsgBuf, int inBufLen, int *inMsgLen)
+{
+ if(!d_init)
+ {
+  d_status.setReport(-1, "sendAndReceive: client not initialized");
+  return -1;
+ }
+
+ // initialize connection again if we lost it due to error.
+ if( fcntl(d_fd, F_GETFL) == -1 )
+ {
+  if( init(d_serverName, d_serverPort, d_recvTimeout, d_bdp) == -1 )
+   return -1;
+ }
+
+ // check buffer pointers
+ if( outMsgBuf == NULL )
+ {
+  d_status.setReport(EINVAL, "sendAndReceive: invalid buffer");
+  return -1;
+ }
+
+ // sequenced request, the reply is matched by its number
+ if( d_sequencing )
+ {
+  unsigned int seq;
+  if( inMsgBuf == NULL )
+   return sendRequest(outMsgBuf, outMsgLen, NULL);
+  if( sendRequest(outMsgBuf, outMsgLen, &seq) == -1 )
+   return -1;
+  return waitReply(inMsgBuf, inBufLen, inMsgLen, &seq, false);
+ }
+
+ // write message to server
+ if( transmit(NULL, outMsgBuf, outMsgLen) == -1 )
+ {
+  setError(errno, "sendAndReceive(send)");
+  close(d_fd);
+  return -1;
+ }
+ 
+ if( inMsgBuf == NULL)
+  return 0;
+
+ // receive reply. A late reply to an earlier request can not be told 
+ // apart, so the socket is replaced after a timeout.
+ if( waitReply(inMsgBuf, inBufLen, inMsgLen, NULL, false) == -1 )
+ { 
+  close(d_fd);
+  return -1;
+ }
+ return 0;
+} 
+
+
+//==============================================================================
+// UDPClient::setSequencing
+//==============================================================================
+void UDPClient::setSequencing(bool enable)
+{
+ d_sequencing = enable;
+}
+
+
+//==============================================================================
+// UDPClient::sendRequest
+//==============================================================================
+int UDPClient::sendRequest(const char *outMsgBuf, int outMsgLen, unsigned int *seq)
+{
+ if(!d_init)
+ {
+  d_status.setReport(-1, "sendRequest: client not initialized");
+  return -1;
+ }
+ if( (outMsgBuf == NULL) || (outMsgLen < 0) )
+ {
+  d_status.setReport(EINVAL, "sendRequest: invalid buffer");
+  return -1;
+ }
+ if( (d_pending == NULL) && 
+     ((d_pending = (struct udp_pending *)calloc(UDP_MAX_PENDING, 
+     sizeof(struct udp_pending))) == NULL) )
+ {
+  setError(ENOMEM, "sendRequest(malloc)");
+  return -1;
+ }
+ 
+ // the slot of the number must be free, or its request expired
+ long long now = monotonicUs();
+ struct udp_pending *p = &d_pending[d_nextSeq % UDP_MAX_PENDING];
+ if( (seq != NULL) && p->busy && 
+     ((timeoutUs() == 0) || (now - p->sent < timeoutUs())) )
+ {
+  d_status.setReport(EAGAIN, "sendRequest: too many requests outstanding");
+  return -1;
+ }
+ 
+ struct udp_seq_header hdr;
+ hdr.code = UDP_CTRL_SEQ;
+ hdr.seq = d_nextSeq++;
+ if( transmit(&hdr, outMsgBuf, outMsgLen) == -1 )
+ {
+  setError(errno, "sendRequest(sendmsg)");
+  return -1;
+ }
+ if( seq == NULL )
+  return 0;
+ p->seq = hdr.seq;
+ p->sent = now;
+ p->busy = true;
+ *seq = hdr.seq;
+ return 0;
+}
+
+
+//==============================================================================
+// UDPClient::receiveReply
+//==============================================================================
+int UDPClient::receiveReply(char *inMsgBuf, int inBufLen, int *inMsgLen, 
+                            unsigned int *seq)
+{
+ if(!d_init)
+ {
+  d_status.setReport(-1, "receiveReply: client not initialized");
+  return -1;
+ }
+ if( (inMsgBuf == NULL) || (inMsgLen == NULL) || (seq == NULL) )
+ {
+  d_status.setReport(EINVAL, "receiveReply: invalid buffer");
+  return -1;
+ }
+ return waitReply(inMsgBuf, inBufLen, inMsgLen, seq, true);
+}
+
+
+//==============================================================================
+// UDPClient::waitReply
+//==============================================================================
+int UDPClient::waitReply(char *inMsgBuf, int inBufLen, int *inMsgLen, 
+                         unsigned int *seq, bool anySeq)
+{
+ // a timeout of 0 waits until a reply arrives, as SO_RCVTIMEO does
+ long long timeout = timeoutUs();
+ long long deadline = timeout ? monotonicUs() + timeout : 0;
+ struct sockaddr_in from;
+ struct udp_seq_header hdr;
+ 
+ while(1)
+ {
+  // wait within the timeout
+  int wait = -1;
+  if( deadline )
+  {
+   long long left = deadline - monotonicUs();
+   if( left <= 0 )
+   {
+    d_status.setReport(ETIMEDOUT, anySeq ? "receiveReply: timed out" 
+                       : "sendAndReceive(recv): timed out");
+    return -1;
+   }
+   wait = (int)((left + 999) / 1000);
+  }
+  struct pollfd pfd;
+  pfd.fd = d_fd;
+  pfd.events = POLLIN;
+  int n = poll(&pfd, 1, wait);
+  if( n == -1 )
+  {
+   if( errno == EINTR )
+    continue;
+   setError(errno, "sendAndReceive(poll)");
+   return -1;
+  }
+  if( n == 0 )
+   continue;
+  
+  int len = receiveMessage(inMsgBuf, inBufLen, seq ? &hdr : NULL, &from);
+  if( len == -1 )
+  {
+   if( (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) )
+    continue;
+   setError(errno, "sendAndReceive(recv)");
+   return -1;
+  }
+  
+  // skip packets from other sources
+  if( (from.sin_addr.s_addr != d_server.sin_addr.s_addr) || 
+      (from.sin_port != d_server.sin_port) )
+   continue;
+  if( seq == NULL )
+  {
+   *inMsgLen = len;
+   return 0;
+  }
+  
+  // skip replies to requests given up on, or not sent by us
+  if( (len < UDP_SEQ_HDRLEN) || (hdr.code != UDP_CTRL_SEQ) || (d_pending == NULL) )
+   continue;
+  struct udp_pending *p = &d_pending[hdr.seq % UDP_MAX_PENDING];
+  if( !p->busy || (p->seq != hdr.seq) || (!anySeq && (hdr.seq != *seq)) )
+   continue;
+  p->busy = false;
+  if( timeout && (monotonicUs() - p->sent >= timeout) )
+   continue;
+  *inMsgLen = len - UDP_SEQ_HDRLEN;
+  *seq = hdr.seq;
+  return 0;
+ }
+}
+
+
+//==============================================================================
+// UDPClient::receiveMessage
+//==============================================================================
+int UDPClient::receiveMessage(char *inMsgBuf, int inBufLen, 
+                              struct udp_seq_header *hdr, struct sockaddr_in *from)
+{
+ int hdrLen = hdr ? UDP_SEQ_HDRLEN : 0;
+ if( d_fragLen == 0 )
+ {
+  // the header of a sequenced reply lands apart from the message
+  struct iovec iov[2];
+  struct msghdr m;
+  memset(&m, 0, sizeof(m));
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = UDP_SEQ_HDRLEN;
+  iov[1].iov_base = inMsgBuf;
+  iov[1].iov_len = inBufLen;
+  m.msg_name = from;
+  m.msg_namelen = sizeof(struct sockaddr_in);
+  m.msg_iov = hdr ? iov : &iov[1];
+  m.msg_iovlen = hdr ? 2 : 1;
+  return recvmsg(d_fd, &m, MSG_DONTWAIT);
+ }
+ 
+ socklen_t fromLen = sizeof(struct sockaddr_in);
+ int len = recvfrom(d_fd, d_pkt, UDP_MAX_PAYLOAD, MSG_DONTWAIT, 
+                    (struct sockaddr *)from, &fromLen);
+ if( len == -1 )
+  return -1;
+ 
+ // fragments of other sources are left for the caller to skip
+ const char *msg = d_pkt;
+ struct udp_frag_header frag;
+ if( readFragHeader(d_pkt, len, &frag) && 
+     (from->sin_addr.s_addr == d_server.sin_addr.s_addr) && 
+     (from->sin_port == d_server.sin_port) )
+ {
+  d_frags->keep = (hdrLen + inBufLen > 0) ? hdrLen + inBufLen : 1;
+  d_frags->timeout = timeoutUs();
+  struct udp_frag_partial *p = addFragment(d_frags, from, &frag, 
+                                           d_pkt + UDP_FRAG_HDRLEN, 
+                                           len - UDP_FRAG_HDRLEN, monotonicUs());
+  if( p == NULL )
+  {
+   errno = EAGAIN;
+   return -1;
+  }
+  p->inUse = false;
+  msg = p->buf;
+  len = (p->bufCap < (int)p->total) ? p->bufCap : (int)p->total;
+ }
+ 
+ // split like recvmsg() does, the excess is discarded
+ if( len < hdrLen )
+ {
+  memcpy(hdr, msg, len);
+  return len;
+ }
+ if( hdr )
+  memcpy(hdr, msg, hdrLen);
+ int copyLen = (len - hdrLen < inBufLen) ? len - hdrLen : inBufLen;
+ memcpy(inMsgBuf, msg + hdrLen, copyLen);
+ return hdrLen + copyLen;
+}
+
+
+//==============================================================================
+// UDPClient::transmit
+//==============================================================================
+int UDPClient::transmit(const struct udp_seq_header *hdr, const char *msg, int msgLen)
+{
+ int hdrLen = hdr ? UDP_SEQ_HDRLEN : 0;
+ unsigned int msgId = d_nextFragId++;
+ for(int tries = 0; ; tries++)
+ {
+  int ret;
+  if( (d_fragLen == 0) || (hdrLen + msgLen <= d_fragLen) )
+   ret = sendReply(d_fd, hdr, hdrLen, msg, msgLen, &d_server, 
+                   sizeof(struct sockaddr_in));
+  else
+   ret = sendFragments(d_fd, hdr, hdrLen, msg, msgLen, msgId, d_fragLen, 
+                       &d_server, sizeof(struct sockaddr_in));
+  
+  // refused as too long, the path MTU has dropped. Try once more.
+  if( (ret == 0) || (errno != EMSGSIZE) || (d_fragSize != UDP_FRAG_AUTO) 
+      || (tries > 0) )
+   return ret;
+  int oldLen = d_fragLen;
+  if( (applyFragmentSize() == -1) || (d_fragLen >= oldLen) )
+  {
+   errno = EMSGSIZE;
+   return -1;
+  }
+ }
+}
+
+
+//==============================================================================
+// UDPClient::setMulticast
+//==============================================================================
+int UDPClient::setMulticast(int ttl, bool loopback, const char *interface)
+{
+ struct in_addr addr;
+ int index;
+ if( (ttl < 0) || (ttl > 255) || (readInterface(interface, &addr, &index) == -1) )
+ {
+  d_status.setReport(EINVAL, "setMulticast: invalid TTL or interface");
+  return -1;
+ }
+ d_mcastTtl = ttl;
+ d_mcastLoop = loopback;
+ d_mcastAddr = addr;
+ d_mcastIndex = index;
+ return applyMulticast();
+}
+
+
+//==============================================================================
+// UDPClient::applyMulticast
+//==============================================================================
+int UDPClient::applyMulticast()
+{
+ if( (d_fd == -1) || (d_mcastTtl == -1) )
+  return 0;
+ 
+ unsigned char ttl = d_mcastTtl;
+ unsigned char loop = d_mcastLoop ? 1 : 0;
+#ifdef __linux__
+ struct ip_mreqn req;
+ memset(&req, 0, sizeof(req));
+ req.imr_address = d_mcastAddr;
+ req.imr_ifindex = d_mcastIndex;
+#else
+ struct in_addr req = d_mcastAddr;
+#endif
+ if( setsockopt(d_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1 )
+ {
+  setError(errno, "setMulticast(setsockopt-IP_MULTICAST_TTL)");
+  return -1;
+ }
+ if( setsockopt(d_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == -1 )
+ {
+  setError(errno, "setMulticast(setsockopt-IP_MULTICAST_LOOP)");
+  return -1;
+ }
+ if( setsockopt(d_fd, IPPROTO_IP, IP_MULTICAST_IF, &req, sizeof(req)) == -1 )
+ {
+  setError(errno, "setMulticast(setsockopt-IP_MULTICAST_IF)");
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// UDPClient::setFragmentSize
+//==============================================================================
+int UDPClient::setFragmentSize(int fragmentSize)
+{
+ if( (fragmentSize != 0) && (fragmentSize != UDP_FRAG_AUTO) && 
+     ((fragmentSize < UDP_FRAG_MIN) || (fragmentSize > UDP_FRAG_MAX)) )
+ {
+  d_status.setReport(EINVAL, "setFragmentSize: invalid size");
+  return -1;
+ }
+ if( (fragmentSize != 0) && (d_pkt == NULL) && 
+     ((d_pkt = (char *)malloc(UDP_MAX_PAYLOAD)) == NULL) )
+ {
+  setError(ENOMEM, "setFragmentSize(malloc)");
+  return -1;
+ }
+ if( (fragmentSize != 0) && (d_frags == NULL) && 
+     ((d_frags = newFragTable(UDP_FRAG_CLIENT_MSGS, UDP_FRAG_CLIENT_MAX, 
+     timeoutUs())) == NULL) )
+ {
+  setError(ENOMEM, "setFragmentSize(malloc)");
+  return -1;
+ }
+ d_fragSize = fragmentSize;
+ return applyFragmentSize();
+}
+
+
+//==============================================================================
+// UDPClient::applyFragmentSize
+//==============================================================================
+int UDPClient::applyFragmentSize()
+{
+ d_fragLen = d_fragSize;
+ if( d_fd == -1 )
+  return 0;
+ 
+#ifdef __linux__
+ // fragments must not be split by IP on the way
+ int pmtu = (d_fragSize != 0) ? IP_PMTUDISC_DO : IP_PMTUDISC_WANT;
+ if( setsockopt(d_fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(int)) == -1 )
+ {
+  setError(errno, "setFragmentSize(setsockopt-IP_MTU_DISCOVER)");
+  return -1;
+ }
+ 
+ // the kernel's path MTU estimate is only read from a connected socket
+ if( d_fragSize == UDP_FRAG_AUTO )
+ {
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  int mtu;
+  socklen_t mtuLen = sizeof(int);
+  if( (fd != -1) && (connect(fd, (struct sockaddr *)&d_server, 
+      sizeof(struct sockaddr_in)) == 0) && 
+      (getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &mtuLen) == 0) )
+   d_fragLen = mtu - 28; // IPv4 and UDP headers
+  if( fd != -1 )
+   close(fd);
+ }
+#endif
+ if( d_fragLen == UDP_FRAG_AUTO )
+  d_fragLen = UDP_FRAG_DEFAULT;
+ if( d_fragLen > UDP_FRAG_MAX )
+  d_fragLen = UDP_FRAG_MAX;
+ if( (d_fragLen != 0) && (d_fragLen < UDP_FRAG_MIN) )
+  d_fragLen = UDP_FRAG_MIN;
+ return 0;
+}
+
+
+//==============================================================================
+// UDPClient::timeoutUs
+//==============================================================================
+long long UDPClient::timeoutUs() const
+{
+ return (long long)d_recvTimeout.tv_sec * 1000000 + d_recvTimeout.tv_usec;
+}
+                   
+
+//==============================================================================
+// UDPClient::sendSegments
+//==============================================================================
+int UDPClient::sendSegments(const char *outMsgBuf, int outMsgLen, int segmentSize)
+{
+ if(!d_init)
+ {
+  d_status.setReport(-1, "sendSegments: client not initialized");
+  return -1;
+ }
+ if( (outMsgBuf == NULL) || (outMsgLen < 0) || (segmentSize < 1) 
+     || (segmentSize > UDP_MAX_PAYLOAD) )
+ {
+  d_status.setReport(EINVAL, "sendSegments: invalid buffer or segment size");
+  return -1;
+ }
+ 
+ // the kernel takes a limited number of segments per datagram
+ int perSend = UDP_MAX_PAYLOAD / segmentSize;
+ if( perSend > UDP_GSO_MAXSEGS )
+  perSend = UDP_GSO_MAXSEGS;
+ 
+ int sent = 0;
+ while( sent < outMsgLen )
+ {
+  int len = outMsgLen - sent;
+  if( len > perSend * segmentSize )
+   len = perSend * segmentSize;
+  
+#ifdef __linux__
+  // one large buffer, cut into datagrams by the kernel (or the NIC)
+  if( d_gso && (len > segmentSize) )
+  {
+   struct msghdr msg;
+   struct iovec iov;
+   char control[CMSG_SPACE(sizeof(uint16_t))];
+   memset(&msg, 0, sizeof(msg));
+   memset(control, 0, sizeof(control));
+   iov.iov_base = (void *)(outMsgBuf + sent);
+   iov.iov_len = len;
+   msg.msg_name = &d_server;
+   msg.msg_namelen = sizeof(struct sockaddr_in);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_UDP;
+   cmsg->cmsg_type = UDP_SEGMENT;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+   uint16_t gsoSize = segmentSize;
+   memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(uint16_t));
+   if( sendmsg(d_fd, &msg, 0) == len )
+   {
+    sent += len;
+    continue;
+   }
+   
+   // no segmentation offload here, send datagram by datagram from now on
+   if( (errno != EINVAL) && (errno != EIO) && (errno != ENOPROTOOPT) )
+   {
+    setError(errno, "sendSegments(sendmsg)");
+    return -1;
+   }
+   d_gso = false;
+  }
+#endif
+  
+  for(int offset = 0; offset < len; offset += segmentSize)
+  {
+   int segLen = (len - offset < segmentSize) ? len - offset : segmentSize;
+   if( sendto(d_fd, outMsgBuf + sent + offset, segLen, 0, 
+       (struct sockaddr *)&d_server, sizeof(struct sockaddr_in)) < segLen )
+   {
+    setError(errno, "sendSegments(sendto)");
+    return -1;
+   }
+  }
+  sent += len;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// UDPClient::init
+//==============================================================================
+int UDPClient::init(const char *serverIp, int port, struct timeval &timout, int bdp)
+{
+ struct hostent *server;
+ struct sockaddr_in clientSock;
+ char info[80];
  
- // bind a name to the socket
- name.sin_family = AF_INET;
- name.sin_port = htons(port);
- name.sin_addr.s_addr = htonl(INADDR_ANY);
- memset(&(name.sin_zero), '\0', 8);
- if( bind(d_fd, (struct sockaddr *)&name, sizeof(struct sockaddr)) == -1)
+ d_recvTimeout.tv_sec = timout.tv_sec;
+ d_recvTimeout.tv_usec = timout.tv_usec;
+ d_bdp = bdp;
+
+ if(d_fd)
+ {
+  close(d_fd);
+  d_fd = -1;
+ }
+
+ d_init = false;
+ 
+ // copy the server name
+ int nlen;
+ nlen = strlen(serverIp);
+ if( !d_serverName ) {
+  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
+  if( d_serverName == NULL ) {
+   setError(-1, "init(realloc)");
+   return -1;
+  }
+  strncpy(d_serverName, serverIp, nlen);
+  d_serverName[nlen] = '\0';
+ }
+ else if(strncmp(d_serverName, serverIp, nlen)) {
+  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
+  if( d_serverName == NULL ) {
+   setError(-1, "init(realloc)");
+   return -1;
+  }
+  strncpy(d_serverName, serverIp, nlen);
+  d_serverName[nlen] = '\0';
+ }
+ d_serverPort = port;
+
+ // set up client socket info
+ clientSock.sin_family=AF_INET;
+ clientSock.sin_addr.s_addr=htonl(INADDR_ANY);
+ clientSock.sin_port=htons(0);
+ memset(&(clientSock.sin_zero), '\0', 8);
+
+ // open client socket
+ if( (d_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+ {
+  setError(errno, "init(socket)");
+  return -1;
+ }
+
+ // set suggested optimal socket buffer sizes.
+ int yes = d_bdp * 1024;
+ if( yes != 0 ) {
+  if( setsockopt(d_fd, SOL_SOCKET, SO_SNDBUF, (char *)&yes, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_SNDBUF)");
+   close(d_fd);
+   d_fd = -1;
+   return -1;
+  }
+
+  // set suggested optimal socket buffer sizes.
+  if( setsockopt(d_fd, SOL_SOCKET, SO_RCVBUF, (char *)&yes, sizeof(int)) == -1)
+  {
+   setError(errno, "init(setsockopt-SO_RCVBUF)");
+   close(d_fd);
+   d_fd = -1;
+   return -1;
+  }
+ }
+
+ // set receive timeout 
+ if( setsockopt(d_fd, SOL_SOCKET, SO_RCVTIMEO, &d_recvTimeout, 
+     sizeof(struct timeval)) == -1)
+ {
+  setError(errno, "init(setsockopt) SO_RCVTIMEO");
+  close(d_fd);
+  d_fd = -1;
+  return -1;
+ }
+
+ // bind client socket
+ if( bind(d_fd, (struct sockaddr *)&clientSock, sizeof(struct sockaddr)) == -1)
  {
   setError(errno, "init(bind)");
   close(d_fd);
@@ -183,310 +2809,722 @@ int UDPServer::init(int port, int maxMsgSize, int bdp)
   return -1;
  }
 
- // Create the buffer to store client messages
- d_rcvBuf = (char *)realloc(d_rcvBuf, maxMsgSize * sizeof(char));
- if(d_rcvBuf == NULL)
+ // get network server entry
+ server = gethostbyname(serverIp);
+ if( server == NULL )
+ {
+  snprintf(info, 80, "gethostbyname %s", hstrerror(h_errno));
+  d_status.setReport(h_errno, info);
+  close(d_fd);
+  d_fd = -1;
+  return -1;
+ }
+ 
+ // server socket info
+ d_server.sin_family = AF_INET;
+ d_server.sin_port = htons(port);
+ d_server.sin_addr.s_addr = *((in_addr_t *)server->h_addr);
+ memset(&(d_server.sin_zero), '\0', 8);
+
+ // replies to requests on the old socket will not come
+ if( d_pending )
+  memset(d_pending, 0, UDP_MAX_PENDING * sizeof(struct udp_pending));
+ for(int k = 0; d_frags && (k < d_frags->size); k++)
+  d_frags->parts[k].inUse = false;
+ 
+ // fragments sized for the path to this server, multicast options
+ if( ((d_fragSize != 0) && (applyFragmentSize() == -1)) || 
+     (applyMulticast() == -1) )
+ {
+  close(d_fd);
+  d_fd = -1;
+  return -1;
+ }
+
+ d_init = true; 
+ return 0;
+}
+
+
+//==============================================================================
+// UDPClient::getStatusCode
+//==============================================================================
+int UDPClient::getStatusCode() const
+{
+ return d_status.getReportCode();
+}
+
+
+//==============================================================================
+// UDPClient::getStatusMessage
+//==============================================================================
+const char *UDPClient::getStatusMessage() const
+{
+ return d_status.getReportMessage();
+}
+
+
+//==============================================================================
+// UDPClient::setError
+//==============================================================================
+void UDPClient::setError(int code, const char *functionName)
+{
+ char buf[80];
+ snprintf(buf, 80, "%s: %s", functionName, strerror(code));
+ d_status.setReport(code, buf);
+}
+
+
+//==============================================================================
+// UDPReliableClient::UDPReliableClient
+//==============================================================================
+UDPReliableClient::UDPReliableClient()
+{
+ d_slots = NULL;
+ d_unreliable = NULL;
+ d_numUnreliable = 0;
+ d_pkt = NULL;
+ d_maxMsgSize = 0;
+ d_conn = 0;
+ d_base = 0;
+ d_nextSeq = 0;
+ d_nextId = 0;
+ d_window = UDP_REL_WINDOW;
+ d_peerWindow = UDP_REL_WINDOW;
+ d_srtt = 0;
+ d_rttvar = 0;
+ d_rto = UDP_REL_INITIAL_RTO;
+ d_retransmits = 0;
+ d_lastHeard = 0;
+ d_sendLoss = 0;
+ d_receiveLoss = 0;
+ d_seed = (unsigned int)(monotonicUs() ^ getpid() ^ (long)this);
+ d_status.setReport(0, "UDPReliableClient");
+}
+
+
+//==============================================================================
+// UDPReliableClient::~UDPReliableClient
+//==============================================================================
+UDPReliableClient::~UDPReliableClient()
+{
+ for(int k = 0; d_slots && (k < UDP_REL_WINDOW); k++)
+ {
+  free(d_slots[k].msg);
+  free(d_slots[k].reply);
+ }
+ for(int k = 0; d_unreliable && (k < UDP_REL_MAX_REPLIES); k++)
+  free(d_unreliable[k].data);
+ free(d_slots);
+ free(d_unreliable);
+ free(d_pkt);
+}
+
+
+//==============================================================================
+// UDPReliableClient::init
+//==============================================================================
+int UDPReliableClient::init(const char *serverIp, int port, struct timeval &timeout,
+                            int maxMsgSize, int bdp)
+{
+ if( maxMsgSize < 0 )
+ {
+  d_status.setReport(EINVAL, "init: invalid message size");
+  return -1;
+ }
+ if( d_slots == NULL )
+ {
+  d_slots = (struct udp_rel_slot *)calloc(UDP_REL_WINDOW, sizeof(struct udp_rel_slot));
+  d_unreliable = (struct udp_rel_reply *)calloc(UDP_REL_MAX_REPLIES, 
+                                                sizeof(struct udp_rel_reply));
+  if( (d_slots == NULL) || (d_unreliable == NULL) )
+  {
+   free(d_slots);
+   free(d_unreliable);
+   d_slots = NULL;
+   d_unreliable = NULL;
+   d_status.setReport(ENOMEM, "init(calloc)");
+   return -1;
+  }
+ }
+ 
+ // replies to unreliable messages are kept in buffers of their own
+ for(int k = 0; k < UDP_REL_MAX_REPLIES; k++)
+ {
+  char *buf = (char *)realloc(d_unreliable[k].data, maxMsgSize + 1);
+  if( buf == NULL )
+  {
+   d_status.setReport(ENOMEM, "init(realloc)");
+   return -1;
+  }
+  d_unreliable[k].data = buf;
+ }
+ char *buf = (char *)realloc(d_pkt, maxMsgSize + UDP_HDR_ROOM);
+ if( buf == NULL )
+ {
+  d_status.setReport(ENOMEM, "init(realloc)");
+  return -1;
+ }
+ d_pkt = buf;
+ d_maxMsgSize = maxMsgSize;
+ 
+ reset();
+ if( d_client.init(serverIp, port, timeout, bdp) == -1 )
+ {
+  d_status.setReport(d_client.getStatusCode(), d_client.getStatusMessage());
+  return -1;
+ }
+ return 0;
+}
+
+
+//==============================================================================
+// UDPReliableClient::send
+//==============================================================================
+int UDPReliableClient::send(const char *outMsgBuf, int outMsgLen, int mode, 
+                            unsigned int *id)
+{
+ if( (d_slots == NULL) || !d_client.d_init )
+ {
+  d_status.setReport(-1, "send: client not initialized");
+  return -1;
+ }
+ if( (outMsgBuf == NULL) || (outMsgLen < 0) || (outMsgLen > d_maxMsgSize) 
+     || (id == NULL) )
+ {
+  d_status.setReport(EINVAL, "send: invalid buffer");
+  return -1;
+ }
+ if( (mode != UDP_UNRELIABLE) && (mode != UDP_RELIABLE) && 
+     (mode != UDP_RELIABLE_ORDERED) )
+ {
+  d_status.setReport(EINVAL, "send: invalid mode");
+  return -1;
+ }
+ 
+ // unreliable messages are sent once, numbered apart
+ if( mode == UDP_UNRELIABLE )
+ {
+  struct udp_rel_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.code = UDP_CTRL_REL;
+  hdr.conn = d_conn;
+  hdr.seq = d_nextId;
+  hdr.ack = d_base;
+  hdr.flags = UDP_REL_DATA | UDP_REL_UNRELIABLE;
+  *id = d_nextId++;
+  if( !simulateLoss(d_sendLoss) && (sendReply(d_client.d_fd, &hdr, UDP_HDR_ROOM, 
+      outMsgBuf, outMsgLen, &d_client.d_server, sizeof(struct sockaddr_in)) == -1) )
+  {
+   d_status.setReport(errno, "send(sendmsg): could not send");
+   return -1;
+  }
+  return 0;
+ }
+ 
+ // wait for room in the window
+ long long deadline = deadlineAfter(d_client.timeoutUs());
+ int window = (d_window < d_peerWindow) ? d_window : d_peerWindow;
+ while( (int)(d_nextSeq - d_base) >= window )
+ {
+  // the oldest reply must be taken with receive() first
+  if( d_slots[d_base % UDP_REL_WINDOW].hasReply || (monotonicUs() >= deadline) )
+  {
+   d_status.setReport(EAGAIN, "send: window full");
+   return -1;
+  }
+  if( pump(deadline) == -1 )
+   return -1;
+  window = (d_window < d_peerWindow) ? d_window : d_peerWindow;
+ }
+ 
+ struct udp_rel_slot *s = &d_slots[d_nextSeq % UDP_REL_WINDOW];
+ if( s->msgCap < outMsgLen )
+ {
+  char *buf = (char *)realloc(s->msg, outMsgLen);
+  if( buf == NULL )
+  {
+   d_status.setReport(ENOMEM, "send(realloc)");
+   return -1;
+  }
+  s->msg = buf;
+  s->msgCap = outMsgLen;
+ }
+ memcpy(s->msg, outMsgBuf, outMsgLen);
+ s->msgLen = outMsgLen;
+ s->inUse = true;
+ s->seq = d_nextSeq++;
+ s->id = d_nextId++;
+ s->ordered = (mode == UDP_RELIABLE_ORDERED);
+ s->sends = 0;
+ s->silent = 0;
+ s->sampled = false;
+ s->received = false;
+ s->fastResent = false;
+ s->complete = false;
+ s->hasReply = false;
+ *id = s->id;
+ if( transmit(s) == -1 )
+  return -1;
+ 
+ // take what arrived meanwhile, without waiting
+ return pump(0);
+}
+
+
+//==============================================================================
+// UDPReliableClient::receive
+//==============================================================================
+int UDPReliableClient::receive(char *inMsgBuf, int inBufLen, int *inMsgLen, 
+                               unsigned int *id)
+{
+ if( (d_slots == NULL) || !d_client.d_init )
+ {
+  d_status.setReport(-1, "receive: client not initialized");
+  return -1;
+ }
+ if( (inMsgBuf == NULL) || (inBufLen < 0) || (inMsgLen == NULL) || (id == NULL) )
+ {
+  d_status.setReport(EINVAL, "receive: invalid buffer");
+  return -1;
+ }
+ 
+ long long deadline = deadlineAfter(d_client.timeoutUs());
+ while(1)
+ {
+  // replies to unreliable messages first, they may be dropped
+  if( d_numUnreliable > 0 )
+  {
+   struct udp_rel_reply first = d_unreliable[0];
+   *inMsgLen = (first.len < inBufLen) ? first.len : inBufLen;
+   memcpy(inMsgBuf, first.data, *inMsgLen);
+   *id = first.id;
+   memmove(&d_unreliable[0], &d_unreliable[1], 
+           (UDP_REL_MAX_REPLIES - 1) * sizeof(struct udp_rel_reply));
+   d_unreliable[UDP_REL_MAX_REPLIES - 1] = first;
+   d_numUnreliable--;
+   return 0;
+  }
+  
+  unsigned int seq;
+  if( nextReply(&seq) )
+  {
+   struct udp_rel_slot *s = &d_slots[seq % UDP_REL_WINDOW];
+   *inMsgLen = (s->replyLen < inBufLen) ? s->replyLen : inBufLen;
+   memcpy(inMsgBuf, s->reply, *inMsgLen);
+   *id = s->id;
+   s->hasReply = false;
+   s->inUse = false;
+   releaseSlots();
+   return 0;
+  }
+  
+  if( monotonicUs() >= deadline )
+  {
+   d_status.setReport(ETIMEDOUT, "receive: timed out");
+   return -1;
+  }
+  if( pump(deadline) == -1 )
+   return -1;
+ }
+}
+
+
+//==============================================================================
+// UDPReliableClient::flush
+//==============================================================================
+int UDPReliableClient::flush()
+{
+ if( (d_slots == NULL) || !d_client.d_init )
  {
-  setError(ENOMEM, "UDPServer(malloc)");
-  close(d_fd);
-  d_fd = -1;
+  d_status.setReport(-1, "flush: client not initialized");
   return -1;
  }
- d_rcvBufSize = maxMsgSize;
- d_init = true;
  
- return 0;
+ // gives up only when a message is not acknowledged
+ while(1)
+ {
+  bool done = true;
+  for(unsigned int seq = d_base; seq != d_nextSeq; seq++)
+  {
+   struct udp_rel_slot *s = &d_slots[seq % UDP_REL_WINDOW];
+   if( s->inUse && !s->complete )
+    done = false;
+  }
+  if( done )
+   return 0;
+  if( pump(deadlineAfter(d_client.timeoutUs())) == -1 )
+   return -1;
+ }
 }
 
 
 //==============================================================================
-// UDPServer::getStatusCode
+// UDPReliableClient::setWindow
 //==============================================================================
-int UDPServer::getStatusCode() const
+int UDPReliableClient::setWindow(int numMessages)
 {
- return d_status.getReportCode();
+ if( (numMessages < 1) || (numMessages > UDP_REL_WINDOW) )
+ {
+  d_status.setReport(EINVAL, "setWindow: invalid size");
+  return -1;
+ }
+ d_window = numMessages;
+ return 0;
 }
 
 
 //==============================================================================
-// UDPServer::getStatusMessage
+// UDPReliableClient::setLossSimulation
 //==============================================================================
-const char *UDPServer::getStatusMessage() const
+void UDPReliableClient::setLossSimulation(double sendLoss, double receiveLoss)
 {
- return d_status.getReportMessage();
+ d_sendLoss = sendLoss;
+ d_receiveLoss = receiveLoss;
 }
 
 
 //==============================================================================
-// UDPServer::setError
+// UDPReliableClient::getRoundTripTime
 //==============================================================================
-void UDPServer::setError(int code, const char *functionName)
+long long UDPReliableClient::getRoundTripTime() const
 {
- char buf[80];
- snprintf(buf, 80, "%s: %s", functionName, strerror(code));
- d_status.setReport(code, buf);
+ return d_srtt;
 }
 
 
 //==============================================================================
-// UDPClient::UDPClient
+// UDPReliableClient::getRetransmissions
 //==============================================================================
-UDPClient::UDPClient()
+long long UDPReliableClient::getRetransmissions() const
 {
- d_fd = -1;
- d_init = false;
- d_serverName = NULL;
- d_serverPort = 0;
- d_recvTimeout.tv_sec = 1;
- d_recvTimeout.tv_usec = 0;
- d_bdp = 0;
- setError(0, "UDPClient");
+ return d_retransmits;
 }
 
 
-UDPClient::UDPClient(const char *serverIp, int port, struct timeval &t, int bdp)
+//==============================================================================
+// UDPReliableClient::getStatusCode
+//==============================================================================
+int UDPReliableClient::getStatusCode() const
 {
- d_init = false;
- d_serverName = NULL;
- d_serverPort = 0;
- d_fd = -1;
- d_recvTimeout.tv_sec = 1;
- d_recvTimeout.tv_usec = 0;
- d_bdp = 0;
- 
- // init connection to server
- if( init(serverIp, port, t, bdp) == -1 )
-  return;
- 
- setError(0, "UDPClient");
+ return d_status.getReportCode();
 }
 
 
 //==============================================================================
-// UDPClient::~UDPClient
+// UDPReliableClient::getStatusMessage
 //==============================================================================
-UDPClient::~UDPClient()
+const char *UDPReliableClient::getStatusMessage() const
 {
- if(d_fd)
- {
-  close(d_fd);
-  d_fd = -1;
- }
- if(d_serverName)
-  free(d_serverName);
+ return d_status.getReportMessage();
 }
 
 
 //==============================================================================
-// UDPClient::sendAndReceive
+// UDPReliableClient::transmit
 //==============================================================================
-int UDPClient::sendAndReceive(char *outMsgBuf, int outMsgLen,
-                     char *inMsgBuf, int inBufLen, int *inMsgLen)
+int UDPReliableClient::transmit(struct udp_rel_slot *s)
 {
- int serverAddrLen;
- struct sockaddr_in fromAddress;
- char info[80];
+ struct udp_rel_header hdr;
+ memset(&hdr, 0, sizeof(hdr));
+ hdr.code = UDP_CTRL_REL;
+ hdr.conn = d_conn;
+ hdr.seq = s->seq;
+ hdr.ack = d_base;
+ hdr.flags = UDP_REL_DATA | (s->ordered ? UDP_REL_ORDERED : 0);
+ hdr.window = d_window;
  
- if(!d_init)
+ // loss alone does not slow down resends. Once the server was silent 
+ // for a few resends in a row, each resend waits twice as long.
+ long long now = monotonicUs();
+ if( s->sends > 0 )
  {
-  d_status.setReport(-1, "sendAndReceive: client not initialized");
-  return -1;
+  d_retransmits++;
+  s->silent = (d_lastHeard < s->sent) ? s->silent + 1 : 0;
  }
-
- // initialize connection again if we lost it due to error.
- if( fcntl(d_fd, F_GETFL) == -1 )
+ int shift = s->silent - UDP_REL_DUP_THRESH + 1;
+ long long rto = d_rto << ((shift < 0) ? 0 : (shift > 10) ? 10 : shift);
+ if( rto > UDP_REL_MAX_RTO )
+  rto = UDP_REL_MAX_RTO;
+ s->sends++;
+ s->sent = now;
+ s->due = now + rto;
+ 
+ if( simulateLoss(d_sendLoss) )
+  return 0;
+ if( sendReply(d_client.d_fd, &hdr, UDP_HDR_ROOM, s->msg, s->msgLen, 
+     &d_client.d_server, sizeof(struct sockaddr_in)) == -1 )
  {
-  if( init(d_serverName, d_serverPort, d_recvTimeout, d_bdp) == -1 )
-   return -1;
+  d_status.setReport(errno, "send(sendmsg): could not send");
+  return -1;
  }
+ return 0;
+}
 
- // check buffer pointers
- if( outMsgBuf == NULL )
+
+//==============================================================================
+// UDPReliableClient::pump
+//==============================================================================
+int UDPReliableClient::pump(long long deadline)
+{
+ // wait until the deadline or the next resend
+ long long now = monotonicUs();
+ long long wake = deadline;
+ for(unsigned int seq = d_base; seq != d_nextSeq; seq++)
  {
-  d_status.setReport(EINVAL, "sendAndReceive: invalid buffer");
-  return -1;
+  struct udp_rel_slot *s = &d_slots[seq % UDP_REL_WINDOW];
+  if( s->inUse && !s->complete && (s->due < wake) )
+   wake = s->due;
  }
-
- // write message to server
- serverAddrLen = sizeof(struct sockaddr_in);
- if( sendto(d_fd, outMsgBuf, outMsgLen, 0, (struct sockaddr *)&d_server, 
-     serverAddrLen) < outMsgLen )
+ struct pollfd pfd;
+ pfd.fd = d_client.d_fd;
+ pfd.events = POLLIN;
+ int wait = (wake == LLONG_MAX) ? -1 
+            : (wake > now) ? (int)((wake - now + 999) / 1000) : 0;
+ if( (poll(&pfd, 1, wait) == -1) && (errno != EINTR) )
  {
-  setError(errno, "sendAndReceive(send)");
-  close(d_fd);
+  d_status.setReport(errno, "receive(poll): could not wait");
   return -1;
  }
  
- if( inMsgBuf == NULL)
-  return 0;
-
-
- // receive reply
- if( (*inMsgLen = recvfrom(d_fd, inMsgBuf, inBufLen, 0, (struct sockaddr *)&fromAddress, 
-     (socklen_t *)&serverAddrLen)) == -1 )
- { 
-  setError(errno, "sendAndReceive(recv)");
-  close(d_fd);
-  return -1;
- }
-
- // received reply from someone else
- if(fromAddress.sin_addr.s_addr != d_server.sin_addr.s_addr)
+ // take all packets waiting
+ while(1)
  {
-  snprintf(info, 80, "sendAndReceive(recv): Received message from some other source");
-  d_status.setReport(-1, info);
-  close(d_fd);
-  d_fd = -1;
-  return -1;
+  struct sockaddr_in from;
+  socklen_t fromLen = sizeof(from);
+  int len = recvfrom(d_client.d_fd, d_pkt, d_maxMsgSize + UDP_HDR_ROOM, 
+                     MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen);
+  if( len == -1 )
+   break;
+  if( (from.sin_addr.s_addr != d_client.d_server.sin_addr.s_addr) || 
+      (from.sin_port != d_client.d_server.sin_port) || 
+      simulateLoss(d_receiveLoss) )
+   continue;
+  d_lastHeard = monotonicUs();
+  processPacket(d_pkt, len);
  }
  
+ // resend what is due. Messages the server holds are only probed.
+ now = monotonicUs();
+ for(unsigned int seq = d_base; seq != d_nextSeq; seq++)
+ {
+  struct udp_rel_slot *s = &d_slots[seq % UDP_REL_WINDOW];
+  if( !s->inUse || s->complete || (s->due > now) )
+   continue;
+  if( !s->received && (s->silent >= UDP_REL_MAX_RETRIES) && 
+      (d_lastHeard < s->sent) )
+  {
+   reset();
+   d_status.setReport(ETIMEDOUT, "send: server not responding");
+   return -1;
+  }
+  s->fastResent = false;
+  transmit(s);
+ }
  return 0;
-} 
-                   
+}
+
 
 //==============================================================================
-// UDPClient::init
+// UDPReliableClient::processPacket
 //==============================================================================
-int UDPClient::init(const char *serverIp, int port, struct timeval &timout, int bdp)
+void UDPReliableClient::processPacket(const char *pkt, int len)
 {
- struct hostent *server;
- struct sockaddr_in clientSock;
- char info[80];
+ struct udp_rel_header hdr;
+ if( len < UDP_HDR_ROOM )
+  return;
+ memcpy(&hdr, pkt, UDP_HDR_ROOM);
+ if( (hdr.code != UDP_CTRL_REL) || (hdr.conn != d_conn) || (hdr.flags & UDP_REL_DATA) )
+  return;
+ const char *payload = pkt + UDP_HDR_ROOM;
+ int payloadLen = len - UDP_HDR_ROOM;
  
- d_recvTimeout.tv_sec = timout.tv_sec;
- d_recvTimeout.tv_usec = timout.tv_usec;
- d_bdp = bdp;
-
- if(d_fd)
+ // keep replies to unreliable messages, dropping the oldest if full
+ if( hdr.flags & UDP_REL_UNRELIABLE )
  {
-  close(d_fd);
-  d_fd = -1;
+  if( !(hdr.flags & UDP_REL_REPLY) )
+   return;
+  if( d_numUnreliable == UDP_REL_MAX_REPLIES )
+  {
+   struct udp_rel_reply first = d_unreliable[0];
+   memmove(&d_unreliable[0], &d_unreliable[1], 
+           (UDP_REL_MAX_REPLIES - 1) * sizeof(struct udp_rel_reply));
+   d_unreliable[UDP_REL_MAX_REPLIES - 1] = first;
+   d_numUnreliable--;
+  }
+  struct udp_rel_reply *r = &d_unreliable[d_numUnreliable++];
+  r->id = hdr.seq;
+  r->len = payloadLen;
+  memcpy(r->data, payload, payloadLen);
+  return;
  }
-
- d_init = false;
  
- // copy the server name
- int nlen;
- nlen = strlen(serverIp);
- if( !d_serverName ) {
-  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
-  if( d_serverName == NULL ) {
-   setError(-1, "init(realloc)");
-   return -1;
+ long long now = monotonicUs();
+ d_peerWindow = hdr.window;
+ if( (d_peerWindow < 1) || (d_peerWindow > UDP_REL_WINDOW) )
+  d_peerWindow = UDP_REL_WINDOW;
+ 
+ // the packet answers one message; only a message sent once gives a 
+ // round-trip time that is not ambiguous, and only one the server did not
+ // hold back a round trip that is not stretched
+ struct udp_rel_slot *s = &d_slots[hdr.seq % UDP_REL_WINDOW];
+ if( s->inUse && (s->seq == hdr.seq) && !s->complete )
+ {
+  if( !s->sampled && (s->sends == 1) && !(hdr.flags & UDP_REL_HELD) )
+   sampleRtt(now - s->sent);
+  s->sampled = true;
+  if( hdr.flags & UDP_REL_NOREPLY )
+  {
+   s->inUse = false;
+   s->complete = true;
   }
-  strncpy(d_serverName, serverIp, nlen);
-  d_serverName[nlen] = '\0';
- }
- else if(strncmp(d_serverName, serverIp, nlen)) {
-  d_serverName = (char *)realloc(d_serverName, (nlen+1) * sizeof(char));
-  if( d_serverName == NULL ) {
-   setError(-1, "init(realloc)");
-   return -1;
+  else if( hdr.flags & UDP_REL_REPLY )
+  {
+   if( payloadLen > d_maxMsgSize )
+    payloadLen = d_maxMsgSize;
+   if( s->replyCap < payloadLen )
+   {
+    char *buf = (char *)realloc(s->reply, payloadLen);
+    if( buf == NULL )
+     return;
+    s->reply = buf;
+    s->replyCap = payloadLen;
+   }
+   memcpy(s->reply, payload, payloadLen);
+   s->replyLen = payloadLen;
+   s->complete = true;
+   s->received = true;
+   s->hasReply = true;
   }
-  strncpy(d_serverName, serverIp, nlen);
-  d_serverName[nlen] = '\0';
  }
- d_serverPort = port;
-
- // set up client socket info
- clientSock.sin_family=AF_INET;
- clientSock.sin_addr.s_addr=htonl(INADDR_ANY);
- clientSock.sin_port=htons(0);
- memset(&(clientSock.sin_zero), '\0', 8);
-
- // open client socket
- if( (d_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+ 
+ // cumulative and selective acknowledgement
+ for(unsigned int seq = d_base; seq != d_nextSeq; seq++)
  {
-  setError(errno, "init(socket)");
-  return -1;
- }
-
- // set suggested optimal socket buffer sizes.
- int yes = d_bdp * 1024;
- if( yes != 0 ) {
-  if( setsockopt(d_fd, SOL_SOCKET, SO_SNDBUF, (char *)&yes, sizeof(int)) == -1)
+  struct udp_rel_slot *a = &d_slots[seq % UDP_REL_WINDOW];
+  if( !a->inUse || a->complete )
+   continue;
+  int above = (int)(seq - hdr.ack);
+  if( (above == 0) || ((above > 0) && ((above > 64) || 
+      !((hdr.sack >> (above - 1)) & 1))) )
+   continue;
+  a->received = true;
+  
+  // handled by the server, but the reply was lost: ask again. Messages 
+  // held back are only probed if the server falls silent.
+  if( (above < 0) || !a->ordered )
   {
-   setError(errno, "init(setsockopt-SO_SNDBUF)");
-   close(d_fd);
-   d_fd = -1;
-   return -1;
+   if( !a->fastResent )
+   {
+    a->fastResent = true;
+    transmit(a);
+   }
   }
-
-  // set suggested optimal socket buffer sizes.
-  if( setsockopt(d_fd, SOL_SOCKET, SO_RCVBUF, (char *)&yes, sizeof(int)) == -1)
+  else if( a->due < now + 2 * d_rto )
+   a->due = now + 2 * d_rto;
+ }
+ 
+ // resend a message once later ones were acknowledged before it
+ int later = 0;
+ for(unsigned int seq = d_nextSeq; seq != d_base; )
+ {
+  struct udp_rel_slot *l = &d_slots[--seq % UDP_REL_WINDOW];
+  if( !l->inUse )
+   continue;
+  if( l->received )
+   later++;
+  else if( (later >= UDP_REL_DUP_THRESH) && !l->fastResent )
   {
-   setError(errno, "init(setsockopt-SO_RCVBUF)");
-   close(d_fd);
-   d_fd = -1;
-   return -1;
+   l->fastResent = true;
+   transmit(l);
   }
  }
+ releaseSlots();
+}
 
- // set receive timeout 
- if( setsockopt(d_fd, SOL_SOCKET, SO_RCVTIMEO, &d_recvTimeout, 
-     sizeof(struct timeval)) == -1)
+
+//==============================================================================
+// UDPReliableClient::sampleRtt
+//==============================================================================
+void UDPReliableClient::sampleRtt(long long rtt)
+{
+ // RFC 6298
+ if( d_srtt == 0 )
  {
-  setError(errno, "init(setsockopt) SO_RCVTIMEO");
-  close(d_fd);
-  d_fd = -1;
-  return -1;
+  d_srtt = (rtt > 0) ? rtt : 1;
+  d_rttvar = rtt / 2;
  }
-
- // bind client socket
- if( bind(d_fd, (struct sockaddr *)&clientSock, sizeof(struct sockaddr)) == -1)
+ else
  {
-  setError(errno, "init(bind)");
-  close(d_fd);
-  d_fd = -1;
-  return -1;
+  long long err = (d_srtt > rtt) ? d_srtt - rtt : rtt - d_srtt;
+  d_rttvar = (3 * d_rttvar + err) / 4;
+  d_srtt = (7 * d_srtt + rtt) / 8;
  }
+ d_rto = d_srtt + 4 * d_rttvar;
+ if( d_rto < UDP_REL_MIN_RTO )
+  d_rto = UDP_REL_MIN_RTO;
+ if( d_rto > UDP_REL_MAX_RTO )
+  d_rto = UDP_REL_MAX_RTO;
+}
 
- // get network server entry
- server = gethostbyname(serverIp);
- if( server == NULL )
+
+//==============================================================================
+// UDPReliableClient::nextReply
+//==============================================================================
+bool UDPReliableClient::nextReply(unsigned int *seq)
+{
+ // an ordered reply waits for the ordered messages before it
+ bool blocked = false;
+ for(unsigned int n = d_base; n != d_nextSeq; n++)
  {
-  snprintf(info, 80, "gethostbyname %s", hstrerror(h_errno));
-  d_status.setReport(h_errno, info);
-  close(d_fd);
-  d_fd = -1;
-  return -1;
+  struct udp_rel_slot *s = &d_slots[n % UDP_REL_WINDOW];
+  if( !s->inUse )
+   continue;
+  if( s->hasReply && (!s->ordered || !blocked) )
+  {
+   *seq = n;
+   return true;
+  }
+  if( s->ordered )
+   blocked = true;
  }
- 
- // server socket info
- d_server.sin_family = AF_INET;
- d_server.sin_port = htons(port);
- d_server.sin_addr.s_addr = *((in_addr_t *)server->h_addr);
- memset(&(d_server.sin_zero), '\0', 8);
-
- d_init = true; 
- return 0;
+ return false;
 }
 
 
 //==============================================================================
-// UDPClient::getStatusCode
+// UDPReliableClient::releaseSlots
 //==============================================================================
-int UDPClient::getStatusCode() const
+void UDPReliableClient::releaseSlots()
 {
- return d_status.getReportCode();
+ while( (d_base != d_nextSeq) && !d_slots[d_base % UDP_REL_WINDOW].inUse )
+  d_base++;
 }
 
 
 //==============================================================================
-// UDPClient::getStatusMessage
+// UDPReliableClient::reset
 //==============================================================================
-const char *UDPClient::getStatusMessage() const
+void UDPReliableClient::reset()
 {
- return d_status.getReportMessage();
+ for(int k = 0; k < UDP_REL_WINDOW; k++)
+ {
+  d_slots[k].inUse = false;
+  d_slots[k].hasReply = false;
+ }
+ d_numUnreliable = 0;
+ d_base = 0;
+ d_nextSeq = 0;
+ d_peerWindow = UDP_REL_WINDOW;
+ d_lastHeard = monotonicUs();
+ d_conn = rand_r(&d_seed);
 }
 
 
 //==============================================================================
-// UDPClient::setError
+// UDPReliableClient::simulateLoss
 //==============================================================================
-void UDPClient::setError(int code, const char *functionName)
+bool UDPReliableClient::simulateLoss(double rate)
 {
- char buf[80];
- snprintf(buf, 80, "%s: %s", functionName, strerror(code));
- d_status.setReport(code, buf);
+ return (rate > 0) && (rand_r(&d_seed) < rate * RAND_MAX);
 }
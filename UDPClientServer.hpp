@@ -25,6 +25,37 @@
 
 #include "StatusReport.hpp"
 
+#define UDP_UNRELIABLE 0 // delivery mode: sent once
+#define UDP_RELIABLE 1 // delivery mode: retransmitted until replied to
+#define UDP_RELIABLE_ORDERED 2 // delivery mode: reliable, and in send order
+#define UDP_REL_WINDOW 64 // messages in flight of a UDPReliableClient
+#define UDP_FRAG_AUTO (-1) // fragment size: from the path MTU
+#define UDP_HIST_BUCKETS 40 // buckets of a UDPLatencyHistogram
+
+struct udp_batch;
+struct udp_receiver;
+struct udp_pending;
+struct udp_rel_peer;
+struct udp_rel_slot;
+struct udp_rel_reply;
+struct udp_seq_header;
+struct udp_frag_header;
+struct udp_frag_table;
+struct udp_rate_table;
+
+//==============================================================================
+// A latency distribution recorded by a UDPServer (see 
+// UDPServer::setTimestamps()). Bucket i counts the samples of 2^i to 
+// 2^(i+1)-1 nanoseconds; the first also counts 0, the last all longer ones.
+//==============================================================================
+struct UDPLatencyHistogram
+{
+ unsigned long count[UDP_HIST_BUCKETS]; // samples per bucket
+ unsigned long samples;                 // samples in all buckets
+ unsigned long long totalNs;            // sum of the samples (ns)
+ unsigned long long maxNs;              // longest sample (ns)
+};
+
 //==============================================================================
 // class UDPServer
 //------------------------------------------------------------------------------
@@ -37,10 +68,13 @@
 // reach their destination, or that they will reach the destination in the right 
 // sequence. UDP prioritizes speed over reliability. Use (the much slower) 
 // TCPServer/TCPClient if reliability and data integrity is more important in 
-// your application.   
+// your application, or UDPReliableClient for delivery guarantees without
+// the head-of-line blocking of TCP.
 //
 // <b>Example Program:</b>
 // \include UDPClientServer.t.cpp
+// Messages larger than a datagram: 
+// \include UDPFragment.t.cpp
 //==============================================================================
 
 class UDPServer
@@ -91,6 +125,134 @@ class UDPServer
    // data into the message buffer and calls the user implemented function 
    // receiveAndReply().
 
+  int setBatchSize(int batchSize);
+   // Receive and reply to data packets in batches (Linux). Each pass of 
+   // doMessageCycle() then takes all waiting packets, up to \a batchSize, 
+   // with one recvmmsg() call, calls receiveAndReply() for each, and sends 
+   // the replies of the batch with one sendmmsg() call. This saves system 
+   // calls at high packet rates. Replies are copied before the next call 
+   // to receiveAndReply(), so the reply buffer may be reused. Call before 
+   // doMessageCycle().
+   //  batchSize  Packets per batch at most. 1 (default) receives and 
+   //             replies to one packet at a time.
+   //  return     0 on success, -1 on error (EBUSY if the message cycle 
+   //             runs).
+
+  int setReceiveOffload(bool enable);
+   // Let the kernel coalesce packets of a stream into one buffer (UDP_GRO,
+   // Linux 5.0 or later). doMessageCycle() then receives such a buffer in 
+   // one go and calls receiveAndReply() for each packet in it, so the 
+   // handler sees the same packets as without offload. Useful with bulk 
+   // senders such as UDPClient::sendSegments(). Implies the batched loop 
+   // (see setBatchSize()). Call before doMessageCycle().
+   //  enable  true to receive coalesced packets.
+   //  return  0 on success, -1 on error (EBUSY if the message cycle 
+   //          runs).
+
+  int setTimestamps(bool enable);
+   // Record how long data packets wait in the socket queue, from the 
+   // kernel receive timestamp (SO_TIMESTAMPNS, Linux) to the handler, and
+   // how long they are handled, in histograms that all receive threads 
+   // update without locks (see getLatencyHistograms()). Long waits with 
+   // short handling call for more receive threads or larger socket 
+   // buffers. The kernel's count of packets dropped for a full socket 
+   // buffer is read as well (SO_RXQ_OVFL, see getSocketDrops()). Implies
+   // the batched loop (see setBatchSize()). Call before doMessageCycle().
+   //  enable  true to record. Enabling starts the histograms over.
+   //  return  0 on success, -1 on error (EBUSY if the message cycle 
+   //          runs).
+
+  void getLatencyHistograms(UDPLatencyHistogram *queueDelay, 
+                            UDPLatencyHistogram *handlerTime) const;
+   // Get the histograms recorded with setTimestamps(). The counters are 
+   // read while they are updated, so they may be off by the packets in 
+   // progress. Either pointer may be NULL.
+   //  queueDelay   Kernel receive to the call of receiveAndReply().
+   //  handlerTime  receiveAndReply() and preparing the reply.
+
+  void clearLatencyHistograms();
+   // Start the histograms over.
+
+  unsigned long getSocketDrops() const;
+   // Get the number of packets the kernel dropped because a socket buffer 
+   // of the server was full, as of the last packet received with 
+   // setTimestamps() enabled. Larger buffers (the bdp argument of init())
+   // or more receive threads help.
+   //  return  Packets dropped on all sockets of the server.
+
+  int setRateLimit(double packetsPerSec, int burst, int maxSources=4096);
+   // Limit the data packets each client address may send. Every address 
+   // has a token bucket of \a burst packets, refilled at \a packetsPerSec.
+   // Packets over the limit are dropped before they are handled (see 
+   // getRateLimitCounters()). Addresses are kept in a fixed table of 16 
+   // bytes per entry; a new address takes the place of one whose bucket 
+   // is full again, or else of the one idle longest among a few. Receive
+   // threads share the table without locks. Call before doMessageCycle().
+   //  packetsPerSec  Sustained rate per address. 0 removes the limit.
+   //  burst          Packets an idle address may send at once.
+   //  maxSources     Addresses tracked at once (rounded up to a power of
+   //                 two).
+   //  return         0 on success, -1 on error (EBUSY if the message 
+   //                 cycle runs).
+
+  void getRateLimitCounters(unsigned long *dropped, unsigned long *evicted) const;
+   // Get the rate limiter counters. Either pointer may be NULL.
+   //  dropped  Packets dropped for being over the limit.
+   //  evicted  Addresses forgotten while their bucket was not full, 
+   //           because the table was crowded.
+
+  int setReceiveThreads(int numThreads, const int *cpus=NULL, 
+                        bool concurrentHandler=false);
+   // Receive data packets in several threads. Call this before init().
+   // Each thread gets a socket of its own bound to the server port 
+   // (SO_REUSEPORT), and the kernel spreads clients over the sockets.
+   // doMessageCycle() runs the first receiver in the calling thread and 
+   // the others in threads of their own, which are stopped when the 
+   // calling thread is cancelled. Batching and receive offload apply to 
+   // every receiver.
+   //  numThreads         Number of receive threads (default is 1).
+   //  cpus               NULL, or array of numThreads cpu numbers to pin 
+   //                     the threads to. The first pins the thread calling
+   //                     doMessageCycle(). Use -1 to not pin a thread.
+   //  concurrentHandler  If true, receiveAndReply() is called from the 
+   //                     receive threads at the same time and must be 
+   //                     thread safe. Otherwise calls are serialized.
+   //  return             0 on success, -1 on error.
+
+  int setReassembly(int maxMsgSize, int maxPartial=16, int timeoutMs=1000);
+   // Accept messages larger than a datagram, sent in fragments by a 
+   // UDPClient (see UDPClient::setFragmentSize()). Fragments are collected
+   // per client and message until the message is complete, which is then
+   // passed to receiveAndReply() in one piece. A reply that does not fit 
+   // into a fragment is sent back in fragments of the same size. A message
+   // of which a fragment is lost is dropped. Messages that arrive whole 
+   // may then be as long as the largest fragment (8972 bytes) even if 
+   // init() was given a smaller size. Call this before init().
+   //  maxMsgSize  Largest message (bytes). Larger ones are dropped.
+   //  maxPartial  Messages collected at once. When all are in use, the 
+   //              one that has waited longest for a fragment is dropped.
+   //  timeoutMs   Time after the last fragment before a message is 
+   //              dropped.
+   //  return      0 on success, -1 on error.
+
+  int joinGroup(const char *group, const char *interface=NULL);
+   // Subscribe to a multicast group (IP_ADD_MEMBERSHIP). doMessageCycle()
+   // then also receives the data packets a publisher sends to the group 
+   // address and the server port (see UDPClient::setMulticast()), in the 
+   // same (batched) loop as other packets. Subscribers usually return NULL 
+   // from receiveAndReply(). Call after init(). With several receive 
+   // threads, the first one takes all packets of the group. On Linux the
+   // server then only receives groups it joined itself, not all groups 
+   // joined on the host (IP_MULTICAST_ALL).
+   //  group      Multicast address, such as "239.1.2.3".
+   //  interface  Address or (Linux) name of the local interface to join 
+   //             on, or NULL to let the system choose.
+   //  return     0 on success, -1 on error.
+
+  int leaveGroup(const char *group, const char *interface=NULL);
+   // Unsubscribe from a multicast group joined with joinGroup().
+   //  return  0 on success, -1 on error.
+
   int getStatusCode() const;
    //  return  0 on no error, else latest status code. See errno.h for codes.
 
@@ -121,6 +283,86 @@ class UDPServer
    //  code          errno error code
    //  functionName  The unsuccessful function call
 
+  int serviceReliable(struct udp_receiver *r, const char *msg, int msgLen,
+                      struct sockaddr_in *from, socklen_t fromLen);
+   // Handle a packet of a UDPReliableClient: deliver messages in the 
+   // requested order, acknowledge them, and resend cached replies to 
+   // retransmitted messages.
+   //  return  1 if the packet was of a UDPReliableClient, else 0.
+
+  struct udp_rel_peer *findPeer(struct sockaddr_in *from);
+   // Find the state of a UDPReliableClient, or make room for it. Call 
+   // with d_relLock held.
+   //  return  peer, or NULL if out of memory or all peers are in use.
+
+  void releasePeer(struct udp_rel_peer *peer);
+   // Unlock a peer locked by serviceReliable().
+
+  int reassemble(struct udp_receiver *r, const char *pkt, int pktLen,
+                 struct sockaddr_in *from, struct udp_frag_header *frag);
+   // Collect a fragment of a message (see setReassembly()).
+   //  frag    Set to the header of the fragment.
+   //  return  0 if the packet is not a fragment, 1 if the message is not
+   //          complete yet, 2 if it is. The message is then in the 
+   //          reassembly buffer of the receiver.
+
+  void handleMessage(struct udp_receiver *r, const char *msg, int msgLen,
+                     struct sockaddr_in *from, socklen_t fromLen,
+                     const struct udp_frag_header *frag);
+   // Pass a message to receiveAndReply() and send the reply.
+   //  frag  Header of the last fragment of a reassembled message, or NULL.
+
+  int packetSize() const;
+   //  return  the size of the receive buffers.
+
+  int setMembership(bool join, const char *group, const char *interface);
+   // Join or leave a multicast group (see joinGroup()).
+   //  return  0 on success, -1 on error.
+
+  int openSocket(int port, int sockBufSize);
+   // Create a socket bound to the port.
+   //  return  socket, or -1 on error.
+
+  int createReceivers(int numThreads, const int *cpus);
+   // Allocate the receivers (see setReceiveThreads()).
+   //  return  0 on success, -1 on error.
+
+  void freeReceivers();
+   // Close and release the receivers.
+
+  void closeReceivers();
+   // Close the sockets and buffers of the additional receivers.
+
+  static void *receiverEntry(void *receiver);
+   // Thread function of the additional receivers.
+
+  static void stopReceivers(void *server);
+   // Cancel and join the additional receive threads.
+
+  void runReceiver(struct udp_receiver *r);
+   // Receive and reply to packets on the socket of a receiver, forever.
+
+  int allocBatch(struct udp_receiver *r);
+   // Create the buffers for batches of d_batchSize packets.
+   //  return  0 on success, -1 on error.
+  
+  void freeBatch();
+  void freeBatch(struct udp_receiver *r);
+   // Release the batch buffers of all receivers, or of one.
+  
+  void doBatchCycle(struct udp_receiver *r);
+   // runReceiver() with recvmmsg()/sendmmsg().
+  
+  int handlePacket(struct udp_receiver *r, int i, const char *pkt, int pktLen,
+                   int numReplies);
+   // Handle packet i of a batch (or a segment of it). Replies are added to
+   // the batch buffers.
+   //  numReplies  Replies in the batch buffers so far.
+   //  return      Replies in the batch buffers now.
+
+  void sendReplies(struct udp_receiver *r, int numReplies);
+   // Send the replies collected in the batch buffers.
+
   int d_fd;
    // Socket file descriptor
   
@@ -133,6 +375,51 @@ class UDPServer
   bool d_init;
    // true if server initialized
 
+  volatile bool d_running;
+   // true while doMessageCycle() runs
+
+  int d_batchSize;
+   // Packets per batch
+  
+  bool d_gro;
+   // true if coalesced packets are received (UDP_GRO)
+  
+  bool d_timestamps;
+   // true if latencies are recorded (SO_TIMESTAMPNS)
+  
+  UDPLatencyHistogram d_queueHist;
+   // kernel receive to handler
+  
+  UDPLatencyHistogram d_handlerHist;
+   // handler time
+  
+  struct udp_receiver *d_receivers;
+   // Receive threads. The first uses d_fd and d_rcvBuf.
+  
+  int d_numReceivers;
+   // Number of receivers
+  
+  bool d_serializeHandler;
+   // true if receiveAndReply() calls are serialized
+  
+  pthread_mutex_t d_handlerLock;
+   // Serializes receiveAndReply()
+  
+  struct udp_rel_peer **d_relPeers;
+   // State of UDPReliableClients, or NULL
+  
+  pthread_mutex_t d_relLock;
+   // Serializes access to the above list (each peer has its own lock)
+  
+  struct udp_frag_table *d_frags;
+   // Partially received messages, or NULL
+  
+  pthread_mutex_t d_fragLock;
+   // Serializes access to the above
+  
+  struct udp_rate_table *d_rateLimit;
+   // Per-address rate limits, or NULL
+  
   StatusReport d_status;
    // Status reports 
 };
@@ -153,7 +440,10 @@ class UDPServer
 // your application.   
 //
 // <b>Example Program:</b>
-// See example for UDPServer
+// See example for UDPServer. Many requests in flight at once: 
+// \include UDPPipelined.t.cpp
+// Publishing to a multicast group: 
+// \include UDPMulticast.t.cpp
 //==============================================================================
 
 class UDPClient
@@ -172,7 +462,8 @@ class UDPClient
    //            waits for replies from the server. This parameter 
    //            sets the timeout period in waiting for a reply. If a 
    //            reply is not received within this timeout period, 
-   //            sendAndReceive() will exit with error.
+   //            sendAndReceive() will exit with error. A timeout of 0 
+   //            waits until a reply arrives.
    //  bdp       This is an advanced option. It allows the user to suggest
    //            the bandwidth-delay product in kilo bytes so that socket 
    //            buffers of optimal sizes can be created. Suppose you are 
@@ -195,7 +486,8 @@ class UDPClient
    //           waits for replies from the server. This parameter 
    //           sets the timeout period in waiting for a reply. If a 
    //           reply is not received within this timeout period, 
-   //           sendAndReceive() will exit with error.
+   //           sendAndReceive() will exit with error. A timeout of 0 
+   //           waits until a reply arrives.
    //  bdp      This is an advanced option. It allows the user to suggest
    //           the bandwidth-delay product in kilo bytes so that socket 
    //           buffers of optimal sizes can be created. Suppose you are 
@@ -236,12 +528,111 @@ class UDPClient
    //  return     0 on success, -1 on error. Call getStatus....() for the
    //             error.
 
+  void setSequencing(bool enable);
+   // Number the requests of sendAndReceive(). Each request then carries a
+   // small header with a sequence number that the server returns with the
+   // reply, and replies to earlier requests that timed out are discarded 
+   // instead of being taken for the current reply. The socket is kept 
+   // after a timeout. Off by default, for servers of older versions.
+   //  enable  true to number requests.
+
+  int sendRequest(const char *outMsgBuf, int outMsgLen, unsigned int *seq);
+   // Send a numbered request without waiting for the reply, so that many 
+   // requests can be outstanding at once. Collect the replies with 
+   // receiveReply(). A request is forgotten once its reply was received, 
+   // or when the timeout (set in init(), if not 0) has passed since it was
+   // sent.
+   //  outMsgBuf  Message to the server.
+   //  outMsgLen  Length of the message.
+   //  seq        Set to the number of the request. NULL to not expect a 
+   //             reply.
+   //  return     0 on success, -1 on error. EAGAIN if 1024 requests are
+   //             outstanding.
+
+  int receiveReply(char *inMsgBuf, int inBufLen, int *inMsgLen, unsigned int *seq);
+   // Receive the next reply to an outstanding request of sendRequest(), in 
+   // the order they arrive. Replies to forgotten requests, and packets from 
+   // other sources, are skipped. Waits up to the timeout set in init().
+   //  inMsgBuf   Buffer for the reply.
+   //  inBufLen   Size of the buffer. Longer replies are truncated.
+   //  inMsgLen   Set to the length of the reply.
+   //  seq        Set to the number of the request replied to.
+   //  return     0 on success, -1 on error or timeout.
+
+  int sendSegments(const char *outMsgBuf, int outMsgLen, int segmentSize);
+   // Send a buffer to the server as a series of datagrams of \a segmentSize
+   // bytes (the last may be shorter), without waiting for replies. With 
+   // segmentation offload (UDP_SEGMENT, Linux 4.18 or later) up to 64 
+   // datagrams are passed to the kernel in one call. Otherwise, or if the
+   // kernel refuses, they are sent one by one.
+   //  outMsgBuf    Data to send.
+   //  outMsgLen    Length of the data.
+   //  segmentSize  Payload per datagram. Keep it within the path MTU.
+   //  return       0 on success, -1 on error.
+
+  int setMulticast(int ttl, bool loopback=true, const char *interface=NULL);
+   // Set up the client as a publisher to a multicast group. init() the 
+   // client with the group address and the port of the subscribers (see 
+   // UDPServer::joinGroup()), and send with sendAndReceive() without a
+   // reply buffer, sendRequest() or sendSegments(). Each datagram is sent
+   // once and reaches all subscribers. The settings are kept across init().
+   //  ttl        Routers a packet may pass (0 keeps it on this host, 1 in 
+   //             the local network).
+   //  loopback   true to deliver to subscribers on this host too.
+   //  interface  Address or (Linux) name of the interface to send from, 
+   //             or NULL to let the system choose.
+   //  return     0 on success, -1 on error.
+
+  int setFragmentSize(int fragmentSize);
+   // Send messages larger than \a fragmentSize in fragments of that size, 
+   // which a server reassembles (see UDPServer::setReassembly()). 
+   // Fragments are sent with the don't-fragment bit set, so that no
+   // fragment is split by IP on the way. Replies sent back in fragments
+   // are reassembled into the buffer of sendAndReceive() or receiveReply().
+   //  fragmentSize  Bytes per datagram (header included), 0 (default) to
+   //                not fragment, or UDP_FRAG_AUTO for the largest 
+   //                datagram the path MTU to the server allows (the 
+   //                kernel's estimate, renewed when a fragment is refused
+   //                as too large).
+   //  return        0 on success, -1 on error.
+
  private:
   void setError(int code, const char *functionName);
    // Set a error report
    //  code          errno error code
    //  functionName  The unsuccessful function call
 
+  int waitReply(char *inMsgBuf, int inBufLen, int *inMsgLen, unsigned int *seq,
+                bool anySeq);
+   // Receive a reply from the server within the timeout.
+   //  seq     NULL for a plain reply. Otherwise the number of the request 
+   //          to wait for, or set to the one replied to if anySeq is true.
+   //  return  0 on success, -1 on error.
+
+  long long timeoutUs() const;
+   //  return  the receive timeout in microseconds.
+
+  int receiveMessage(char *inMsgBuf, int inBufLen, struct udp_seq_header *hdr,
+                     struct sockaddr_in *from);
+   // Receive a datagram like recvmsg(), with the sequence header (if \a hdr
+   // is not NULL) and the message in separate buffers. With fragmentation,
+   // collects fragments and returns the message when it is complete.
+   //  return  bytes received, or -1 with errno set (EAGAIN if a fragment
+   //          was taken but the message is not complete).
+
+  int transmit(const struct udp_seq_header *hdr, const char *msg, int msgLen);
+   // Send a message, preceded by a sequence header if \a hdr is not NULL,
+   // in fragments if it is too long for one.
+   //  return  0 on success, -1 on error.
+
+  int applyFragmentSize();
+   // Find the fragment size for d_fragSize and set the don't-fragment bit.
+   //  return  0 on success, -1 on error.
+
+  int applyMulticast();
+   // Set the multicast options on the socket.
+   //  return  0 on success, -1 on error.
+
   struct sockaddr_in d_server;
    // server to connect to.
   
@@ -262,7 +653,251 @@ class UDPClient
  
   struct timeval d_recvTimeout;
    // receive timout
+  
+  bool d_gso;
+   // false once segmentation offload was refused
+
+  bool d_sequencing;
+   // true if sendAndReceive() numbers requests
+  
+  unsigned int d_nextSeq;
+   // number of the next request
+  
+  struct udp_pending *d_pending;
+   // outstanding requests by number modulo UDP_MAX_PENDING, or NULL
+  
+  int d_fragSize;
+   // fragment size asked for, 0 or UDP_FRAG_AUTO
+  
+  int d_fragLen;
+   // bytes per fragment in use, 0 if not fragmenting
+  
+  unsigned int d_nextFragId;
+   // number of the next fragmented message
+  
+  char *d_pkt;
+   // receive buffer for fragments, or NULL
+  
+  struct udp_frag_table *d_frags;
+   // partially received replies, or NULL
+  
+  int d_mcastTtl;
+   // multicast TTL, or -1 if not publishing
+  
+  bool d_mcastLoop;
+   // true if multicast packets are looped back to this host
+  
+  struct in_addr d_mcastAddr;
+   // address of the interface to publish on, or INADDR_ANY
+  
+  int d_mcastIndex;
+   // index of the interface to publish on, or 0
+   
+  friend class UDPReliableClient;
+   
+  StatusReport d_status;
+   // Error reports 
+};
+
+
+//==============================================================================
+// class UDPReliableClient
+//------------------------------------------------------------------------------
+// \brief
+// Reliable delivery of messages to a UDPServer, without the head-of-line 
+// blocking and congestion backoff of TCP.
+//
+// Each message is sent in one of three modes. UDP_UNRELIABLE messages are 
+// sent once, like UDPClient does. UDP_RELIABLE messages are retransmitted 
+// until the server replied, and reach receiveAndReply() in the order they 
+// arrive. UDP_RELIABLE_ORDERED messages are also held back by the server
+// until all reliable messages sent before them have arrived, and their 
+// replies are returned in the same order.
+//
+// The server acknowledges the reliable messages it holds with a cumulative 
+// and a selective acknowledgement, so that only lost messages are resent. 
+// A message is resent when three later ones were acknowledged before it, 
+// or when its retransmission timeout, estimated from round-trip times as 
+// TCP does (RFC 6298), expires. Unlike TCP, loss does not slow the client
+// down: the timeout only backs off once the server did not answer several
+// resends in a row. At most setWindow() reliable messages are in flight.
+// The server keeps the replies of recent messages so that a lost reply is
+// sent again rather than the message being handled twice. 
+// Requires a UDPServer of this version or later.
+//
+// All retransmission is driven by the client from within send() and 
+// receive(). Use one thread per client.
+//
+// <b>Example Program:</b>
+// \code
+// struct timeval timeout = {1, 0};
+// UDPReliableClient client;
+// client.init("10.0.0.1", 5000, timeout, 1024);
+// unsigned int id;
+// client.send(msg, msgLen, UDP_RELIABLE_ORDERED, &id);
+// client.receive(reply, sizeof(reply), &replyLen, &id);
+// \endcode
+// A complete program, over a link that loses packets: 
+// \include UDPReliable.t.cpp
+//==============================================================================
+
+class UDPReliableClient
+{
+ public:
+  UDPReliableClient();
+   // The default constructor. Does nothing.
+  
+  ~UDPReliableClient();
+   // The destructor. Cleans up.
+  
+  int init(const char *serverIp, int port, struct timeval &timeout, 
+           int maxMsgSize=1024, int bdp=0);
+   // Set up the client. Parameters are as in UDPClient::init().
+   //  timeout     Longest time send() waits for room in the window, and
+   //              receive() for a reply. 0 waits without limit.
+   //  maxMsgSize  Largest message and reply (bytes). Longer replies are 
+   //              truncated.
+   //  return      0 on success, -1 on error.
+  
+  int send(const char *outMsgBuf, int outMsgLen, int mode, unsigned int *id);
+   // Send a message. Returns once the message is sent, waiting first for 
+   // room if the window is full.
+   //  outMsgBuf  Message to the server.
+   //  outMsgLen  Length of the message.
+   //  mode       UDP_UNRELIABLE, UDP_RELIABLE or UDP_RELIABLE_ORDERED.
+   //  id         Set to the number of the message, which receive() 
+   //             returns with the reply.
+   //  return     0 on success, -1 on error. EAGAIN if the window stayed 
+   //             full, or is held up by a reply not yet taken with 
+   //             receive(). ETIMEDOUT if the server stopped responding 
+   //             (all messages in flight are then dropped).
+  
+  int receive(char *inMsgBuf, int inBufLen, int *inMsgLen, unsigned int *id);
+   // Receive the next reply. Messages the server did not reply to have 
+   // none. Replies to unreliable messages may be missing.
+   //  inMsgBuf  Buffer for the reply.
+   //  inBufLen  Size of the buffer. Longer replies are truncated.
+   //  inMsgLen  Set to the length of the reply.
+   //  id        Set to the number of the message replied to.
+   //  return    0 on success, -1 on error or timeout.
+  
+  int flush();
+   // Wait until the server has handled all reliable messages sent. 
+   // Replies stay available to receive().
+   //  return  0 on success, -1 on error.
+  
+  int setWindow(int numMessages);
+   // Set the number of reliable messages in flight at most.
+   //  numMessages  1 to UDP_REL_WINDOW (default).
+   //  return       0 on success, -1 on error.
+  
+  void setLossSimulation(double sendLoss, double receiveLoss);
+   // Drop packets on purpose, for testing on a loss free network such 
+   // as the loopback interface.
+   //  sendLoss     Fraction (0 to 1) of packets not sent.
+   //  receiveLoss  Fraction (0 to 1) of received packets ignored.
+  
+  long long getRoundTripTime() const;
+   //  return  Smoothed round-trip time (microseconds), 0 if not measured.
+  
+  long long getRetransmissions() const;
+   //  return  Number of messages resent.
+  
+  int getStatusCode() const;
+   //  return  Latest status code.
    
+  const char *getStatusMessage() const;
+   //  return  Latest error status report.
+
+ private:
+  int transmit(struct udp_rel_slot *s);
+   // Send (or resend) the message of a slot.
+   //  return  0 on success, -1 on error.
+  
+  int pump(long long deadline);
+   // Wait for packets until the deadline or the next retransmission, 
+   // process them, and resend messages that are due.
+   //  return  0 on success, -1 if the server stopped responding.
+  
+  void processPacket(const char *pkt, int len);
+   // Apply the acknowledgements and reply of a packet from the server.
+  
+  void sampleRtt(long long rtt);
+   // Update the round-trip time estimate and timeout.
+  
+  bool nextReply(unsigned int *seq);
+   // Find the next reply receive() may return.
+   //  return  true if there is one.
+  
+  void releaseSlots();
+   // Free completed slots at the start of the window.
+  
+  void reset();
+   // Drop all messages in flight and start a new connection.
+  
+  bool simulateLoss(double rate);
+   //  return  true if a packet is to be dropped.
+  
+  UDPClient d_client;
+   // Socket and server address
+  
+  struct udp_rel_slot *d_slots;
+   // Reliable messages in flight, by sequence number modulo UDP_REL_WINDOW
+  
+  struct udp_rel_reply *d_unreliable;
+   // Replies to unreliable messages, not yet received
+  
+  int d_numUnreliable;
+   // Number of above
+  
+  char *d_pkt;
+   // Receive buffer
+  
+  int d_maxMsgSize;
+   // Largest message
+  
+  unsigned int d_conn;
+   // Connection number, new for each reset
+  
+  unsigned int d_base;
+   // Oldest sequence number in use
+  
+  unsigned int d_nextSeq;
+   // Next reliable sequence number
+  
+  unsigned int d_nextId;
+   // Number of the next message
+  
+  int d_window;
+   // Messages in flight at most
+  
+  int d_peerWindow;
+   // Messages in flight the server accepts
+  
+  long long d_srtt;
+   // Smoothed round-trip time (us), 0 if not measured
+  
+  long long d_rttvar;
+   // Round-trip time variation (us)
+  
+  long long d_rto;
+   // Retransmission timeout (us)
+  
+  long long d_retransmits;
+   // Messages resent
+  
+  long long d_lastHeard;
+   // Time a packet was last received from the server (us)
+  
+  double d_sendLoss;
+   // Simulated loss of sent packets
+  
+  double d_receiveLoss;
+   // Simulated loss of received packets
+  
+  unsigned int d_seed;
+   // Random state of loss simulation
+  
   StatusReport d_status;
    // Error reports 
 };
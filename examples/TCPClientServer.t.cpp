@@ -12,6 +12,10 @@
 
 using namespace std;
 
+// Server address. Run with argument "unix" to use a local socket instead 
+// of TCP port 3000.
+const char *localAddress = NULL;
+
 //==============================================================================
 // class MyServer
 //==============================================================================
@@ -19,6 +23,7 @@ class MyServer : public TCPServer
 {
  public:
   MyServer(int port, int maxLen, int bdp) : TCPServer(port, maxLen, bdp){};
+  MyServer(const char *addr, int maxLen, int bdp) : TCPServer(addr, maxLen, bdp){};
   ~MyServer() {};
   virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen); 
  private:
@@ -43,7 +48,12 @@ const char *MyServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *o
 void *server(void *arg)
 {
  arg=arg;
- MyServer server(3000, 8, 100);
+ MyServer *serverPtr;
+ if(localAddress)
+  serverPtr = new MyServer(localAddress, 8, 100);
+ else
+  serverPtr = new MyServer(3000, 8, 100);
+ MyServer &server = *serverPtr;
 
  server.enableIgnoreSigPipe();
  
@@ -58,6 +68,7 @@ void *server(void *arg)
  if(server.getStatusCode())
   cout << "server: " << server.getStatusMessage() << endl;
  
+ delete serverPtr;
  return NULL;
 }
 
@@ -79,7 +90,7 @@ int client()
  timeout.tv_usec = 5000; // 5 ms
  
  // initialize a client and connect to server
- TCPClient client("127.0.0.1", 3000, timeout, 100);
+ TCPClient client(localAddress ? localAddress : "127.0.0.1", 3000, timeout, 100);
  if(client.getStatusCode())
  {
   cout << "client: " << client.getStatusMessage() << endl;
@@ -136,8 +147,11 @@ int client()
 //==============================================================================
 // main function
 //==============================================================================
-int main()
+int main(int argc, char *argv[])
 {
+ if( (argc > 1) && (strcmp(argv[1], "unix") == 0) )
+  localAddress = "unix:/tmp/TCPClientServer.t.sock";
+
  pthread_t threadId;
  pthread_create(&threadId, NULL, &server, NULL);
  sleep(1);
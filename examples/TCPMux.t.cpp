@@ -0,0 +1,186 @@
+//==============================================================================
+// TCPMux.t.cpp - Example program for TCPMuxClient
+//
+// Usage: TCPMux.t [chunk size]
+//
+// Several threads share one connection to an echo server, each on a stream
+// of its own. One thread keeps sending large messages while the others
+// send small ones. The small messages are cut in between the chunks of the
+// large ones, so their round trips stay short. Printed are the round trips
+// of the small messages and the number of large messages sent.
+//==============================================================================
+
+#include "TCPClientServer.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+
+#define MUX_PORT 3020
+#define MUX_LARGE (4 << 20)    // bytes of a large message
+#define MUX_SMALL 64           // bytes of a small message
+#define MUX_SMALL_THREADS 4    // threads sending small messages
+#define MUX_SMALL_COUNT 200    // small messages per thread
+
+static long long nowUs()
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+//==============================================================================
+// class MyServer
+// - echoes small messages, acknowledges large ones
+//==============================================================================
+class MyServer : public TCPServer
+{
+ public:
+  MyServer(int port, int maxLen) : TCPServer(port, maxLen, 0){};
+  ~MyServer() {};
+  virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen);
+};
+
+
+const char *MyServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ if( inMsgLen > MUX_SMALL )
+ {
+  *outMsgLen = 2;
+  return "ok";
+ }
+ *outMsgLen = inMsgLen;
+ return inMsgBuf;
+}
+
+
+//==============================================================================
+// server
+//==============================================================================
+void *server(void *arg)
+{
+ arg=arg;
+ MyServer server(MUX_PORT, MUX_LARGE);
+ server.enableIgnoreSigPipe();
+ if(server.getStatusCode())
+ {
+  cout << "server: " << server.getStatusMessage() << endl;
+  return NULL;
+ }
+ server.doMessageCycle();
+ return NULL;
+}
+
+
+//==============================================================================
+// client threads
+//==============================================================================
+TCPMuxClient client;
+volatile bool stopLarge = false;
+
+void *sendLarge(void *arg)
+{
+ int *count = (int *)arg;
+ int stream = client.openStream();
+ char *msg = (char *)malloc(MUX_LARGE);
+ char reply[16];
+ int replyLen;
+
+ memset(msg, 'L', MUX_LARGE);
+ while( !stopLarge )
+ {
+  if( client.sendAndReceive(stream, msg, MUX_LARGE, reply, sizeof(reply),
+      &replyLen) == -1 )
+  {
+   cout << "large: " << client.getStatusMessage() << endl;
+   break;
+  }
+  (*count)++;
+ }
+ free(msg);
+ client.closeStream(stream);
+ return NULL;
+}
+
+
+void *sendSmall(void *arg)
+{
+ long long *worst = (long long *)arg;
+ int stream = client.openStream();
+ char msg[MUX_SMALL];
+ char reply[MUX_SMALL];
+ int replyLen;
+
+ for(int i = 0; i < MUX_SMALL_COUNT; i++)
+ {
+  int msgLen = snprintf(msg, MUX_SMALL, "small %d", i);
+  long long start = nowUs();
+  if( (client.sendAndReceive(stream, msg, msgLen, reply, sizeof(reply),
+      &replyLen) == -1) || (replyLen != msgLen) || memcmp(msg, reply, msgLen) )
+  {
+   cout << "small: " << client.getStatusMessage() << endl;
+   break;
+  }
+  long long rtt = nowUs() - start;
+  if( rtt > *worst )
+   *worst = rtt;
+ }
+ client.closeStream(stream);
+ return NULL;
+}
+
+
+//==============================================================================
+// main function
+//==============================================================================
+int main(int argc, char *argv[])
+{
+ pthread_t threadId;
+ pthread_create(&threadId, NULL, &server, NULL);
+ sleep(1);
+
+ struct timeval timeout;
+ timeout.tv_sec = 2;
+ timeout.tv_usec = 0;
+ if( client.init("127.0.0.1", MUX_PORT, timeout) == -1 )
+ {
+  cout << "client: " << client.getStatusMessage() << endl;
+  return 1;
+ }
+ if( (argc > 1) && (client.setChunkSize(atoi(argv[1])) == -1) )
+ {
+  cout << "client: " << client.getStatusMessage() << endl;
+  return 1;
+ }
+
+ // one large sender, then the small ones alongside
+ int largeCount = 0;
+ long long worst[MUX_SMALL_THREADS];
+ pthread_t large, small[MUX_SMALL_THREADS];
+ pthread_create(&large, NULL, &sendLarge, &largeCount);
+ usleep(50000);
+ long long start = nowUs();
+ for(int k = 0; k < MUX_SMALL_THREADS; k++)
+ {
+  worst[k] = 0;
+  pthread_create(&small[k], NULL, &sendSmall, &worst[k]);
+ }
+ for(int k = 0; k < MUX_SMALL_THREADS; k++)
+  pthread_join(small[k], NULL);
+ long long elapsed = nowUs() - start;
+ stopLarge = true;
+ pthread_join(large, NULL);
+
+ long long longest = 0;
+ for(int k = 0; k < MUX_SMALL_THREADS; k++)
+  if( worst[k] > longest )
+   longest = worst[k];
+ cout << MUX_SMALL_THREADS * MUX_SMALL_COUNT << " small messages in "
+      << elapsed / 1000 << " ms, longest round trip " << longest << " us" << endl;
+ cout << largeCount << " large messages of " << MUX_LARGE << " bytes meanwhile"
+      << endl;
+ return 0;
+}
@@ -0,0 +1,155 @@
+//==============================================================================
+// TCPShMem.t.cpp - Example program for the shared memory transport of
+// TCPClient/TCPServer
+//
+// Usage: TCPShMem.t [round trips]
+//
+// A client on the same host as the server exchanges messages over TCP,
+// then asks for the shared memory transport
+// (TCPClient::enableShMemTransport()) and exchanges the same messages
+// through shared memory. The mean round trip of both is printed.
+//==============================================================================
+
+#include "TCPClientServer.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+
+#define SHM_PORT 3010
+#define SHM_MAX_MSG 64
+
+static long long nowNs()
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return (long long)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+//==============================================================================
+// class EchoServer
+//==============================================================================
+class EchoServer : public TCPServer
+{
+ public:
+  EchoServer(int port, int maxLen) : TCPServer(port, maxLen, 0){};
+  ~EchoServer() {};
+  virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen);
+};
+
+
+const char *EchoServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ *outMsgLen = inMsgLen;
+ return inMsgBuf;
+}
+
+
+//==============================================================================
+// server
+//==============================================================================
+void *server(void *arg)
+{
+ arg=arg;
+ EchoServer server(SHM_PORT, SHM_MAX_MSG);
+ server.enableIgnoreSigPipe();
+ if(server.getStatusCode())
+ {
+  cout << "server: " << server.getStatusMessage() << endl;
+  return NULL;
+ }
+ server.doMessageCycle();
+ return NULL;
+}
+
+
+//==============================================================================
+// exchange - send a number of messages and return the mean round trip (us)
+//==============================================================================
+double exchange(TCPClient &client, int count)
+{
+ char outMsgBuf[SHM_MAX_MSG];
+ char inMsgBuf[SHM_MAX_MSG];
+ int inMsgLen;
+
+ long long start = nowNs();
+ for(int i = 0; i < count; i++)
+ {
+  int outMsgLen = snprintf(outMsgBuf, SHM_MAX_MSG, "Hello %d", i);
+  if( client.sendAndReceive(outMsgBuf, outMsgLen, inMsgBuf, SHM_MAX_MSG,
+      &inMsgLen) == -1 )
+  {
+   cout << "client: " << client.getStatusMessage() << endl;
+   return -1;
+  }
+  if( (inMsgLen != outMsgLen) || memcmp(inMsgBuf, outMsgBuf, inMsgLen) )
+  {
+   cout << "client: wrong reply to message " << i << endl;
+   return -1;
+  }
+ }
+ return (nowNs() - start) / 1e3 / count;
+}
+
+
+//==============================================================================
+// client
+// - times round trips over TCP, then over shared memory
+//==============================================================================
+int client(int count)
+{
+ struct timeval timeout;
+ timeout.tv_sec = 1;
+ timeout.tv_usec = 0;
+ TCPClient client("127.0.0.1", SHM_PORT, timeout);
+ if(client.getStatusCode())
+ {
+  cout << "client: " << client.getStatusMessage() << endl;
+  return -1;
+ }
+ client.enableIgnoreSigPipe();
+
+ double tcp = exchange(client, count);
+ if( tcp < 0 )
+  return -1;
+ cout << "TCP          : " << tcp << " us per round trip" << endl;
+
+ // same host, so the server offers a shared memory region
+ if( client.enableShMemTransport(SHM_MAX_MSG) == -1 )
+ {
+  cout << "client: " << client.getStatusMessage() << endl;
+  return -1;
+ }
+ double shm = exchange(client, count);
+ if( shm < 0 )
+  return -1;
+ cout << "shared memory: " << shm << " us per round trip (active: "
+      << (client.isShMemTransportActive() ? "yes" : "no") << ")" << endl;
+ return 0;
+}
+
+
+//==============================================================================
+// main function
+//==============================================================================
+int main(int argc, char *argv[])
+{
+ int count = (argc > 1) ? atoi(argv[1]) : 10000;
+ if( count < 1 )
+ {
+  cout << "usage: " << argv[0] << " [round trips]" << endl;
+  return 1;
+ }
+
+ pthread_t threadId;
+ pthread_create(&threadId, NULL, &server, NULL);
+ sleep(1);
+ int rc = client(count);
+ 
+ // give the server time to see the client go and remove the region
+ usleep(200000);
+ return (rc == 0) ? 0 : 1;
+}
@@ -0,0 +1,284 @@
+//==============================================================================
+// UDPBenchmark.t.cpp - Throughput and latency benchmark for UDPClient/UDPServer
+//
+// Usage: UDPBenchmark.t [seconds per run] [requests in flight per client]
+//                       [1 to measure socket queueing]
+//
+// An echo server is run on the loopback interface for each combination of
+// payload size, client threads, server batch size and server receive
+// threads. Each client thread keeps a number of sequenced requests in flight
+// (UDPClient::sendRequest()) and measures the round trip of every reply.
+// Reported are replies per second, payload throughput (each way), round
+// trip percentiles, requests that got no reply within the timeout, and 
+// packets the kernel dropped for a full socket buffer (SO_RXQ_OVFL). 
+// Optionally the mean time requests waited in the server's socket queue is 
+// measured too. This takes receive timestamps, which make the server use
+// recvmmsg() even at batch size 1, so it is off by default. The drop count
+// comes with the timestamps, so both columns show "-" without them.
+//==============================================================================
+
+#include "UDPClientServer.hpp"
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+
+#define BENCH_PORT 3400
+#define BENCH_MAX_MSG 1472
+#define BENCH_SLOTS 1024     // requests a UDPClient keeps track of
+#define BENCH_TIMEOUT 200000 // time (us) before a request is given up
+
+static long long nowNs()
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return (long long)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+//==============================================================================
+// class EchoServer
+//==============================================================================
+class EchoServer : public UDPServer
+{
+ public:
+  EchoServer() {};
+  ~EchoServer() {};
+ protected:
+  virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen);
+};
+
+
+const char *EchoServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ *outMsgLen = inMsgLen;
+ return inMsgBuf;
+}
+
+
+void *serve(void *arg)
+{
+ ((EchoServer *)arg)->doMessageCycle();
+ return NULL;
+}
+
+
+//==============================================================================
+// client threads
+//==============================================================================
+struct bench_request
+{
+ unsigned int seq;            // number of the request
+ long long sent;              // time (ns) sent
+ bool outstanding;            // true until answered or given up
+};
+
+struct bench_client
+{
+ int port;
+ int size;                    // payload bytes
+ int window;                  // requests in flight
+ volatile bool *stop;
+ unsigned long replies;       // replies before the stop
+ unsigned long lost;          // requests without a reply
+ vector<long long> rtt;       // round trips (ns)
+};
+
+
+void *client(void *arg)
+{
+ struct bench_client *c = (struct bench_client *)arg;
+ struct timeval timeout;
+ timeout.tv_sec = 0;
+ timeout.tv_usec = BENCH_TIMEOUT;
+ UDPClient udp("127.0.0.1", c->port, timeout, 1024);
+ if( udp.getStatusCode() )
+ {
+  cout << "client: " << udp.getStatusMessage() << endl;
+  return NULL;
+ }
+ udp.setSequencing(true);
+
+ char msg[BENCH_MAX_MSG];
+ char reply[BENCH_MAX_MSG];
+ memset(msg, 'x', sizeof(msg));
+ vector<struct bench_request> requests(BENCH_SLOTS);
+ int inFlight = 0;
+ long long nextExpiry = 0;
+ c->rtt.reserve(1 << 20);
+ while( !*c->stop || (inFlight > 0) )
+ {
+  // keep the window full until the stop
+  while( !*c->stop && (inFlight < c->window) )
+  {
+   unsigned int seq;
+   if( udp.sendRequest(msg, c->size, &seq) == -1 )
+    break;
+   struct bench_request *r = &requests[seq % BENCH_SLOTS];
+   if( r->outstanding ) // given up by the client already
+   {
+    c->lost++;
+    inFlight--;
+   }
+   r->seq = seq;
+   r->sent = nowNs();
+   r->outstanding = true;
+   inFlight++;
+  }
+
+  // requests unanswered for the timeout are lost, and the client skips 
+  // their replies from now on
+  long long now = nowNs();
+  if( now >= nextExpiry )
+  {
+   for(int k = 0; k < BENCH_SLOTS; k++)
+   {
+    struct bench_request *r = &requests[k];
+    if( r->outstanding && (now - r->sent >= BENCH_TIMEOUT * 1000LL) )
+    {
+     r->outstanding = false;
+     c->lost++;
+     inFlight--;
+    }
+   }
+   nextExpiry = now + BENCH_TIMEOUT * 1000LL / 8;
+  }
+
+  int len;
+  unsigned int seq;
+  if( udp.receiveReply(reply, sizeof(reply), &len, &seq) == -1 )
+   continue;
+  struct bench_request *r = &requests[seq % BENCH_SLOTS];
+  if( !r->outstanding || (r->seq != seq) )
+   continue;
+  r->outstanding = false;
+  inFlight--;
+  if( *c->stop )
+   continue;
+  c->replies++;
+  c->rtt.push_back(nowNs() - r->sent);
+ }
+ return NULL;
+}
+
+
+//==============================================================================
+// run one configuration
+//==============================================================================
+void run(int port, int size, int numClients, int batch, int numServers,
+         double seconds, int window, bool timestamps)
+{
+ EchoServer *server = new EchoServer;
+ server->setReceiveThreads(numServers, NULL, true);
+ if( server->init(port, BENCH_MAX_MSG, 4096) == -1 )
+ {
+  cout << "server: " << server->getStatusMessage() << endl;
+  delete server;
+  return;
+ }
+ server->setBatchSize(batch);
+ server->setTimestamps(timestamps);
+ pthread_t serverThread;
+ pthread_create(&serverThread, NULL, &serve, server);
+ usleep(50000);
+
+ volatile bool stop = false;
+ vector<struct bench_client> clients(numClients);
+ vector<pthread_t> threads(numClients);
+ long long start = nowNs();
+ for(int k = 0; k < numClients; k++)
+ {
+  clients[k].port = port;
+  clients[k].size = size;
+  clients[k].window = window;
+  clients[k].stop = &stop;
+  clients[k].replies = 0;
+  clients[k].lost = 0;
+  pthread_create(&threads[k], NULL, &client, &clients[k]);
+ }
+ struct timespec duration;
+ duration.tv_sec = (time_t)seconds;
+ duration.tv_nsec = (long)((seconds - duration.tv_sec) * 1e9);
+ while( nanosleep(&duration, &duration) == -1 )
+  ;
+ stop = true;
+ double elapsed = (nowNs() - start) / 1e9;
+
+ unsigned long replies = 0, lost = 0;
+ vector<long long> rtt;
+ for(int k = 0; k < numClients; k++)
+ {
+  pthread_join(threads[k], NULL);
+  replies += clients[k].replies;
+  lost += clients[k].lost;
+  rtt.insert(rtt.end(), clients[k].rtt.begin(), clients[k].rtt.end());
+ }
+ sort(rtt.begin(), rtt.end());
+ UDPLatencyHistogram queue;
+ server->getLatencyHistograms(&queue, NULL);
+ unsigned long drops = server->getSocketDrops();
+ pthread_cancel(serverThread);
+ pthread_join(serverThread, NULL);
+ delete server;
+
+ // percentiles in microseconds
+ double p[4] = {0, 0, 0, 0};
+ if( !rtt.empty() )
+ {
+  p[0] = rtt[rtt.size() / 2] / 1e3;
+  p[1] = rtt[(size_t)(rtt.size() * 0.99)] / 1e3;
+  p[2] = rtt[(size_t)(rtt.size() * 0.999)] / 1e3;
+  p[3] = rtt.back() / 1e3;
+ }
+ char queued[16] = "-";
+ if( timestamps && queue.samples )
+  snprintf(queued, sizeof(queued), "%.1f", queue.totalNs / queue.samples / 1e3);
+ char dropped[16] = "-";
+ if( timestamps )
+  snprintf(dropped, sizeof(dropped), "%lu", drops);
+ printf("%5d %7d %5d %7d %10.0f %7.3f %8.1f %8.1f %8.1f %8.1f %8s %7lu %7s\n",
+        size, numClients, batch, numServers, replies / elapsed,
+        replies * (double)size * 8 / elapsed / 1e9, p[0], p[1], p[2], p[3],
+        queued, lost, dropped);
+ fflush(stdout);
+}
+
+
+//==============================================================================
+// main function
+//==============================================================================
+int main(int argc, char *argv[])
+{
+ double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+ int window = (argc > 2) ? atoi(argv[2]) : 16;
+ bool timestamps = (argc > 3) && (atoi(argv[3]) == 1);
+ if( (seconds <= 0) || (window < 1) || (window > 512) )
+ {
+  cout << "usage: " << argv[0] << " [seconds per run] [requests in flight]" 
+       << " [1 to measure socket queueing and drops]" << endl;
+  return 1;
+ }
+
+ int sizes[] = {64, 512, 1400};
+ int clientCounts[] = {1, 4};
+ int batches[] = {1, 32};
+ int serverCounts[] = {1, 4};
+
+ printf("%d requests in flight per client, %.1f s per run, latencies in us\n",
+        window, seconds);
+ printf("%5s %7s %5s %7s %10s %7s %8s %8s %8s %8s %8s %7s %7s\n", "size",
+        "clients", "batch", "servers", "replies/s", "Gbit/s", "p50", "p99",
+        "p99.9", "max", "queue", "lost", "drops");
+ int port = BENCH_PORT;
+ for(size_t s = 0; s < sizeof(sizes) / sizeof(int); s++)
+  for(size_t c = 0; c < sizeof(clientCounts) / sizeof(int); c++)
+   for(size_t b = 0; b < sizeof(batches) / sizeof(int); b++)
+    for(size_t t = 0; t < sizeof(serverCounts) / sizeof(int); t++)
+     run(port++, sizes[s], clientCounts[c], batches[b], serverCounts[t],
+         seconds, window, timestamps);
+ return 0;
+}
@@ -0,0 +1,128 @@
+//==============================================================================
+// UDPFragment.t.cpp - Example program for fragmented messages of
+// UDPClient/UDPServer
+//
+// Usage: UDPFragment.t [fragment size]
+//
+// A client sends messages of up to 1 MB, larger than a datagram, to a
+// server that reassembles them (UDPServer::setReassembly()) and replies
+// with the message reversed, which is sent back in fragments too. The
+// fragment size defaults to the largest the path MTU allows
+// (UDP_FRAG_AUTO). Printed are the round trip and the result of each size.
+//==============================================================================
+
+#include "UDPClientServer.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+
+#define FRAG_PORT 3023
+#define FRAG_MAX_MSG (1 << 20)
+#define FRAG_BDP 4096 // kB of socket buffers, room for a message in fragments
+
+static long long nowUs()
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+//==============================================================================
+// class ReverseServer
+// - replies with the message reversed
+//==============================================================================
+class ReverseServer : public UDPServer
+{
+ public:
+  ReverseServer() { d_outMsgBuf = new char[FRAG_MAX_MSG]; };
+  ~ReverseServer() { delete [] d_outMsgBuf; };
+ protected:
+  virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen);
+ private:
+  char *d_outMsgBuf;
+};
+
+
+const char *ReverseServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ for(int i = 0; i < inMsgLen; i++)
+  d_outMsgBuf[i] = inMsgBuf[inMsgLen - 1 - i];
+ *outMsgLen = inMsgLen;
+ return d_outMsgBuf;
+}
+
+
+//==============================================================================
+// server
+//==============================================================================
+void *server(void *arg)
+{
+ ((ReverseServer *)arg)->doMessageCycle();
+ return NULL;
+}
+
+
+//==============================================================================
+// main function
+//==============================================================================
+int main(int argc, char *argv[])
+{
+ int fragmentSize = (argc > 1) ? atoi(argv[1]) : UDP_FRAG_AUTO;
+
+ // reassembly is set up before init()
+ ReverseServer *myServer = new ReverseServer;
+ if( (myServer->setReassembly(FRAG_MAX_MSG) == -1) ||
+     (myServer->init(FRAG_PORT, 1024, FRAG_BDP) == -1) )
+ {
+  cout << "server: " << myServer->getStatusMessage() << endl;
+  return 1;
+ }
+ pthread_t threadId;
+ pthread_create(&threadId, NULL, &server, myServer);
+ sleep(1);
+
+ struct timeval timeout;
+ timeout.tv_sec = 1;
+ timeout.tv_usec = 0;
+ UDPClient client("127.0.0.1", FRAG_PORT, timeout, FRAG_BDP);
+ if( client.getStatusCode() || (client.setFragmentSize(fragmentSize) == -1) )
+ {
+  cout << "client: " << client.getStatusMessage() << endl;
+  return 1;
+ }
+
+ char *outMsgBuf = new char[FRAG_MAX_MSG];
+ char *inMsgBuf = new char[FRAG_MAX_MSG];
+ int inMsgLen;
+ int sizes[] = {100, 1400, 9000, 65536, 200000, FRAG_MAX_MSG};
+ int failed = 0;
+
+ for(int i = 0; i < FRAG_MAX_MSG; i++)
+  outMsgBuf[i] = (char)(i * 7 + i / 251);
+ for(unsigned int k = 0; k < sizeof(sizes) / sizeof(int); k++)
+ {
+  int outMsgLen = sizes[k];
+  long long start = nowUs();
+  int rc = client.sendAndReceive(outMsgBuf, outMsgLen, inMsgBuf, FRAG_MAX_MSG,
+                                 &inMsgLen);
+  long long rtt = nowUs() - start;
+  bool good = (rc == 0) && (inMsgLen == outMsgLen);
+  for(int i = 0; good && (i < inMsgLen); i++)
+   good = (inMsgBuf[i] == outMsgBuf[outMsgLen - 1 - i]);
+  cout << outMsgLen << " bytes: ";
+  if( rc == -1 )
+   cout << client.getStatusMessage() << endl;
+  else
+   cout << (good ? "ok" : "wrong reply") << ", " << rtt << " us" << endl;
+  if( !good )
+   failed++;
+ }
+
+ delete [] outMsgBuf;
+ delete [] inMsgBuf;
+ return (failed == 0) ? 0 : 1;
+}
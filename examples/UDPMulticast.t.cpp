@@ -0,0 +1,136 @@
+//==============================================================================
+// UDPMulticast.t.cpp - Example program for multicast with UDPClient/UDPServer
+//
+// Usage: UDPMulticast.t [interface]
+//
+// Three subscribers (UDPServer::joinGroup()) on this host share a port. A
+// publisher (UDPClient::setMulticast()) sends each message once to the
+// group, and every subscriber receives it. Then one subscriber leaves the
+// group and no longer receives. Printed are the messages each subscriber
+// received. The interface to use may be given by address or name, such
+// as "lo" if there is no network.
+//==============================================================================
+
+#include "UDPClientServer.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
+
+using namespace std;
+
+#define MC_GROUP "239.1.2.3"
+#define MC_PORT 3024
+#define MC_MAX_MSG 64
+#define MC_SUBSCRIBERS 3
+#define MC_COUNT 1000
+
+//==============================================================================
+// class Subscriber
+// - counts the messages of the publisher, does not reply
+//==============================================================================
+class Subscriber : public UDPServer
+{
+ public:
+  Subscriber() : received(0) {};
+  ~Subscriber() {};
+  volatile int received;
+ protected:
+  virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen);
+};
+
+
+const char *Subscriber::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ outMsgLen=outMsgLen;
+ if( (inMsgLen > 4) && !memcmp(inMsgBuf, "news", 4) )
+  received++;
+ return NULL;
+}
+
+
+//==============================================================================
+// subscriber
+//==============================================================================
+void *subscriber(void *arg)
+{
+ ((Subscriber *)arg)->doMessageCycle();
+ return NULL;
+}
+
+
+//==============================================================================
+// publish - send a number of messages to the group
+//==============================================================================
+void publish(UDPClient &publisher, int count)
+{
+ char outMsgBuf[MC_MAX_MSG];
+ for(int i = 0; i < count; i++)
+ {
+  int outMsgLen = snprintf(outMsgBuf, MC_MAX_MSG, "news %d", i);
+  if( publisher.sendAndReceive(outMsgBuf, outMsgLen, NULL, 0, NULL) == -1 )
+   cout << "publisher: " << publisher.getStatusMessage() << endl;
+
+  // pace the publisher, so that no subscriber's buffer overflows
+  if( i % 100 == 99 )
+   usleep(1000);
+ }
+ usleep(100000);
+}
+
+
+//==============================================================================
+// main function
+//==============================================================================
+int main(int argc, char *argv[])
+{
+ const char *interface = (argc > 1) ? argv[1] : NULL;
+
+ Subscriber subscribers[MC_SUBSCRIBERS];
+ pthread_t threadId[MC_SUBSCRIBERS];
+ for(int k = 0; k < MC_SUBSCRIBERS; k++)
+ {
+  if( (subscribers[k].init(MC_PORT, MC_MAX_MSG) == -1) ||
+      (subscribers[k].joinGroup(MC_GROUP, interface) == -1) )
+  {
+   cout << "subscriber " << k << ": " << subscribers[k].getStatusMessage() << endl;
+   return 1;
+  }
+  pthread_create(&threadId[k], NULL, &subscriber, &subscribers[k]);
+ }
+ sleep(1);
+
+ // TTL 0 keeps the packets on this host, loopback delivers them here
+ struct timeval timeout;
+ timeout.tv_sec = 1;
+ timeout.tv_usec = 0;
+ UDPClient publisher(MC_GROUP, MC_PORT, timeout);
+ if( publisher.getStatusCode() ||
+     (publisher.setMulticast(0, true, interface) == -1) )
+ {
+  cout << "publisher: " << publisher.getStatusMessage() << endl;
+  return 1;
+ }
+
+ publish(publisher, MC_COUNT);
+ cout << MC_COUNT << " messages published" << endl;
+ for(int k = 0; k < MC_SUBSCRIBERS; k++)
+  cout << " subscriber " << k << " received " << subscribers[k].received << endl;
+
+ if( subscribers[0].leaveGroup(MC_GROUP, interface) == -1 )
+ {
+  cout << "subscriber 0: " << subscribers[0].getStatusMessage() << endl;
+  return 1;
+ }
+ publish(publisher, MC_COUNT);
+ cout << MC_COUNT << " more, after subscriber 0 left the group" << endl;
+ for(int k = 0; k < MC_SUBSCRIBERS; k++)
+  cout << " subscriber " << k << " received " << subscribers[k].received << endl;
+
+ for(int k = 0; k < MC_SUBSCRIBERS; k++)
+ {
+  pthread_cancel(threadId[k]);
+  pthread_join(threadId[k], NULL);
+ }
+ return 0;
+}
@@ -0,0 +1,178 @@
+//==============================================================================
+// UDPPipelined.t.cpp - Example program for pipelined requests of UDPClient
+//
+// Usage: UDPPipelined.t [requests] [outstanding]
+//
+// A client sends numbered requests to an echo server, first one at a time
+// with sendAndReceive(), then with up to [outstanding] requests in flight
+// (sendRequest()/receiveReply()). Replies are matched to their requests by
+// number. The requests per second of both are printed.
+//==============================================================================
+
+#include "UDPClientServer.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+
+#define PIPE_PORT 3021
+#define PIPE_MAX_MSG 64
+
+static long long nowUs()
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+//==============================================================================
+// class EchoServer
+//==============================================================================
+class EchoServer : public UDPServer
+{
+ public:
+  EchoServer(int port, int maxLen) : UDPServer(port, maxLen, 0){};
+  ~EchoServer() {};
+ protected:
+  virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen);
+};
+
+
+const char *EchoServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ *outMsgLen = inMsgLen;
+ return inMsgBuf;
+}
+
+
+//==============================================================================
+// server
+//==============================================================================
+void *server(void *arg)
+{
+ arg=arg;
+ EchoServer server(PIPE_PORT, PIPE_MAX_MSG);
+ if(server.getStatusCode())
+ {
+  cout << "server: " << server.getStatusMessage() << endl;
+  return NULL;
+ }
+ server.setBatchSize(32);
+ server.doMessageCycle();
+ return NULL;
+}
+
+
+//==============================================================================
+// oneByOne - send requests one at a time, return the number answered
+//==============================================================================
+int oneByOne(UDPClient &client, int count)
+{
+ char outMsgBuf[PIPE_MAX_MSG];
+ char inMsgBuf[PIPE_MAX_MSG];
+ int inMsgLen;
+ int answered = 0;
+
+ for(int i = 0; i < count; i++)
+ {
+  int outMsgLen = snprintf(outMsgBuf, PIPE_MAX_MSG, "request %d", i);
+  if( client.sendAndReceive(outMsgBuf, outMsgLen, inMsgBuf, PIPE_MAX_MSG,
+      &inMsgLen) == -1 )
+   continue;
+  if( (inMsgLen == outMsgLen) && !memcmp(inMsgBuf, outMsgBuf, inMsgLen) )
+   answered++;
+ }
+ return answered;
+}
+
+
+//==============================================================================
+// pipelined - keep up to 'window' requests outstanding, return the number
+// answered
+//==============================================================================
+int pipelined(UDPClient &client, int count, int window)
+{
+ char outMsgBuf[PIPE_MAX_MSG];
+ char inMsgBuf[PIPE_MAX_MSG];
+ int inMsgLen;
+ unsigned int first = 0, seq;
+ int sent = 0, done = 0, answered = 0;
+
+ while( done < count )
+ {
+  // fill the window
+  while( (sent < count) && (sent - done < window) )
+  {
+   int outMsgLen = snprintf(outMsgBuf, PIPE_MAX_MSG, "request %d", sent);
+   if( client.sendRequest(outMsgBuf, outMsgLen, &seq) == -1 )
+   {
+    cout << "client: " << client.getStatusMessage() << endl;
+    return answered;
+   }
+   if( sent == 0 )
+    first = seq;
+   sent++;
+  }
+
+  // collect a reply, or give up on the outstanding ones after the timeout
+  if( client.receiveReply(inMsgBuf, PIPE_MAX_MSG, &inMsgLen, &seq) == -1 )
+  {
+   done = sent;
+   continue;
+  }
+  char expected[PIPE_MAX_MSG];
+  int expectedLen = snprintf(expected, PIPE_MAX_MSG, "request %u", seq - first);
+  if( (inMsgLen == expectedLen) && !memcmp(inMsgBuf, expected, inMsgLen) )
+   answered++;
+  done++;
+ }
+ return answered;
+}
+
+
+//==============================================================================
+// main function
+//==============================================================================
+int main(int argc, char *argv[])
+{
+ int count = (argc > 1) ? atoi(argv[1]) : 100000;
+ int window = (argc > 2) ? atoi(argv[2]) : 64;
+ if( (count < 1) || (window < 1) || (window > 1024) )
+ {
+  cout << "usage: " << argv[0] << " [requests] [outstanding (1-1024)]" << endl;
+  return 1;
+ }
+
+ pthread_t threadId;
+ pthread_create(&threadId, NULL, &server, NULL);
+ sleep(1);
+
+ struct timeval timeout;
+ timeout.tv_sec = 0;
+ timeout.tv_usec = 100000; // 100 ms
+ UDPClient client("127.0.0.1", PIPE_PORT, timeout);
+ if(client.getStatusCode())
+ {
+  cout << "client: " << client.getStatusMessage() << endl;
+  return 1;
+ }
+
+ // numbered requests, so that a late reply is not taken for the next one
+ client.setSequencing(true);
+
+ long long start = nowUs();
+ int answered = oneByOne(client, count);
+ long long elapsed = nowUs() - start;
+ cout << "one at a time : " << answered << "/" << count << " answered, "
+      << (long long)count * 1000000 / (elapsed + 1) << " requests/s" << endl;
+
+ start = nowUs();
+ answered = pipelined(client, count, window);
+ elapsed = nowUs() - start;
+ cout << window << " outstanding : " << answered << "/" << count << " answered, "
+      << (long long)count * 1000000 / (elapsed + 1) << " requests/s" << endl;
+ return 0;
+}
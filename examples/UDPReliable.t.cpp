@@ -0,0 +1,183 @@
+//==============================================================================
+// UDPReliable.t.cpp - Example program for UDPReliableClient
+//
+// Usage: UDPReliable.t [loss fraction] [messages]
+//
+// A client sends messages to a server over a link that drops a fraction
+// of the packets each way (simulated, see setLossSimulation()). Every
+// other message is UDP_RELIABLE_ORDERED, the others UDP_RELIABLE. The
+// server counts how often it handled each message and checks the order of
+// the ordered ones. Printed are the replies received, the messages lost or
+// handled twice, order errors, retransmissions and the round-trip time.
+//==============================================================================
+
+#include "UDPClientServer.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+using namespace std;
+
+#define REL_PORT 3022
+#define REL_MAX_MSG 64
+#define REL_MAX_COUNT 100000
+
+static long long nowUs()
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return (long long)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+//==============================================================================
+// class MyServer
+// - counts the messages handled, and replies with the message number
+//==============================================================================
+class MyServer : public UDPServer
+{
+ public:
+  MyServer(int port, int maxLen) : UDPServer(port, maxLen, 0),
+   lastOrdered(-1), orderErrors(0) { memset(handled, 0, sizeof(handled)); };
+  ~MyServer() {};
+  int handled[REL_MAX_COUNT];
+  int lastOrdered;
+  int orderErrors;
+ protected:
+  virtual const char *receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen);
+ private:
+  char d_outMsgBuf[REL_MAX_MSG];
+};
+
+
+const char *MyServer::receiveAndReply(const char *inMsgBuf, int inMsgLen, int *outMsgLen)
+{
+ char msg[REL_MAX_MSG];
+ char mode;
+ int number;
+
+ if( inMsgLen >= REL_MAX_MSG )
+  return NULL;
+ memcpy(msg, inMsgBuf, inMsgLen);
+ msg[inMsgLen] = 0;
+ if( (sscanf(msg, "%c%d", &mode, &number) != 2) || (number < 0) ||
+     (number >= REL_MAX_COUNT) )
+  return NULL;
+
+ handled[number]++;
+ if( mode == 'O' )
+ {
+  if( number < lastOrdered )
+   orderErrors++;
+  lastOrdered = number;
+ }
+ *outMsgLen = snprintf(d_outMsgBuf, REL_MAX_MSG, "%d", number);
+ return d_outMsgBuf;
+}
+
+
+//==============================================================================
+// server
+//==============================================================================
+void *server(void *arg)
+{
+ ((MyServer *)arg)->doMessageCycle();
+ return NULL;
+}
+
+
+//==============================================================================
+// main function
+//==============================================================================
+int main(int argc, char *argv[])
+{
+ double loss = (argc > 1) ? atof(argv[1]) : 0.1;
+ int count = (argc > 2) ? atoi(argv[2]) : 10000;
+ if( (loss < 0) || (loss >= 1) || (count < 1) || (count > REL_MAX_COUNT) )
+ {
+  cout << "usage: " << argv[0] << " [loss fraction (0-1)] [messages (1-"
+       << REL_MAX_COUNT << ")]" << endl;
+  return 1;
+ }
+
+ MyServer *myServer = new MyServer(REL_PORT, REL_MAX_MSG);
+ if(myServer->getStatusCode())
+ {
+  cout << "server: " << myServer->getStatusMessage() << endl;
+  return 1;
+ }
+ pthread_t threadId;
+ pthread_create(&threadId, NULL, &server, myServer);
+ sleep(1);
+
+ struct timeval timeout;
+ timeout.tv_sec = 1;
+ timeout.tv_usec = 0;
+ UDPReliableClient client;
+ if( client.init("127.0.0.1", REL_PORT, timeout, REL_MAX_MSG) == -1 )
+ {
+  cout << "client: " << client.getStatusMessage() << endl;
+  return 1;
+ }
+ client.setLossSimulation(loss, loss);
+
+ char outMsgBuf[REL_MAX_MSG];
+ char inMsgBuf[REL_MAX_MSG];
+ int inMsgLen;
+ unsigned int id, firstId = 0;
+ int replies = 0, wrongReplies = 0;
+
+ long long start = nowUs();
+ for(int i = 0; i < count; i++)
+ {
+  int mode = (i % 2) ? UDP_RELIABLE_ORDERED : UDP_RELIABLE;
+  int outMsgLen = snprintf(outMsgBuf, REL_MAX_MSG, "%c%d",
+                           (i % 2) ? 'O' : 'R', i);
+
+  // take replies while the window is held up by them
+  while( client.send(outMsgBuf, outMsgLen, mode, &id) == -1 )
+  {
+   if( (client.getStatusCode() != EAGAIN) ||
+       (client.receive(inMsgBuf, REL_MAX_MSG - 1, &inMsgLen, &id) == -1) )
+   {
+    cout << "client: " << client.getStatusMessage() << endl;
+    return 1;
+   }
+   inMsgBuf[inMsgLen] = 0;
+   if( atoi(inMsgBuf) != (int)(id - firstId) )
+    wrongReplies++;
+   replies++;
+  }
+  if( i == 0 )
+   firstId = id;
+ }
+ if( client.flush() == -1 )
+  cout << "client: " << client.getStatusMessage() << endl;
+ while( (replies < count) &&
+        (client.receive(inMsgBuf, REL_MAX_MSG - 1, &inMsgLen, &id) == 0) )
+ {
+  inMsgBuf[inMsgLen] = 0;
+  if( atoi(inMsgBuf) != (int)(id - firstId) )
+   wrongReplies++;
+  replies++;
+ }
+ long long elapsed = nowUs() - start;
+
+ int lost = 0, twice = 0;
+ for(int i = 0; i < count; i++)
+ {
+  if( myServer->handled[i] == 0 )
+   lost++;
+  else if( myServer->handled[i] > 1 )
+   twice++;
+ }
+ cout << "loss " << loss << ": " << replies << "/" << count << " replies ("
+      << wrongReplies << " wrong), " << lost << " lost, " << twice
+      << " handled twice, " << myServer->orderErrors << " out of order" << endl;
+ cout << client.getRetransmissions() << " retransmissions, round trip "
+      << client.getRoundTripTime() << " us, " << elapsed / 1000 << " ms" << endl;
+ return 0;
+}